@@ -0,0 +1,163 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+require 'objspace'
+require 'optparse'
+require 'yaml'
+require 'json'
+require 'rxerces'
+
+# Measures what each operation costs in memory rather than in time: the
+# Ruby objects it allocates (GC.stat deltas), the ObjectSpace.memsize_of
+# of what it returns, how much the process RSS grows while it runs, which
+# includes the Xerces heap, and how many collections it causes.
+#
+# Each operation is checked against the budgets in allocation_budgets.yml,
+# and the script exits with status 1 if any budget is exceeded, so it can
+# run in CI. An object or memsize budget is either a number or a base plus
+# an amount per item in the result (nodes, or attributes for #attributes).
+
+options = {
+  sizes: [10, 1_000, 10_000],
+  budgets: File.join(__dir__, 'allocation_budgets.yml'),
+  work: 200_000,
+  json: nil
+}
+
+OptionParser.new do |opts|
+  opts.banner = "Usage: ruby benchmarks/allocation_benchmark.rb [options]"
+  opts.on("--sizes LIST", Array, "Document sizes in books (default: 10,1000,10000)") do |list|
+    options[:sizes] = list.map { |size| Integer(size) }
+  end
+  opts.on("--budgets FILE", "Budget file (default: benchmarks/allocation_budgets.yml)") { |file| options[:budgets] = file }
+  opts.on("--no-budgets", "Only report, never fail") { options[:budgets] = nil }
+  opts.on("--work N", Integer, "Books processed per operation and size, which sets the iterations") do |work|
+    options[:work] = work
+  end
+  opts.on("--json FILE", "Also write the results as JSON") { |file| options[:json] = file }
+end.parse!
+
+def generate_xml(count)
+  books = (1..count).map do |i|
+    category = ['fiction', 'science', 'biography', 'history'][i % 4]
+    "<book id=\"book#{i}\" category=\"#{category}\"><title lang=\"en\">Title #{i}</title>" \
+      "<price>#{'%.2f' % (10.0 + (i % 50))}</price></book>"
+  end
+  "<catalog>#{books.join}</catalog>"
+end
+
+# Resident set size in KB, which covers the native heaps as well
+def rss_kb
+  if File.readable?('/proc/self/status')
+    File.foreach('/proc/self/status') do |line|
+      return line.split[1].to_i if line.start_with?('VmRSS:')
+    end
+  end
+  `ps -o rss= -p #{Process.pid}`.to_i
+end
+
+# memsize_of the result and of what it holds
+def deep_memsize(result)
+  case result
+  when RXerces::XML::NodeSet, Array
+    result.inject(ObjectSpace.memsize_of(result)) { |sum, node| sum + ObjectSpace.memsize_of(node) }
+  when Hash
+    result.inject(ObjectSpace.memsize_of(result)) do |sum, (key, value)|
+      sum + ObjectSpace.memsize_of(key) + ObjectSpace.memsize_of(value)
+    end
+  else
+    ObjectSpace.memsize_of(result)
+  end
+end
+
+def item_count(result)
+  case result
+  when RXerces::XML::NodeSet, Array, Hash then result.size
+  else 0
+  end
+end
+
+def measure(iterations)
+  result = yield # Warm up caches, such as the XPath compile cache
+  rss_before = rss_kb
+  GC.start
+  stat_before = GC.stat
+  # Read on its own so no Hash is counted against the operation
+  allocated_before = GC.stat(:total_allocated_objects)
+
+  iterations.times { result = yield }
+
+  allocated = GC.stat(:total_allocated_objects) - allocated_before
+  stat_after = GC.stat
+  {
+    iterations: iterations,
+    objects: allocated.fdiv(iterations),
+    memsize: deep_memsize(result),
+    items: item_count(result),
+    rss_kb: [rss_kb - rss_before, 0].max,
+    gc_count: stat_after[:count] - stat_before[:count],
+    minor_gc_count: stat_after[:minor_gc_count] - stat_before[:minor_gc_count],
+    major_gc_count: stat_after[:major_gc_count] - stat_before[:major_gc_count]
+  }
+end
+
+# The budget for one metric, given the number of items in the result
+def limit(budget, items)
+  return budget if budget.is_a?(Numeric)
+  budget.fetch('base', 0) + budget.fetch('per_item', 0) * items
+end
+
+budgets = options[:budgets] ? YAML.load_file(options[:budgets]) : {}
+results = []
+failures = []
+
+puts "=" * 100
+puts "Allocation Benchmarks"
+puts "=" * 100
+puts format("%-12s %8s %10s %12s %12s %10s %8s %12s",
+            "operation", "books", "iterations", "objects/call", "memsize", "rss KB", "GCs", "minor/major")
+puts "-" * 100
+
+options[:sizes].each do |size|
+  doc = RXerces::XML::Document.parse(generate_xml(size))
+  root = doc.root
+  book = doc.at_xpath("//book[last()]")
+  iterations = [options[:work] / size, 5].max
+
+  operations = {
+    'children' => -> { root.children },
+    'xpath' => -> { doc.xpath('//book') },
+    'attributes' => -> { book.attributes },
+    'text' => -> { root.text },
+    'to_s' => -> { doc.to_s }
+  }
+
+  operations.each do |name, operation|
+    result = measure(iterations, &operation).merge(operation: name, size: size)
+    results << result
+
+    puts format("%-12s %8d %10d %12.1f %12d %10d %8d %12s",
+                name, size, iterations, result[:objects], result[:memsize], result[:rss_kb],
+                result[:gc_count], "#{result[:minor_gc_count]}/#{result[:major_gc_count]}")
+
+    (budgets[name] || {}).each do |metric, budget|
+      allowed = limit(budget, result[:items])
+      actual = result.fetch(metric.to_sym)
+      if actual > allowed
+        failures << format("%s (%d books): %s %.1f exceeds budget %.1f", name, size, metric, actual, allowed)
+      end
+    end
+  end
+end
+
+puts
+
+File.write(options[:json], JSON.pretty_generate(results)) if options[:json]
+
+if failures.empty?
+  puts "All allocation budgets met" if options[:budgets]
+else
+  puts "Allocation budgets exceeded:"
+  failures.each { |failure| puts "  #{failure}" }
+  exit 1
+end
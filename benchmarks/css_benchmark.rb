@@ -37,76 +37,97 @@ puts
 # Parse documents once
 rxerces_doc = RXerces::XML::Document.parse(HTML_DATA)
 nokogiri_doc = Nokogiri::HTML(HTML_DATA) if NOKOGIRI_AVAILABLE
+original_engine = RXerces.css_engine
+
+# The native engine matches selectors directly against the DOM; the :xpath
+# engine translates them to XPath first. The translation only handles
+# simple selectors, so selectors that need the native engine are not
+# reported for it.
+SELECTORS = [
+  ["Simple CSS", "div", true],
+  ["Class CSS", ".title", true],
+  ["ID CSS", "#div100", true],
+  ["Descendant CSS", "div.content p.text", true],
+  ["Child CSS", "ul.list > li.special", true],
+  ["Adjacent sibling CSS", "h2 + p", false],
+  ["Structural pseudo-class CSS", "li:nth-child(2)", false],
+  ["Negation CSS", "li:not(.special)", false]
+].freeze
+
+# Check that both engines agree before timing anything
+SELECTORS.each do |_, selector, xpath_supported|
+  next unless xpath_supported
+
+  counts = [:native, :xpath].map do |engine|
+    RXerces.css_engine = engine
+    rxerces_doc.css(selector).length
+  end
 
-# Simple CSS selector
-puts "Simple CSS: div"
-puts "-" * 80
-
-Benchmark.ips do |x|
-  x.config(time: 5, warmup: 2)
-
-  x.report("rxerces") { rxerces_doc.css('div') }
-  x.report("nokogiri") { nokogiri_doc.css('div') } if NOKOGIRI_AVAILABLE
-
-  x.compare!
+  abort "CSS engines disagree on #{selector}: #{counts.inspect}" unless counts.uniq.size == 1
 end
 
-puts
-
-# Class selector
-puts "Class CSS: .title"
-puts "-" * 80
+SELECTORS.each do |label, selector, xpath_supported|
+  puts "#{label}: #{selector}"
+  puts "-" * 80
 
-Benchmark.ips do |x|
-  x.config(time: 5, warmup: 2)
+  Benchmark.ips do |x|
+    x.config(time: 5, warmup: 2)
 
-  x.report("rxerces") { rxerces_doc.css('.title') }
-  x.report("nokogiri") { nokogiri_doc.css('.title') } if NOKOGIRI_AVAILABLE
+    x.report("rxerces native") do
+      RXerces.css_engine = :native
+      rxerces_doc.css(selector)
+    end
 
-  x.compare!
-end
-
-puts
+    if xpath_supported
+      x.report("rxerces xpath") do
+        RXerces.css_engine = :xpath
+        rxerces_doc.css(selector)
+      end
+    end
 
-# ID selector
-puts "ID CSS: #div100"
-puts "-" * 80
+    x.report("nokogiri") { nokogiri_doc.css(selector) } if NOKOGIRI_AVAILABLE
 
-Benchmark.ips do |x|
-  x.config(time: 5, warmup: 2)
-
-  x.report("rxerces") { rxerces_doc.css('#div100') }
-  x.report("nokogiri") { nokogiri_doc.css('#div100') } if NOKOGIRI_AVAILABLE
+    x.compare!
+  end
 
-  x.compare!
+  puts
 end
 
-puts
-
-# Descendant combinator
-puts "Descendant CSS: div.content p.text"
+# at_css (first match)
+puts "at_css: .title (first match only)"
 puts "-" * 80
 
 Benchmark.ips do |x|
   x.config(time: 5, warmup: 2)
 
-  x.report("rxerces") { rxerces_doc.css('div.content p.text') }
-  x.report("nokogiri") { nokogiri_doc.css('div.content p.text') } if NOKOGIRI_AVAILABLE
+  [:native, :xpath].each do |engine|
+    x.report("rxerces #{engine}") do
+      RXerces.css_engine = engine
+      rxerces_doc.at_css('.title')
+    end
+  end
+
+  x.report("nokogiri") { nokogiri_doc.at_css('.title') } if NOKOGIRI_AVAILABLE
 
   x.compare!
 end
 
-puts
+RXerces.css_engine = original_engine
 
-# at_css (first match)
-puts "at_css: .title (first match only)"
+# Selector matching against individual nodes. ancestors(selector) tests
+# each ancestor against the compiled selector instead of searching the
+# whole document for matches.
+puts "Selector matching: ancestors('div.content'), matches?"
 puts "-" * 80
 
+spans = rxerces_doc.css('span.highlight').to_a
+compiled = RXerces::XML::Selector.compile('div.content > p.text > span')
+
 Benchmark.ips do |x|
   x.config(time: 5, warmup: 2)
 
-  x.report("rxerces") { rxerces_doc.at_css('.title') }
-  x.report("nokogiri") { nokogiri_doc.at_css('.title') } if NOKOGIRI_AVAILABLE
+  x.report("rxerces ancestors") { spans.each { |span| span.ancestors('div.content') } }
+  x.report("rxerces matches?") { spans.each { |span| span.matches?(compiled) } }
 
   x.compare!
 end
@@ -0,0 +1,521 @@
+// Native microbenchmarks for the extension's hot paths. Everything here
+// calls the Ruby-independent parts of ext/rxerces directly, so the numbers
+// contain no GVL, wrapper allocation or GC time. Results are written as
+// JSON; progress goes to stderr.
+//
+//   rake bench:native
+//   tmp/bench_native --filter xpath --min-time 1 --size 2000 --output out.json
+//
+// Each benchmark is run in batches large enough to take about a
+// millisecond, until --min-time seconds have passed, and the per-operation
+// times of the batches are summarized.
+
+#include <xercesc/util/PlatformUtils.hpp>
+#include <xercesc/util/XMLString.hpp>
+#include <xercesc/util/XMLUni.hpp>
+#include <xercesc/parsers/XercesDOMParser.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/framework/MemBufInputSource.hpp>
+#include <xercesc/framework/MemBufFormatTarget.hpp>
+#include <xercesc/sax/HandlerBase.hpp>
+#include <xercesc/sax/SAXParseException.hpp>
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/sax2/XMLReaderFactory.hpp>
+#include <xercesc/internal/XMLGrammarPoolImpl.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "xpath_engine.h"
+#include "xpath_guard.h"
+#include "css_engine.h"
+#include "c14n.h"
+#include "xalan_context.h"
+
+#ifdef HAVE_XALAN
+#include <xalanc/XPath/XPathEvaluator.hpp>
+#endif
+
+using namespace xercesc;
+
+namespace {
+
+struct Options {
+    double min_time;
+    size_t size;
+    std::string filter;
+    std::string output;
+
+    Options() : min_time(0.5), size(500) {}
+};
+
+struct Result {
+    std::string name;
+    unsigned long long iterations;
+    double mean_ns;
+    double median_ns;
+    double min_ns;
+    double max_ns;
+    double stddev_ns;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// Results of the benchmarked calls are added here so they are not
+// optimized away
+volatile size_t sink = 0;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+class Runner {
+public:
+    explicit Runner(const Options& options) : options_(options) {}
+
+    // Time operation, which returns something derived from its work
+    void run(const std::string& name, const std::function<size_t()>& operation) {
+        if (!options_.filter.empty() && name.find(options_.filter) == std::string::npos) {
+            return;
+        }
+        fprintf(stderr, "%-44s", name.c_str());
+
+        // Grow the batch until it takes about a millisecond
+        unsigned long long batch = 1;
+        for (;;) {
+            Clock::time_point start = Clock::now();
+            for (unsigned long long i = 0; i < batch; i++) {
+                sink += operation();
+            }
+            if (seconds_since(start) >= 0.001 || batch >= (1ULL << 30)) {
+                break;
+            }
+            batch *= 2;
+        }
+
+        std::vector<double> samples;
+        Clock::time_point started = Clock::now();
+        while (samples.size() < 5 || seconds_since(started) < options_.min_time) {
+            Clock::time_point start = Clock::now();
+            for (unsigned long long i = 0; i < batch; i++) {
+                sink += operation();
+            }
+            samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / batch);
+        }
+
+        Result result;
+        result.name = name;
+        result.iterations = batch * samples.size();
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+        result.mean_ns = sum / samples.size();
+        result.median_ns = samples[samples.size() / 2];
+        result.min_ns = samples.front();
+        result.max_ns = samples.back();
+        double variance = 0;
+        for (double sample : samples) {
+            variance += (sample - result.mean_ns) * (sample - result.mean_ns);
+        }
+        result.stddev_ns = std::sqrt(variance / samples.size());
+        results_.push_back(result);
+
+        fprintf(stderr, "%14.1f ns/op  (%llu iterations)\n", result.median_ns, result.iterations);
+    }
+
+    const std::vector<Result>& results() const { return results_; }
+
+private:
+    const Options& options_;
+    std::vector<Result> results_;
+};
+
+std::string json_string(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+std::string to_json(const Options& options, size_t document_bytes, const std::vector<Result>& results) {
+    std::ostringstream out;
+    out.precision(10);
+    out << "{\n";
+#ifdef HAVE_XALAN
+    out << "  \"xalan\": true,\n";
+#else
+    out << "  \"xalan\": false,\n";
+#endif
+    out << "  \"size\": " << options.size << ",\n";
+    out << "  \"document_bytes\": " << document_bytes << ",\n";
+    out << "  \"min_time\": " << options.min_time << ",\n";
+    out << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        out << (i ? ",\n" : "\n");
+        out << "    {\"name\": " << json_string(result.name)
+            << ", \"iterations\": " << result.iterations
+            << ", \"mean_ns\": " << result.mean_ns
+            << ", \"median_ns\": " << result.median_ns
+            << ", \"min_ns\": " << result.min_ns
+            << ", \"max_ns\": " << result.max_ns
+            << ", \"stddev_ns\": " << result.stddev_ns << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+// The catalog used by benchmarks/xpath_engine_benchmark.rb, with count books
+std::string catalog_xml(size_t count) {
+    static const char* const categories[] = { "fiction", "science", "biography", "history" };
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><catalog>";
+    char buffer[512];
+    for (size_t i = 1; i <= count; i++) {
+        snprintf(buffer, sizeof(buffer),
+                 "<book id=\"book%zu\" category=\"%s\" class=\"item %s\">"
+                 "<title lang=\"en\">Title %zu</title><author>Author %zu</author>"
+                 "<year>%zu</year><price>%.2f</price></book>",
+                 i, categories[i % 4], categories[i % 4], i, i, 1990 + i % 30, 10.0 + i % 50);
+        xml += buffer;
+    }
+    return xml + "</catalog>";
+}
+
+const char CATALOG_XSD[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<xs:schema xmlns:xs=\"http://www.w3.org/2001/XMLSchema\">"
+    "<xs:element name=\"catalog\"><xs:complexType><xs:sequence>"
+    "<xs:element name=\"book\" maxOccurs=\"unbounded\"><xs:complexType><xs:sequence>"
+    "<xs:element name=\"title\"><xs:complexType><xs:simpleContent>"
+    "<xs:extension base=\"xs:string\"><xs:attribute name=\"lang\" type=\"xs:string\"/></xs:extension>"
+    "</xs:simpleContent></xs:complexType></xs:element>"
+    "<xs:element name=\"author\" type=\"xs:string\"/>"
+    "<xs:element name=\"year\" type=\"xs:integer\"/>"
+    "<xs:element name=\"price\" type=\"xs:decimal\"/>"
+    "</xs:sequence>"
+    "<xs:attribute name=\"id\" type=\"xs:ID\" use=\"required\"/>"
+    "<xs:attribute name=\"category\" type=\"xs:string\"/>"
+    "<xs:attribute name=\"class\" type=\"xs:string\"/>"
+    "</xs:complexType></xs:element>"
+    "</xs:sequence></xs:complexType></xs:element>"
+    "</xs:schema>";
+
+const char SCHEMA_SYSTEM_ID[] = "schema.xsd";
+
+const char* const XPATH_QUERIES[] = {
+    "//book",
+    "/catalog/book/title",
+    "//book[@category='fiction']",
+    "//book[year > 2000 and price < 30]/title",
+    "//book[position() mod 10 = 0]/@id",
+    "//title[contains(., '42')]/following-sibling::price",
+};
+
+// The subset the Xerces engine understands
+const char* const XERCES_QUERIES[] = {
+    "//book",
+    "/catalog/book/title",
+};
+
+const char* const CSS_SELECTORS[] = {
+    "book",
+    ".fiction",
+    "#book100",
+    "catalog > book title",
+    "book[category=science] price",
+    "book:nth-child(10n) + book",
+};
+
+// Errors from the parsers would mean the benchmark measures nothing
+class FailingErrorHandler : public HandlerBase {
+public:
+    void error(const SAXParseException& e) { fail(e); }
+    void fatalError(const SAXParseException& e) { fail(e); }
+
+private:
+    void fail(const SAXParseException& e) {
+        char* message = XMLString::transcode(e.getMessage());
+        fprintf(stderr, "\nbench_native: %s\n", message);
+        XMLString::release(&message);
+        exit(1);
+    }
+};
+
+DOMDocument* parse(XercesDOMParser& parser, const std::string& xml) {
+    MemBufInputSource input((const XMLByte*)xml.data(), xml.size(), "document.xml");
+    parser.parse(input);
+    return parser.getDocument();
+}
+
+void configure_parser(XercesDOMParser& parser, ErrorHandler& errors) {
+    // As document_parse sets it up without a schema
+    parser.setValidationScheme(XercesDOMParser::Val_Never);
+    parser.setDoNamespaces(true);
+    parser.setDoSchema(false);
+    parser.setLoadExternalDTD(false);
+    parser.setDisableDefaultEntityResolution(true);
+    parser.setErrorHandler(&errors);
+}
+
+DOMImplementationLS* ls_implementation() {
+    XMLCh* name = XMLString::transcode("LS");
+    DOMImplementationLS* implementation =
+        (DOMImplementationLS*)DOMImplementationRegistry::getDOMImplementation(name);
+    XMLString::release(&name);
+    return implementation;
+}
+
+void run_benchmarks(Runner& runner, const std::string& xml) {
+    FailingErrorHandler errors;
+
+    // Parsing
+    runner.run("parse", [&]() {
+        XercesDOMParser parser;
+        configure_parser(parser, errors);
+        return (size_t)parse(parser, xml)->getChildNodes()->getLength();
+    });
+
+    XercesDOMParser parser;
+    configure_parser(parser, errors);
+    DOMDocument* doc = parse(parser, xml);
+    DOMElement* root = doc->getDocumentElement();
+
+    // XPath validation, without the cache that normally fronts it
+    runner.run("xpath_guard/check", [&]() {
+        char message[256];
+        size_t passed = 0;
+        for (const char* query : XPATH_QUERIES) {
+            passed += native_guard::check(query, 10000, message, sizeof(message));
+        }
+        return passed;
+    });
+
+    // Native XPath engine
+    for (const char* query : XPATH_QUERIES) {
+        runner.run(std::string("native_xpath/compile ") + query, [&]() {
+            return native_xpath::compile(query)->source().size();
+        });
+    }
+    for (const char* query : XPATH_QUERIES) {
+        native_xpath::CompiledExpressionPtr compiled = native_xpath::compile(query);
+        runner.run(std::string("native_xpath/select ") + query, [&]() {
+            std::vector<DOMNode*> nodes;
+            native_xpath::select_nodes(*compiled, doc, nodes);
+            return nodes.size();
+        });
+    }
+
+    // Xerces XPath subset
+    DOMXPathNSResolver* resolver = doc->createNSResolver(root);
+    for (const char* query : XERCES_QUERIES) {
+        XMLCh* expression_text = XMLString::transcode(query);
+        runner.run(std::string("xerces_xpath/compile ") + query, [&]() {
+            DOMXPathExpression* expression = doc->createExpression(expression_text, resolver);
+            expression->release();
+            return (size_t)1;
+        });
+        DOMXPathExpression* expression = doc->createExpression(expression_text, resolver);
+        DOMXPathResult* result = nullptr;
+        runner.run(std::string("xerces_xpath/select ") + query, [&]() {
+            result = expression->evaluate(doc, DOMXPathResult::ORDERED_NODE_SNAPSHOT_TYPE, result);
+            size_t found = 0;
+            XMLSize_t length = result->getSnapshotLength();
+            for (XMLSize_t i = 0; i < length; i++) {
+                result->snapshotItem(i);
+                found += result->getNodeValue() != nullptr;
+            }
+            return found;
+        });
+        if (result) {
+            result->release();
+        }
+        expression->release();
+        XMLString::release(&expression_text);
+    }
+
+#ifdef HAVE_XALAN
+    // Xalan, through the context each document keeps
+    runner.run("xalan/context", [&]() {
+        std::unique_ptr<native_xalan::Context> context(native_xalan::create_context(doc));
+        return (size_t)(context != nullptr);
+    });
+
+    std::unique_ptr<native_xalan::Context> context(native_xalan::create_context(doc));
+    for (const char* query : XPATH_QUERIES) {
+        runner.run(std::string("xalan/compile ") + query, [&]() {
+            xalanc::XPath* xpath = context->compile(query);
+            context->factory->returnObject(xpath);
+            return (size_t)1;
+        });
+    }
+    for (const char* query : XPATH_QUERIES) {
+        xalanc::XPath* xpath = context->compile(query);
+        runner.run(std::string("xalan/select ") + query, [&]() {
+            std::vector<DOMNode*> nodes;
+            context->select(*xpath, doc, nodes);
+            return nodes.size();
+        });
+        context->factory->returnObject(xpath);
+    }
+    context.reset();
+#endif
+
+    // CSS
+    for (const char* selector : CSS_SELECTORS) {
+        native_css::SelectorPtr compiled = native_css::compile(selector);
+        runner.run(std::string("css/to_xpath ") + selector, [&]() {
+            return native_css::to_xpath(*compiled).size();
+        });
+    }
+    for (const char* selector : CSS_SELECTORS) {
+        runner.run(std::string("css/compile ") + selector, [&]() {
+            return native_css::compile(selector)->complexes().size();
+        });
+    }
+    for (const char* selector : CSS_SELECTORS) {
+        native_css::SelectorPtr compiled = native_css::compile(selector);
+        runner.run(std::string("css/select ") + selector, [&]() {
+            std::vector<DOMNode*> nodes;
+            native_css::select(*compiled, doc, nodes);
+            return nodes.size();
+        });
+    }
+
+    // Serialization
+    DOMLSSerializer* serializer = ls_implementation()->createLSSerializer();
+    DOMLSOutput* output = ls_implementation()->createLSOutput();
+    XMLCh* encoding = XMLString::transcode("UTF-8");
+    output->setEncoding(encoding);
+    MemBufFormatTarget target;
+    output->setByteStream(&target);
+    runner.run("serialize", [&]() {
+        target.reset();
+        serializer->write(doc, output);
+        return (size_t)target.getLen();
+    });
+    output->release();
+    serializer->release();
+    XMLString::release(&encoding);
+
+    native_c14n::Options c14n_options;
+    runner.run("serialize/c14n", [&]() {
+        target.reset();
+        native_c14n::canonicalize(doc, c14n_options, target);
+        return (size_t)target.getLen();
+    });
+
+    // Validation against a compiled, locked schema
+    XMLGrammarPoolImpl pool(XMLPlatformUtils::fgMemoryManager);
+    {
+        XercesDOMParser loader(nullptr, XMLPlatformUtils::fgMemoryManager, &pool);
+        loader.setDoNamespaces(true);
+        loader.setDoSchema(true);
+        loader.setErrorHandler(&errors);
+        MemBufInputSource schema((const XMLByte*)CATALOG_XSD, strlen(CATALOG_XSD), SCHEMA_SYSTEM_ID);
+        loader.loadGrammar(schema, Grammar::SchemaGrammarType, true);
+    }
+    pool.lockPool();
+    XMLCh* schema_location = XMLString::transcode(SCHEMA_SYSTEM_ID);
+    runner.run("validate", [&]() {
+        std::unique_ptr<SAX2XMLReader> reader(XMLReaderFactory::createXMLReader(XMLPlatformUtils::fgMemoryManager, &pool));
+        reader->setFeature(XMLUni::fgSAX2CoreNameSpaces, true);
+        reader->setFeature(XMLUni::fgSAX2CoreValidation, true);
+        reader->setFeature(XMLUni::fgXercesDynamic, false);
+        reader->setFeature(XMLUni::fgXercesSchema, true);
+        reader->setFeature(XMLUni::fgXercesUseCachedGrammarInParse, true);
+        reader->setProperty(XMLUni::fgXercesSchemaExternalNoNameSpaceSchemaLocation, schema_location);
+        reader->setErrorHandler(&errors);
+        MemBufInputSource input((const XMLByte*)xml.data(), xml.size(), "document.xml");
+        reader->parse(input);
+        return (size_t)1;
+    });
+    XMLString::release(&schema_location);
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: bench_native [--filter TEXT] [--min-time SECONDS] [--size BOOKS] [--output FILE]\n");
+    exit(2);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+        }
+        if (arg == "--filter") {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time") {
+            options.min_time = atof(argv[++i]);
+        } else if (arg == "--size") {
+            options.size = (size_t)atol(argv[++i]);
+        } else if (arg == "--output") {
+            options.output = argv[++i];
+        } else {
+            usage();
+        }
+    }
+
+    XMLPlatformUtils::Initialize();
+#ifdef HAVE_XALAN
+    xalanc::XPathEvaluator::initialize();
+#endif
+
+    std::string xml = catalog_xml(options.size);
+    Runner runner(options);
+    try {
+        run_benchmarks(runner, xml);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "\nbench_native: %s\n", e.what());
+        return 1;
+    } catch (...) {
+        fprintf(stderr, "\nbench_native: benchmark failed with a Xerces or Xalan exception\n");
+        return 1;
+    }
+
+#ifdef HAVE_XALAN
+    xalanc::XPathEvaluator::terminate();
+#endif
+    XMLPlatformUtils::Terminate();
+
+    std::string json = to_json(options, xml.size(), runner.results());
+    if (options.output.empty()) {
+        fputs(json.c_str(), stdout);
+    } else {
+        FILE* file = fopen(options.output.c_str(), "w");
+        if (!file) {
+            perror(options.output.c_str());
+            return 1;
+        }
+        fputs(json.c_str(), file);
+        fclose(file);
+    }
+    return 0;
+}
@@ -6,9 +6,12 @@
 benchmarks = %w[
   parse_benchmark.rb
   xpath_benchmark.rb
+  xpath_engine_benchmark.rb
   css_benchmark.rb
   traversal_benchmark.rb
   serialization_benchmark.rb
+  schema_benchmark.rb
+  allocation_benchmark.rb
 ]
 
 puts "Running all RXerces benchmarks..."
@@ -0,0 +1,138 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+require 'benchmark/ips'
+require 'etc'
+require 'tempfile'
+require 'rxerces'
+
+begin
+  require 'nokogiri'
+  NOKOGIRI_AVAILABLE = true
+rescue LoadError
+  NOKOGIRI_AVAILABLE = false
+  puts "Nokogiri not available - install with: gem install nokogiri"
+end
+
+XSD = <<~XSD
+  <?xml version="1.0" encoding="UTF-8"?>
+  <xs:schema xmlns:xs="http://www.w3.org/2001/XMLSchema">
+    <xs:element name="root">
+      <xs:complexType>
+        <xs:sequence>
+          <xs:element name="person" maxOccurs="unbounded">
+            <xs:complexType>
+              <xs:sequence>
+                <xs:element name="age" type="xs:integer"/>
+                <xs:element name="city" type="xs:string"/>
+              </xs:sequence>
+              <xs:attribute name="id" type="xs:integer" use="required"/>
+              <xs:attribute name="name" type="xs:string"/>
+            </xs:complexType>
+          </xs:element>
+        </xs:sequence>
+      </xs:complexType>
+    </xs:element>
+  </xs:schema>
+XSD
+
+def generate_xml(count)
+  people = (1..count).map do |i|
+    "<person id=\"#{i}\" name=\"Person#{i}\"><age>#{20 + (i % 50)}</age><city>City#{i % 20}</city></person>"
+  end
+  "<root>#{people.join}</root>"
+end
+
+SMALL_XML = generate_xml(10)
+LARGE_XML = generate_xml(1000)
+
+puts "=" * 80
+puts "Schema Validation Benchmarks"
+puts "=" * 80
+puts
+
+rxerces_schema = RXerces::XML::Schema.from_string(XSD)
+nokogiri_schema = Nokogiri::XML::Schema(XSD) if NOKOGIRI_AVAILABLE
+
+# Repeated validation: the schema is compiled once, so each call only
+# scans the document
+[["Small", SMALL_XML], ["Large", LARGE_XML]].each do |label, xml|
+  puts "#{label} document validate (#{xml.bytesize} bytes)"
+  puts "-" * 80
+
+  rxerces_doc = RXerces::XML::Document.parse(xml)
+  rxerces_source_doc = RXerces::XML::Document.parse(xml, preserve_source: true)
+  nokogiri_doc = Nokogiri::XML(xml) if NOKOGIRI_AVAILABLE
+
+  Benchmark.ips do |x|
+    x.config(time: 5, warmup: 2)
+
+    x.report("rxerces") { rxerces_doc.validate(rxerces_schema) }
+    x.report("rxerces preserve_source") { rxerces_source_doc.validate(rxerces_schema) }
+    x.report("nokogiri") { nokogiri_schema.validate(nokogiri_doc) } if NOKOGIRI_AVAILABLE
+
+    x.compare!
+  end
+
+  puts
+end
+
+# Parse then validate, against validating while parsing
+puts "Large document parse + validate (#{LARGE_XML.bytesize} bytes)"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces parse(schema:)") { RXerces::XML::Document.parse(LARGE_XML, schema: rxerces_schema).errors }
+  x.report("rxerces parse, validate") { RXerces::XML::Document.parse(LARGE_XML).validate(rxerces_schema) }
+  x.report("nokogiri parse, validate") { nokogiri_schema.validate(Nokogiri::XML(LARGE_XML)) } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+puts
+
+# A batch of messages against one schema: validated one by one, against
+# spread over native threads with the GVL released
+MESSAGES = Array.new(200) { SMALL_XML.dup }
+threads = [Etc.nprocessors, 4].min
+
+puts "Batch of #{MESSAGES.length} small messages (#{threads} threads)"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces validate each") { MESSAGES.each { |xml| RXerces::XML::Document.parse(xml).validate(rxerces_schema) } }
+  x.report("rxerces validate_many") { rxerces_schema.validate_many(MESSAGES, threads: threads) }
+  x.report("nokogiri validate each") { MESSAGES.each { |xml| nokogiri_schema.validate(Nokogiri::XML(xml)) } } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+puts
+
+# Streaming a large file from disk, against reading and parsing it first
+STREAM_XML = generate_xml(20_000)
+stream_file = Tempfile.new(['schema_benchmark', '.xml'])
+stream_file.write(STREAM_XML)
+stream_file.close
+
+puts "Streaming file validate (#{STREAM_XML.bytesize} bytes)"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces validate_file") { rxerces_schema.validate_file(stream_file.path) }
+  x.report("rxerces parse, validate") { RXerces::XML::Document.parse(File.read(stream_file.path)).validate(rxerces_schema) }
+  x.report("nokogiri validate(path)") { nokogiri_schema.validate(stream_file.path) } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+stream_file.unlink
+
+puts
+puts "=" * 80
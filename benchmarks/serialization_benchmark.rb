@@ -89,5 +89,92 @@ Benchmark.ips do |x|
   x.compare!
 end
 
+puts
+
+# Streaming into an IO: output is written in fixed-size chunks, so no
+# full copy of the document is built in memory
+puts "Large document write_to(IO) (#{LARGE_XML.bytesize} bytes)"
+puts "-" * 80
+
+null_io = File.open(File::NULL, 'w')
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces write_to") { rxerces_large.write_to(null_io) }
+  x.report("rxerces to_s + write") { null_io.write(rxerces_large.to_s) }
+  x.report("nokogiri write_to") { nokogiri_large.write_to(null_io) } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+null_io.close
+
+puts
+
+# Fragments: NodeSet#to_xml writes every node through one pooled
+# serializer into a single buffer
+puts "Serialize 1,000 <person> fragments"
+puts "-" * 80
+
+rxerces_people = rxerces_large.xpath('//person')
+nokogiri_people = nokogiri_large.xpath('//person') if NOKOGIRI_AVAILABLE
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces NodeSet#to_xml") { rxerces_people.to_xml }
+  x.report("rxerces map(&:to_xml).join") { rxerces_people.map(&:to_xml).join }
+  x.report("nokogiri NodeSet#to_xml") { nokogiri_people.to_xml } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+puts
+
+# Change one attribute, then serialize: with preserve_source only the
+# changed start tag is rebuilt, everything else is copied from the source
+puts "Large document: change one attribute, then to_s"
+puts "-" * 80
+
+rxerces_tracked = RXerces::XML::Document.parse(LARGE_XML, preserve_source: true)
+tracked_person = rxerces_tracked.xpath('//person').first
+plain_person = rxerces_large.xpath('//person').first
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces preserve_source") do
+    tracked_person['name'] = 'Changed'
+    rxerces_tracked.to_s
+  end
+  x.report("rxerces") do
+    plain_person['name'] = 'Changed'
+    rxerces_large.to_s
+  end
+
+  x.compare!
+end
+
+puts
+
+# Canonicalization streamed into a digest, as done when signing
+puts "Large document exclusive canonicalization + SHA-256"
+puts "-" * 80
+
+require 'digest'
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces write_canonical") { rxerces_large.write_canonical(Digest::SHA256.new) }
+  x.report("rxerces canonicalize") { Digest::SHA256.hexdigest(rxerces_large.canonicalize) }
+  if NOKOGIRI_AVAILABLE
+    x.report("nokogiri canonicalize") { Digest::SHA256.hexdigest(nokogiri_large.canonicalize(Nokogiri::XML::XML_C14N_EXCLUSIVE_1_0)) }
+  end
+
+  x.compare!
+end
+
 puts
 puts "=" * 80
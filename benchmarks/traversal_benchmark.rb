@@ -145,5 +145,66 @@ Benchmark.ips do |x|
   x.compare!
 end
 
+puts
+
+# Wide elements: child access follows sibling pointers, and positional
+# access uses a cached child index
+WIDE_XML = "<root>#{(1..20_000).map { |i| "<row n=\"#{i}\"/>" }.join}</root>"
+rxerces_wide = RXerces::XML::Document.parse(WIDE_XML).root
+nokogiri_wide = Nokogiri::XML(WIDE_XML).root if NOKOGIRI_AVAILABLE
+
+puts "Wide element (20,000 children): .children, .child_at"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces children") { rxerces_wide.children }
+  x.report("nokogiri children") { nokogiri_wide.children } if NOKOGIRI_AVAILABLE
+  x.report("rxerces child_at x100") { 100.times { |i| rxerces_wide.child_at(i * 199) } }
+  x.report("nokogiri children[] x100") { 100.times { |i| nokogiri_wide.children[i * 199] } } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+puts
+
+# Subtree iteration: native iterators walk DOM pointers and yield as they
+# go, instead of materializing a NodeSet first
+puts "Visit every <row> element"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces xpath('.//row').each") { rxerces_wide.xpath('.//row').each { |_| } }
+  x.report("rxerces each_element('row')") { rxerces_wide.each_element('row') { |_| } }
+  x.report("rxerces traverse") { rxerces_wide.traverse { |_| } }
+  x.report("nokogiri traverse") { nokogiri_wide.traverse { |_| } } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
+puts
+
+# Paths of every element: one pass with running sibling counters instead of
+# a previous-sibling scan per node and level
+puts "Paths of every element"
+puts "-" * 80
+
+rxerces_elements = rxerces_doc.xpath('//*')
+nokogiri_elements = nokogiri_doc.xpath('//*') if NOKOGIRI_AVAILABLE
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces map(&:path)") { rxerces_elements.map(&:path) }
+  x.report("rxerces paths") { rxerces_elements.paths }
+  x.report("rxerces each_with_path") { rxerces_doc.each_with_path(type: :element) { |_path, _node| } }
+  x.report("nokogiri map(&:path)") { nokogiri_elements.map(&:path) } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
 puts
 puts "=" * 80
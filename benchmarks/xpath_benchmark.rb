@@ -96,5 +96,28 @@ Benchmark.ips do |x|
   x.compare!
 end
 
+puts
+
+# Combining results of separate queries: NodeSet set operations merge in
+# document order natively
+puts "NodeSet union/intersection of two 250-node results"
+puts "-" * 80
+
+rxerces_fiction = rxerces_doc.xpath("//book[@category='fiction' or @category='science']")
+rxerces_early = rxerces_doc.xpath('//book[year < 2005]')
+nokogiri_fiction = nokogiri_doc.xpath("//book[@category='fiction' or @category='science']") if NOKOGIRI_AVAILABLE
+nokogiri_early = nokogiri_doc.xpath('//book[year < 2005]') if NOKOGIRI_AVAILABLE
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  x.report("rxerces |") { rxerces_fiction | rxerces_early }
+  x.report("rxerces &") { rxerces_fiction & rxerces_early }
+  x.report("nokogiri |") { nokogiri_fiction | nokogiri_early } if NOKOGIRI_AVAILABLE
+  x.report("nokogiri &") { nokogiri_fiction & nokogiri_early } if NOKOGIRI_AVAILABLE
+
+  x.compare!
+end
+
 puts
 puts "=" * 80
@@ -0,0 +1,136 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+require 'benchmark/ips'
+require 'rxerces'
+
+# Compares the XPath engines built into RXerces against each other. The
+# native engine is always available; Xalan only when RXerces was compiled
+# against it. The Xerces engine is limited to the XML Schema XPath subset,
+# so it is only reported for the queries it can handle.
+
+ENGINES = [:native]
+ENGINES << :xalan if RXerces.xalan_enabled?
+
+# Sample XML for XPath queries
+XML_DATA = begin
+  books = (1..500).map do |i|
+    category = ['fiction', 'science', 'biography', 'history'][i % 4]
+    year = 1990 + (i % 30)
+    price = 10.0 + (i % 50)
+    "<book id=\"book#{i}\" category=\"#{category}\">
+      <title lang=\"en\">Title #{i}</title>
+      <author>Author #{i}</author>
+      <year>#{year}</year>
+      <price>#{'%.2f' % price}</price>
+    </book>"
+  end
+  "<catalog>#{books.join}</catalog>"
+end
+
+QUERIES = {
+  "//book" => true,
+  "/catalog/book/title" => true,
+  "//book[@category='fiction']" => false,
+  "//book[year > 2000 and price < 30]/title" => false,
+  "//book[position() mod 10 = 0]/@id" => false,
+  "//title[contains(., '42')]/following-sibling::price" => false
+}.freeze
+
+puts "=" * 80
+puts "XPath Engine Benchmarks"
+puts "=" * 80
+puts "XML Size: #{XML_DATA.bytesize} bytes"
+puts "Engines: #{ENGINES.join(', ')}"
+puts
+
+doc = RXerces::XML::Document.parse(XML_DATA)
+original_engine = RXerces.xpath_engine
+
+# Check that every engine agrees before timing anything
+QUERIES.each_key do |query|
+  counts = ENGINES.map do |engine|
+    RXerces.xpath_engine = engine
+    doc.xpath(query).length
+  end
+
+  unless counts.uniq.size == 1
+    abort "Engines disagree on #{query}: #{ENGINES.zip(counts).to_h}"
+  end
+end
+
+QUERIES.each do |query, xerces_supported|
+  puts "XPath: #{query}"
+  puts "-" * 80
+
+  engines = ENGINES.dup
+  engines << :xerces if xerces_supported
+
+  Benchmark.ips do |x|
+    x.config(time: 5, warmup: 2)
+
+    engines.each do |engine|
+      x.report(engine.to_s) do
+        RXerces.xpath_engine = engine
+        doc.xpath(query)
+      end
+    end
+
+    x.compare!
+  end
+
+  puts
+end
+
+# Compiling is cached per engine, so also measure first-time compilation
+puts "Compile + evaluate (unique expression per iteration)"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  ENGINES.each do |engine|
+    counter = 0
+    x.report(engine.to_s) do
+      RXerces.xpath_engine = engine
+      counter += 1
+      doc.xpath("//book[@id='book#{counter % 100_000}']")
+    end
+  end
+
+  x.compare!
+end
+
+# Bounded queries stop evaluating once enough nodes have been found
+puts "First match (early termination)"
+puts "-" * 80
+
+Benchmark.ips do |x|
+  x.config(time: 5, warmup: 2)
+
+  ENGINES.each do |engine|
+    x.report("#{engine} xpath.first") do
+      RXerces.xpath_engine = engine
+      doc.xpath("//book[@category='science']").first
+    end
+
+    x.report("#{engine} at_xpath") do
+      RXerces.xpath_engine = engine
+      doc.at_xpath("//book[@category='science']")
+    end
+
+    x.report("#{engine} xpath_each + break") do
+      RXerces.xpath_engine = engine
+      doc.xpath_each("//book[@category='science']") { |book| break book }
+    end
+  end
+
+  x.compare!
+end
+
+puts
+
+RXerces.xpath_engine = original_engine
+
+puts
+puts "=" * 80
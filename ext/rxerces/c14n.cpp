@@ -0,0 +1,424 @@
+#include "c14n.h"
+#include "xpath_engine.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace xercesc;
+
+namespace native_c14n {
+
+// Output is passed to the target in blocks of about this size
+static const size_t FLUSH_SIZE = 16 * 1024;
+
+static const char XML_NAMESPACE[] = "http://www.w3.org/XML/1998/namespace";
+
+static std::string utf8(const XMLCh* str) {
+    if (!str) {
+        return std::string();
+    }
+    return native_xpath::xstring_to_utf8(str, XMLString::stringLen(str));
+}
+
+static bool starts_with(const std::string& str, const char* prefix) {
+    return str.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static std::string prefix_of(const std::string& qname) {
+    size_t colon = qname.find(':');
+    return colon == std::string::npos ? std::string() : qname.substr(0, colon);
+}
+
+// A namespace binding, from a declaration in the document or as written
+struct Namespace {
+    std::string prefix;  // empty for the default namespace
+    std::string uri;
+
+    Namespace(const std::string& p, const std::string& u) : prefix(p), uri(u) {}
+
+    bool operator<(const Namespace& other) const {
+        return prefix < other.prefix;
+    }
+};
+
+struct Attribute {
+    std::string uri;
+    std::string local_name;
+    std::string name;
+    std::string value;
+
+    bool operator<(const Attribute& other) const {
+        return uri != other.uri ? uri < other.uri : local_name < other.local_name;
+    }
+};
+
+// Bindings with nested scopes, one per open element. Lookups search from
+// the innermost scope outwards.
+class NamespaceScopes {
+public:
+    void open() { marks_.push_back(bindings_.size()); }
+
+    void close() {
+        bindings_.erase(bindings_.begin() + marks_.back(), bindings_.end());
+        marks_.pop_back();
+    }
+
+    void bind(const std::string& prefix, const std::string& uri) {
+        bindings_.push_back(Namespace(prefix, uri));
+    }
+
+    const std::string* lookup(const std::string& prefix) const {
+        for (size_t i = bindings_.size(); i > 0; i--) {
+            if (bindings_[i - 1].prefix == prefix) {
+                return &bindings_[i - 1].uri;
+            }
+        }
+        return nullptr;
+    }
+
+    // Every prefix bound in any scope, innermost binding only
+    std::vector<std::string> prefixes() const {
+        std::vector<std::string> result;
+        for (const Namespace& binding : bindings_) {
+            if (std::find(result.begin(), result.end(), binding.prefix) == result.end()) {
+                result.push_back(binding.prefix);
+            }
+        }
+        return result;
+    }
+
+private:
+    std::vector<Namespace> bindings_;
+    std::vector<size_t> marks_;
+};
+
+class Canonicalizer {
+public:
+    Canonicalizer(const Options& options, XMLFormatTarget& target)
+        : options_(options), target_(target), apex_(nullptr), document_element_seen_(false) {
+        for (const std::string& prefix : options.inclusive_prefixes) {
+            inclusive_prefixes_.push_back(prefix == "#default" ? std::string() : prefix);
+        }
+    }
+
+    void run(DOMNode* apex) {
+        if (apex->getNodeType() == DOMNode::ATTRIBUTE_NODE) {
+            throw Error("cannot canonicalize an attribute node");
+        }
+
+        apex_ = apex;
+        bind_ancestor_namespaces();
+
+        // Walk the subtree in document order, writing start tags on the way
+        // down and end tags on the way back up
+        DOMNode* node = apex;
+        while (node) {
+            DOMNode* child = enter(node) ? node->getFirstChild() : nullptr;
+            if (child) {
+                node = child;
+                continue;
+            }
+
+            while (node) {
+                leave(node);
+                if (node == apex) {
+                    node = nullptr;
+                } else if (node->getNextSibling()) {
+                    node = node->getNextSibling();
+                    break;
+                } else {
+                    node = node->getParentNode();
+                }
+            }
+        }
+
+        flush();
+    }
+
+private:
+    // Write the opening part of node. Returns true if its children are to
+    // be visited.
+    bool enter(DOMNode* node) {
+        switch (node->getNodeType()) {
+            case DOMNode::DOCUMENT_NODE:
+            case DOMNode::ENTITY_REFERENCE_NODE:
+                return true;
+            case DOMNode::ELEMENT_NODE:
+                start_element(static_cast<DOMElement*>(node));
+                if (at_document_level(node)) {
+                    document_element_seen_ = true;
+                }
+                return true;
+            case DOMNode::TEXT_NODE:
+            case DOMNode::CDATA_SECTION_NODE:
+                escape_text(node->getNodeValue());
+                return false;
+            case DOMNode::COMMENT_NODE:
+                if (options_.with_comments) {
+                    before_document_level(node);
+                    out_ += "<!--";
+                    out_ += utf8(node->getNodeValue());
+                    out_ += "-->";
+                    after_document_level(node);
+                }
+                return false;
+            case DOMNode::PROCESSING_INSTRUCTION_NODE: {
+                before_document_level(node);
+                out_ += "<?";
+                out_ += utf8(node->getNodeName());
+                std::string data = utf8(node->getNodeValue());
+                if (!data.empty()) {
+                    out_ += ' ';
+                    out_ += data;
+                }
+                out_ += "?>";
+                after_document_level(node);
+                return false;
+            }
+            default:
+                // Document types and anything else have no canonical form
+                return false;
+        }
+    }
+
+    void leave(DOMNode* node) {
+        if (node->getNodeType() == DOMNode::ELEMENT_NODE) {
+            out_ += "</";
+            out_ += utf8(node->getNodeName());
+            out_ += '>';
+            in_scope_.close();
+            rendered_.close();
+        }
+        if (out_.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    void start_element(DOMElement* element) {
+        bool apex = element == apex_;
+
+        // Split the attributes into namespace declarations and the rest
+        std::vector<Namespace> declared;
+        std::vector<Attribute> attributes;
+        collect_attributes(element, declared, attributes);
+
+        in_scope_.open();
+        for (const Namespace& binding : declared) {
+            in_scope_.bind(binding.prefix, binding.uri);
+        }
+
+        if (apex && options_.mode == MODE_INCLUSIVE) {
+            inherit_xml_attributes(element, attributes);
+        }
+
+        // Work out which prefixes may need a declaration here
+        std::vector<std::string> candidates;
+        if (options_.mode == MODE_INCLUSIVE) {
+            if (apex) {
+                candidates = in_scope_.prefixes();
+            } else {
+                for (const Namespace& binding : declared) {
+                    candidates.push_back(binding.prefix);
+                }
+            }
+        } else {
+            // Prefixes come from the qualified names, so elements created
+            // without namespace information are handled too
+            candidates.push_back(prefix_of(utf8(element->getNodeName())));
+            for (const Attribute& attribute : attributes) {
+                std::string prefix = prefix_of(attribute.name);
+                if (!prefix.empty()) {
+                    candidates.push_back(prefix);
+                }
+            }
+            candidates.insert(candidates.end(), inclusive_prefixes_.begin(), inclusive_prefixes_.end());
+        }
+
+        std::vector<Namespace> output;
+        for (const std::string& prefix : candidates) {
+            if (prefix == "xml" || std::find_if(output.begin(), output.end(),
+                    [&prefix](const Namespace& n) { return n.prefix == prefix; }) != output.end()) {
+                continue;
+            }
+
+            const std::string* uri = in_scope_.lookup(prefix);
+            const std::string* written = rendered_.lookup(prefix);
+            if (!uri || uri->empty()) {
+                // An unbound default namespace only needs xmlns="" to undo
+                // a default written on an output ancestor
+                if (prefix.empty() && written && !written->empty()) {
+                    output.push_back(Namespace(prefix, std::string()));
+                }
+            } else if (!written || *written != *uri) {
+                output.push_back(Namespace(prefix, *uri));
+            }
+        }
+
+        std::sort(output.begin(), output.end());
+        std::sort(attributes.begin(), attributes.end());
+
+        rendered_.open();
+        out_ += '<';
+        out_ += utf8(element->getNodeName());
+        for (const Namespace& binding : output) {
+            rendered_.bind(binding.prefix, binding.uri);
+            out_ += binding.prefix.empty() ? " xmlns" : " xmlns:";
+            out_ += binding.prefix;
+            out_ += "=\"";
+            escape_attribute(binding.uri);
+            out_ += '"';
+        }
+        for (const Attribute& attribute : attributes) {
+            out_ += ' ';
+            out_ += attribute.name;
+            out_ += "=\"";
+            escape_attribute(attribute.value);
+            out_ += '"';
+        }
+        out_ += '>';
+    }
+
+    static void collect_attributes(DOMElement* element, std::vector<Namespace>& declared,
+                                   std::vector<Attribute>& attributes) {
+        DOMNamedNodeMap* map = element->getAttributes();
+        XMLSize_t length = map ? map->getLength() : 0;
+        for (XMLSize_t i = 0; i < length; i++) {
+            DOMNode* attr = map->item(i);
+            std::string name = utf8(attr->getNodeName());
+
+            if (name == "xmlns") {
+                declared.push_back(Namespace(std::string(), utf8(attr->getNodeValue())));
+            } else if (starts_with(name, "xmlns:")) {
+                declared.push_back(Namespace(name.substr(6), utf8(attr->getNodeValue())));
+            } else {
+                Attribute attribute;
+                attribute.name = name;
+                attribute.uri = utf8(attr->getNamespaceURI());
+                attribute.local_name = attr->getLocalName() ? utf8(attr->getLocalName()) : name;
+                attribute.value = utf8(attr->getNodeValue());
+                if (attribute.uri.empty() && starts_with(name, "xml:")) {
+                    attribute.uri = XML_NAMESPACE;
+                    attribute.local_name = name.substr(4);
+                }
+                attributes.push_back(attribute);
+            }
+        }
+    }
+
+    // Declarations made above the apex are in scope for it
+    void bind_ancestor_namespaces() {
+        std::vector<DOMElement*> ancestors;
+        for (DOMNode* parent = apex_->getParentNode(); parent; parent = parent->getParentNode()) {
+            if (parent->getNodeType() == DOMNode::ELEMENT_NODE) {
+                ancestors.push_back(static_cast<DOMElement*>(parent));
+            }
+        }
+
+        in_scope_.open();
+        for (size_t i = ancestors.size(); i > 0; i--) {
+            std::vector<Namespace> declared;
+            std::vector<Attribute> ignored;
+            collect_attributes(ancestors[i - 1], declared, ignored);
+            for (const Namespace& binding : declared) {
+                in_scope_.bind(binding.prefix, binding.uri);
+            }
+        }
+    }
+
+    // Canonical XML 1.0 copies xml:lang, xml:space and the like from the
+    // omitted ancestors of the apex, nearest first
+    static void inherit_xml_attributes(DOMElement* element, std::vector<Attribute>& attributes) {
+        for (DOMNode* parent = element->getParentNode(); parent; parent = parent->getParentNode()) {
+            if (parent->getNodeType() != DOMNode::ELEMENT_NODE) {
+                continue;
+            }
+
+            std::vector<Namespace> ignored;
+            std::vector<Attribute> inherited;
+            collect_attributes(static_cast<DOMElement*>(parent), ignored, inherited);
+            for (const Attribute& attribute : inherited) {
+                if (attribute.uri != XML_NAMESPACE) {
+                    continue;
+                }
+                bool present = false;
+                for (const Attribute& existing : attributes) {
+                    if (existing.uri == attribute.uri && existing.local_name == attribute.local_name) {
+                        present = true;
+                        break;
+                    }
+                }
+                if (!present) {
+                    attributes.push_back(attribute);
+                }
+            }
+        }
+    }
+
+    bool at_document_level(DOMNode* node) const {
+        DOMNode* parent = node->getParentNode();
+        return apex_->getNodeType() == DOMNode::DOCUMENT_NODE &&
+               parent && parent->getNodeType() == DOMNode::DOCUMENT_NODE;
+    }
+
+    // Comments and processing instructions outside the document element
+    // are separated from it by a line feed
+    void before_document_level(DOMNode* node) {
+        if (document_element_seen_ && at_document_level(node)) {
+            out_ += '\n';
+        }
+    }
+
+    void after_document_level(DOMNode* node) {
+        if (!document_element_seen_ && at_document_level(node)) {
+            out_ += '\n';
+        }
+    }
+
+    void escape_text(const XMLCh* text) {
+        for (char c : utf8(text)) {
+            switch (c) {
+                case '&': out_ += "&amp;"; break;
+                case '<': out_ += "&lt;"; break;
+                case '>': out_ += "&gt;"; break;
+                case '\r': out_ += "&#xD;"; break;
+                default: out_ += c; break;
+            }
+        }
+    }
+
+    void escape_attribute(const std::string& value) {
+        for (char c : value) {
+            switch (c) {
+                case '&': out_ += "&amp;"; break;
+                case '<': out_ += "&lt;"; break;
+                case '"': out_ += "&quot;"; break;
+                case '\t': out_ += "&#x9;"; break;
+                case '\n': out_ += "&#xA;"; break;
+                case '\r': out_ += "&#xD;"; break;
+                default: out_ += c; break;
+            }
+        }
+    }
+
+    void flush() {
+        if (!out_.empty()) {
+            target_.writeChars((const XMLByte*)out_.data(), out_.size(), nullptr);
+            out_.clear();
+        }
+    }
+
+    const Options& options_;
+    XMLFormatTarget& target_;
+    DOMNode* apex_;
+    bool document_element_seen_;
+    std::vector<std::string> inclusive_prefixes_;
+    NamespaceScopes in_scope_;  // Declarations in the document
+    NamespaceScopes rendered_;  // Declarations written to the output
+    std::string out_;
+};
+
+void canonicalize(DOMNode* node, const Options& options, XMLFormatTarget& out) {
+    Canonicalizer canonicalizer(options, out);
+    canonicalizer.run(node);
+}
+
+} // namespace native_c14n
@@ -0,0 +1,52 @@
+#ifndef RXERCES_C14N_H
+#define RXERCES_C14N_H
+
+#include <xercesc/util/XercesDefs.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/framework/XMLFormatter.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Native Canonical XML serializer. Produces Canonical XML 1.0 or Exclusive
+// XML Canonicalization 1.0 of a document or of the subtree below a node,
+// writing UTF-8 directly to an XMLFormatTarget so the canonical bytes can
+// be streamed to a file or a digest without being collected first.
+//
+// Namespace declarations are emitted sorted by prefix (default first) and
+// attributes sorted by namespace URI and local name. Superfluous namespace
+// declarations are dropped; in exclusive mode only the namespaces visibly
+// used by an element (or listed as inclusive prefixes) are emitted.
+//
+// Errors are reported by throwing native_c14n::Error.
+namespace native_c14n {
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+enum Mode {
+    MODE_INCLUSIVE,  // Canonical XML 1.0
+    MODE_EXCLUSIVE   // Exclusive XML Canonicalization 1.0
+};
+
+struct Options {
+    Mode mode;
+    bool with_comments;
+
+    // Exclusive mode only: prefixes handled as in inclusive mode. The
+    // default namespace is written as "#default".
+    std::vector<std::string> inclusive_prefixes;
+
+    Options() : mode(MODE_EXCLUSIVE), with_comments(false) {}
+};
+
+// Write the canonical form of node and its subtree to out. node may be a
+// document, an element or a text, comment or processing instruction node;
+// attribute nodes cannot be canonicalized on their own.
+void canonicalize(xercesc::DOMNode* node, const Options& options, xercesc::XMLFormatTarget& out);
+
+} // namespace native_c14n
+
+#endif
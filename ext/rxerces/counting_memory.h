@@ -0,0 +1,52 @@
+#ifndef RXERCES_COUNTING_MEMORY_H
+#define RXERCES_COUNTING_MEMORY_H
+
+#include <xercesc/util/PlatformUtils.hpp>
+#include <xercesc/framework/MemoryManager.hpp>
+#include <atomic>
+#include <cstddef>
+
+namespace native_memory {
+
+// Memory manager that keeps count of the bytes handed out through it, so a
+// document can report what its DOM and Xalan structures hold. Blocks come
+// from the Xerces default manager with their size in a header in front.
+class CountingMemoryManager : public xercesc::MemoryManager {
+public:
+    CountingMemoryManager() : bytes_(0) {}
+
+    xercesc::MemoryManager* getExceptionMemoryManager() {
+        return xercesc::XMLPlatformUtils::fgMemoryManager->getExceptionMemoryManager();
+    }
+
+    void* allocate(XMLSize_t size) {
+        Header* header = (Header*)xercesc::XMLPlatformUtils::fgMemoryManager->allocate(sizeof(Header) + size);
+        header->size = size;
+        bytes_.fetch_add(size, std::memory_order_relaxed);
+        return header + 1;
+    }
+
+    void deallocate(void* p) {
+        if (!p) {
+            return;
+        }
+        Header* header = (Header*)p - 1;
+        bytes_.fetch_sub(header->size, std::memory_order_relaxed);
+        xercesc::XMLPlatformUtils::fgMemoryManager->deallocate(header);
+    }
+
+    // Bytes currently allocated, not counting the headers
+    size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+    union Header {
+        XMLSize_t size;
+        std::max_align_t align;
+    };
+
+    std::atomic<size_t> bytes_;
+};
+
+} // namespace native_memory
+
+#endif
@@ -0,0 +1,1067 @@
+#include "css_engine.h"
+#include "xpath_engine.h"
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace xercesc;
+
+namespace native_css {
+
+typedef native_xpath::XString XString;
+
+// ---------------------------------------------------------------------------
+// Compiled form
+// ---------------------------------------------------------------------------
+
+enum Combinator { COMBINATOR_DESCENDANT, COMBINATOR_CHILD, COMBINATOR_ADJACENT, COMBINATOR_SIBLING };
+
+struct AttributeTest {
+    enum Op { EXISTS, EQUALS, NOT_EQUALS, INCLUDES, DASH_MATCH, PREFIX, SUFFIX, SUBSTRING };
+
+    Op op;
+    XString name;
+    XString value;
+};
+
+struct Compound;
+
+struct PseudoTest {
+    enum Kind {
+        FIRST_CHILD, LAST_CHILD, ONLY_CHILD, NTH_CHILD, NTH_LAST_CHILD,
+        FIRST_OF_TYPE, LAST_OF_TYPE, ONLY_OF_TYPE, NTH_OF_TYPE, NTH_LAST_OF_TYPE,
+        ROOT, EMPTY, NOT
+    };
+
+    Kind kind;
+    long a;  // an+b for the nth- variants
+    long b;
+    std::vector<std::shared_ptr<Compound> > negated;
+
+    PseudoTest() : kind(FIRST_CHILD), a(0), b(0) {}
+};
+
+// A sequence of simple selectors that all apply to one element, plus the
+// combinator that relates it to the compound on its left
+struct Compound {
+    enum Namespace { NS_ANY, NS_NONE, NS_PREFIX };
+
+    Namespace ns;
+    XString prefix;
+    bool has_tag;
+    XString tag;
+    std::vector<XString> ids;
+    std::vector<XString> classes;
+    std::vector<AttributeTest> attributes;
+    std::vector<PseudoTest> pseudos;
+    Combinator combinator;
+
+    Compound() : ns(NS_ANY), has_tag(false), combinator(COMBINATOR_DESCENDANT) {}
+};
+
+// Compounds are stored right to left, the order they are matched in
+struct ComplexSelector {
+    std::vector<Compound> compounds;
+};
+
+Selector::Selector(const std::vector<ComplexSelector*>& complexes, const std::string& source)
+    : complexes_(complexes), source_(source) {}
+
+Selector::~Selector() {
+    for (ComplexSelector* c : complexes_) delete c;
+}
+
+// ---------------------------------------------------------------------------
+// String helpers
+// ---------------------------------------------------------------------------
+
+static const XMLCh ID_NAME[] = { 'i', 'd', 0 };
+static const XMLCh CLASS_NAME[] = { 'c', 'l', 'a', 's', 's', 0 };
+
+static inline bool is_css_space(XMLCh c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool equals(const XString& a, const XMLCh* b) {
+    if (!b) return a.empty();
+    size_t i = 0;
+    for (; i < a.length(); i++) {
+        if (b[i] != a[i]) return false;
+    }
+    return b[i] == 0;
+}
+
+static size_t xlength(const XMLCh* s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+static bool starts_with(const XMLCh* s, size_t length, const XString& prefix) {
+    return prefix.length() <= length && std::equal(prefix.begin(), prefix.end(), s);
+}
+
+static bool ends_with(const XMLCh* s, size_t length, const XString& suffix) {
+    return suffix.length() <= length && std::equal(suffix.begin(), suffix.end(), s + length - suffix.length());
+}
+
+static bool contains(const XMLCh* s, size_t length, const XString& needle) {
+    return std::search(s, s + length, needle.begin(), needle.end()) != s + length || needle.empty();
+}
+
+// True if token is one of the whitespace-separated words in list
+static bool contains_token(const XMLCh* list, const XString& token) {
+    if (!list || token.empty()) return false;
+
+    const XMLCh* p = list;
+    while (*p) {
+        while (*p && is_css_space(*p)) p++;
+        const XMLCh* start = p;
+        while (*p && !is_css_space(*p)) p++;
+        if ((size_t)(p - start) == token.length() && std::equal(token.begin(), token.end(), start)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const XMLCh* attribute_value(DOMElement* element, const XMLCh* name) {
+    DOMAttr* attr = element->getAttributeNode(name);
+    return attr ? attr->getValue() : nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+// ---------------------------------------------------------------------------
+
+static inline bool is_ident_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '_' || c >= 0x80 || c == '\\';
+}
+
+static inline int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void append_utf8(std::string& out, unsigned long cp) {
+    if (cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) cp = 0xFFFD;
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static const int MAX_NOT_DEPTH = 32;
+
+class Parser {
+public:
+    explicit Parser(const std::string& source) : src_(source), pos_(0), not_depth_(0) {}
+
+    std::vector<ComplexSelector*> parse() {
+        std::vector<ComplexSelector*> complexes;
+
+        try {
+            skip_space();
+            if (at_end()) {
+                // A blank selector matches every element
+                ComplexSelector* all = new ComplexSelector();
+                all->compounds.push_back(Compound());
+                complexes.push_back(all);
+                return complexes;
+            }
+
+            for (;;) {
+                complexes.push_back(parse_complex());
+                skip_space();
+                if (at_end()) break;
+                if (peek() != ',') unexpected();
+                pos_++;
+                skip_space();
+            }
+        } catch (...) {
+            for (ComplexSelector* c : complexes) delete c;
+            throw;
+        }
+
+        return complexes;
+    }
+
+private:
+    bool at_end() const { return pos_ >= src_.length(); }
+    unsigned char peek(size_t offset = 0) const {
+        return pos_ + offset < src_.length() ? (unsigned char)src_[pos_ + offset] : 0;
+    }
+
+    bool skip_space() {
+        size_t start = pos_;
+        while (!at_end() && is_css_space(peek())) pos_++;
+        return pos_ > start;
+    }
+
+    void unexpected() const {
+        if (at_end()) {
+            throw Error("Unexpected end of selector");
+        }
+        char message[64];
+        snprintf(message, sizeof(message), "Unexpected '%c' at position %lu", src_[pos_], (unsigned long)pos_);
+        throw Error(message);
+    }
+
+    void expect(char c) {
+        if (peek() != (unsigned char)c) unexpected();
+        pos_++;
+    }
+
+    // Identifier with CSS escapes; attribute names may also contain ':'
+    std::string parse_ident(bool allow_colon = false) {
+        std::string result;
+        while (!at_end()) {
+            unsigned char c = peek();
+            if (c == '\\') {
+                pos_++;
+                if (at_end()) unexpected();
+                if (hex_value(peek()) >= 0) {
+                    unsigned long cp = 0;
+                    for (int i = 0; i < 6 && hex_value(peek()) >= 0; i++) {
+                        cp = cp * 16 + (unsigned long)hex_value(peek());
+                        pos_++;
+                    }
+                    if (is_css_space(peek())) pos_++;
+                    append_utf8(result, cp);
+                } else {
+                    result.push_back(src_[pos_++]);
+                }
+            } else if (is_ident_char(c) || (allow_colon && c == ':')) {
+                result.push_back((char)c);
+                pos_++;
+            } else {
+                break;
+            }
+        }
+        if (result.empty()) unexpected();
+        return result;
+    }
+
+    static XString to_xstring(const std::string& s) {
+        return native_xpath::utf8_to_xstring(s.data(), s.length());
+    }
+
+    ComplexSelector* parse_complex() {
+        std::vector<Compound> compounds;
+        std::vector<Combinator> combinators;
+
+        compounds.push_back(parse_compound());
+        for (;;) {
+            bool space = skip_space();
+            if (at_end() || peek() == ',') break;
+
+            Combinator combinator;
+            unsigned char c = peek();
+            if (c == '>' || c == '+' || c == '~') {
+                pos_++;
+                skip_space();
+                combinator = c == '>' ? COMBINATOR_CHILD : (c == '+' ? COMBINATOR_ADJACENT : COMBINATOR_SIBLING);
+            } else if (space) {
+                combinator = COMBINATOR_DESCENDANT;
+            } else {
+                unexpected();
+                break;
+            }
+
+            combinators.push_back(combinator);
+            compounds.push_back(parse_compound());
+        }
+
+        // Store right to left; each compound keeps the combinator that
+        // leads to its left neighbour
+        ComplexSelector* complex = new ComplexSelector();
+        size_t n = compounds.size();
+        for (size_t i = 0; i < n; i++) {
+            complex->compounds.push_back(compounds[n - 1 - i]);
+            if (i + 1 < n) {
+                complex->compounds.back().combinator = combinators[n - 2 - i];
+            }
+        }
+        return complex;
+    }
+
+    Compound parse_compound() {
+        Compound compound;
+        bool any = false;
+
+        // Type or universal selector, optionally namespace-qualified
+        unsigned char c = peek();
+        if (c == '*' || c == '|' || is_ident_char(c)) {
+            std::string first;
+            bool first_is_star = false;
+            if (c == '*') {
+                first_is_star = true;
+                pos_++;
+            } else if (c != '|') {
+                first = parse_ident();
+            }
+
+            std::string name = first;
+            bool name_is_star = first_is_star;
+            if (peek() == '|' && peek(1) != '=') {
+                pos_++;
+                if (first_is_star) {
+                    compound.ns = Compound::NS_ANY;
+                } else if (first.empty()) {
+                    compound.ns = Compound::NS_NONE;
+                } else {
+                    compound.ns = Compound::NS_PREFIX;
+                    compound.prefix = to_xstring(first);
+                }
+                if (peek() == '*') {
+                    pos_++;
+                    name_is_star = true;
+                } else {
+                    name = parse_ident();
+                    name_is_star = false;
+                }
+            } else if (c == '|') {
+                unexpected();
+            }
+
+            if (!name_is_star) {
+                compound.has_tag = true;
+                compound.tag = to_xstring(name);
+            }
+            any = true;
+        }
+
+        for (;;) {
+            c = peek();
+            if (c == '#') {
+                pos_++;
+                compound.ids.push_back(to_xstring(parse_ident()));
+            } else if (c == '.') {
+                pos_++;
+                compound.classes.push_back(to_xstring(parse_ident()));
+            } else if (c == '[') {
+                compound.attributes.push_back(parse_attribute());
+            } else if (c == ':') {
+                compound.pseudos.push_back(parse_pseudo());
+            } else {
+                break;
+            }
+            any = true;
+        }
+
+        if (!any) unexpected();
+        return compound;
+    }
+
+    AttributeTest parse_attribute() {
+        AttributeTest test;
+        expect('[');
+        skip_space();
+        test.name = to_xstring(parse_ident(true));
+        skip_space();
+
+        if (peek() == ']') {
+            pos_++;
+            test.op = AttributeTest::EXISTS;
+            return test;
+        }
+
+        unsigned char c = peek();
+        if (c == '=') {
+            test.op = AttributeTest::EQUALS;
+        } else if (peek(1) != '=') {
+            unexpected();
+        } else if (c == '!') {
+            test.op = AttributeTest::NOT_EQUALS;
+        } else if (c == '~') {
+            test.op = AttributeTest::INCLUDES;
+        } else if (c == '|') {
+            test.op = AttributeTest::DASH_MATCH;
+        } else if (c == '^') {
+            test.op = AttributeTest::PREFIX;
+        } else if (c == '$') {
+            test.op = AttributeTest::SUFFIX;
+        } else if (c == '*') {
+            test.op = AttributeTest::SUBSTRING;
+        } else {
+            unexpected();
+        }
+        pos_ += (c == '=') ? 1 : 2;
+        skip_space();
+
+        std::string value;
+        c = peek();
+        if (c == '"' || c == '\'') {
+            pos_++;
+            while (!at_end() && peek() != c) {
+                if (peek() == '\\' && pos_ + 1 < src_.length()) {
+                    pos_++;
+                }
+                value.push_back(src_[pos_++]);
+            }
+            expect((char)c);
+            skip_space();
+        } else {
+            // Unquoted values run to the closing bracket
+            while (!at_end() && peek() != ']') {
+                value.push_back(src_[pos_++]);
+            }
+            size_t end = value.find_last_not_of(" \t\r\n\f");
+            value.erase(end == std::string::npos ? 0 : end + 1);
+            if (value.empty()) unexpected();
+        }
+
+        expect(']');
+        test.value = to_xstring(value);
+        return test;
+    }
+
+    PseudoTest parse_pseudo() {
+        PseudoTest pseudo;
+        expect(':');
+        if (peek() == ':') {
+            throw Error("Pseudo-elements are not supported");
+        }
+
+        size_t start = pos_;
+        std::string name = parse_ident();
+
+        struct SimplePseudo { const char* name; PseudoTest::Kind kind; bool nth; };
+        static const SimplePseudo PSEUDOS[] = {
+            { "first-child", PseudoTest::FIRST_CHILD, false },
+            { "last-child", PseudoTest::LAST_CHILD, false },
+            { "only-child", PseudoTest::ONLY_CHILD, false },
+            { "first-of-type", PseudoTest::FIRST_OF_TYPE, false },
+            { "last-of-type", PseudoTest::LAST_OF_TYPE, false },
+            { "only-of-type", PseudoTest::ONLY_OF_TYPE, false },
+            { "root", PseudoTest::ROOT, false },
+            { "empty", PseudoTest::EMPTY, false },
+            { "nth-child", PseudoTest::NTH_CHILD, true },
+            { "nth-last-child", PseudoTest::NTH_LAST_CHILD, true },
+            { "nth-of-type", PseudoTest::NTH_OF_TYPE, true },
+            { "nth-last-of-type", PseudoTest::NTH_LAST_OF_TYPE, true },
+        };
+
+        for (const SimplePseudo& p : PSEUDOS) {
+            if (name != p.name) continue;
+            pseudo.kind = p.kind;
+            if (p.nth) {
+                expect('(');
+                parse_nth(pseudo);
+            }
+            return pseudo;
+        }
+
+        if (name == "not") {
+            if (++not_depth_ > MAX_NOT_DEPTH) {
+                throw Error("Selector nesting too deep");
+            }
+            pseudo.kind = PseudoTest::NOT;
+            expect('(');
+            for (;;) {
+                skip_space();
+                pseudo.negated.push_back(std::make_shared<Compound>(parse_compound()));
+                skip_space();
+                if (peek() != ',') break;
+                pos_++;
+            }
+            expect(')');
+            not_depth_--;
+            return pseudo;
+        }
+
+        throw Error("Unsupported pseudo-class: :" + src_.substr(start, pos_ - start));
+    }
+
+    // an+b, odd or even, up to and including the closing parenthesis
+    void parse_nth(PseudoTest& pseudo) {
+        std::string arg;
+        while (!at_end() && peek() != ')') {
+            if (!is_css_space(peek())) arg.push_back(src_[pos_]);
+            pos_++;
+        }
+        expect(')');
+
+        if (arg == "odd") {
+            pseudo.a = 2;
+            pseudo.b = 1;
+            return;
+        }
+        if (arg == "even") {
+            pseudo.a = 2;
+            pseudo.b = 0;
+            return;
+        }
+
+        size_t n = arg.find_first_of("nN");
+        if (n == std::string::npos) {
+            pseudo.a = 0;
+            pseudo.b = parse_integer(arg);
+            return;
+        }
+
+        std::string a = arg.substr(0, n);
+        std::string b = arg.substr(n + 1);
+        if (a.empty() || a == "+") {
+            pseudo.a = 1;
+        } else if (a == "-") {
+            pseudo.a = -1;
+        } else {
+            pseudo.a = parse_integer(a);
+        }
+
+        if (b.empty()) {
+            pseudo.b = 0;
+        } else if (b[0] != '+' && b[0] != '-') {
+            throw Error("Invalid nth expression: " + arg);
+        } else {
+            pseudo.b = parse_integer(b);
+        }
+    }
+
+    static long parse_integer(const std::string& s) {
+        size_t i = (!s.empty() && (s[0] == '+' || s[0] == '-')) ? 1 : 0;
+        if (i == s.length() || s.length() - i > 9 || s.find_first_not_of("0123456789", i) != std::string::npos) {
+            throw Error("Invalid nth expression: " + s);
+        }
+        return strtol(s.c_str(), nullptr, 10);
+    }
+
+    std::string src_;
+    size_t pos_;
+    int not_depth_;
+};
+
+// ---------------------------------------------------------------------------
+// Matching
+// ---------------------------------------------------------------------------
+
+// Entity references are transparent, as in the XPath engine
+static DOMElement* parent_element(DOMNode* node) {
+    DOMNode* parent = node->getParentNode();
+    while (parent && parent->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+        parent = parent->getParentNode();
+    }
+    return (parent && parent->getNodeType() == DOMNode::ELEMENT_NODE) ? static_cast<DOMElement*>(parent) : nullptr;
+}
+
+static DOMElement* previous_element(DOMNode* node) {
+    for (DOMNode* s = node->getPreviousSibling(); s; s = s->getPreviousSibling()) {
+        if (s->getNodeType() == DOMNode::ELEMENT_NODE) return static_cast<DOMElement*>(s);
+    }
+    return nullptr;
+}
+
+static DOMElement* next_element(DOMNode* node) {
+    for (DOMNode* s = node->getNextSibling(); s; s = s->getNextSibling()) {
+        if (s->getNodeType() == DOMNode::ELEMENT_NODE) return static_cast<DOMElement*>(s);
+    }
+    return nullptr;
+}
+
+// 1-based positions of an element among its element siblings, and among
+// those of the same type, counted from the start and from the end
+struct ElementPosition {
+    long index;
+    long index_from_end;
+    long type_index;
+    long type_index_from_end;
+};
+
+// State kept for the length of one matches() or select() call. Sibling
+// positions are computed for all the children of a parent the first time
+// a :nth-* or *-of-type test needs one of them, so testing every child of
+// a wide parent stays linear.
+struct MatchState {
+    std::unordered_map<const DOMElement*, ElementPosition> positions;
+};
+
+static const ElementPosition& element_position(MatchState& state, DOMElement* element) {
+    auto it = state.positions.find(element);
+    if (it != state.positions.end()) {
+        return it->second;
+    }
+
+    DOMNode* parent = element->getParentNode();
+    if (!parent) {
+        ElementPosition only = { 1, 1, 1, 1 };
+        return state.positions[element] = only;
+    }
+
+    std::vector<DOMElement*> siblings;
+    std::map<XString, long> type_counts;
+    for (DOMNode* child = parent->getFirstChild(); child; child = child->getNextSibling()) {
+        if (child->getNodeType() != DOMNode::ELEMENT_NODE) continue;
+        DOMElement* sibling = static_cast<DOMElement*>(child);
+        siblings.push_back(sibling);
+        ElementPosition& position = state.positions[sibling];
+        position.index = (long)siblings.size();
+        position.type_index = ++type_counts[XString(sibling->getNodeName())];
+    }
+    for (DOMElement* sibling : siblings) {
+        ElementPosition& position = state.positions[sibling];
+        position.index_from_end = (long)siblings.size() - position.index + 1;
+        position.type_index_from_end = type_counts[XString(sibling->getNodeName())] - position.type_index + 1;
+    }
+    return state.positions[element];
+}
+
+static bool nth_matches(long a, long b, long index) {
+    if (a == 0) return index == b;
+    long diff = index - b;
+    return diff % a == 0 && diff / a >= 0;
+}
+
+static bool is_empty(DOMElement* element) {
+    for (DOMNode* c = element->getFirstChild(); c; c = c->getNextSibling()) {
+        switch (c->getNodeType()) {
+            case DOMNode::COMMENT_NODE:
+            case DOMNode::PROCESSING_INSTRUCTION_NODE:
+                break;
+            case DOMNode::TEXT_NODE:
+            case DOMNode::CDATA_SECTION_NODE: {
+                const XMLCh* data = c->getNodeValue();
+                if (data && *data) return false;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool compound_matches(const Compound& compound, DOMElement* element, MatchState& state);
+
+static bool pseudo_matches(const PseudoTest& pseudo, DOMElement* element, MatchState& state) {
+    switch (pseudo.kind) {
+        case PseudoTest::FIRST_CHILD:
+            return !previous_element(element);
+        case PseudoTest::LAST_CHILD:
+            return !next_element(element);
+        case PseudoTest::ONLY_CHILD:
+            return !previous_element(element) && !next_element(element);
+        case PseudoTest::NTH_CHILD:
+            return nth_matches(pseudo.a, pseudo.b, element_position(state, element).index);
+        case PseudoTest::NTH_LAST_CHILD:
+            return nth_matches(pseudo.a, pseudo.b, element_position(state, element).index_from_end);
+        case PseudoTest::FIRST_OF_TYPE:
+            return element_position(state, element).type_index == 1;
+        case PseudoTest::LAST_OF_TYPE:
+            return element_position(state, element).type_index_from_end == 1;
+        case PseudoTest::ONLY_OF_TYPE: {
+            const ElementPosition& position = element_position(state, element);
+            return position.type_index == 1 && position.type_index_from_end == 1;
+        }
+        case PseudoTest::NTH_OF_TYPE:
+            return nth_matches(pseudo.a, pseudo.b, element_position(state, element).type_index);
+        case PseudoTest::NTH_LAST_OF_TYPE:
+            return nth_matches(pseudo.a, pseudo.b, element_position(state, element).type_index_from_end);
+        case PseudoTest::ROOT: {
+            DOMNode* parent = element->getParentNode();
+            return parent && parent->getNodeType() == DOMNode::DOCUMENT_NODE;
+        }
+        case PseudoTest::EMPTY:
+            return is_empty(element);
+        case PseudoTest::NOT:
+            for (const std::shared_ptr<Compound>& c : pseudo.negated) {
+                if (compound_matches(*c, element, state)) return false;
+            }
+            return true;
+    }
+    return false;
+}
+
+static bool attribute_matches(const AttributeTest& test, DOMElement* element) {
+    const XMLCh* value = attribute_value(element, test.name.c_str());
+
+    if (test.op == AttributeTest::NOT_EQUALS) {
+        return !value || !equals(test.value, value);
+    }
+    if (!value) return false;
+
+    switch (test.op) {
+        case AttributeTest::EXISTS:
+            return true;
+        case AttributeTest::EQUALS:
+            return equals(test.value, value);
+        case AttributeTest::INCLUDES:
+            return contains_token(value, test.value);
+        case AttributeTest::DASH_MATCH: {
+            size_t length = xlength(value);
+            return starts_with(value, length, test.value) &&
+                   (length == test.value.length() || value[test.value.length()] == '-');
+        }
+        case AttributeTest::PREFIX:
+            return !test.value.empty() && starts_with(value, xlength(value), test.value);
+        case AttributeTest::SUFFIX:
+            return !test.value.empty() && ends_with(value, xlength(value), test.value);
+        case AttributeTest::SUBSTRING:
+            return !test.value.empty() && contains(value, xlength(value), test.value);
+        default:
+            return false;
+    }
+}
+
+// The namespace bound to prefix for a ns|tag test: the document element's
+// binding, as for prefixes in XPath, or else the element's own
+static const XMLCh* selector_namespace(const XString& prefix, DOMElement* element) {
+    DOMDocument* doc = element->getOwnerDocument();
+    DOMElement* root = doc ? doc->getDocumentElement() : nullptr;
+    const XMLCh* uri = root ? root->lookupNamespaceURI(prefix.c_str()) : nullptr;
+    return uri ? uri : element->lookupNamespaceURI(prefix.c_str());
+}
+
+// Cheapest tests first: tag, id, class, then attributes and pseudo-classes
+static bool compound_matches(const Compound& compound, DOMElement* element, MatchState& state) {
+    if (compound.has_tag) {
+        const XMLCh* local = element->getLocalName();
+        if (!equals(compound.tag, local ? local : element->getNodeName())) return false;
+    }
+
+    if (compound.ns == Compound::NS_PREFIX) {
+        const XMLCh* uri = selector_namespace(compound.prefix, element);
+        const XMLCh* ns = element->getNamespaceURI();
+        if (!uri || !ns || !XMLString::equals(uri, ns)) return false;
+    } else if (compound.ns == Compound::NS_NONE) {
+        const XMLCh* ns = element->getNamespaceURI();
+        if (ns && *ns) return false;
+    }
+
+    for (const XString& id : compound.ids) {
+        if (!equals(id, attribute_value(element, ID_NAME))) return false;
+        if (id.empty()) return false;
+    }
+
+    if (!compound.classes.empty()) {
+        const XMLCh* classes = attribute_value(element, CLASS_NAME);
+        if (!classes) return false;
+        for (const XString& c : compound.classes) {
+            if (!contains_token(classes, c)) return false;
+        }
+    }
+
+    for (const AttributeTest& test : compound.attributes) {
+        if (!attribute_matches(test, element)) return false;
+    }
+
+    for (const PseudoTest& pseudo : compound.pseudos) {
+        if (!pseudo_matches(pseudo, element, state)) return false;
+    }
+
+    return true;
+}
+
+// compounds[index] matched element; check the compounds to its left
+static bool match_left(const ComplexSelector& complex, size_t index, DOMElement* element, MatchState& state) {
+    if (index + 1 == complex.compounds.size()) {
+        return true;
+    }
+
+    const Compound& next = complex.compounds[index + 1];
+    switch (complex.compounds[index].combinator) {
+        case COMBINATOR_CHILD: {
+            DOMElement* parent = parent_element(element);
+            return parent && compound_matches(next, parent, state) && match_left(complex, index + 1, parent, state);
+        }
+        case COMBINATOR_DESCENDANT:
+            for (DOMElement* a = parent_element(element); a; a = parent_element(a)) {
+                if (compound_matches(next, a, state) && match_left(complex, index + 1, a, state)) return true;
+            }
+            return false;
+        case COMBINATOR_ADJACENT: {
+            DOMElement* sibling = previous_element(element);
+            return sibling && compound_matches(next, sibling, state) && match_left(complex, index + 1, sibling, state);
+        }
+        case COMBINATOR_SIBLING:
+            for (DOMElement* s = previous_element(element); s; s = previous_element(s)) {
+                if (compound_matches(next, s, state) && match_left(complex, index + 1, s, state)) return true;
+            }
+            return false;
+    }
+    return false;
+}
+
+static DOMNode* next_in_subtree(DOMNode* node, const DOMNode* root) {
+    DOMNode* child = node->getFirstChild();
+    if (child) return child;
+
+    while (node && node != root) {
+        DOMNode* sibling = node->getNextSibling();
+        if (sibling) return sibling;
+        node = node->getParentNode();
+    }
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+SelectorPtr compile(const std::string& selector) {
+    Parser parser(selector);
+    std::vector<ComplexSelector*> complexes = parser.parse();
+    return SelectorPtr(new Selector(complexes, selector));
+}
+
+static bool matches(const Selector& selector, DOMElement* element, MatchState& state) {
+    for (const ComplexSelector* complex : selector.complexes()) {
+        if (compound_matches(complex->compounds[0], element, state) && match_left(*complex, 0, element, state)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool matches(const Selector& selector, DOMElement* element) {
+    MatchState state;
+    return matches(selector, element, state);
+}
+
+void select(const Selector& selector, DOMNode* scope, std::vector<DOMNode*>& out, size_t limit) {
+    if (limit == 0) return;
+
+    MatchState state;
+    size_t found = 0;
+    for (DOMNode* node = scope->getFirstChild(); node; node = next_in_subtree(node, scope)) {
+        if (node->getNodeType() == DOMNode::ELEMENT_NODE && matches(selector, static_cast<DOMElement*>(node), state)) {
+            out.push_back(node);
+            if (++found >= limit) return;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// XPath translation
+// ---------------------------------------------------------------------------
+
+static bool has_xml_space(const XString& s) {
+    for (XMLCh c : s) {
+        if (is_css_space(c)) return true;
+    }
+    return false;
+}
+
+// An XPath string literal; values holding both quote characters are
+// spliced together with concat()
+static std::string xpath_literal(const XString& value) {
+    std::string s = native_xpath::xstring_to_utf8(value.c_str(), value.length());
+    if (s.find('\'') == std::string::npos) return "'" + s + "'";
+    if (s.find('"') == std::string::npos) return "\"" + s + "\"";
+
+    std::string result = "concat(";
+    size_t start = 0;
+    while (start < s.length()) {
+        size_t quote = s.find('\'', start);
+        if (quote == start) {
+            result += "\"'\", ";
+            start++;
+            continue;
+        }
+        size_t end = quote == std::string::npos ? s.length() : quote;
+        result += "'" + s.substr(start, end - start) + "', ";
+        start = end;
+    }
+    result.erase(result.length() - 2);
+    return result + ")";
+}
+
+static std::string xpath_number(long n) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", n);
+    return buf;
+}
+
+// The attribute as an XPath node-set. Attributes are looked up by
+// qualified name, as getAttributeNode does, so names that are not plain
+// unprefixed XPath names go through name().
+static std::string xpath_attribute(const XString& name) {
+    bool plain = !name.empty() &&
+                 ((name[0] >= 'a' && name[0] <= 'z') || (name[0] >= 'A' && name[0] <= 'Z') || name[0] == '_');
+    for (XMLCh c : name) {
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '_' || c == '-' || c == '.')) {
+            plain = false;
+        }
+    }
+    if (plain) return "@" + native_xpath::xstring_to_utf8(name.c_str(), name.length());
+    return "@*[name()=" + xpath_literal(name) + "]";
+}
+
+// True if the whitespace-separated list in the string value of set holds token
+static std::string xpath_contains_token(const std::string& set, const XString& token) {
+    if (token.empty() || has_xml_space(token)) return "false()";
+    return "contains(concat(' ', normalize-space(" + set + "), ' '), " +
+           xpath_literal(XString(1, ' ') + token + XString(1, ' ')) + ")";
+}
+
+static std::string attribute_to_xpath(const AttributeTest& test) {
+    std::string attr = xpath_attribute(test.name);
+    std::string value = xpath_literal(test.value);
+
+    switch (test.op) {
+        case AttributeTest::EXISTS:
+            return attr;
+        case AttributeTest::EQUALS:
+            return attr + "=" + value;
+        case AttributeTest::NOT_EQUALS:
+            return "not(" + attr + "=" + value + ")";
+        case AttributeTest::INCLUDES:
+            return xpath_contains_token(attr, test.value);
+        case AttributeTest::DASH_MATCH:
+            return "(" + attr + "=" + value + " or starts-with(" + attr + ", " +
+                   xpath_literal(test.value + XString(1, '-')) + "))";
+        case AttributeTest::PREFIX:
+            if (test.value.empty()) return "false()";
+            return "starts-with(" + attr + ", " + value + ")";
+        case AttributeTest::SUFFIX:
+            if (test.value.empty()) return "false()";
+            return "substring(" + attr + ", string-length(" + attr + ") - string-length(" + value + ") + 1)=" + value;
+        case AttributeTest::SUBSTRING:
+            if (test.value.empty()) return "false()";
+            return "contains(" + attr + ", " + value + ")";
+    }
+    return "false()";
+}
+
+// an+b against the 1-based index count(axis::*) + 1
+static std::string nth_to_xpath(long a, long b, const char* axis) {
+    long offset = 1 - b;
+    std::string diff = std::string("count(") + axis + "::*)";
+    if (offset > 0) diff += " + " + xpath_number(offset);
+    if (offset < 0) diff += " - " + xpath_number(-offset);
+
+    if (a == 0) return diff + "=0";
+    return "(" + diff + ") mod " + xpath_number(a) + "=0 and (" + diff + ") div " + xpath_number(a) + ">=0";
+}
+
+static std::string compound_to_xpath(const Compound& compound);
+
+static std::string pseudo_to_xpath(const PseudoTest& pseudo) {
+    switch (pseudo.kind) {
+        case PseudoTest::FIRST_CHILD:
+            return "not(preceding-sibling::*)";
+        case PseudoTest::LAST_CHILD:
+            return "not(following-sibling::*)";
+        case PseudoTest::ONLY_CHILD:
+            return "not(preceding-sibling::* or following-sibling::*)";
+        case PseudoTest::NTH_CHILD:
+            return nth_to_xpath(pseudo.a, pseudo.b, "preceding-sibling");
+        case PseudoTest::NTH_LAST_CHILD:
+            return nth_to_xpath(pseudo.a, pseudo.b, "following-sibling");
+        case PseudoTest::FIRST_OF_TYPE:
+        case PseudoTest::LAST_OF_TYPE:
+        case PseudoTest::ONLY_OF_TYPE:
+        case PseudoTest::NTH_OF_TYPE:
+        case PseudoTest::NTH_LAST_OF_TYPE:
+            // Comparing siblings with the element's own name needs current(),
+            // which XPath 1.0 lacks
+            throw Error("The *-of-type pseudo-classes are not supported by the :xpath CSS engine");
+        case PseudoTest::ROOT:
+            return "not(parent::*)";
+        case PseudoTest::EMPTY:
+            return "not(* or text()[string-length() > 0])";
+        case PseudoTest::NOT: {
+            std::string result;
+            for (const std::shared_ptr<Compound>& c : pseudo.negated) {
+                if (!result.empty()) result += " and ";
+                std::string test = compound_to_xpath(*c);
+                result += test.empty() ? "false()" : "not(" + test + ")";
+            }
+            return result;
+        }
+    }
+    return "false()";
+}
+
+// The tests of one compound as an XPath condition on the context element,
+// or an empty string if it matches every element
+static std::string compound_to_xpath(const Compound& compound) {
+    std::vector<std::string> tests;
+
+    if (compound.has_tag) {
+        tests.push_back("local-name()=" + xpath_literal(compound.tag));
+    }
+
+    if (compound.ns == Compound::NS_PREFIX) {
+        // Bound as by selector_namespace: the document element's binding,
+        // or else the one in scope at the element
+        std::string prefix = "namespace::*[local-name()=" + xpath_literal(compound.prefix) + "]";
+        tests.push_back("((/*/" + prefix + " and namespace-uri()=/*/" + prefix + ") or (not(/*/" + prefix +
+                        ") and namespace-uri()=" + prefix + "))");
+    } else if (compound.ns == Compound::NS_NONE) {
+        tests.push_back("namespace-uri()=''");
+    }
+
+    for (const XString& id : compound.ids) {
+        tests.push_back(id.empty() ? "false()" : "@id=" + xpath_literal(id));
+    }
+
+    for (const XString& c : compound.classes) {
+        tests.push_back(xpath_contains_token("@class", c));
+    }
+
+    for (const AttributeTest& test : compound.attributes) {
+        tests.push_back(attribute_to_xpath(test));
+    }
+
+    for (const PseudoTest& pseudo : compound.pseudos) {
+        tests.push_back(pseudo_to_xpath(pseudo));
+    }
+
+    std::string result;
+    for (const std::string& test : tests) {
+        if (!result.empty()) result += " and ";
+        result += test;
+    }
+    return result;
+}
+
+// compounds[index] and, through the combinators, the compounds to its left
+// as one condition on the context element
+static std::string complex_to_xpath(const ComplexSelector& complex, size_t index) {
+    std::string result = compound_to_xpath(complex.compounds[index]);
+    if (index + 1 == complex.compounds.size()) {
+        return result;
+    }
+
+    std::string step;
+    switch (complex.compounds[index].combinator) {
+        case COMBINATOR_CHILD: step = "parent::*"; break;
+        case COMBINATOR_DESCENDANT: step = "ancestor::*"; break;
+        case COMBINATOR_ADJACENT: step = "preceding-sibling::*[1]"; break;
+        case COMBINATOR_SIBLING: step = "preceding-sibling::*"; break;
+    }
+
+    std::string left = complex_to_xpath(complex, index + 1);
+    if (!left.empty()) step += "[" + left + "]";
+    return result.empty() ? step : result + " and " + step;
+}
+
+std::string to_xpath(const Selector& selector) {
+    std::string result;
+    for (const ComplexSelector* complex : selector.complexes()) {
+        std::string test = complex_to_xpath(*complex, 0);
+        if (!result.empty()) result += " | ";
+        result += test.empty() ? ".//*" : ".//*[" + test + "]";
+    }
+    return result;
+}
+
+} // namespace native_css
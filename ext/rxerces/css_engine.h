@@ -0,0 +1,81 @@
+#ifndef RXERCES_CSS_ENGINE_H
+#define RXERCES_CSS_ENGINE_H
+
+#include <xercesc/util/XercesDefs.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Native CSS selector engine. Selectors are parsed once into a compiled
+// form and matched right to left against Xerces DOM elements, so no XPath
+// text is generated, validated or compiled.
+//
+// Supported: type, universal, #id, .class, [attr], [attr=v], [attr~=v],
+// [attr|=v], [attr^=v], [attr$=v], [attr*=v], [attr!=v], the descendant,
+// child (>), adjacent sibling (+) and general sibling (~) combinators,
+// selector lists (,) and the :first-child, :last-child, :only-child,
+// :nth-child(), :nth-last-child(), :first-of-type, :last-of-type,
+// :only-of-type, :nth-of-type(), :nth-last-of-type(), :root, :empty and
+// :not() pseudo-classes. Matching is case-sensitive, as XML is. In ns|tag
+// the prefix stands for a namespace URI, bound as for XPath on the
+// document element or else in scope at the element tested.
+//
+// Errors are reported by throwing native_css::Error.
+namespace native_css {
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+struct ComplexSelector;
+
+// A parsed selector list. Instances are immutable once compiled and may be
+// used concurrently.
+class Selector {
+public:
+    Selector(const std::vector<ComplexSelector*>& complexes, const std::string& source);
+    ~Selector();
+
+    const std::string& source() const { return source_; }
+    const std::vector<ComplexSelector*>& complexes() const { return complexes_; }
+
+private:
+    Selector(const Selector&);
+    Selector& operator=(const Selector&);
+
+    std::vector<ComplexSelector*> complexes_;
+    std::string source_;
+};
+
+typedef std::shared_ptr<const Selector> SelectorPtr;
+
+// Parse a selector list. Throws Error on syntax errors or unsupported
+// pseudo-classes. A blank selector matches every element.
+SelectorPtr compile(const std::string& selector);
+
+// True if element matches any selector in the list. Combinators may look
+// at ancestors and siblings anywhere in the document.
+bool matches(const Selector& selector, xercesc::DOMElement* element);
+
+// Append the elements below scope (not scope itself) that match, in
+// document order, stopping once limit nodes have been appended. As with
+// querySelectorAll, combinators may match ancestors outside scope.
+void select(const Selector& selector, xercesc::DOMNode* scope,
+            std::vector<xercesc::DOMNode*>& out, size_t limit = (size_t)-1);
+
+// Translate a compiled selector to an XPath 1.0 expression for the :xpath
+// CSS engine, with a union branch for each selector of the list. The
+// expression is relative: evaluated at scope, it walks only the subtree
+// and selects the same elements as select(). Each compound becomes a
+// predicate and each combinator a parent::, ancestor:: or
+// preceding-sibling:: test, so ancestors outside scope may still match.
+// Throws Error for the *-of-type pseudo-classes, which XPath 1.0 cannot
+// express.
+std::string to_xpath(const Selector& selector);
+
+} // namespace native_css
+
+#endif
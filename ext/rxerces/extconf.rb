@@ -76,4 +76,10 @@ else
   puts "  Or specify: --with-xalan-dir=/path/to/xalan"
 end
 
+# Static tracepoints (optional). have_header defines HAVE_SYS_SDT_H, which
+# probes.h uses to turn the probe macros on.
+if enable_config('probes', true) && RUBY_PLATFORM =~ /linux/ && have_header('sys/sdt.h')
+  puts "sys/sdt.h found: USDT probes enabled"
+end
+
 create_makefile('rxerces/rxerces')
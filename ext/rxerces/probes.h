@@ -0,0 +1,32 @@
+#ifndef RXERCES_PROBES_H
+#define RXERCES_PROBES_H
+
+// Static tracepoints for bpftrace, perf and SystemTap, under the provider
+// name "rxerces". extconf.rb defines HAVE_SYS_SDT_H where <sys/sdt.h> is
+// available; each probe is then a single nop until a tracer attaches to
+// it. Elsewhere the macros compile to nothing.
+//
+//   parse__start(bytes)                   parse__done(bytes, elements, errors)
+//   xpath__start(expression)              xpath__done(expression, results)
+//   xpath__compile__start(expression)     xpath__compile__done(expression, cache_hit)
+//   serialize__start(nodes)               serialize__done(bytes)
+//   validate__start(bytes)                validate__done(bytes, errors)
+//
+// validate__start reports 0 bytes for validate_file and validate_io, whose
+// size is only known once validate__done reports the bytes scanned.
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#ifdef DTRACE_PROBE
+#define RXERCES_PROBE1(name, a) DTRACE_PROBE1(rxerces, name, a)
+#define RXERCES_PROBE2(name, a, b) DTRACE_PROBE2(rxerces, name, a, b)
+#define RXERCES_PROBE3(name, a, b, c) DTRACE_PROBE3(rxerces, name, a, b, c)
+#else
+#define RXERCES_PROBE1(name, a) do {} while (0)
+#define RXERCES_PROBE2(name, a, b) do {} while (0)
+#define RXERCES_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
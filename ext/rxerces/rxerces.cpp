@@ -1,5 +1,6 @@
 #include "rxerces.h"
 #include <ruby/encoding.h>
+#include <ruby/thread.h>
 #include <xercesc/util/PlatformUtils.hpp>
 #include <xercesc/parsers/XercesDOMParser.hpp>
 #include <xercesc/dom/DOM.hpp>
@@ -7,33 +8,44 @@
 #include <xercesc/util/XMLUni.hpp>
 #include <xercesc/framework/MemBufInputSource.hpp>
 #include <xercesc/framework/MemBufFormatTarget.hpp>
+#include <xercesc/framework/LocalFileInputSource.hpp>
+#include <xercesc/util/BinInputStream.hpp>
+#include <xercesc/util/SecurityManager.hpp>
+#include <xercesc/framework/XMLFormatter.hpp>
 #include <xercesc/util/XercesDefs.hpp>
 #include <xercesc/dom/DOMXPathResult.hpp>
 #include <xercesc/dom/DOMXPathExpression.hpp>
 #include <xercesc/sax/ErrorHandler.hpp>
 #include <xercesc/sax/SAXParseException.hpp>
 #include <xercesc/sax/SAXException.hpp>
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/sax2/XMLReaderFactory.hpp>
+#include <xercesc/internal/XMLGrammarPoolImpl.hpp>
 #include <sstream>
 #include <vector>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <climits>
+#include <cstddef>
 #include <list>
+#include <map>
 #include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include "xpath_engine.h"
+#include "css_engine.h"
+#include "c14n.h"
+#include "source_map.h"
+#include "stats.h"
+#include "probes.h"
+#include "xpath_guard.h"
+#include "counting_memory.h"
+#include "xalan_context.h"
 
 #ifdef HAVE_XALAN
 #include <xalanc/XPath/XPathEvaluator.hpp>
-#include <xalanc/XPath/NodeRefList.hpp>
-#include <xalanc/XPath/XObject.hpp>
-#include <xalanc/XPath/XObjectFactoryDefault.hpp>
-#include <xalanc/XPath/XPathEnvSupportDefault.hpp>
-#include <xalanc/XPath/XPathExecutionContextDefault.hpp>
-#include <xalanc/XPath/XPathConstructionContextDefault.hpp>
-#include <xalanc/XPath/ElementPrefixResolverProxy.hpp>
-#include <xalanc/XPath/XPathFactoryDefault.hpp>
-#include <xalanc/XPath/XPathProcessorImpl.hpp>
-#include <xalanc/XPath/XPath.hpp>
-#include <xalanc/XercesParserLiaison/XercesParserLiaison.hpp>
-#include <xalanc/XercesParserLiaison/XercesDOMSupport.hpp>
-#include <xalanc/XercesParserLiaison/XercesDocumentWrapper.hpp>
 #include <xalanc/PlatformSupport/XalanMemoryManagerDefault.hpp>
 #endif
 
@@ -50,6 +62,8 @@ VALUE rb_cNodeSet;
 VALUE rb_cElement;
 VALUE rb_cText;
 VALUE rb_cSchema;
+VALUE rb_cSelector;
+VALUE rb_cSyntaxError;
 
 // Initialization flags
 static bool xerces_initialized = false;
@@ -69,40 +83,6 @@ static size_t xpath_cache_max_size = 10000; // Max cached expressions
 static size_t xpath_max_length = 10000;     // Max XPath expression length
 
 #ifdef HAVE_XALAN
-// Cached Xalan context per document for XPath performance
-// This avoids recreating expensive Xalan infrastructure on every XPath query
-struct XalanContext {
-    XercesParserLiaison* liaison;
-    XercesDOMSupport* domSupport;
-    XalanDocument* xalanDoc;
-    XercesDocumentWrapper* docWrapper;
-    XPathEnvSupportDefault* envSupport;
-    XObjectFactoryDefault* objectFactory;
-    XPathExecutionContextDefault* executionContext;
-    XPathConstructionContextDefault* constructionContext;
-    XPathFactoryDefault* factory;
-    XPathProcessorImpl* processor;
-
-    XalanContext() : liaison(nullptr), domSupport(nullptr), xalanDoc(nullptr),
-                     docWrapper(nullptr), envSupport(nullptr), objectFactory(nullptr),
-                     executionContext(nullptr), constructionContext(nullptr),
-                     factory(nullptr), processor(nullptr) {}
-
-    ~XalanContext() {
-        // Clean up in reverse order of creation
-        delete executionContext;
-        delete constructionContext;
-        delete objectFactory;
-        delete envSupport;
-        delete factory;
-        delete processor;
-        // domSupport must be deleted before liaison
-        delete domSupport;
-        // liaison owns xalanDoc/docWrapper, so don't delete them separately
-        delete liaison;
-    }
-};
-
 // Compiled XPath expression cache per document
 struct CompiledXPath {
     XPath* xpath;
@@ -115,11 +95,91 @@ struct CompiledXPath {
 static const size_t XPATH_COMPILE_CACHE_SIZE = 100;
 #endif
 
+// XPath engine used by xpath, at_xpath and css. Defaults to Xalan when it
+// was found at build time, otherwise to the native XPath 1.0 evaluator.
+// The Xerces engine only supports the XML Schema XPath subset.
+enum XPathEngine {
+    XPATH_ENGINE_NATIVE,
+    XPATH_ENGINE_XALAN,
+    XPATH_ENGINE_XERCES
+};
+
+#ifdef HAVE_XALAN
+static XPathEngine xpath_engine = XPATH_ENGINE_XALAN;
+#else
+static XPathEngine xpath_engine = XPATH_ENGINE_NATIVE;
+#endif
+
+// CSS engine used by css and at_css. The native engine matches selectors
+// right to left against the DOM; the XPath engine compiles them the same way,
+// translates them with native_css::to_xpath and runs the result through the
+// selected XPath engine.
+enum CSSEngine {
+    CSS_ENGINE_NATIVE,
+    CSS_ENGINE_XPATH
+};
+
+static CSSEngine css_engine = CSS_ENGINE_NATIVE;
+
+// Compiled Xerces XPath expression cache per document, used by the Xerces
+// engine. Expressions are bound to the document's namespace resolver.
+struct XercesCompiledXPath {
+    DOMXPathExpression* expression;
+    DOMXPathNSResolver* resolver;  // Owned; nullptr if the shared resolver was used
+    std::string source;            // Cache key
+
+    XercesCompiledXPath(DOMXPathExpression* e, DOMXPathNSResolver* r, const std::string& src)
+        : expression(e), resolver(r), source(src) {}
+
+    void release() {
+        expression->release();
+        if (resolver) {
+            resolver->release();
+        }
+    }
+};
+
+static const size_t XERCES_XPATH_CACHE_SIZE = 100;
+
+// Compiled native XPath expressions are immutable and not tied to a
+// document, so a single process-wide LRU cache is shared by all documents
+struct NativeCompiledXPath {
+    native_xpath::CompiledExpressionPtr compiled;
+    std::list<std::string>::iterator lru_position;
+};
+
+static std::list<std::string>* native_xpath_lru_list = nullptr;
+static std::unordered_map<std::string, NativeCompiledXPath>* native_xpath_cache_map = nullptr;
+static std::mutex native_xpath_cache_mutex;
+static const size_t NATIVE_XPATH_CACHE_SIZE = 256;
+
+// Compiled CSS selectors are cached process-wide in the same way. The
+// CSS-to-XPath translation used by the :xpath CSS engine is cached in the
+// same entry, so either form is only produced once per selector.
+struct CachedCSSSelector {
+    native_css::SelectorPtr compiled;
+    std::string xpath;
+    bool translated;
+    std::list<std::string>::iterator lru_position;
+};
+
+static std::list<std::string>* css_selector_lru_list = nullptr;
+static std::unordered_map<std::string, CachedCSSSelector>* css_selector_cache_map = nullptr;
+static std::mutex css_selector_cache_mutex;
+static const size_t CSS_SELECTOR_CACHE_SIZE = 256;
+
+// Serializers are reused instead of being created for every call. A
+// serializer is taken from the idle list for the duration of one call, so
+// each thread that is serializing has one of its own.
+static std::vector<DOMLSSerializer*>* idle_serializers = nullptr;
+static std::mutex serializer_pool_mutex;
+static const size_t SERIALIZER_POOL_SIZE = 8;
+
 // Forward declarations
-static std::string css_to_xpath(const char* css);
 static VALUE node_css(VALUE self, VALUE selector);
-static VALUE node_xpath(VALUE self, VALUE path);
-static VALUE document_xpath(VALUE self, VALUE path);
+static VALUE node_xpath(int argc, VALUE* argv, VALUE self);
+static VALUE document_xpath(int argc, VALUE* argv, VALUE self);
+static VALUE rxerces_xpath_engine(VALUE self);
 
 // Initialize Xerces (and Xalan if available) exactly once
 static void ensure_xerces_initialized() {
@@ -160,6 +220,35 @@ static void cleanup_xerces() {
         xpath_cache_map = nullptr;
     }
 
+    // Clean up compiled native XPath cache
+    if (native_xpath_cache_map) {
+        delete native_xpath_cache_map;
+        native_xpath_cache_map = nullptr;
+    }
+    if (native_xpath_lru_list) {
+        delete native_xpath_lru_list;
+        native_xpath_lru_list = nullptr;
+    }
+
+    // Clean up compiled CSS selector cache
+    if (css_selector_cache_map) {
+        delete css_selector_cache_map;
+        css_selector_cache_map = nullptr;
+    }
+    if (css_selector_lru_list) {
+        delete css_selector_lru_list;
+        css_selector_lru_list = nullptr;
+    }
+
+    // Serializers must be released before Xerces terminates
+    if (idle_serializers) {
+        for (DOMLSSerializer* serializer : *idle_serializers) {
+            serializer->release();
+        }
+        delete idle_serializers;
+        idle_serializers = nullptr;
+    }
+
 #ifdef HAVE_XALAN
     if (xalan_initialized) {
         XPathEvaluator::terminate();
@@ -172,8 +261,32 @@ static void cleanup_xerces() {
     }
 }
 
+// The plan of a query and what each of its steps did, copied out of a
+// native_xpath::Profile
+struct XPathPlan {
+    bool planned;
+    std::string text;
+    std::vector<native_xpath::StepProfile> steps;
+
+    XPathPlan() : planned(false) {}
+};
+
+// Where the time of one XPath query went, filled in along the way when
+// doc.xpath_profile passes one down. Given a plan, the native engine
+// profiles its steps during the timed run.
+struct XPathProfile {
+    bool validation_cache_hit;
+    bool compile_cache_hit;
+    uint64_t compile_nanoseconds;
+    uint64_t execute_nanoseconds;
+    XPathPlan* plan;
+
+    XPathProfile() : validation_cache_hit(false), compile_cache_hit(false),
+                     compile_nanoseconds(0), execute_nanoseconds(0), plan(nullptr) {}
+};
+
 // Validate XPath expression to prevent XPath injection attacks
-static void validate_xpath_expression(const char* xpath_str) {
+static void validate_xpath_expression(const char* xpath_str, XPathProfile* profile = nullptr) {
     if (!xpath_str || strlen(xpath_str) == 0) {
         rb_raise(rb_eArgError, "XPath expression cannot be empty");
     }
@@ -193,125 +306,18 @@ static void validate_xpath_expression(const char* xpath_str) {
         if (it != xpath_cache_map->end()) {
             // Cache hit: move to front (most recently used)
             xpath_cache_lru_list->splice(xpath_cache_lru_list->begin(), *xpath_cache_lru_list, it->second);
+            native_stats::count(native_stats::XPATH_VALIDATION_HITS);
+            if (profile) {
+                profile->validation_cache_hit = true;
+            }
             return; // Already validated
         }
-    }
-    size_t len = xpath.length();
-
-    // Check for excessively long XPath expressions (potential DoS)
-    if (xpath_max_length > 0 && len > xpath_max_length) {
-        rb_raise(rb_eArgError, "XPath expression is too long (max %zu characters)", xpath_max_length);
-    }
-
-    // Check for dangerous patterns that could indicate XPath injection
-    // These patterns are commonly used in XPath injection attacks
-
-    // 1. Check for unbalanced quotes which could break out of string literals
-    int single_quotes = 0;
-    int double_quotes = 0;
-    bool in_single_quote = false;
-    bool in_double_quote = false;
-
-    for (size_t i = 0; i < len; i++) {
-        char c = xpath[i];
-
-        // Track quote state
-        if (c == '\'' && !in_double_quote) {
-            in_single_quote = !in_single_quote;
-            single_quotes++;
-        } else if (c == '"' && !in_single_quote) {
-            in_double_quote = !in_double_quote;
-            double_quotes++;
-        }
-    }
-
-    // Unbalanced quotes are suspicious
-    if (single_quotes % 2 != 0 || double_quotes % 2 != 0) {
-        rb_raise(rb_eArgError, "XPath expression contains unbalanced quotes");
-    }
-
-    // 2. Check for suspicious comment patterns that could be used to bypass validation
-    if (xpath.find("(:") != std::string::npos || xpath.find(":)") != std::string::npos) {
-        rb_raise(rb_eArgError, "XPath expression contains suspicious comment patterns");
-    }
-
-    // 3. Check for null bytes which could truncate validation
-    if (xpath.find('\0') != std::string::npos) {
-        rb_raise(rb_eArgError, "XPath expression contains null bytes");
-    }
-
-    // 4. Check for excessive nesting which could cause stack overflow
-    int bracket_depth = 0;
-    int paren_depth = 0;
-    const int MAX_DEPTH = 100;
-
-    for (size_t i = 0; i < len; i++) {
-        char c = xpath[i];
-
-        if (c == '[') bracket_depth++;
-        else if (c == ']') bracket_depth--;
-        else if (c == '(') paren_depth++;
-        else if (c == ')') paren_depth--;
-
-        if (bracket_depth > MAX_DEPTH || paren_depth > MAX_DEPTH) {
-            rb_raise(rb_eArgError, "XPath expression has excessive nesting depth");
-        }
-
-        if (bracket_depth < 0 || paren_depth < 0) {
-            rb_raise(rb_eArgError, "XPath expression has unbalanced brackets or parentheses");
-        }
-    }
-
-    if (bracket_depth != 0 || paren_depth != 0) {
-        rb_raise(rb_eArgError, "XPath expression has unbalanced brackets or parentheses");
-    }
-
-    // 5. Check for suspicious function calls that could access system functions
-    // or perform dangerous operations
-    std::vector<std::string> dangerous_patterns = {
-        "document(",       // Can access external documents
-        "doc(",            // Can access external documents
-        "collection(",     // Can access external collections
-        "unparsed-text(", // Can read arbitrary files
-        "system-property(", // Can leak system information
-        "environment-variable(", // Can leak environment variables
-    };
-
-    for (const auto& pattern : dangerous_patterns) {
-        if (xpath.find(pattern) != std::string::npos) {
-            rb_raise(rb_eArgError, "XPath expression contains potentially dangerous function: %s", pattern.c_str());
-        }
-    }
-
-    // 6. Check for encoded characters that could bypass validation
-    // Use specific patterns to avoid false positives (e.g., "Q&A" in text)
-    if (xpath.find("&#") != std::string::npos ||    // Numeric character reference (&#60;)
-        xpath.find("&#x") != std::string::npos ||   // Hex character reference (&#x3C;)
-        xpath.find("&amp;#") != std::string::npos) { // Encoded entity reference
-        rb_raise(rb_eArgError, "XPath expression contains encoded characters");
+        native_stats::count(native_stats::XPATH_VALIDATION_MISSES);
     }
 
-    // 7. Detect potential boolean-based blind XPath injection patterns
-    // These patterns use 'or' with always-true conditions
-    std::vector<std::string> injection_patterns = {
-        "or 1=1",
-        "or '1'='1'",
-        "or \"1\"=\"1\"",
-        "or true()",
-        "and 1=0",
-        "and false()",
-        "or 'a'='a'",
-        "or \"a\"=\"a\"",
-    };
-
-    // Convert to lowercase for case-insensitive comparison
-    std::string xpath_lower = xpath;
-    std::transform(xpath_lower.begin(), xpath_lower.end(), xpath_lower.begin(), ::tolower);
-
-    for (const auto& pattern : injection_patterns) {
-        if (xpath_lower.find(pattern) != std::string::npos) {
-            rb_raise(rb_eArgError, "XPath expression contains suspicious injection pattern");
-        }
+    char error_message[256];
+    if (!native_guard::check(xpath, xpath_max_length, error_message, sizeof(error_message))) {
+        rb_raise(rb_eArgError, "%s", error_message);
     }
 
     // Add to cache if caching is enabled (LRU eviction)
@@ -375,16 +381,168 @@ private:
     char* fLocalForm;
 };
 
+// Position of a node in a pre-order and a post-order walk of its
+// document. A node is an ancestor of another exactly when it comes before
+// it in pre-order and after it in post-order.
+struct NodeInterval {
+    unsigned long pre;
+    unsigned long post;
+};
+
+typedef std::unordered_map<const DOMNode*, NodeInterval> NodeIntervalMap;
+
+// A warning or error reported while parsing or validating. The message is
+// kept as Xerces reported it and only transcoded when it is read, so
+// input that produces a flood of errors costs one copy of each message.
+struct ErrorRecord {
+    enum Level {
+        LEVEL_WARNING = 1,
+        LEVEL_ERROR = 2,
+        LEVEL_FATAL = 3
+    };
+
+    Level level;
+    unsigned long line;     // 0 when the problem has no position
+    unsigned long column;
+    std::vector<XMLCh> message;
+
+    ErrorRecord(Level level, const SAXParseException& e)
+        : level(level), line((unsigned long)e.getLineNumber()), column((unsigned long)e.getColumnNumber()) {
+        const XMLCh* text = e.getMessage();
+        message.assign(text, text + XMLString::stringLen(text));
+    }
+
+    ErrorRecord(Level level, const char* text) : level(level), line(0), column(0) {
+        XStr xtext(text);
+        const XMLCh* unicode = xtext.unicodeForm();
+        message.assign(unicode, unicode + XMLString::stringLen(unicode));
+    }
+
+    std::string text() const {
+        return message.empty() ? std::string() : native_xpath::xstring_to_utf8(message.data(), message.size());
+    }
+
+    // "Error at line 4, column 12: ..." or, without a position, the message
+    std::string format() const {
+        if (!line) {
+            return text();
+        }
+        static const char* const names[] = { "", "Warning", "Error", "Fatal error" };
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%s at line %lu, column %lu: ", names[level], line, column);
+        return prefix + text();
+    }
+};
+
+// What the parser built, counted as it went
+struct ParseStats {
+    unsigned long elements;
+    unsigned long attributes;
+    unsigned long text_nodes;  // Including CDATA sections
+    unsigned long max_depth;   // 1 for a document with only a root element
+    size_t input_bytes;
+    uint64_t parse_nanoseconds;
+
+    ParseStats() : elements(0), attributes(0), text_nodes(0), max_depth(0),
+                   input_bytes(0), parse_nanoseconds(0) {}
+};
+
+// Adds ParseStats counting to a DOM parser. Adjacent character events
+// are merged into one text node by the parser, so a text node is counted
+// when a run of them starts.
+template <class Parser>
+class CountingParser : public Parser {
+public:
+    ParseStats stats;
+
+    template <typename... Args>
+    explicit CountingParser(Args... args) : Parser(args...), depth_(0), in_text_(false), in_cdata_(false) {}
+
+    void startElement(const XMLElementDecl& elemDecl, const unsigned int urlId,
+                      const XMLCh* const elemPrefix, const RefVectorOf<XMLAttr>& attrList,
+                      const XMLSize_t attrCount, const bool isEmpty, const bool isRoot) {
+        stats.elements++;
+        stats.attributes += attrCount;
+        if (++depth_ > stats.max_depth) {
+            stats.max_depth = depth_;
+        }
+        in_text_ = false;
+        // For an empty element this calls endElement itself
+        Parser::startElement(elemDecl, urlId, elemPrefix, attrList, attrCount, isEmpty, isRoot);
+    }
+
+    void endElement(const XMLElementDecl& elemDecl, const unsigned int urlId,
+                    const bool isRoot, const XMLCh* const elemPrefix) {
+        depth_--;
+        in_text_ = false;
+        Parser::endElement(elemDecl, urlId, isRoot, elemPrefix);
+    }
+
+    void docCharacters(const XMLCh* const chars, const XMLSize_t length, const bool cdataSection) {
+        text(cdataSection);
+        Parser::docCharacters(chars, length, cdataSection);
+    }
+
+    void ignorableWhitespace(const XMLCh* const chars, const XMLSize_t length, const bool cdataSection) {
+        text(cdataSection);
+        Parser::ignorableWhitespace(chars, length, cdataSection);
+    }
+
+    void docComment(const XMLCh* const comment) {
+        in_text_ = false;
+        Parser::docComment(comment);
+    }
+
+    void docPI(const XMLCh* const target, const XMLCh* const data) {
+        in_text_ = false;
+        Parser::docPI(target, data);
+    }
+
+    void startEntityReference(const XMLEntityDecl& entDecl) {
+        in_text_ = false;
+        Parser::startEntityReference(entDecl);
+    }
+
+    void endEntityReference(const XMLEntityDecl& entDecl) {
+        in_text_ = false;
+        Parser::endEntityReference(entDecl);
+    }
+
+private:
+    void text(bool cdata) {
+        if (!in_text_ || cdata != in_cdata_) {
+            stats.text_nodes++;
+        }
+        in_text_ = true;
+        in_cdata_ = cdata;
+    }
+
+    unsigned long depth_;
+    bool in_text_;
+    bool in_cdata_;
+};
+
 // Wrapper structure for DOMDocument
 typedef struct {
     DOMDocument* doc;
     XercesDOMParser* parser;
-    std::vector<std::string>* parse_errors;
+    native_memory::CountingMemoryManager* memory;  // The parser's and the DOM's allocations
+    ParseStats parse_stats;
+    std::vector<ErrorRecord>* parse_errors;
 #ifdef HAVE_XALAN
-    XalanContext* xalan_context;  // Cached Xalan context for XPath performance
+    native_xalan::Context* xalan_context;  // Cached Xalan context for XPath performance
     std::list<CompiledXPath*>* xpath_cache_list;  // LRU list of compiled expressions
     std::unordered_map<std::string, std::list<CompiledXPath*>::iterator>* xpath_cache_map;
 #endif
+    DOMXPathNSResolver* xerces_resolver;  // Shared by cached Xerces expressions without prefixes
+    DOMXPathResult* xerces_result;        // Reused between Xerces evaluations
+    std::list<XercesCompiledXPath*>* xerces_xpath_cache_list;
+    std::unordered_map<std::string, std::list<XercesCompiledXPath*>::iterator>* xerces_xpath_cache_map;
+    unsigned long mutation_count;  // Bumped whenever the tree is modified
+    std::unordered_map<const DOMNode*, std::vector<DOMNode*> >* child_index;  // Children of wide nodes, by position
+    NodeIntervalMap* intervals;  // Document order labels, built on first use
+    native_source::SourceMap* source;  // Source text and element spans, with preserve_source: true
+    VALUE schema;  // Schema validated against while parsing; its grammar pool must outlive the parser
 } DocumentWrapper;
 
 // Wrapper structure for DOMNode
@@ -398,101 +556,92 @@ typedef struct {
     VALUE nodes_array;
 } NodeSetWrapper;
 
-// Wrapper structure for Schema
+// Wrapper structure for Schema. The XSD is compiled once into the grammar
+// pool, which every validation against the schema reuses. Neither changes
+// after compiling, so a Schema can be shared between threads.
 typedef struct {
-    std::string* schemaContent;
+    XMLGrammarPool* grammar_pool;
+    std::vector<ErrorRecord>* grammar_errors;  // Problems found compiling the XSD
 } SchemaWrapper;
 
-// Error handler for schema validation
-class ValidationErrorHandler : public ErrorHandler {
-public:
-    std::vector<std::string> errors;
+// The system id the compiled grammar is registered under. Validating
+// parsers name it as the no-namespace schema location, so documents that
+// do not point at a schema themselves still use the cached grammar.
+static const char SCHEMA_SYSTEM_ID[] = "schema.xsd";
 
-    void warning(const SAXParseException& e) {
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Warning at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors.push_back(buffer);
-        XMLString::release(&msg);
-    }
+// Wrapper structure for a compiled CSS selector
+typedef struct {
+    native_css::SelectorPtr* selector;
+} SelectorWrapper;
 
-    void error(const SAXParseException& e) {
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Error at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors.push_back(buffer);
-        XMLString::release(&msg);
-    }
+// Thrown from ErrorCollector to stop the scanner early
+struct ValidationStopped {};
 
-    void fatalError(const SAXParseException& e) {
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Fatal error at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors.push_back(buffer);
-        XMLString::release(&msg);
-    }
+// When to stop collecting errors and end the scan
+struct ErrorLimits {
+    size_t max_errors;    // 0 for no limit
+    bool fatal_on_first;  // Stop at the first error that is not a warning
 
-    void resetErrors() {
-        errors.clear();
-    }
+    ErrorLimits() : max_errors(0), fatal_on_first(false) {}
 };
 
-// Error handler for parsing - stores errors but doesn't throw
-class ParseErrorHandler : public ErrorHandler {
+// Error handler for parsing and schema validation. Problems are collected
+// into errors unless a subclass reports them elsewhere; once the limits
+// are reached the scan is stopped by throwing ValidationStopped.
+class ErrorCollector : public ErrorHandler {
 public:
-    std::vector<std::string>* errors;
+    std::vector<ErrorRecord> errors;
+    ErrorLimits limits;
     bool has_fatal;
+    bool stopped;  // The limits ended the scan
 
-    ParseErrorHandler(std::vector<std::string>* error_vec)
-        : errors(error_vec), has_fatal(false) {}
+    ErrorCollector() : has_fatal(false), stopped(false), reported_(0), counted_(0) {}
+    virtual ~ErrorCollector() {}
 
     void warning(const SAXParseException& e) {
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Warning at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors->push_back(buffer);
-        XMLString::release(&msg);
+        add(ErrorRecord(ErrorRecord::LEVEL_WARNING, e));
     }
 
     void error(const SAXParseException& e) {
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Error at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors->push_back(buffer);
-        XMLString::release(&msg);
+        add(ErrorRecord(ErrorRecord::LEVEL_ERROR, e));
     }
 
     void fatalError(const SAXParseException& e) {
         has_fatal = true;
-        char* msg = XMLString::transcode(e.getMessage());
-        char buffer[512];
-        snprintf(buffer, sizeof(buffer), "Fatal error at line %lu, column %lu: %s",
-                 (unsigned long)e.getLineNumber(),
-                 (unsigned long)e.getColumnNumber(),
-                 msg);
-        errors->push_back(buffer);
-        XMLString::release(&msg);
+        add(ErrorRecord(ErrorRecord::LEVEL_FATAL, e));
     }
 
     void resetErrors() {
-        errors->clear();
+        errors.clear();
         has_fatal = false;
     }
+
+    // Report a problem, throwing ValidationStopped once the limits are
+    // reached. Warnings are reported but, as for fatal_on_first, do not
+    // count towards max_errors.
+    void add(const ErrorRecord& record) {
+        report(record);
+        reported_++;
+        if (record.level == ErrorRecord::LEVEL_WARNING) {
+            return;
+        }
+        counted_++;
+        if ((limits.max_errors && counted_ >= limits.max_errors) || limits.fatal_on_first) {
+            stopped = true;
+            throw ValidationStopped();
+        }
+    }
+
+    size_t reported() const { return reported_; }
+
+protected:
+    virtual void report(const ErrorRecord& record) {
+        errors.push_back(record);
+    }
+
+private:
+    size_t reported_;
+    size_t counted_;  // Reported errors and fatal errors
 };
 
 // Memory management functions
@@ -518,9 +667,39 @@ static void document_free(void* ptr) {
             delete wrapper->xalan_context;
         }
 #endif
+        // Xerces XPath objects reference the document, so release them first
+        if (wrapper->xerces_xpath_cache_list) {
+            for (auto& compiled : *wrapper->xerces_xpath_cache_list) {
+                compiled->release();
+                delete compiled;
+            }
+            delete wrapper->xerces_xpath_cache_list;
+        }
+        if (wrapper->xerces_xpath_cache_map) {
+            delete wrapper->xerces_xpath_cache_map;
+        }
+        if (wrapper->xerces_result) {
+            wrapper->xerces_result->release();
+        }
+        if (wrapper->xerces_resolver) {
+            wrapper->xerces_resolver->release();
+        }
+        if (wrapper->child_index) {
+            delete wrapper->child_index;
+        }
+        if (wrapper->intervals) {
+            delete wrapper->intervals;
+        }
+        if (wrapper->source) {
+            delete wrapper->source;
+        }
         if (wrapper->parser) {
             delete wrapper->parser;
         }
+        // Everything the parser allocated is gone, so the manager can go too
+        if (wrapper->memory) {
+            delete wrapper->memory;
+        }
         if (wrapper->parse_errors) {
             delete wrapper->parse_errors;
         }
@@ -537,6 +716,13 @@ static void node_free(void* ptr) {
     }
 }
 
+static void document_mark(void* ptr) {
+    DocumentWrapper* wrapper = (DocumentWrapper*)ptr;
+    if (wrapper) {
+        rb_gc_mark(wrapper->schema);
+    }
+}
+
 static void node_mark(void* ptr) {
     NodeWrapper* wrapper = (NodeWrapper*)ptr;
     if (wrapper) {
@@ -561,15 +747,38 @@ static void nodeset_mark(void* ptr) {
 static void schema_free(void* ptr) {
     SchemaWrapper* wrapper = (SchemaWrapper*)ptr;
     if (wrapper) {
-        if (wrapper->schemaContent) {
-            delete wrapper->schemaContent;
+        if (wrapper->grammar_pool) {
+            delete wrapper->grammar_pool;
         }
+        if (wrapper->grammar_errors) {
+            delete wrapper->grammar_errors;
+        }
+        xfree(wrapper);
+    }
+}
+
+static void selector_free(void* ptr) {
+    SelectorWrapper* wrapper = (SelectorWrapper*)ptr;
+    if (wrapper) {
+        delete wrapper->selector;
         xfree(wrapper);
     }
 }
 
+// Includes the DOM heap, so ObjectSpace.memsize_of shows what a document
+// really holds
 static size_t document_size(const void* ptr) {
-    return sizeof(DocumentWrapper);
+    const DocumentWrapper* wrapper = (const DocumentWrapper*)ptr;
+    size_t size = sizeof(DocumentWrapper);
+    if (wrapper->memory) {
+        size += wrapper->memory->bytes();
+    }
+#ifdef HAVE_XALAN
+    if (wrapper->xalan_context) {
+        size += wrapper->xalan_context->bridgeMemory.bytes() + wrapper->xalan_context->xpathMemory.bytes();
+    }
+#endif
+    return size;
 }
 
 static size_t node_size(const void* ptr) {
@@ -584,9 +793,13 @@ static size_t schema_size(const void* ptr) {
     return sizeof(SchemaWrapper);
 }
 
+static size_t selector_size(const void* ptr) {
+    return sizeof(SelectorWrapper);
+}
+
 static const rb_data_type_t document_type = {
     "RXerces::XML::Document",
-    {0, document_free, document_size},
+    {document_mark, document_free, document_size},
     0, 0,
     RUBY_TYPED_FREE_IMMEDIATELY
 };
@@ -612,6 +825,239 @@ static const rb_data_type_t schema_type = {
     RUBY_TYPED_FREE_IMMEDIATELY
 };
 
+static const rb_data_type_t selector_type = {
+    "RXerces::XML::Selector",
+    {0, selector_free, selector_size},
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Number of children of node, following sibling pointers
+static long count_children(DOMNode* node) {
+    long count = 0;
+    for (DOMNode* child = node->getFirstChild(); child; child = child->getNextSibling()) {
+        count++;
+    }
+    return count;
+}
+
+// Nodes with at least this many children get a cached position index
+static const long CHILD_INDEX_MIN_CHILDREN = 32;
+
+// Children of node by position, cached on the document until the next
+// modification. Returns nullptr for nodes with few children, which are
+// cheap to walk directly.
+static const std::vector<DOMNode*>* child_index(DocumentWrapper* doc_wrapper, DOMNode* node) {
+    if (doc_wrapper->child_index) {
+        auto it = doc_wrapper->child_index->find(node);
+        if (it != doc_wrapper->child_index->end()) {
+            return &it->second;
+        }
+    }
+
+    long count = 0;
+    for (DOMNode* child = node->getFirstChild(); child && count < CHILD_INDEX_MIN_CHILDREN; child = child->getNextSibling()) {
+        count++;
+    }
+    if (count < CHILD_INDEX_MIN_CHILDREN) {
+        return nullptr;
+    }
+
+    if (!doc_wrapper->child_index) {
+        doc_wrapper->child_index = new std::unordered_map<const DOMNode*, std::vector<DOMNode*> >();
+    }
+    std::vector<DOMNode*>& children = (*doc_wrapper->child_index)[node];
+    for (DOMNode* child = node->getFirstChild(); child; child = child->getNextSibling()) {
+        children.push_back(child);
+    }
+    return &children;
+}
+
+// Record a modification of the document tree and drop the caches that
+// depend on its structure
+static void document_modified(VALUE doc_ref) {
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+
+    doc_wrapper->mutation_count++;
+    if (doc_wrapper->child_index) {
+        delete doc_wrapper->child_index;
+        doc_wrapper->child_index = nullptr;
+    }
+    if (doc_wrapper->intervals) {
+        delete doc_wrapper->intervals;
+        doc_wrapper->intervals = nullptr;
+    }
+}
+
+// The source map of a document parsed with preserve_source: true, which
+// mutations must keep up to date, or nullptr
+static native_source::SourceMap* document_source(VALUE doc_ref) {
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+    return doc_wrapper->source;
+}
+
+// Documents whose tree is being read with the GVL released, by
+// serialization, canonicalization or validation, with the number of such
+// reads in progress. Only touched with the GVL held. Methods that modify a
+// tree raise while its document is listed rather than change the tree
+// under the reader.
+static std::unordered_map<const DOMDocument*, unsigned>* busy_documents = nullptr;
+
+static const DOMDocument* owner_document(const DOMNode* node) {
+    if (node->getNodeType() == DOMNode::DOCUMENT_NODE) {
+        return static_cast<const DOMDocument*>(node);
+    }
+    return node->getOwnerDocument();
+}
+
+// Raise if the tree node belongs to is being read without the GVL
+static void check_tree_writable(const DOMNode* node) {
+    if (busy_documents && busy_documents->count(owner_document(node))) {
+        rb_raise(rb_eRuntimeError, "document is being read by another operation and cannot be modified");
+    }
+}
+
+struct NoGvlCall {
+    void* (*func)(void*);
+    void* data;
+    rb_unblock_function_t* ubf;
+    void* ubf_data;
+};
+
+static VALUE no_gvl_call_body(VALUE arg) {
+    NoGvlCall* call = reinterpret_cast<NoGvlCall*>(arg);
+    rb_thread_call_without_gvl(call->func, call->data, call->ubf, call->ubf_data);
+    return Qnil;
+}
+
+// Run func with the GVL released. rb_thread_call_without_gvl raises a
+// pending interrupt itself; it is caught here and its state returned for
+// the caller to pass to rb_jump_tag once its own C++ locals are destroyed.
+static int call_without_gvl(void* (*func)(void*), void* data, rb_unblock_function_t* ubf, void* ubf_data) {
+    NoGvlCall call = { func, data, ubf, ubf_data };
+    int state = 0;
+    rb_protect(no_gvl_call_body, reinterpret_cast<VALUE>(&call), &state);
+    return state;
+}
+
+// As call_without_gvl, while func reads the trees that nodes belong to.
+// The documents stay busy until func returns.
+static int call_without_gvl_reading(const std::vector<DOMNode*>& nodes, void* (*func)(void*), void* data,
+                                    rb_unblock_function_t* ubf = nullptr, void* ubf_data = nullptr) {
+    std::vector<const DOMDocument*> documents;
+    for (const DOMNode* node : nodes) {
+        const DOMDocument* doc = owner_document(node);
+        if (doc && std::find(documents.begin(), documents.end(), doc) == documents.end()) {
+            documents.push_back(doc);
+        }
+    }
+
+    if (!busy_documents) {
+        busy_documents = new std::unordered_map<const DOMDocument*, unsigned>();
+    }
+    for (const DOMDocument* doc : documents) {
+        (*busy_documents)[doc]++;
+    }
+
+    int state = call_without_gvl(func, data, ubf, ubf_data);
+
+    for (const DOMDocument* doc : documents) {
+        auto it = busy_documents->find(doc);
+        if (--it->second == 0) {
+            busy_documents->erase(it);
+        }
+    }
+    return state;
+}
+
+// Pre-order and post-order labels for every node of the document,
+// attributes included, built in one walk and cached until the next
+// modification. Attributes are numbered after their owner element and
+// before its children. Nodes that are not attached to the document have
+// no label.
+static const NodeIntervalMap& node_intervals(DocumentWrapper* doc_wrapper) {
+    if (doc_wrapper->intervals) {
+        return *doc_wrapper->intervals;
+    }
+
+    NodeIntervalMap* intervals = new NodeIntervalMap();
+    doc_wrapper->intervals = intervals;
+
+    DOMNode* root = doc_wrapper->doc;
+    if (!root) {
+        return *intervals;
+    }
+
+    unsigned long pre = 0;
+    unsigned long post = 0;
+    DOMNode* node = root;
+    while (node) {
+        (*intervals)[node].pre = pre++;
+
+        if (node->getNodeType() == DOMNode::ELEMENT_NODE) {
+            DOMNamedNodeMap* attributes = node->getAttributes();
+            XMLSize_t length = attributes ? attributes->getLength() : 0;
+            for (XMLSize_t i = 0; i < length; i++) {
+                NodeInterval& label = (*intervals)[attributes->item(i)];
+                label.pre = pre++;
+                label.post = post++;
+            }
+        }
+
+        DOMNode* child = node->getFirstChild();
+        if (child) {
+            node = child;
+            continue;
+        }
+
+        // Close finished nodes on the way back up
+        while (node) {
+            (*intervals)[node].post = post++;
+            if (node == root) {
+                node = nullptr;
+            } else if (node->getNextSibling()) {
+                node = node->getNextSibling();
+                break;
+            } else {
+                node = node->getParentNode();
+            }
+        }
+    }
+
+    return *intervals;
+}
+
+// Sort key giving the document order of node. Attached nodes order by
+// their pre-order label; detached nodes come after them, ordered by
+// address, as libxml2 does for nodes it cannot place.
+struct DocumentOrderKey {
+    unsigned long detached;
+    uintptr_t position;
+
+    bool operator<(const DocumentOrderKey& other) const {
+        return detached != other.detached ? detached < other.detached : position < other.position;
+    }
+
+    bool operator==(const DocumentOrderKey& other) const {
+        return detached == other.detached && position == other.position;
+    }
+};
+
+static DocumentOrderKey document_order_key(const NodeIntervalMap& intervals, const DOMNode* node) {
+    DocumentOrderKey key;
+    auto it = intervals.find(node);
+    if (it != intervals.end()) {
+        key.detached = 0;
+        key.position = it->second.pre;
+    } else {
+        key.detached = 1;
+        key.position = (uintptr_t)node;
+    }
+    return key;
+}
+
 // Helper to create Ruby Node object from DOMNode
 static VALUE wrap_node(DOMNode* node, VALUE doc_ref) {
     if (!node) {
@@ -636,23 +1082,33 @@ static VALUE wrap_node(DOMNode* node, VALUE doc_ref) {
     wrapper->node = node;
     wrapper->doc_ref = doc_ref;
     DATA_PTR(rb_node) = wrapper;
+    native_stats::count(native_stats::NODES_WRAPPED);
 
     return rb_node;
 }
 
-// RXerces::XML::Document.parse(string, options = {})
-// Validate options hash for document_parse - only allow known keys
-static void validate_parse_options(VALUE options) {
-    if (NIL_P(options)) {
-        return;
+// Helper to create Ruby NodeSet object from an array of Ruby nodes
+static VALUE wrap_nodeset_array(VALUE nodes_array) {
+    NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
+    wrapper->nodes_array = nodes_array;
+    return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+}
+
+// Helper to create Ruby NodeSet object from a list of DOMNodes
+static VALUE wrap_nodeset(const std::vector<DOMNode*>& nodes, VALUE doc_ref) {
+    VALUE nodes_array = rb_ary_new_capa((long)nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        rb_ary_push(nodes_array, wrap_node(nodes[i], doc_ref));
     }
 
-    Check_Type(options, T_HASH);
+    return wrap_nodeset_array(nodes_array);
+}
 
-    // Define allowed option keys
-    std::vector<const char*> allowed_keys = {
-        "allow_external_entities"
-    };
+// RXerces::XML::Document.parse(string, options = {})
+// Validate options hash for document_parse - only allow known keys
+// Raise ArgumentError if options contains a key not in allowed_keys
+static void validate_option_keys(VALUE options, const std::vector<const char*>& allowed_keys) {
+    Check_Type(options, T_HASH);
 
     // Get all keys from the provided options hash
     VALUE keys = rb_funcall(options, rb_intern("keys"), 0);
@@ -683,9 +1139,60 @@ static void validate_parse_options(VALUE options) {
         }
 
         if (!found) {
-            rb_raise(rb_eArgError, "Unknown option: %s. Allowed options are: allow_external_entities", key_cstr);
+            std::string allowed_list;
+            for (const auto& allowed : allowed_keys) {
+                if (!allowed_list.empty()) {
+                    allowed_list += ", ";
+                }
+                allowed_list += allowed;
+            }
+            rb_raise(rb_eArgError, "Unknown option: %s. Allowed options are: %s", key_cstr, allowed_list.c_str());
+        }
+    }
+}
+
+static void validate_parse_options(VALUE options) {
+    if (NIL_P(options)) {
+        return;
+    }
+
+    // Define allowed option keys
+    validate_option_keys(options, { "allow_external_entities", "preserve_source", "schema", "max_errors", "fatal_on_first" });
+}
+
+// Read the max_errors: and fatal_on_first: options
+static ErrorLimits error_limits(VALUE options) {
+    ErrorLimits limits;
+    if (NIL_P(options)) {
+        return limits;
+    }
+
+    VALUE rb_max_errors = rb_hash_aref(options, ID2SYM(rb_intern("max_errors")));
+    if (!NIL_P(rb_max_errors)) {
+        long requested = NUM2LONG(rb_max_errors);
+        if (requested < 1) {
+            rb_raise(rb_eArgError, "max_errors must be at least 1");
         }
+        limits.max_errors = (size_t)requested;
     }
+    limits.fatal_on_first = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("fatal_on_first"))));
+    return limits;
+}
+
+// Whether validation may load external entities and DTDs (default: false
+// for security)
+static bool allow_external_entities(VALUE options) {
+    return !NIL_P(options) && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("allow_external_entities"))));
+}
+
+// The ErrorRecord as an RXerces::XML::SyntaxError
+static VALUE error_record_to_ruby(const ErrorRecord& record) {
+    std::string message = record.format();
+    VALUE error = rb_exc_new_str(rb_cSyntaxError, rb_utf8_str_new(message.data(), (long)message.size()));
+    rb_ivar_set(error, rb_intern("@level"), INT2FIX(record.level));
+    rb_ivar_set(error, rb_intern("@line"), record.line ? ULONG2NUM(record.line) : Qnil);
+    rb_ivar_set(error, rb_intern("@column"), record.line ? ULONG2NUM(record.column) : Qnil);
+    return error;
 }
 
 static VALUE document_parse(int argc, VALUE* argv, VALUE klass) {
@@ -700,16 +1207,50 @@ static VALUE document_parse(int argc, VALUE* argv, VALUE klass) {
     // Validate options hash before processing
     validate_parse_options(options);
 
-    XercesDOMParser* parser = new XercesDOMParser();
-
     // Check if external entities should be allowed (default: false for security)
     bool allow_external = false;
+    bool preserve_source = false;
+    VALUE schema = Qnil;
     if (!NIL_P(options)) {
         VALUE allow_key = rb_intern("allow_external_entities");
         VALUE allow_val = rb_hash_aref(options, ID2SYM(allow_key));
         if (RTEST(allow_val)) {
             allow_external = true;
         }
+        preserve_source = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("preserve_source"))));
+        schema = rb_hash_aref(options, ID2SYM(rb_intern("schema")));
+    }
+
+    ErrorLimits limits = error_limits(options);
+
+    SchemaWrapper* schema_wrapper = nullptr;
+    if (!NIL_P(schema)) {
+        if (!rb_obj_is_kind_of(schema, rb_cSchema)) {
+            rb_raise(rb_eTypeError, "schema must be an RXerces::XML::Schema");
+        }
+        TypedData_Get_Struct(schema, SchemaWrapper, &schema_type, schema_wrapper);
+    }
+    XMLGrammarPool* grammar_pool = schema_wrapper ? schema_wrapper->grammar_pool : nullptr;
+
+    // With preserve_source the parser records where each element's markup
+    // is, so that serializing copies unmodified elements from the source
+    // The parser and the document it builds allocate through memory, which
+    // is how memory_stats knows their size
+    native_memory::CountingMemoryManager* memory = new native_memory::CountingMemoryManager();
+    native_source::SourceTrackingParser* tracking_parser = nullptr;
+    XercesDOMParser* parser;
+    ParseStats* stats;
+    if (preserve_source) {
+        CountingParser<native_source::SourceTrackingParser>* counting =
+            new CountingParser<native_source::SourceTrackingParser>(xml_str, strlen(xml_str), grammar_pool, memory);
+        tracking_parser = counting;
+        parser = counting;
+        stats = &counting->stats;
+    } else {
+        CountingParser<XercesDOMParser>* counting =
+            new CountingParser<XercesDOMParser>(nullptr, memory, grammar_pool);
+        parser = counting;
+        stats = &counting->stats;
     }
 
     if (allow_external) {
@@ -722,64 +1263,147 @@ static VALUE document_parse(int argc, VALUE* argv, VALUE klass) {
         parser->setDisableDefaultEntityResolution(true);
     }
 
-    parser->setValidationScheme(XercesDOMParser::Val_Never);
-    parser->setDoNamespaces(true);
-    parser->setDoSchema(false);
+    if (schema_wrapper) {
+        // Validate while the tree is built, against the schema's compiled
+        // grammar; problems are reported through document.errors
+        parser->setValidationScheme(XercesDOMParser::Val_Always);
+        parser->setDoNamespaces(true);
+        parser->setDoSchema(true);
+        parser->useCachedGrammarInParse(true);
+        parser->setExternalNoNamespaceSchemaLocation(SCHEMA_SYSTEM_ID);
+    } else {
+        parser->setValidationScheme(XercesDOMParser::Val_Never);
+        parser->setDoNamespaces(true);
+        parser->setDoSchema(false);
+    }
 
     // Set up error handler to capture parse errors
-    std::vector<std::string>* parse_errors = new std::vector<std::string>();
-    ParseErrorHandler error_handler(parse_errors);
+    ErrorCollector error_handler;
+    error_handler.limits = limits;
     parser->setErrorHandler(&error_handler);
 
+    VALUE failure = Qnil;
+    VALUE rb_doc = Qnil;
+    bool stopped = false;
     try {
-        MemBufInputSource input((const XMLByte*)xml_str, strlen(xml_str), "memory");
-        parser->parse(input);
+        size_t length = strlen(xml_str);
+        MemBufInputSource input((const XMLByte*)xml_str, length, "memory");
+        native_stats::count(native_stats::PARSES);
+        native_stats::count(native_stats::PARSE_BYTES, length);
+        if (schema_wrapper) {
+            native_stats::count(native_stats::VALIDATIONS);
+        }
+        native_stats::Timer timer;
+        RXERCES_PROBE1(parse__start, length);
+        try {
+            parser->parse(input);
+        } catch (const ValidationStopped&) {
+            // The error limits were reached; the scan ends here
+        } catch (...) {
+            RXERCES_PROBE3(parse__done, length, stats->elements, error_handler.errors.size());
+            throw;
+        }
+        stats->parse_nanoseconds = timer.stop(native_stats::PARSE_TIME);
+        stats->input_bytes = length;
+        RXERCES_PROBE3(parse__done, length, stats->elements, error_handler.errors.size());
 
         DOMDocument* doc = parser->getDocument();
 
+        // Problems in the schema come first, as validate reports them
+        std::vector<ErrorRecord>* parse_errors = new std::vector<ErrorRecord>();
+        if (schema_wrapper) {
+            *parse_errors = *schema_wrapper->grammar_errors;
+        }
+        parse_errors->insert(parse_errors->end(), error_handler.errors.begin(), error_handler.errors.end());
+        std::vector<ErrorRecord>().swap(error_handler.errors);
+
         DocumentWrapper* wrapper = ALLOC(DocumentWrapper);
         wrapper->doc = doc;
         wrapper->parser = parser;
+        wrapper->memory = memory;
+        wrapper->parse_stats = *stats;
         wrapper->parse_errors = parse_errors;
 #ifdef HAVE_XALAN
         wrapper->xalan_context = nullptr;  // Lazily initialized on first XPath query
         wrapper->xpath_cache_list = nullptr;
         wrapper->xpath_cache_map = nullptr;
 #endif
-
-        VALUE rb_doc = TypedData_Wrap_Struct(rb_cDocument, &document_type, wrapper);
-
-        // If there were fatal errors, raise an exception with details
-        if (error_handler.has_fatal && !parse_errors->empty()) {
-            std::string all_errors;
+        wrapper->xerces_resolver = nullptr;
+        wrapper->xerces_result = nullptr;
+        wrapper->xerces_xpath_cache_list = nullptr;
+        wrapper->xerces_xpath_cache_map = nullptr;
+        wrapper->mutation_count = 0;
+        wrapper->child_index = nullptr;
+        wrapper->intervals = nullptr;
+        wrapper->source = tracking_parser ? tracking_parser->release_source() : nullptr;
+        wrapper->schema = schema;
+
+        rb_doc = TypedData_Wrap_Struct(rb_cDocument, &document_type, wrapper);
+
+        // If there were fatal errors, or the error limits stopped the
+        // parse, raise an exception with details
+        if ((error_handler.has_fatal || error_handler.stopped) && !parse_errors->empty()) {
+            stopped = error_handler.stopped;
+            failure = rb_str_new_cstr("XML parsing failed:");
             for (const auto& err : *parse_errors) {
-                if (!all_errors.empty()) all_errors += "\n";
-                all_errors += err;
+                std::string line = err.format();
+                rb_str_cat_cstr(failure, "\n");
+                rb_str_cat(failure, line.data(), (long)line.size());
             }
-            rb_raise(rb_eRuntimeError, "XML parsing failed:\n%s", all_errors.c_str());
         }
-
-        return rb_doc;
     } catch (const XMLException& e) {
         CharStr message(e.getMessage());
-        delete parse_errors;
         delete parser;
+        delete memory;
         rb_raise(rb_eRuntimeError, "XML parsing error: %s", message.localForm());
     } catch (const DOMException& e) {
         CharStr message(e.getMessage());
-        delete parse_errors;
         delete parser;
+        delete memory;
         rb_raise(rb_eRuntimeError, "DOM error: %s", message.localForm());
     } catch (...) {
-        delete parse_errors;
         delete parser;
+        delete memory;
         rb_raise(rb_eRuntimeError, "Unknown XML parsing error");
     }
 
-    return Qnil;
+    if (!NIL_P(failure)) {
+        if (!stopped) {
+            rb_exc_raise(rb_exc_new_str(rb_eRuntimeError, failure));
+        }
+        // Stopped by max_errors or fatal_on_first: the problems found so far
+        // go with the exception, as the document is never returned
+        DocumentWrapper* wrapper;
+        TypedData_Get_Struct(rb_doc, DocumentWrapper, &document_type, wrapper);
+        VALUE errors = rb_ary_new_capa((long)wrapper->parse_errors->size());
+        for (const auto& record : *wrapper->parse_errors) {
+            rb_ary_push(errors, error_record_to_ruby(record));
+        }
+        VALUE error = rb_exc_new_str(rb_cSyntaxError, failure);
+        rb_ivar_set(error, rb_intern("@level"), INT2FIX(ErrorRecord::LEVEL_FATAL));
+        rb_ivar_set(error, rb_intern("@line"), rb_ivar_get(rb_ary_entry(errors, -1), rb_intern("@line")));
+        rb_ivar_set(error, rb_intern("@column"), rb_ivar_get(rb_ary_entry(errors, -1), rb_intern("@column")));
+        rb_ivar_set(error, rb_intern("@errors"), errors);
+        rb_exc_raise(error);
+    }
+    return rb_doc;
+}
+
+// syntax_error.warning?, error? and fatal?
+static VALUE syntax_error_warning_p(VALUE self) {
+    return rb_ivar_get(self, rb_intern("@level")) == INT2FIX(ErrorRecord::LEVEL_WARNING) ? Qtrue : Qfalse;
+}
+
+static VALUE syntax_error_error_p(VALUE self) {
+    return rb_ivar_get(self, rb_intern("@level")) == INT2FIX(ErrorRecord::LEVEL_ERROR) ? Qtrue : Qfalse;
+}
+
+static VALUE syntax_error_fatal_p(VALUE self) {
+    return rb_ivar_get(self, rb_intern("@level")) == INT2FIX(ErrorRecord::LEVEL_FATAL) ? Qtrue : Qfalse;
 }
 
-// document.errors - returns array of parse errors (warnings and errors)
+// document.errors - returns array of parse errors (warnings and errors) as
+// RXerces::XML::SyntaxError objects
 static VALUE document_errors(VALUE self) {
     DocumentWrapper* wrapper;
     TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
@@ -788,13 +1412,77 @@ static VALUE document_errors(VALUE self) {
 
     if (wrapper->parse_errors) {
         for (const auto& error : *wrapper->parse_errors) {
-            rb_ary_push(errors_array, rb_str_new2(error.c_str()));
+            rb_ary_push(errors_array, error_record_to_ruby(error));
         }
     }
 
     return errors_array;
 }
 
+// document.parse_stats - what parsing built and how long it took, counted
+// by the parser as it went
+static VALUE document_parse_stats(VALUE self) {
+    DocumentWrapper* wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
+
+    const ParseStats& stats = wrapper->parse_stats;
+    VALUE result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("elements")), ULONG2NUM(stats.elements));
+    rb_hash_aset(result, ID2SYM(rb_intern("attributes")), ULONG2NUM(stats.attributes));
+    rb_hash_aset(result, ID2SYM(rb_intern("text_nodes")), ULONG2NUM(stats.text_nodes));
+    rb_hash_aset(result, ID2SYM(rb_intern("max_depth")), ULONG2NUM(stats.max_depth));
+    rb_hash_aset(result, ID2SYM(rb_intern("input_bytes")), SIZET2NUM(stats.input_bytes));
+    rb_hash_aset(result, ID2SYM(rb_intern("parse_time")), DBL2NUM(stats.parse_nanoseconds / 1e9));
+    return result;
+}
+
+// document.memory_stats - bytes held natively by the document. Compiled
+// Xerces expressions live in the DOM heap, so they count towards dom_bytes
+// rather than xpath_cache_bytes.
+static VALUE document_memory_stats(VALUE self) {
+    DocumentWrapper* wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
+
+    size_t xalan_bytes = 0;
+    size_t cache_entries = 0;
+    size_t cache_bytes = 0;
+#ifdef HAVE_XALAN
+    if (wrapper->xalan_context) {
+        xalan_bytes = wrapper->xalan_context->bridgeMemory.bytes();
+        cache_bytes += wrapper->xalan_context->xpathMemory.bytes();
+    }
+    if (wrapper->xpath_cache_list) {
+        for (const auto* compiled : *wrapper->xpath_cache_list) {
+            // The entry, and its expression once in it and once in the map
+            cache_bytes += sizeof(CompiledXPath) + 2 * compiled->expression.capacity();
+        }
+        cache_entries += wrapper->xpath_cache_list->size();
+    }
+#endif
+    if (wrapper->xerces_xpath_cache_list) {
+        for (const auto* compiled : *wrapper->xerces_xpath_cache_list) {
+            cache_bytes += sizeof(XercesCompiledXPath) + 2 * compiled->source.capacity();
+        }
+        cache_entries += wrapper->xerces_xpath_cache_list->size();
+    }
+
+    size_t error_bytes = 0;
+    if (wrapper->parse_errors) {
+        error_bytes = wrapper->parse_errors->capacity() * sizeof(ErrorRecord);
+        for (const auto& error : *wrapper->parse_errors) {
+            error_bytes += error.message.capacity() * sizeof(XMLCh);
+        }
+    }
+
+    VALUE result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("dom_bytes")), SIZET2NUM(wrapper->memory ? wrapper->memory->bytes() : 0));
+    rb_hash_aset(result, ID2SYM(rb_intern("xalan_bytes")), SIZET2NUM(xalan_bytes));
+    rb_hash_aset(result, ID2SYM(rb_intern("xpath_cache_entries")), SIZET2NUM(cache_entries));
+    rb_hash_aset(result, ID2SYM(rb_intern("xpath_cache_bytes")), SIZET2NUM(cache_bytes));
+    rb_hash_aset(result, ID2SYM(rb_intern("error_bytes")), SIZET2NUM(error_bytes));
+    return result;
+}
+
 // document.root
 static VALUE document_root(VALUE self) {
     DocumentWrapper* wrapper;
@@ -808,6 +1496,265 @@ static VALUE document_root(VALUE self) {
     return wrap_node(root, self);
 }
 
+// Serializer output is handed to Ruby in chunks of this many bytes
+static const size_t SERIALIZE_CHUNK_SIZE = 64 * 1024;
+
+// Thrown from RubyFormatTarget to stop the serializer once Ruby has raised
+struct SerializationStopped {};
+
+// XMLFormatTarget that streams the serializer's encoded bytes into a Ruby
+// String, or to an object by calling method (write for an IO, update for a
+// digest) with each chunk. Bytes are gathered into a fixed-size chunk, so memory use
+// does not grow with the document. The serializer runs without the GVL;
+// each full chunk is delivered with the GVL held, and anything Ruby raises
+// is kept in state() until the serializer has unwound.
+class RubyFormatTarget : public XMLFormatTarget {
+public:
+    RubyFormatTarget(VALUE destination, ID method, int encoding_index)
+        : destination_(destination), method_(method), encoding_index_(encoding_index),
+          without_gvl_(false), state_(0), written_(0) {
+        buffer_.reserve(SERIALIZE_CHUNK_SIZE);
+    }
+
+    void writeChars(const XMLByte* const toWrite, const XMLSize_t count, XMLFormatter* const formatter) {
+        if (state_) {
+            throw SerializationStopped();
+        }
+
+        buffer_.append((const char*)toWrite, count);
+        written_ += count;
+        if (buffer_.size() >= SERIALIZE_CHUNK_SIZE) {
+            if (without_gvl_) {
+                rb_thread_call_with_gvl(deliver_with_gvl, this);
+            } else {
+                deliver();
+            }
+        }
+    }
+
+    // Deliver what is left; called with the GVL held
+    void finish() {
+        if (!state_ && !buffer_.empty()) {
+            deliver();
+        }
+    }
+
+    void set_without_gvl(bool without_gvl) { without_gvl_ = without_gvl; }
+    int state() const { return state_; }
+    size_t written() const { return written_; }  // Bytes produced so far
+
+private:
+    static void* deliver_with_gvl(void* target) {
+        static_cast<RubyFormatTarget*>(target)->deliver();
+        return nullptr;
+    }
+
+    static VALUE deliver_chunk(VALUE arg) {
+        RubyFormatTarget* target = reinterpret_cast<RubyFormatTarget*>(arg);
+        if (target->method_) {
+            VALUE chunk = rb_str_new(target->buffer_.data(), (long)target->buffer_.size());
+            rb_enc_associate_index(chunk, target->encoding_index_);
+            rb_funcall(target->destination_, target->method_, 1, chunk);
+        } else {
+            rb_str_cat(target->destination_, target->buffer_.data(), (long)target->buffer_.size());
+        }
+        return Qnil;
+    }
+
+    void deliver() {
+        rb_protect(deliver_chunk, reinterpret_cast<VALUE>(this), &state_);
+        buffer_.clear();
+    }
+
+    VALUE destination_;
+    ID method_;
+    int encoding_index_;
+    bool without_gvl_;
+    int state_;
+    size_t written_;
+    std::string buffer_;
+};
+
+static DOMImplementationLS* ls_implementation() {
+    XStr ls_name("LS");
+    return (DOMImplementationLS*)DOMImplementationRegistry::getDOMImplementation(ls_name.unicodeForm());
+}
+
+// Take a serializer from the idle list, or create one
+static DOMLSSerializer* acquire_serializer(bool indent) {
+    DOMLSSerializer* serializer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(serializer_pool_mutex);
+        if (idle_serializers && !idle_serializers->empty()) {
+            serializer = idle_serializers->back();
+            idle_serializers->pop_back();
+        }
+    }
+
+    if (!serializer) {
+        serializer = ls_implementation()->createLSSerializer();
+    }
+
+    DOMConfiguration* config = serializer->getDomConfig();
+    if (config->canSetParameter(XMLUni::fgDOMWRTFormatPrettyPrint, indent)) {
+        config->setParameter(XMLUni::fgDOMWRTFormatPrettyPrint, indent);
+    }
+    return serializer;
+}
+
+// Return a serializer to the idle list
+static void release_serializer(DOMLSSerializer* serializer) {
+    {
+        std::lock_guard<std::mutex> lock(serializer_pool_mutex);
+        if (!idle_serializers) {
+            idle_serializers = new std::vector<DOMLSSerializer*>();
+        }
+        if (idle_serializers->size() < SERIALIZER_POOL_SIZE) {
+            idle_serializers->push_back(serializer);
+            return;
+        }
+    }
+    serializer->release();
+}
+
+struct SerializeCall {
+    const std::vector<DOMNode*>* nodes;
+    const native_source::SourceMap* source;  // Set when copying from the parsed source
+    RubyFormatTarget* target;
+    const char* encoding;
+    bool indent;
+    bool ok;
+    char error[512];
+};
+
+// Runs the serializer with the GVL released. Only Xerces is called here;
+// Ruby is reached through the target's chunk delivery.
+static void* serialize_without_gvl(void* arg) {
+    SerializeCall* call = static_cast<SerializeCall*>(arg);
+    DOMLSSerializer* serializer = nullptr;
+    DOMLSOutput* output = nullptr;
+
+    call->target->set_without_gvl(true);
+    try {
+        serializer = acquire_serializer(call->indent);
+        output = ls_implementation()->createLSOutput();
+        XStr encoding(call->encoding);
+        output->setEncoding(encoding.unicodeForm());
+        output->setByteStream(call->target);
+
+        // Every node is written through the same target and buffer
+        call->ok = true;
+        for (DOMNode* node : *call->nodes) {
+            bool written;
+            if (call->source && node->getNodeType() == DOMNode::DOCUMENT_NODE) {
+                // Only what changed since parsing goes through the serializer
+                written = call->source->write(static_cast<DOMDocument*>(node), *call->target,
+                    [serializer, output](DOMNode* changed) { return serializer->write(changed, output); });
+            } else {
+                written = serializer->write(node, output);
+            }
+            if (!written) {
+                call->ok = false;
+                snprintf(call->error, sizeof(call->error), "cannot write as %s", call->encoding);
+                break;
+            }
+        }
+    } catch (const SerializationStopped&) {
+        call->ok = false;
+    } catch (const DOMException& e) {
+        char* message = XMLString::transcode(e.getMessage());
+        snprintf(call->error, sizeof(call->error), "%s", message);
+        XMLString::release(&message);
+        call->ok = false;
+    } catch (const XMLException& e) {
+        char* message = XMLString::transcode(e.getMessage());
+        snprintf(call->error, sizeof(call->error), "%s", message);
+        XMLString::release(&message);
+        call->ok = false;
+    } catch (...) {
+        snprintf(call->error, sizeof(call->error), "unknown exception type");
+        call->ok = false;
+    }
+    call->target->set_without_gvl(false);
+
+    if (output) {
+        output->release();
+    }
+    if (serializer) {
+        release_serializer(serializer);
+    }
+    return nullptr;
+}
+
+// Serialize nodes one after another into destination, a String to append
+// to or an object responding to write, in the given encoding. Their
+// documents cannot be modified until it is done. With a source map,
+// unmodified elements are copied from the parsed source. The nodes are
+// taken by value so they are freed here before anything is raised.
+static void serialize_nodes(std::vector<DOMNode*> nodes, VALUE destination, const char* encoding, bool indent,
+                            const native_source::SourceMap* source = nullptr) {
+    bool to_io = !RB_TYPE_P(destination, T_STRING);
+    if (!to_io) {
+        rb_str_modify(destination);
+    }
+
+    int encoding_index = rb_enc_find_index(encoding);
+    if (encoding_index < 0) {
+        encoding_index = rb_ascii8bit_encindex();
+    }
+
+    SerializeCall call;
+    call.nodes = &nodes;
+    call.source = source;
+    call.encoding = encoding;
+    call.indent = indent;
+    call.ok = false;
+    call.error[0] = '\0';
+
+    int state;
+    {
+        RubyFormatTarget target(destination, to_io ? rb_intern("write") : 0, encoding_index);
+        call.target = &target;
+        native_stats::count(native_stats::SERIALIZATIONS);
+        native_stats::Timer timer;
+        RXERCES_PROBE1(serialize__start, nodes.size());
+        state = call_without_gvl_reading(nodes, serialize_without_gvl, &call);
+        if (call.ok && !state) {
+            target.finish();
+        }
+        RXERCES_PROBE1(serialize__done, target.written());
+        timer.stop(native_stats::SERIALIZE_TIME);
+        if (!state) {
+            state = target.state();
+        }
+    }
+    std::vector<DOMNode*>().swap(nodes);
+
+    if (state) {
+        rb_jump_tag(state);
+    }
+    if (!call.ok) {
+        rb_raise(rb_eRuntimeError, "Failed to serialize document: %s", call.error);
+    }
+}
+
+static void serialize_node(DOMNode* node, VALUE destination, const char* encoding, bool indent,
+                           const native_source::SourceMap* source = nullptr) {
+    serialize_nodes(std::vector<DOMNode*>(1, node), destination, encoding, indent, source);
+}
+
+// The source map to serialize a document from, if it has one and the
+// output can reuse the source bytes as they are: UTF-8 without indenting
+static const native_source::SourceMap* reusable_source(DocumentWrapper* wrapper, const char* encoding, bool indent) {
+    if (!wrapper->source || indent) {
+        return nullptr;
+    }
+    if (STRCASECMP(encoding, "UTF-8") != 0 && STRCASECMP(encoding, "UTF8") != 0) {
+        return nullptr;
+    }
+    return wrapper->source;
+}
+
 // document.to_s / document.to_xml
 static VALUE document_to_s(VALUE self) {
     DocumentWrapper* wrapper;
@@ -817,32 +1764,256 @@ static VALUE document_to_s(VALUE self) {
         return rb_str_new_cstr("");
     }
 
-    try {
-        DOMImplementation* impl = DOMImplementationRegistry::getDOMImplementation(XStr("LS").unicodeForm());
-        DOMLSSerializer* serializer = ((DOMImplementationLS*)impl)->createLSSerializer();
+    VALUE result = rb_utf8_str_new("", 0);
+    serialize_node(wrapper->doc, result, "UTF-8", false, reusable_source(wrapper, "UTF-8", false));
+    return result;
+}
+
+// Parse the encoding: and indent: options of write_to
+static void parse_write_options(VALUE options, VALUE* encoding, bool* indent) {
+    *encoding = rb_str_new_cstr("UTF-8");
+    *indent = false;
+
+    if (NIL_P(options)) {
+        return;
+    }
+
+    validate_option_keys(options, { "encoding", "indent" });
+
+    VALUE encoding_opt = rb_hash_aref(options, ID2SYM(rb_intern("encoding")));
+    if (!NIL_P(encoding_opt)) {
+        if (rb_obj_is_kind_of(encoding_opt, rb_cEncoding)) {
+            encoding_opt = rb_funcall(encoding_opt, rb_intern("name"), 0);
+        }
+        if (!RB_TYPE_P(encoding_opt, T_STRING)) {
+            rb_raise(rb_eTypeError, "encoding must be a String or Encoding");
+        }
+        *encoding = encoding_opt;
+    }
 
-        XMLCh* xml_str = serializer->writeToString(wrapper->doc);
-        CharStr utf8_str(xml_str);
+    *indent = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("indent"))));
+}
+
+// Check that io can be written to by serialize_node
+static void check_write_destination(VALUE io) {
+    if (!RB_TYPE_P(io, T_STRING) && !rb_respond_to(io, rb_intern("write"))) {
+        rb_raise(rb_eTypeError, "io must be a String or respond to write");
+    }
+}
+
+// document.write_to(io, encoding: 'UTF-8', indent: false) - streams the
+// serialized document into io, or appends it to a String
+static VALUE document_write_to(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    check_write_destination(io);
+
+    VALUE encoding;
+    bool indent;
+    parse_write_options(options, &encoding, &indent);
+
+    DocumentWrapper* wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
+
+    if (wrapper->doc) {
+        const char* encoding_name = StringValueCStr(encoding);
+        serialize_node(wrapper->doc, io, encoding_name, indent, reusable_source(wrapper, encoding_name, indent));
+    }
 
-        VALUE result = rb_str_new_cstr(utf8_str.localForm());
+    RB_GC_GUARD(encoding);
+    return io;
+}
+
+// Canonicalization options, checked before any native state is built so
+// that nothing needs unwinding when they are rejected
+struct CanonicalOptions {
+    native_c14n::Mode mode;
+    bool with_comments;
+    VALUE inclusive_namespaces;  // Array of Strings, or nil
+};
 
-        XMLString::release(&xml_str);
-        serializer->release();
+// Parse the mode:, with_comments: and inclusive_namespaces: options of
+// canonicalize and write_canonical
+static CanonicalOptions parse_canonical_options(VALUE options) {
+    CanonicalOptions result;
+    result.mode = native_c14n::MODE_EXCLUSIVE;
+    result.with_comments = false;
+    result.inclusive_namespaces = Qnil;
 
+    if (NIL_P(options)) {
         return result;
-    } catch (const DOMException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "Failed to serialize document: %s", message.localForm());
-    } catch (const XMLException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "Failed to serialize document (XMLException): %s", message.localForm());
-    } catch (const std::exception& e) {
-        rb_raise(rb_eRuntimeError, "Failed to serialize document (std::exception): %s", e.what());
+    }
+
+    validate_option_keys(options, { "mode", "with_comments", "inclusive_namespaces" });
+
+    VALUE mode = rb_hash_aref(options, ID2SYM(rb_intern("mode")));
+    if (!NIL_P(mode)) {
+        if (mode == ID2SYM(rb_intern("inclusive"))) {
+            result.mode = native_c14n::MODE_INCLUSIVE;
+        } else if (mode != ID2SYM(rb_intern("exclusive"))) {
+            rb_raise(rb_eArgError, "mode must be :exclusive or :inclusive");
+        }
+    }
+
+    result.with_comments = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("with_comments"))));
+
+    VALUE prefixes = rb_hash_aref(options, ID2SYM(rb_intern("inclusive_namespaces")));
+    if (!NIL_P(prefixes)) {
+        // Copied, so the caller's array is neither changed nor required
+        // to be unfrozen
+        prefixes = rb_Array(prefixes);
+        VALUE names = rb_ary_new_capa(RARRAY_LEN(prefixes));
+        for (long i = 0; i < RARRAY_LEN(prefixes); i++) {
+            VALUE prefix = rb_ary_entry(prefixes, i);
+            if (SYMBOL_P(prefix)) {
+                prefix = rb_sym_to_s(prefix);
+            } else if (!RB_TYPE_P(prefix, T_STRING)) {
+                rb_raise(rb_eTypeError, "inclusive_namespaces must contain Strings or Symbols");
+            }
+            rb_ary_push(names, prefix);
+        }
+        result.inclusive_namespaces = names;
+    }
+
+    return result;
+}
+
+// The method write_canonical calls to hand over each chunk: none for a
+// String, write for an IO and update for a digest
+static ID canonical_destination_method(VALUE io) {
+    if (RB_TYPE_P(io, T_STRING)) {
+        return 0;
+    }
+    if (rb_respond_to(io, rb_intern("write"))) {
+        return rb_intern("write");
+    }
+    if (rb_respond_to(io, rb_intern("update"))) {
+        return rb_intern("update");
+    }
+    rb_raise(rb_eTypeError, "io must be a String or respond to write or update");
+    return 0;
+}
+
+struct CanonicalizeCall {
+    DOMNode* node;
+    const native_c14n::Options* options;
+    RubyFormatTarget* target;
+    bool ok;
+    char error[512];
+};
+
+// Runs the canonicalizer with the GVL released, as serialize_without_gvl
+static void* canonicalize_without_gvl(void* arg) {
+    CanonicalizeCall* call = static_cast<CanonicalizeCall*>(arg);
+
+    call->target->set_without_gvl(true);
+    try {
+        native_c14n::canonicalize(call->node, *call->options, *call->target);
+        call->ok = true;
+    } catch (const SerializationStopped&) {
+        call->ok = false;
+    } catch (const native_c14n::Error& e) {
+        snprintf(call->error, sizeof(call->error), "%s", e.what());
+        call->ok = false;
+    } catch (const std::bad_alloc&) {
+        snprintf(call->error, sizeof(call->error), "out of memory");
+        call->ok = false;
     } catch (...) {
-        rb_raise(rb_eRuntimeError, "Failed to serialize document (unknown exception type)");
+        snprintf(call->error, sizeof(call->error), "unknown exception type");
+        call->ok = false;
     }
+    call->target->set_without_gvl(false);
+    return nullptr;
+}
 
-    return Qnil;
+// Stream the canonical form of node into destination as UTF-8. The
+// document cannot be modified until it is done.
+static void canonicalize_node(DOMNode* node, VALUE destination, const CanonicalOptions& options) {
+    ID method = canonical_destination_method(destination);
+    if (!method) {
+        rb_str_modify(destination);
+    }
+
+    CanonicalizeCall call;
+    call.node = node;
+    call.ok = false;
+    call.error[0] = '\0';
+
+    int state;
+    {
+        native_c14n::Options native_options;
+        native_options.mode = options.mode;
+        native_options.with_comments = options.with_comments;
+        if (!NIL_P(options.inclusive_namespaces)) {
+            for (long i = 0; i < RARRAY_LEN(options.inclusive_namespaces); i++) {
+                VALUE prefix = RARRAY_AREF(options.inclusive_namespaces, i);
+                native_options.inclusive_prefixes.push_back(std::string(RSTRING_PTR(prefix), RSTRING_LEN(prefix)));
+            }
+        }
+        call.options = &native_options;
+
+        RubyFormatTarget target(destination, method, rb_utf8_encindex());
+        call.target = &target;
+        native_stats::count(native_stats::SERIALIZATIONS);
+        native_stats::Timer timer;
+        state = call_without_gvl_reading(std::vector<DOMNode*>{node}, canonicalize_without_gvl, &call);
+        if (call.ok && !state) {
+            target.finish();
+        }
+        timer.stop(native_stats::SERIALIZE_TIME);
+        if (!state) {
+            state = target.state();
+        }
+    }
+
+    if (state) {
+        rb_jump_tag(state);
+    }
+    if (!call.ok) {
+        rb_raise(rb_eRuntimeError, "Failed to canonicalize: %s", call.error);
+    }
+}
+
+// document.canonicalize(mode: :exclusive, with_comments: false,
+// inclusive_namespaces: nil) - Canonical XML of the document as a String
+static VALUE document_canonicalize(int argc, VALUE* argv, VALUE self) {
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    CanonicalOptions canonical = parse_canonical_options(options);
+
+    DocumentWrapper* wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
+
+    VALUE result = rb_utf8_str_new("", 0);
+    if (wrapper->doc) {
+        canonicalize_node(wrapper->doc, result, canonical);
+    }
+
+    RB_GC_GUARD(canonical.inclusive_namespaces);
+    return result;
+}
+
+// document.write_canonical(io, mode: :exclusive, with_comments: false,
+// inclusive_namespaces: nil) - streams the canonical form into io, a
+// String or a digest
+static VALUE document_write_canonical(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    canonical_destination_method(io);
+    CanonicalOptions canonical = parse_canonical_options(options);
+
+    DocumentWrapper* wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, wrapper);
+
+    if (wrapper->doc) {
+        canonicalize_node(wrapper->doc, io, canonical);
+    }
+
+    RB_GC_GUARD(canonical.inclusive_namespaces);
+    return io;
 }
 
 // document.inspect - human-readable representation
@@ -970,14 +2141,11 @@ static VALUE document_children(VALUE self) {
         return rb_ary_new();
     }
 
-    DOMNodeList* child_nodes = wrapper->doc->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
-
     // Pre-size array for better performance
-    VALUE children = rb_ary_new_capa((long)count);
+    VALUE children = rb_ary_new_capa(count_children(wrapper->doc));
 
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
+    // Follow sibling pointers; DOMNodeList::item(i) walks from the first child
+    for (DOMNode* child = wrapper->doc->getFirstChild(); child; child = child->getNextSibling()) {
         rb_ary_push(children, wrap_node(child, self));
     }
 
@@ -993,14 +2161,9 @@ static VALUE document_element_children(VALUE self) {
         return rb_ary_new();
     }
 
-    DOMNodeList* child_nodes = wrapper->doc->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
-
-    // Pre-size array (may be smaller than count, but good estimate)
-    VALUE children = rb_ary_new_capa((long)count);
+    VALUE children = rb_ary_new();
 
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
+    for (DOMNode* child = wrapper->doc->getFirstChild(); child; child = child->getNextSibling()) {
         if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
             rb_ary_push(children, wrap_node(child, self));
         }
@@ -1018,11 +2181,7 @@ static VALUE document_first_element_child(VALUE self) {
         return Qnil;
     }
 
-    DOMNodeList* child_nodes = wrapper->doc->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
-
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
+    for (DOMNode* child = wrapper->doc->getFirstChild(); child; child = child->getNextSibling()) {
         if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
             return wrap_node(child, self);
         }
@@ -1040,12 +2199,8 @@ static VALUE document_last_element_child(VALUE self) {
         return Qnil;
     }
 
-    DOMNodeList* child_nodes = wrapper->doc->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
-
     // Search backwards for last element
-    for (XMLSize_t i = count; i > 0; i--) {
-        DOMNode* child = child_nodes->item(i - 1);
+    for (DOMNode* child = wrapper->doc->getLastChild(); child; child = child->getPreviousSibling()) {
         if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
             return wrap_node(child, self);
         }
@@ -1054,52 +2209,124 @@ static VALUE document_last_element_child(VALUE self) {
     return Qnil;
 }
 
-#ifdef HAVE_XALAN
-// Helper to initialize or get cached Xalan context for a document
-static XalanContext* get_or_create_xalan_context(DocumentWrapper* doc_wrapper) {
-    if (doc_wrapper->xalan_context) {
-        return doc_wrapper->xalan_context;
+// True if an expression names a namespace prefix: a colon outside string
+// literals that is not part of an axis's ::
+static bool xpath_uses_prefixes(const char* xpath_str) {
+    char quote = 0;
+    for (const char* p = xpath_str; *p; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == ':') {
+            if (p[1] != ':') {
+                return true;
+            }
+            p++;
+        }
     }
+    return false;
+}
 
-    // Create new context
-    XalanContext* ctx = new XalanContext();
-
-    try {
-        ctx->liaison = new XercesParserLiaison();
-        ctx->domSupport = new XercesDOMSupport(*ctx->liaison);
+// The element whose in-scope namespaces bind the prefixes of an
+// expression evaluated at node, as the native engine and Xerces bind them:
+// the node itself, the nearest element above it, or for a document its
+// document element
+static DOMElement* prefix_scope(DOMNode* node) {
+    if (node->getNodeType() == DOMNode::DOCUMENT_NODE) {
+        return static_cast<DOMDocument*>(node)->getDocumentElement();
+    }
+    while (node && node->getNodeType() != DOMNode::ELEMENT_NODE) {
+        node = node->getNodeType() == DOMNode::ATTRIBUTE_NODE
+            ? static_cast<DOMAttr*>(node)->getOwnerElement()
+            : node->getParentNode();
+    }
+    return static_cast<DOMElement*>(node);
+}
 
-        // Create Xalan document wrapper - this is owned by liaison
-        ctx->xalanDoc = ctx->liaison->createDocument(doc_wrapper->doc, false, false, false);
-        if (!ctx->xalanDoc) {
-            delete ctx;
-            return nullptr;
+// Namespace bindings, prefix to URI; the default namespace has the empty
+// prefix and an undeclared one the empty URI
+typedef std::map<native_xpath::XString, native_xpath::XString> NamespaceBindings;
+
+// The bindings in scope at the prefix_scope of node. An element's own
+// prefix takes precedence over its xmlns attributes, and those over the
+// declarations of its ancestors, as in DOMNode::lookupNamespaceURI.
+static void collect_namespace_bindings(DOMNode* node, NamespaceBindings& bindings) {
+    static const XMLCh empty[] = { 0 };
+    for (DOMNode* n = prefix_scope(node); n && n->getNodeType() == DOMNode::ELEMENT_NODE; n = n->getParentNode()) {
+        const XMLCh* uri = n->getNamespaceURI();
+        if (uri) {
+            const XMLCh* prefix = n->getPrefix();
+            bindings.insert(std::make_pair(native_xpath::XString(prefix ? prefix : empty), native_xpath::XString(uri)));
         }
-        ctx->docWrapper = static_cast<XercesDocumentWrapper*>(ctx->xalanDoc);
 
-        // Create XPath infrastructure
-        ctx->envSupport = new XPathEnvSupportDefault();
-        ctx->objectFactory = new XObjectFactoryDefault();
-        ctx->executionContext = new XPathExecutionContextDefault(*ctx->envSupport, *ctx->domSupport, *ctx->objectFactory);
-        ctx->constructionContext = new XPathConstructionContextDefault();
-        ctx->factory = new XPathFactoryDefault();
-        ctx->processor = new XPathProcessorImpl();
+        DOMNamedNodeMap* attributes = n->getAttributes();
+        XMLSize_t length = attributes ? attributes->getLength() : 0;
+        for (XMLSize_t i = 0; i < length; i++) {
+            DOMNode* attr = attributes->item(i);
+            const XMLCh* name = attr->getNodeName();
+            const XMLCh* prefix;
+            if (XMLString::equals(name, XMLUni::fgXMLNSString)) {
+                prefix = empty;
+            } else if (XMLString::startsWith(name, XMLUni::fgXMLNSColonString)) {
+                prefix = name + XMLString::stringLen(XMLUni::fgXMLNSColonString);
+            } else {
+                continue;
+            }
+            const XMLCh* value = attr->getNodeValue();
+            bindings.insert(std::make_pair(native_xpath::XString(prefix), native_xpath::XString(value ? value : empty)));
+        }
+    }
+}
 
-        doc_wrapper->xalan_context = ctx;
+// Cache key for an expression that uses prefixes: the expression followed
+// by the bindings its prefixes resolve against. Queries from nodes that
+// share those bindings share one compiled expression.
+static std::string prefixed_xpath_key(const char* xpath_str, const NamespaceBindings& bindings) {
+    std::string key(xpath_str);
+    for (const auto& binding : bindings) {
+        key.push_back('\0');
+        key.append(reinterpret_cast<const char*>(binding.first.c_str()), (binding.first.size() + 1) * sizeof(XMLCh));
+        key.append(reinterpret_cast<const char*>(binding.second.c_str()), (binding.second.size() + 1) * sizeof(XMLCh));
+    }
+    return key;
+}
 
-        // Initialize XPath expression cache
-        doc_wrapper->xpath_cache_list = new std::list<CompiledXPath*>();
-        doc_wrapper->xpath_cache_map = new std::unordered_map<std::string, std::list<CompiledXPath*>::iterator>();
+#ifdef HAVE_XALAN
+// Helper to initialize or get cached Xalan context for a document
+static native_xalan::Context* get_or_create_xalan_context(DocumentWrapper* doc_wrapper) {
+    if (doc_wrapper->xalan_context) {
+        return doc_wrapper->xalan_context;
+    }
 
-        return ctx;
-    } catch (...) {
-        delete ctx;
+    native_xalan::Context* ctx = native_xalan::create_context(doc_wrapper->doc);
+    if (!ctx) {
         return nullptr;
     }
+    doc_wrapper->xalan_context = ctx;
+
+    // Initialize XPath expression cache
+    doc_wrapper->xpath_cache_list = new std::list<CompiledXPath*>();
+    doc_wrapper->xpath_cache_map = new std::unordered_map<std::string, std::list<CompiledXPath*>::iterator>();
+
+    return ctx;
 }
 
-// Get or compile XPath expression with LRU caching
-static XPath* get_or_compile_xpath(DocumentWrapper* doc_wrapper, XalanContext* ctx, const char* xpath_str) {
-    std::string expr(xpath_str);
+// Get or compile XPath expression with LRU caching. As for Xerces, an
+// expression that uses prefixes is compiled against the context node's
+// namespaces and cached under the bindings in scope there.
+static XPath* get_or_compile_xpath(DocumentWrapper* doc_wrapper, native_xalan::Context* ctx, DOMNode* context_node,
+                                   const char* xpath_str, XPathProfile* profile = nullptr) {
+    bool prefixed = xpath_uses_prefixes(xpath_str);
+    std::string expr;
+    if (prefixed) {
+        NamespaceBindings bindings;
+        collect_namespace_bindings(context_node, bindings);
+        expr = prefixed_xpath_key(xpath_str, bindings);
+    } else {
+        expr = xpath_str;
+    }
+    RXERCES_PROBE1(xpath__compile__start, xpath_str);
 
     // Check cache
     auto it = doc_wrapper->xpath_cache_map->find(expr);
@@ -1109,16 +2336,23 @@ static XPath* get_or_compile_xpath(DocumentWrapper* doc_wrapper, XalanContext* c
         doc_wrapper->xpath_cache_list->erase(it->second);
         doc_wrapper->xpath_cache_list->push_front(compiled);
         (*doc_wrapper->xpath_cache_map)[expr] = doc_wrapper->xpath_cache_list->begin();
+        native_stats::count(native_stats::XPATH_COMPILE_HITS);
+        if (profile) {
+            profile->compile_cache_hit = true;
+        }
+        RXERCES_PROBE2(xpath__compile__done, xpath_str, 1);
         return compiled->xpath;
     }
 
     // Cache miss - compile new XPath
-    XPath* xpath = ctx->factory->create();
-
-    // Get document element for resolver (can be null, that's ok)
-    XalanElement* docElem = ctx->docWrapper->getDocumentElement();
-    ElementPrefixResolverProxy resolver(docElem, *ctx->envSupport, *ctx->domSupport);
-    ctx->processor->initXPath(*xpath, *ctx->constructionContext, XalanDOMString(xpath_str), resolver);
+    native_stats::count(native_stats::XPATH_COMPILE_MISSES);
+    XPath* xpath;
+    try {
+        xpath = ctx->compile(xpath_str, prefixed ? prefix_scope(context_node) : nullptr);
+    } catch (...) {
+        RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
+        throw;
+    }
 
     // Add to cache
     CompiledXPath* compiled = new CompiledXPath(xpath, expr);
@@ -1134,17 +2368,17 @@ static XPath* get_or_compile_xpath(DocumentWrapper* doc_wrapper, XalanContext* c
         doc_wrapper->xpath_cache_list->pop_back();
     }
 
+    RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
     return xpath;
 }
 
-// Helper function to execute XPath using Xalan for full XPath 1.0 support
-// Uses cached Xalan context and compiled XPath expressions for performance
-static VALUE execute_xpath_with_xalan(DOMNode* context_node, const char* xpath_str, VALUE doc_ref) {
-    // Validate XPath expression before execution
-    validate_xpath_expression(xpath_str);
-
-    ensure_xerces_initialized();
-
+// Evaluate XPath using Xalan for full XPath 1.0 support, appending matches
+// to nodes. Uses cached Xalan context and compiled XPath expressions for
+// performance. Errors are copied into error_message.
+static void select_nodes_with_xalan(DOMNode* context_node, const char* xpath_str, VALUE doc_ref,
+                                    std::vector<DOMNode*>& nodes,
+                                    char* error_message, size_t error_size,
+                                    XPathProfile* profile = nullptr) {
     try {
         // Get the document wrapper
         DocumentWrapper* doc_wrapper;
@@ -1152,159 +2386,920 @@ static VALUE execute_xpath_with_xalan(DOMNode* context_node, const char* xpath_s
 
         DOMDocument* domDoc = doc_wrapper->doc;
         if (!domDoc) {
-            NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-            wrapper->nodes_array = rb_ary_new();
-            return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+            return;
         }
 
         // Get or create cached Xalan context
-        XalanContext* ctx = get_or_create_xalan_context(doc_wrapper);
+        native_xalan::Context* ctx = get_or_create_xalan_context(doc_wrapper);
         if (!ctx) {
-            rb_raise(rb_eRuntimeError, "Failed to create Xalan context");
+            snprintf(error_message, error_size, "Failed to create Xalan context");
+            return;
         }
 
-        // Map the context node to Xalan
-        XalanNode* xalanContextNode = ctx->docWrapper->mapNode(context_node);
-        if (!xalanContextNode) {
-            xalanContextNode = ctx->docWrapper;
+        // Get or compile XPath expression (cached)
+        native_stats::Timer compile_timer;
+        XPath* xpath = get_or_compile_xpath(doc_wrapper, ctx, context_node, xpath_str, profile);
+        if (profile) {
+            profile->compile_nanoseconds = compile_timer.elapsed();
         }
+        native_stats::Timer execute_timer;
 
-        // Get or compile XPath expression (cached)
-        XPath* xpath = get_or_compile_xpath(doc_wrapper, ctx, xpath_str);
+        ctx->select(*xpath, context_node, nodes);
+        if (profile) {
+            profile->execute_nanoseconds = execute_timer.elapsed();
+        }
+
+        // Don't return xpath to factory - it's cached!
 
-        // Create resolver for execution
-        XalanElement* docElem = ctx->docWrapper->getDocumentElement();
-        ElementPrefixResolverProxy resolver(docElem, *ctx->envSupport, *ctx->domSupport);
+    } catch (const XalanXPathException& e) {
+        CharStr msg(e.getMessage().c_str());
+        snprintf(error_message, error_size, "XPath error: %s", msg.localForm());
+    } catch (const XMLException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, error_size, "XML error: %s", message.localForm());
+    } catch (...) {
+        snprintf(error_message, error_size, "Unknown XPath error");
+    }
+}
+#endif
 
-        // Reset execution context for clean state
-        ctx->objectFactory->reset();
+// Get or compile a native XPath expression with LRU caching. Lookups that
+// only inspect the expression, not run it, pass count_stats = false so
+// RXerces.stats counts a hit or miss only for the engine that runs a query.
+// Throws native_xpath::Error if the expression does not parse
+static native_xpath::CompiledExpressionPtr get_or_compile_native_xpath(const char* xpath_str,
+                                                                      XPathProfile* profile = nullptr,
+                                                                      bool count_stats = true) {
+    std::string expr(xpath_str);
+    RXERCES_PROBE1(xpath__compile__start, xpath_str);
+
+    {
+        std::lock_guard<std::mutex> lock(native_xpath_cache_mutex);
+        if (!native_xpath_lru_list) {
+            native_xpath_lru_list = new std::list<std::string>();
+        }
+        if (!native_xpath_cache_map) {
+            native_xpath_cache_map = new std::unordered_map<std::string, NativeCompiledXPath>();
+        }
 
-        // Execute XPath query
-        const XObjectPtr result = xpath->execute(xalanContextNode, resolver, *ctx->executionContext);
+        auto it = native_xpath_cache_map->find(expr);
+        if (it != native_xpath_cache_map->end()) {
+            // Cache hit - move to front (most recently used)
+            native_xpath_lru_list->splice(native_xpath_lru_list->begin(), *native_xpath_lru_list, it->second.lru_position);
+            if (count_stats) {
+                native_stats::count(native_stats::XPATH_COMPILE_HITS);
+            }
+            if (profile) {
+                profile->compile_cache_hit = true;
+            }
+            RXERCES_PROBE2(xpath__compile__done, xpath_str, 1);
+            return it->second.compiled;
+        }
+    }
+    if (count_stats) {
+        native_stats::count(native_stats::XPATH_COMPILE_MISSES);
+    }
 
-        VALUE nodes_array = rb_ary_new();
+    // Compile outside the lock; a concurrent compile of the same
+    // expression is harmless since either result can be cached
+    native_xpath::CompiledExpressionPtr compiled;
+    try {
+        compiled = native_xpath::compile(expr);
+    } catch (...) {
+        RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
+        throw;
+    }
 
-        if (result.get() != 0) {
-            // Check if result is a node set
-            const NodeRefListBase& nodeList = result->nodeset();
-            const NodeRefListBase::size_type length = nodeList.getLength();
+    std::lock_guard<std::mutex> lock(native_xpath_cache_mutex);
+    if (native_xpath_cache_map->find(expr) == native_xpath_cache_map->end()) {
+        native_xpath_lru_list->push_front(expr);
+        NativeCompiledXPath entry = { compiled, native_xpath_lru_list->begin() };
+        (*native_xpath_cache_map)[expr] = entry;
 
-            for (NodeRefListBase::size_type i = 0; i < length; ++i) {
-                XalanNode* xalanNode = nodeList.item(i);
-                if (xalanNode) {
-                    // Map back to Xerces DOM node
-                    const DOMNode* domNode = ctx->docWrapper->mapNode(xalanNode);
-                    if (domNode) {
-                        rb_ary_push(nodes_array, wrap_node(const_cast<DOMNode*>(domNode), doc_ref));
-                    }
-                }
+        // Evict if cache is too large
+        if (native_xpath_lru_list->size() > NATIVE_XPATH_CACHE_SIZE) {
+            native_xpath_cache_map->erase(native_xpath_lru_list->back());
+            native_xpath_lru_list->pop_back();
+        }
+    }
+
+    RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
+    return compiled;
+}
+
+// Evaluate XPath with the native engine, passing matches to visitor in
+// document order. Streamable expressions stop as soon as the visitor does.
+// Errors are copied into error_message so the caller can raise once all
+// C++ objects are out of scope.
+static void visit_nodes_with_native(DOMNode* context_node, const char* xpath_str,
+                                    native_xpath::NodeVisitor& visitor,
+                                    char* error_message, size_t error_size,
+                                    XPathProfile* profile = nullptr) {
+    try {
+        native_stats::Timer compile_timer;
+        native_xpath::CompiledExpressionPtr compiled = get_or_compile_native_xpath(xpath_str, profile);
+        if (profile) {
+            profile->compile_nanoseconds = compile_timer.elapsed();
+        }
+        native_stats::Timer execute_timer;
+        if (profile && profile->plan) {
+            native_xpath::Profile step_profile(*compiled);
+            native_xpath::for_each_node(*compiled, context_node, visitor, &step_profile);
+            profile->execute_nanoseconds = execute_timer.elapsed();
+            profile->plan->text = step_profile.plan();
+            profile->plan->steps = step_profile.steps();
+            profile->plan->planned = true;
+        } else {
+            native_xpath::for_each_node(*compiled, context_node, visitor);
+            if (profile) {
+                profile->execute_nanoseconds = execute_timer.elapsed();
             }
         }
+    } catch (const native_xpath::Error& e) {
+        snprintf(error_message, error_size, "XPath error: %s", e.what());
+    } catch (const DOMException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, error_size, "XPath error: %s", message.localForm());
+    } catch (const std::bad_alloc&) {
+        snprintf(error_message, error_size, "XPath error: out of memory");
+    } catch (...) {
+        snprintf(error_message, error_size, "XPath error: unknown error");
+    }
+}
 
-        // Don't return xpath to factory - it's cached!
+// Get or compile a Xerces XPath expression with LRU caching. Prefixes are
+// resolved against the context node, so an expression that uses them is
+// cached under the bindings in scope there, with a resolver holding just
+// those bindings; every other expression shares the document's resolver.
+static DOMXPathExpression* get_or_compile_xerces_xpath(DocumentWrapper* doc_wrapper, DOMNode* context_node,
+                                                       const char* xpath_str, XPathProfile* profile = nullptr) {
+    bool prefixed = xpath_uses_prefixes(xpath_str);
+    NamespaceBindings bindings;
+    std::string expr;
+    if (prefixed) {
+        collect_namespace_bindings(context_node, bindings);
+        expr = prefixed_xpath_key(xpath_str, bindings);
+    } else {
+        expr = xpath_str;
+    }
+    RXERCES_PROBE1(xpath__compile__start, xpath_str);
 
-        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-        wrapper->nodes_array = nodes_array;
-        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+    if (!doc_wrapper->xerces_xpath_cache_list) {
+        doc_wrapper->xerces_xpath_cache_list = new std::list<XercesCompiledXPath*>();
+        doc_wrapper->xerces_xpath_cache_map =
+            new std::unordered_map<std::string, std::list<XercesCompiledXPath*>::iterator>();
+    }
 
-    } catch (const XalanXPathException& e) {
-        CharStr msg(e.getMessage().c_str());
-        rb_raise(rb_eRuntimeError, "XPath error: %s", msg.localForm());
-    } catch (const XMLException& e) {
+    // Check cache
+    auto it = doc_wrapper->xerces_xpath_cache_map->find(expr);
+    if (it != doc_wrapper->xerces_xpath_cache_map->end()) {
+        // Cache hit - move to front (most recently used)
+        doc_wrapper->xerces_xpath_cache_list->splice(
+            doc_wrapper->xerces_xpath_cache_list->begin(), *doc_wrapper->xerces_xpath_cache_list, it->second);
+        native_stats::count(native_stats::XPATH_COMPILE_HITS);
+        if (profile) {
+            profile->compile_cache_hit = true;
+        }
+        RXERCES_PROBE2(xpath__compile__done, xpath_str, 1);
+        return (*it->second)->expression;
+    }
+    native_stats::count(native_stats::XPATH_COMPILE_MISSES);
+
+    DOMDocument* doc = doc_wrapper->doc;
+    DOMXPathNSResolver* resolver = nullptr;
+    if (prefixed) {
+        // Not bound to a node, so the entry can serve any node with the
+        // same bindings and outlives the node it was compiled at
+        resolver = doc->createNSResolver(nullptr);
+        for (const auto& binding : bindings) {
+            resolver->addNamespaceBinding(binding.first.c_str(), binding.second.c_str());
+        }
+    } else if (!doc_wrapper->xerces_resolver) {
+        doc_wrapper->xerces_resolver = doc->createNSResolver(doc);
+    }
+
+    // Cache miss - compile new expression
+    XStr xpath_xstr(xpath_str);
+    DOMXPathExpression* expression;
+    try {
+        expression = doc->createExpression(xpath_xstr.unicodeForm(), resolver ? resolver : doc_wrapper->xerces_resolver);
+    } catch (...) {
+        if (resolver) {
+            resolver->release();
+        }
+        RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
+        throw;
+    }
+
+    // Add to cache
+    doc_wrapper->xerces_xpath_cache_list->push_front(new XercesCompiledXPath(expression, resolver, expr));
+    (*doc_wrapper->xerces_xpath_cache_map)[expr] = doc_wrapper->xerces_xpath_cache_list->begin();
+
+    // Evict if cache is too large
+    if (doc_wrapper->xerces_xpath_cache_list->size() > XERCES_XPATH_CACHE_SIZE) {
+        XercesCompiledXPath* lru = doc_wrapper->xerces_xpath_cache_list->back();
+        doc_wrapper->xerces_xpath_cache_map->erase(lru->source);
+        lru->release();
+        delete lru;
+        doc_wrapper->xerces_xpath_cache_list->pop_back();
+    }
+
+    RXERCES_PROBE2(xpath__compile__done, xpath_str, 0);
+    return expression;
+}
+
+// Evaluate XPath using the Xerces XPath subset, appending matches to nodes.
+// When first_only is set Xerces is asked for the first node in document
+// order only, which lets it stop at that node. Xerces-C has no iterator
+// result types, so any other bounded query is evaluated in full.
+static void select_nodes_with_xerces(DOMNode* context_node, const char* xpath_str, VALUE doc_ref,
+                                     bool first_only, std::vector<DOMNode*>& nodes,
+                                     char* error_message, size_t error_size,
+                                     XPathProfile* profile = nullptr) {
+    try {
+        DocumentWrapper* doc_wrapper;
+        TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+
+        if (!doc_wrapper->doc) {
+            return;
+        }
+
+        native_stats::Timer compile_timer;
+        DOMXPathExpression* expression = get_or_compile_xerces_xpath(doc_wrapper, context_node, xpath_str, profile);
+        if (profile) {
+            profile->compile_nanoseconds = compile_timer.elapsed();
+        }
+        native_stats::Timer execute_timer;
+
+        DOMXPathResult::ResultType type = first_only
+            ? DOMXPathResult::FIRST_ORDERED_NODE_TYPE
+            : DOMXPathResult::ORDERED_NODE_SNAPSHOT_TYPE;
+        DOMXPathResult* result = expression->evaluate(context_node, type, doc_wrapper->xerces_result);
+        doc_wrapper->xerces_result = result;
+
+        if (first_only) {
+            DOMNode* node = result->getNodeValue();
+            if (node) {
+                nodes.push_back(node);
+            }
+            if (profile) {
+                profile->execute_nanoseconds = execute_timer.elapsed();
+            }
+            return;
+        }
+
+        XMLSize_t length = result->getSnapshotLength();
+        nodes.reserve(nodes.size() + length);
+
+        for (XMLSize_t i = 0; i < length; i++) {
+            result->snapshotItem(i);
+            DOMNode* node = result->getNodeValue();
+            if (node) {
+                nodes.push_back(node);
+            }
+        }
+        if (profile) {
+            profile->execute_nanoseconds = execute_timer.elapsed();
+        }
+
+    } catch (const DOMXPathException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, error_size, "XPath error: %s", message.localForm());
+    } catch (const DOMException& e) {
         CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "XML error: %s", message.localForm());
+        snprintf(error_message, error_size, "DOM error: %s", message.localForm());
     } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown XPath error");
+        snprintf(error_message, error_size, "Unknown XPath error");
     }
+}
 
-    NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-    wrapper->nodes_array = rb_ary_new();
-    return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+// Keeps XPath matches from offset on, stopping once limit nodes have been
+// kept (a negative limit keeps everything)
+class NodeCollector : public native_xpath::NodeVisitor {
+public:
+    NodeCollector(std::vector<DOMNode*>& nodes, long offset, long limit)
+        : nodes_(nodes), offset_(offset), limit_(limit), skipped_(0) {}
+
+    bool visit(DOMNode* node) {
+        if (skipped_ < offset_) {
+            skipped_++;
+            return true;
+        }
+        if (limit_ >= 0 && (long)nodes_.size() >= limit_) {
+            return false;
+        }
+        nodes_.push_back(node);
+        return limit_ < 0 || (long)nodes_.size() < limit_;
+    }
+
+private:
+    std::vector<DOMNode*>& nodes_;
+    long offset_;
+    long limit_;
+    long skipped_;
+};
+
+// True if node is scope or lies below it. Attributes belong to the
+// subtree of their owner element.
+static bool node_in_subtree(DOMNode* node, DOMNode* scope) {
+    while (node) {
+        if (node == scope) {
+            return true;
+        }
+        node = node->getNodeType() == DOMNode::ATTRIBUTE_NODE
+            ? static_cast<DOMAttr*>(node)->getOwnerElement()
+            : node->getParentNode();
+    }
+    return false;
 }
 
-// Optimized version that only returns the first matching node (for at_xpath)
-// Avoids creating Ruby wrappers for all nodes when we only need one
-static VALUE execute_xpath_with_xalan_first(DOMNode* context_node, const char* xpath_str, VALUE doc_ref) {
-    // Validate XPath expression before execution
-    validate_xpath_expression(xpath_str);
+// Passes on only the matches inside the subtree of scope
+class SubtreeFilter : public native_xpath::NodeVisitor {
+public:
+    SubtreeFilter(DOMNode* scope, native_xpath::NodeVisitor& next) : scope_(scope), next_(next) {}
+
+    bool visit(DOMNode* node) {
+        return !node_in_subtree(node, scope_) || next_.visit(node);
+    }
+
+private:
+    DOMNode* scope_;
+    native_xpath::NodeVisitor& next_;
+};
+
+struct YieldArgs {
+    DOMNode* node;
+    VALUE doc_ref;
+};
+
+static VALUE yield_xpath_node(VALUE arg) {
+    YieldArgs* args = reinterpret_cast<YieldArgs*>(arg);
+    return rb_yield(wrap_node(args->node, args->doc_ref));
+}
+
+// Yields each XPath match to the block. A raise, break or throw out of the
+// block stops evaluation and is held in state() until the engine has
+// unwound, so no C++ frames are skipped. Evaluation also stops if the
+// block modifies the document, which modified() then reports.
+class NodeYielder : public native_xpath::NodeVisitor {
+public:
+    explicit NodeYielder(VALUE doc_ref) : doc_ref_(doc_ref), state_(0), yielded_(0), modified_(false) {
+        TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper_);
+        mutation_count_ = doc_wrapper_->mutation_count;
+    }
+
+    bool visit(DOMNode* node) {
+        YieldArgs args = { node, doc_ref_ };
+        yielded_++;
+        rb_protect(yield_xpath_node, reinterpret_cast<VALUE>(&args), &state_);
+        if (!state_ && doc_wrapper_->mutation_count != mutation_count_) {
+            modified_ = true;
+        }
+        return state_ == 0 && !modified_;
+    }
+
+    int state() const { return state_; }
+    size_t yielded() const { return yielded_; }
+    bool modified() const { return modified_; }
+
+private:
+    VALUE doc_ref_;
+    DocumentWrapper* doc_wrapper_;
+    unsigned long mutation_count_;
+    int state_;
+    size_t yielded_;
+    bool modified_;
+};
+
+// Pass nodes to visitor until it stops
+static void visit_nodes(const std::vector<DOMNode*>& nodes, native_xpath::NodeVisitor& visitor) {
+    for (DOMNode* node : nodes) {
+        if (!visitor.visit(node)) {
+            break;
+        }
+    }
+}
+
+#ifdef HAVE_XALAN
+// Xalan always evaluates to completion. When the caller only needs the
+// first few matches, expressions the native engine can stream are handed
+// to it instead so evaluation stops at the last node needed.
+static bool native_xpath_streamable(const char* xpath_str) {
+    try {
+        return get_or_compile_native_xpath(xpath_str, nullptr, false)->streamable();
+    } catch (...) {
+        return false;
+    }
+}
+#endif
+
+// How many of the matches the visitor passed to select_xpath will consume
+enum XPathDemand {
+    XPATH_DEMAND_ALL,    // every match
+    XPATH_DEMAND_SOME,   // may stop at any point (limit:, xpath_each)
+    XPATH_DEMAND_FIRST   // only the first match
+};
+
+// Run XPath with the configured engine, passing matches to visitor in
+// document order. Given a profile, the engine records its cache hits and
+// compile and execution times in it. Errors are copied to error_message.
+static void run_xpath(DOMNode* context_node, const char* xpath_str, VALUE doc_ref,
+                      native_xpath::NodeVisitor& visitor, XPathDemand demand,
+                      char* error_message, size_t error_size, XPathProfile* profile = nullptr) {
+    native_stats::count(native_stats::XPATH_QUERIES);
+    native_stats::Timer timer;
+
+    switch (xpath_engine) {
+#ifdef HAVE_XALAN
+        case XPATH_ENGINE_XALAN: {
+            if (demand != XPATH_DEMAND_ALL && native_xpath_streamable(xpath_str)) {
+                visit_nodes_with_native(context_node, xpath_str, visitor, error_message, error_size, profile);
+                break;
+            }
+            std::vector<DOMNode*> nodes;
+            select_nodes_with_xalan(context_node, xpath_str, doc_ref, nodes, error_message, error_size,
+                                    profile);
+            if (!error_message[0]) {
+                visit_nodes(nodes, visitor);
+            }
+            break;
+        }
+#endif
+        case XPATH_ENGINE_XERCES: {
+            std::vector<DOMNode*> nodes;
+            select_nodes_with_xerces(context_node, xpath_str, doc_ref, demand == XPATH_DEMAND_FIRST, nodes,
+                                     error_message, error_size, profile);
+            if (!error_message[0]) {
+                visit_nodes(nodes, visitor);
+            }
+            break;
+        }
+        default:
+            visit_nodes_with_native(context_node, xpath_str, visitor, error_message, error_size, profile);
+            break;
+    }
+    timer.stop(native_stats::XPATH_TIME);
+}
+
+// Raise the error run_xpath copied into error_message. Call only once the
+// C++ objects of the query are out of scope, as the raise skips their
+// destructors.
+static void raise_xpath_error(const char* xpath_str, const char* error_message) {
+    // The caller's xpath__done is skipped by the raise
+    RXERCES_PROBE2(xpath__done, xpath_str, 0);
+    rb_raise(rb_eRuntimeError, "%s", error_message);
+}
+
+// Execute XPath with the configured engine, returning matches from offset
+// on, at most limit of them (a negative limit returns all). Given a scope,
+// only matches in its subtree are kept.
+static VALUE execute_xpath(DOMNode* context_node, const char* xpath_str, VALUE doc_ref,
+                           long offset = 0, long limit = -1, DOMNode* scope = nullptr) {
+    ensure_xerces_initialized();
+
+    XPathDemand demand = XPATH_DEMAND_ALL;
+    if (limit >= 0) {
+        demand = (offset == 0 && limit == 1) ? XPATH_DEMAND_FIRST : XPATH_DEMAND_SOME;
+    }
+
+    char error_message[512] = "";
+    VALUE result = Qnil;
+    RXERCES_PROBE1(xpath__start, xpath_str);
+    {
+        std::vector<DOMNode*> nodes;
+        NodeCollector collector(nodes, offset, limit);
+        if (scope) {
+            // Matches outside scope are skipped, so the first match found
+            // may not be the first one kept
+            SubtreeFilter filter(scope, collector);
+            run_xpath(context_node, xpath_str, doc_ref, filter, demand == XPATH_DEMAND_ALL ? demand : XPATH_DEMAND_SOME,
+                      error_message, sizeof(error_message));
+        } else {
+            run_xpath(context_node, xpath_str, doc_ref, collector, demand, error_message, sizeof(error_message));
+        }
+        if (!error_message[0]) {
+            RXERCES_PROBE2(xpath__done, xpath_str, nodes.size());
+            result = wrap_nodeset(nodes, doc_ref);
+        }
+    }
+    if (error_message[0]) {
+        raise_xpath_error(xpath_str, error_message);
+    }
+    return result;
+}
+
+// Execute XPath with the configured engine, returning only the first match.
+// Only that node is wrapped, and streamable expressions stop evaluating as
+// soon as it is found.
+static VALUE execute_xpath_first(DOMNode* context_node, const char* xpath_str, VALUE doc_ref) {
+    ensure_xerces_initialized();
+
+    char error_message[512] = "";
+    DOMNode* first = nullptr;
+    RXERCES_PROBE1(xpath__start, xpath_str);
+    {
+        std::vector<DOMNode*> nodes;
+        NodeCollector collector(nodes, 0, 1);
+        run_xpath(context_node, xpath_str, doc_ref, collector, XPATH_DEMAND_FIRST, error_message, sizeof(error_message));
+        if (!nodes.empty()) {
+            first = nodes[0];
+        }
+    }
+    if (error_message[0]) {
+        raise_xpath_error(xpath_str, error_message);
+    }
+    RXERCES_PROBE2(xpath__done, xpath_str, first ? 1 : 0);
+    return first ? wrap_node(first, doc_ref) : Qnil;
+}
 
+// Yield each match of an XPath expression to the block, stopping as soon as
+// the block breaks
+static void each_xpath(DOMNode* context_node, const char* xpath_str, VALUE doc_ref) {
     ensure_xerces_initialized();
 
+    char error_message[512] = "";
+    NodeYielder yielder(doc_ref);
+    RXERCES_PROBE1(xpath__start, xpath_str);
+    run_xpath(context_node, xpath_str, doc_ref, yielder, XPATH_DEMAND_SOME, error_message, sizeof(error_message));
+    if (error_message[0]) {
+        raise_xpath_error(xpath_str, error_message);
+    }
+    RXERCES_PROBE2(xpath__done, xpath_str, yielder.yielded());
+    if (yielder.state()) {
+        rb_jump_tag(yielder.state());
+    }
+    if (yielder.modified()) {
+        rb_raise(rb_eRuntimeError, "document modified during iteration");
+    }
+}
+
+// Find or insert the cache entry for a CSS selector and mark it most
+// recently used. Must be called with css_selector_cache_mutex held.
+static CachedCSSSelector& css_selector_cache_entry(const std::string& css) {
+    if (!css_selector_lru_list) {
+        css_selector_lru_list = new std::list<std::string>();
+    }
+    if (!css_selector_cache_map) {
+        css_selector_cache_map = new std::unordered_map<std::string, CachedCSSSelector>();
+    }
+
+    auto it = css_selector_cache_map->find(css);
+    if (it != css_selector_cache_map->end()) {
+        css_selector_lru_list->splice(css_selector_lru_list->begin(), *css_selector_lru_list, it->second.lru_position);
+        return it->second;
+    }
+
+    css_selector_lru_list->push_front(css);
+    CachedCSSSelector& entry = (*css_selector_cache_map)[css];
+    entry.translated = false;
+    entry.lru_position = css_selector_lru_list->begin();
+
+    // Evict if cache is too large; the new entry is at the front
+    if (css_selector_lru_list->size() > CSS_SELECTOR_CACHE_SIZE) {
+        css_selector_cache_map->erase(css_selector_lru_list->back());
+        css_selector_lru_list->pop_back();
+    }
+
+    return entry;
+}
+
+// Get or compile a native CSS selector with LRU caching
+// Throws native_css::Error if the selector does not parse
+static native_css::SelectorPtr get_or_compile_css_selector(const char* css_str) {
+    std::string css(css_str);
+
+    {
+        std::lock_guard<std::mutex> lock(css_selector_cache_mutex);
+        if (css_selector_cache_map) {
+            auto it = css_selector_cache_map->find(css);
+            if (it != css_selector_cache_map->end() && it->second.compiled) {
+                css_selector_lru_list->splice(css_selector_lru_list->begin(), *css_selector_lru_list, it->second.lru_position);
+                return it->second.compiled;
+            }
+        }
+    }
+
+    // Compile outside the lock, as for native XPath expressions
+    native_css::SelectorPtr compiled = native_css::compile(css);
+
+    std::lock_guard<std::mutex> lock(css_selector_cache_mutex);
+    CachedCSSSelector& entry = css_selector_cache_entry(css);
+    if (!entry.compiled) {
+        entry.compiled = compiled;
+    }
+    return entry.compiled;
+}
+
+// Translate a compiled CSS selector to XPath for the :xpath CSS engine,
+// with caching. Throws native_css::Error if it has no translation.
+static std::string get_or_translate_css_selector(const native_css::Selector& selector) {
+    const std::string& css = selector.source();
+
+    {
+        std::lock_guard<std::mutex> lock(css_selector_cache_mutex);
+        if (css_selector_cache_map) {
+            auto it = css_selector_cache_map->find(css);
+            if (it != css_selector_cache_map->end() && it->second.translated) {
+                css_selector_lru_list->splice(css_selector_lru_list->begin(), *css_selector_lru_list, it->second.lru_position);
+                return it->second.xpath;
+            }
+        }
+    }
+
+    std::string xpath = native_css::to_xpath(selector);
+
+    std::lock_guard<std::mutex> lock(css_selector_cache_mutex);
+    CachedCSSSelector& entry = css_selector_cache_entry(css);
+    entry.xpath = xpath;
+    entry.translated = true;
+    return xpath;
+}
+
+// Get the compiled form of a CSS selector argument, which may be a String
+// or an RXerces::XML::Selector. Raises ArgumentError if it does not parse.
+static native_css::SelectorPtr css_selector_from_value(VALUE selector) {
+    if (rb_typeddata_is_kind_of(selector, &selector_type)) {
+        SelectorWrapper* wrapper;
+        TypedData_Get_Struct(selector, SelectorWrapper, &selector_type, wrapper);
+        return *wrapper->selector;
+    }
+
+    Check_Type(selector, T_STRING);
+    const char* css_str = StringValueCStr(selector);
+    char error_message[512] = {0};
+
     try {
-        // Get the document wrapper
-        DocumentWrapper* doc_wrapper;
-        TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+        return get_or_compile_css_selector(css_str);
+    } catch (const native_css::Error& e) {
+        snprintf(error_message, sizeof(error_message), "Invalid CSS selector: %s", e.what());
+    } catch (const std::bad_alloc&) {
+        snprintf(error_message, sizeof(error_message), "Invalid CSS selector: out of memory");
+    } catch (...) {
+        snprintf(error_message, sizeof(error_message), "Invalid CSS selector: unknown error");
+    }
 
-        DOMDocument* domDoc = doc_wrapper->doc;
-        if (!domDoc) {
-            return Qnil;
+    rb_raise(rb_eArgError, "%s", error_message);
+    return native_css::SelectorPtr(); // not reached
+}
+
+// XPath translation of a CSS selector argument (String or Selector), as a
+// Ruby string for the :xpath CSS engine. The translation is relative to the
+// node it is evaluated at. Raises ArgumentError for selectors that do not
+// parse or have no XPath equivalent.
+static VALUE css_selector_to_xpath(VALUE selector) {
+    char error_message[512] = {0};
+    std::string xpath;
+
+    {
+        native_css::SelectorPtr compiled = css_selector_from_value(selector);
+        try {
+            xpath = get_or_translate_css_selector(*compiled);
+        } catch (const native_css::Error& e) {
+            snprintf(error_message, sizeof(error_message), "Invalid CSS selector: %s", e.what());
+        } catch (const std::bad_alloc&) {
+            snprintf(error_message, sizeof(error_message), "Invalid CSS selector: out of memory");
+        } catch (...) {
+            snprintf(error_message, sizeof(error_message), "Invalid CSS selector: unknown error");
         }
+    }
 
-        // Get or create cached Xalan context
-        XalanContext* ctx = get_or_create_xalan_context(doc_wrapper);
-        if (!ctx) {
-            rb_raise(rb_eRuntimeError, "Failed to create Xalan context");
+    if (error_message[0]) {
+        rb_raise(rb_eArgError, "%s", error_message);
+    }
+    return rb_utf8_str_new(xpath.data(), xpath.length());
+}
+
+// Select the descendants of scope matching a CSS selector with the :xpath
+// engine. The translation is evaluated at scope, so
+// only its subtree is walked; combinators may still match ancestors
+// outside it, as with the native engine.
+static VALUE select_css_with_xpath(DOMNode* scope, VALUE selector, VALUE doc_ref) {
+    VALUE path = css_selector_to_xpath(selector);
+    VALUE result = execute_xpath(scope, StringValueCStr(path), doc_ref);
+    RB_GC_GUARD(path);
+    return result;
+}
+
+// Select the descendants of scope matching a compiled CSS selector,
+// stopping after limit matches. Errors are copied into error_message.
+static void select_css(DOMNode* scope, const native_css::Selector& selector, std::vector<DOMNode*>& nodes,
+                       char* error_message, size_t error_size, size_t limit = (size_t)-1) {
+    ensure_xerces_initialized();
+
+    try {
+        native_css::select(selector, scope, nodes, limit);
+    } catch (const DOMException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, error_size, "CSS error: %s", message.localForm());
+    } catch (const std::bad_alloc&) {
+        snprintf(error_message, error_size, "CSS error: out of memory");
+    } catch (...) {
+        snprintf(error_message, error_size, "CSS error: unknown error");
+    }
+}
+
+// Select the descendants of scope (which may be null) matching a CSS
+// selector argument with the native engine: all of them as a NodeSet, or
+// with first_only the first one or nil. Errors are raised once the
+// selector and the matches are out of scope, as the raise skips their
+// destructors.
+static VALUE select_css_with_native(DOMNode* scope, VALUE selector, VALUE doc_ref, bool first_only) {
+    char error_message[512] = {0};
+    VALUE result = Qnil;
+
+    {
+        native_css::SelectorPtr compiled = css_selector_from_value(selector);
+        std::vector<DOMNode*> nodes;
+        if (scope) {
+            select_css(scope, *compiled, nodes, error_message, sizeof(error_message), first_only ? 1 : (size_t)-1);
+        }
+        if (error_message[0] == '\0') {
+            if (first_only) {
+                result = nodes.empty() ? Qnil : wrap_node(nodes[0], doc_ref);
+            } else {
+                result = wrap_nodeset(nodes, doc_ref);
+            }
+        }
+    }
+
+    if (error_message[0] != '\0') {
+        rb_raise(rb_eRuntimeError, "%s", error_message);
+    }
+    return result;
+}
+
+// Parse the limit: and offset: options of xpath()
+static void parse_xpath_options(VALUE options, long* offset, long* limit) {
+    *offset = 0;
+    *limit = -1;
+
+    if (NIL_P(options)) {
+        return;
+    }
+
+    validate_option_keys(options, { "limit", "offset" });
+
+    VALUE limit_val = rb_hash_aref(options, ID2SYM(rb_intern("limit")));
+    if (!NIL_P(limit_val)) {
+        if (!RB_INTEGER_TYPE_P(limit_val)) {
+            rb_raise(rb_eTypeError, "limit must be an Integer");
+        }
+        *limit = NUM2LONG(limit_val);
+        if (*limit < 0) {
+            rb_raise(rb_eArgError, "limit must not be negative");
         }
+    }
 
-        // Map the context node to Xalan
-        XalanNode* xalanContextNode = ctx->docWrapper->mapNode(context_node);
-        if (!xalanContextNode) {
-            xalanContextNode = ctx->docWrapper;
+    VALUE offset_val = rb_hash_aref(options, ID2SYM(rb_intern("offset")));
+    if (!NIL_P(offset_val)) {
+        if (!RB_INTEGER_TYPE_P(offset_val)) {
+            rb_raise(rb_eTypeError, "offset must be an Integer");
+        }
+        *offset = NUM2LONG(offset_val);
+        if (*offset < 0) {
+            rb_raise(rb_eArgError, "offset must not be negative");
         }
+    }
+}
+
+// document.xpath(path, limit: nil, offset: 0)
+static VALUE document_xpath(int argc, VALUE* argv, VALUE self) {
+    VALUE path, options;
+    rb_scan_args(argc, argv, "11", &path, &options);
+
+    long offset, limit;
+    parse_xpath_options(options, &offset, &limit);
+
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+
+    if (!doc_wrapper->doc) {
+        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
+        wrapper->nodes_array = rb_ary_new();
+        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+    }
+
+    Check_Type(path, T_STRING);
+    const char* xpath_str = StringValueCStr(path);
+
+    // Validate XPath expression before execution
+    validate_xpath_expression(xpath_str);
+
+    DOMElement* root = doc_wrapper->doc->getDocumentElement();
+    if (!root) {
+        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
+        wrapper->nodes_array = rb_ary_new();
+        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+    }
+
+    return execute_xpath(root, xpath_str, self, offset, limit);
+}
+
+// document.xpath_profile(path) - runs the query as xpath does and reports
+// the cache hits, compile, execution and wrapping times of the configured
+// engine. The plan and the per-step node counts come from the native
+// engine, as plan_engine says: from the timed run when it is the configured
+// engine, otherwise from a second, untimed pass that leaves RXerces.stats
+// alone. They are nil if it cannot run the expression.
+static VALUE document_xpath_profile(VALUE self, VALUE path) {
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+
+    if (!doc_wrapper->doc) {
+        return Qnil;
+    }
+
+    Check_Type(path, T_STRING);
+    const char* xpath_str = StringValueCStr(path);
+
+    ensure_xerces_initialized();
+
+    XPathProfile profile;
+    validate_xpath_expression(xpath_str, &profile);
+
+    DOMElement* root = doc_wrapper->doc->getDocumentElement();
+    DOMNode* context = root ? static_cast<DOMNode*>(root) : static_cast<DOMNode*>(doc_wrapper->doc);
+
+    char error_message[512] = "";
+    size_t result_count = 0;
+    uint64_t wrap_nanoseconds = 0;
+    VALUE plan = Qnil;
+    VALUE steps = Qnil;
+    {
+        XPathPlan native_plan;
+        profile.plan = &native_plan;
+        std::vector<DOMNode*> nodes;
+        NodeCollector collector(nodes, 0, -1);
+        run_xpath(context, xpath_str, self, collector, XPATH_DEMAND_ALL, error_message, sizeof(error_message),
+                  &profile);
+        profile.plan = nullptr;
+
+        if (!error_message[0]) {
+            native_stats::Timer wrap_timer;
+            VALUE result = wrap_nodeset(nodes, self);
+            wrap_nanoseconds = wrap_timer.elapsed();
+            RB_GC_GUARD(result);
+            result_count = nodes.size();
+
+            // Xalan and Xerces leave the plan to a pass of the native engine
+            if (!native_plan.planned) {
+                try {
+                    native_xpath::CompiledExpressionPtr compiled = get_or_compile_native_xpath(xpath_str, nullptr, false);
+                    native_xpath::Profile step_profile(*compiled);
+                    std::vector<DOMNode*> counted;
+                    NodeCollector counter(counted, 0, -1);
+                    native_xpath::for_each_node(*compiled, context, counter, &step_profile);
+                    native_plan.text = step_profile.plan();
+                    native_plan.steps = step_profile.steps();
+                    native_plan.planned = true;
+                } catch (...) {
+                    // Beyond the native engine; the timings still stand
+                }
+            }
 
-        // Get or compile XPath expression (cached)
-        XPath* xpath = get_or_compile_xpath(doc_wrapper, ctx, xpath_str);
-
-        // Create resolver for execution
-        XalanElement* docElem = ctx->docWrapper->getDocumentElement();
-        ElementPrefixResolverProxy resolver(docElem, *ctx->envSupport, *ctx->domSupport);
-
-        // Reset execution context for clean state
-        ctx->objectFactory->reset();
-
-        // Execute XPath query
-        const XObjectPtr result = xpath->execute(xalanContextNode, resolver, *ctx->executionContext);
-
-        if (result.get() != 0) {
-            // Check if result is a node set
-            const NodeRefListBase& nodeList = result->nodeset();
-            if (nodeList.getLength() > 0) {
-                XalanNode* xalanNode = nodeList.item(0);
-                if (xalanNode) {
-                    // Map back to Xerces DOM node - only wrap the first one!
-                    const DOMNode* domNode = ctx->docWrapper->mapNode(xalanNode);
-                    if (domNode) {
-                        return wrap_node(const_cast<DOMNode*>(domNode), doc_ref);
-                    }
+            if (native_plan.planned) {
+                plan = rb_utf8_str_new(native_plan.text.data(), (long)native_plan.text.size());
+                steps = rb_ary_new();
+                for (const native_xpath::StepProfile& step : native_plan.steps) {
+                    VALUE entry = rb_hash_new();
+                    rb_hash_aset(entry, ID2SYM(rb_intern("step")), rb_utf8_str_new(step.step.data(), (long)step.step.size()));
+                    rb_hash_aset(entry, ID2SYM(rb_intern("contexts")), ULONG2NUM(step.contexts));
+                    rb_hash_aset(entry, ID2SYM(rb_intern("visited")), ULONG2NUM(step.visited));
+                    rb_hash_aset(entry, ID2SYM(rb_intern("selected")), ULONG2NUM(step.selected));
+                    rb_ary_push(steps, entry);
                 }
             }
         }
+    }
 
-        return Qnil;
-
-    } catch (const XalanXPathException& e) {
-        CharStr msg(e.getMessage().c_str());
-        rb_raise(rb_eRuntimeError, "XPath error: %s", msg.localForm());
-    } catch (const XMLException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "XML error: %s", message.localForm());
-    } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown XPath error");
+    if (error_message[0]) {
+        rb_raise(rb_eRuntimeError, "%s", error_message);
     }
 
-    return Qnil;
+    VALUE report = rb_hash_new();
+    rb_hash_aset(report, ID2SYM(rb_intern("engine")), rxerces_xpath_engine(Qnil));
+    rb_hash_aset(report, ID2SYM(rb_intern("plan")), plan);
+    rb_hash_aset(report, ID2SYM(rb_intern("plan_engine")), NIL_P(plan) ? Qnil : ID2SYM(rb_intern("native")));
+    rb_hash_aset(report, ID2SYM(rb_intern("validation_cache_hit")), profile.validation_cache_hit ? Qtrue : Qfalse);
+    rb_hash_aset(report, ID2SYM(rb_intern("compile_cache_hit")), profile.compile_cache_hit ? Qtrue : Qfalse);
+    rb_hash_aset(report, ID2SYM(rb_intern("compile_time")), DBL2NUM(profile.compile_nanoseconds / 1e9));
+    rb_hash_aset(report, ID2SYM(rb_intern("execution_time")), DBL2NUM(profile.execute_nanoseconds / 1e9));
+    rb_hash_aset(report, ID2SYM(rb_intern("steps")), steps);
+    rb_hash_aset(report, ID2SYM(rb_intern("result_count")), SIZET2NUM(result_count));
+    rb_hash_aset(report, ID2SYM(rb_intern("wrap_time")), DBL2NUM(wrap_nanoseconds / 1e9));
+    return report;
 }
-#endif
 
-// document.xpath(path)
-static VALUE document_xpath(VALUE self, VALUE path) {
+// document.xpath_each(path) { |node| ... } - yields matches in document order
+// without building a NodeSet; breaking out of the block stops evaluation
+static VALUE document_xpath_each(VALUE self, VALUE path) {
+    RETURN_ENUMERATOR(self, 1, &path);
+
     DocumentWrapper* doc_wrapper;
     TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
 
     if (!doc_wrapper->doc) {
-        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-        wrapper->nodes_array = rb_ary_new();
-        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
+        return self;
     }
 
     Check_Type(path, T_STRING);
@@ -1313,68 +3308,12 @@ static VALUE document_xpath(VALUE self, VALUE path) {
     // Validate XPath expression before execution
     validate_xpath_expression(xpath_str);
 
-#ifdef HAVE_XALAN
-    // Use Xalan for full XPath 1.0 support
     DOMElement* root = doc_wrapper->doc->getDocumentElement();
-    if (!root) {
-        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-        wrapper->nodes_array = rb_ary_new();
-        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-    }
-    return execute_xpath_with_xalan(root, xpath_str, self);
-#else
-    // Fall back to Xerces XPath subset
-    try {
-        DOMElement* root = doc_wrapper->doc->getDocumentElement();
-        if (!root) {
-            NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-            wrapper->nodes_array = rb_ary_new();
-            return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-        }
-
-        DOMXPathNSResolver* resolver = doc_wrapper->doc->createNSResolver(root);
-        XStr xpath_xstr(xpath_str);
-        DOMXPathExpression* expression = doc_wrapper->doc->createExpression(
-            xpath_xstr.unicodeForm(), resolver);
-
-        DOMXPathResult* result = expression->evaluate(
-            doc_wrapper->doc->getDocumentElement(),
-            DOMXPathResult::ORDERED_NODE_SNAPSHOT_TYPE,
-            NULL);
-
-        VALUE nodes_array = rb_ary_new();
-        XMLSize_t length = result->getSnapshotLength();
-
-        for (XMLSize_t i = 0; i < length; i++) {
-            result->snapshotItem(i);
-            DOMNode* node = result->getNodeValue();
-            if (node) {
-                rb_ary_push(nodes_array, wrap_node(node, self));
-            }
-        }
-
-        expression->release();
-        resolver->release();
-        result->release();
-
-        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-        wrapper->nodes_array = nodes_array;
-        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-
-    } catch (const DOMXPathException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "XPath error: %s", message.localForm());
-    } catch (const DOMException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "DOM error: %s", message.localForm());
-    } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown XPath error");
+    if (root) {
+        each_xpath(root, xpath_str, self);
     }
 
-    NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-    wrapper->nodes_array = rb_ary_new();
-    return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-#endif
+    return self;
 }
 
 // document.at_xpath(path) - returns first matching node or nil
@@ -1392,73 +3331,50 @@ static VALUE document_at_xpath(VALUE self, VALUE path) {
     // Validate XPath expression before execution
     validate_xpath_expression(xpath_str);
 
-#ifdef HAVE_XALAN
-    // Use optimized first-only version
     DOMElement* root = doc_wrapper->doc->getDocumentElement();
     if (!root) {
         return Qnil;
     }
-    return execute_xpath_with_xalan_first(root, xpath_str, self);
-#else
-    // Fall back to getting all results and returning first
-    VALUE nodeset = document_xpath(self, path);
-    NodeSetWrapper* wrapper;
-    TypedData_Get_Struct(nodeset, NodeSetWrapper, &nodeset_type, wrapper);
-
-    if (RARRAY_LEN(wrapper->nodes_array) == 0) {
-        return Qnil;
-    }
 
-    return rb_ary_entry(wrapper->nodes_array, 0);
-#endif
+    // Use optimized first-only version
+    return execute_xpath_first(root, xpath_str, self);
 }
 
-// document.css(selector) - Convert CSS to XPath and execute
+// document.css(selector) - all elements matching a CSS selector
 static VALUE document_css(VALUE self, VALUE selector) {
-    Check_Type(selector, T_STRING);
-    const char* css_str = StringValueCStr(selector);
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
 
-    // Convert CSS to XPath
-    std::string xpath_str = css_to_xpath(css_str);
+    if (css_engine == CSS_ENGINE_NATIVE) {
+        return select_css_with_native(doc_wrapper->doc, selector, self, false);
+    }
 
-    // Call the xpath method with converted selector
-    return document_xpath(self, rb_str_new2(xpath_str.c_str()));
+    if (!doc_wrapper->doc) {
+        css_selector_to_xpath(selector);
+        return wrap_nodeset(std::vector<DOMNode*>(), self);
+    }
+    return select_css_with_xpath(doc_wrapper->doc, selector, self);
 }
 
 // document.at_css(selector) - Returns first matching node
 static VALUE document_at_css(VALUE self, VALUE selector) {
-    Check_Type(selector, T_STRING);
-    const char* css_str = StringValueCStr(selector);
-
-    // Convert CSS to XPath
-    std::string xpath_str = css_to_xpath(css_str);
-
-#ifdef HAVE_XALAN
     DocumentWrapper* doc_wrapper;
     TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
 
-    if (!doc_wrapper->doc) {
-        return Qnil;
-    }
-
-    // Use optimized first-only version
-    DOMElement* root = doc_wrapper->doc->getDocumentElement();
-    if (!root) {
-        return Qnil;
+    if (css_engine == CSS_ENGINE_NATIVE) {
+        return select_css_with_native(doc_wrapper->doc, selector, self, true);
     }
-    return execute_xpath_with_xalan_first(root, xpath_str.c_str(), self);
-#else
-    VALUE nodeset = document_css(self, selector);
 
-    NodeSetWrapper* wrapper;
-    TypedData_Get_Struct(nodeset, NodeSetWrapper, &nodeset_type, wrapper);
+    VALUE path = css_selector_to_xpath(selector);
 
-    if (RARRAY_LEN(wrapper->nodes_array) == 0) {
+    if (!doc_wrapper->doc) {
         return Qnil;
     }
 
-    return rb_ary_entry(wrapper->nodes_array, 0);
-#endif
+    // Use optimized first-only version
+    VALUE found = execute_xpath_first(doc_wrapper->doc, StringValueCStr(path), self);
+    RB_GC_GUARD(path);
+    return found;
 }
 
 // node.inspect - human-readable representation
@@ -1631,9 +3547,19 @@ static VALUE node_text_set(VALUE self, VALUE text) {
 
     Check_Type(text, T_STRING);
     const char* text_str = StringValueCStr(text);
+    check_tree_writable(wrapper->node);
+
+    native_source::SourceMap* source = document_source(wrapper->doc_ref);
+    if (source) {
+        source->forget_descendants(wrapper->node);
+    }
 
     XStr text_xstr(text_str);
     wrapper->node->setTextContent(text_xstr.unicodeForm());
+    document_modified(wrapper->doc_ref);
+    if (source) {
+        source->content_changed(wrapper->node);
+    }
 
     return text;
 }
@@ -1676,12 +3602,21 @@ static VALUE node_set_attribute(VALUE self, VALUE attr_name, VALUE attr_value) {
 
     const char* attr_str = StringValueCStr(attr_name);
     const char* value_str = StringValueCStr(attr_value);
+    check_tree_writable(wrapper->node);
 
     DOMElement* element = dynamic_cast<DOMElement*>(wrapper->node);
     XStr attr_xstr(attr_str);
     XStr value_xstr(value_str);
     element->setAttribute(attr_xstr.unicodeForm(), value_xstr.unicodeForm());
 
+    // Also bumps the mutation count, which xmlns attributes matter to for
+    // prefix resolution
+    document_modified(wrapper->doc_ref);
+    native_source::SourceMap* source = document_source(wrapper->doc_ref);
+    if (source) {
+        source->attributes_changed(element);
+    }
+
     return attr_value;
 }
 
@@ -1705,105 +3640,420 @@ static VALUE node_has_attribute_p(VALUE self, VALUE attr_name) {
         return Qfalse;
     }
 
-    return Qtrue;
+    return Qtrue;
+}
+
+// node.children - a new Array wrapping every child, so O(n) per call even
+// when the node has a child index; child_at and child_count use the index
+static VALUE node_children(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return rb_ary_new();
+    }
+
+    VALUE doc_ref = wrapper->doc_ref;
+
+    // Pre-size array for better performance
+    VALUE children = rb_ary_new_capa(count_children(wrapper->node));
+
+    // Follow sibling pointers; DOMNodeList::item(i) walks from the first child
+    for (DOMNode* child = wrapper->node->getFirstChild(); child; child = child->getNextSibling()) {
+        rb_ary_push(children, wrap_node(child, doc_ref));
+    }
+
+    return children;
+}
+
+// node.element_children - returns only element children (no text nodes)
+static VALUE node_element_children(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return rb_ary_new();
+    }
+
+    VALUE doc_ref = wrapper->doc_ref;
+    VALUE children = rb_ary_new();
+
+    for (DOMNode* child = wrapper->node->getFirstChild(); child; child = child->getNextSibling()) {
+        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
+            rb_ary_push(children, wrap_node(child, doc_ref));
+        }
+    }
+
+    return children;
+}
+
+// node.first_element_child - returns first element child
+static VALUE node_first_element_child(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return Qnil;
+    }
+
+    VALUE doc_ref = wrapper->doc_ref;
+    for (DOMNode* child = wrapper->node->getFirstChild(); child; child = child->getNextSibling()) {
+        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
+            return wrap_node(child, doc_ref);
+        }
+    }
+
+    return Qnil;
+}
+
+// node.last_element_child - returns last element child
+static VALUE node_last_element_child(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return Qnil;
+    }
+
+    VALUE doc_ref = wrapper->doc_ref;
+    // Search backwards for last element
+    for (DOMNode* child = wrapper->node->getLastChild(); child; child = child->getPreviousSibling()) {
+        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
+            return wrap_node(child, doc_ref);
+        }
+    }
+
+    return Qnil;
+}
+
+// node.child_at(index) - child at index (negative counts from the end), or nil
+static VALUE node_child_at(VALUE self, VALUE index) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    long i = NUM2LONG(index);
+
+    if (!wrapper->node) {
+        return Qnil;
+    }
+
+    VALUE doc_ref = wrapper->doc_ref;
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+
+    const std::vector<DOMNode*>* children = child_index(doc_wrapper, wrapper->node);
+    if (children) {
+        long count = (long)children->size();
+        if (i < 0) {
+            i += count;
+        }
+        return (i >= 0 && i < count) ? wrap_node((*children)[i], doc_ref) : Qnil;
+    }
+
+    // Few children, walk them
+    if (i < 0) {
+        i += count_children(wrapper->node);
+        if (i < 0) {
+            return Qnil;
+        }
+    }
+
+    DOMNode* child = wrapper->node->getFirstChild();
+    while (child && i > 0) {
+        child = child->getNextSibling();
+        i--;
+    }
+
+    return child ? wrap_node(child, doc_ref) : Qnil;
+}
+
+// node.child_count - number of child nodes, without building an array
+static VALUE node_child_count(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return INT2FIX(0);
+    }
+
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(wrapper->doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+
+    const std::vector<DOMNode*>* children = child_index(doc_wrapper, wrapper->node);
+    return LONG2NUM(children ? (long)children->size() : count_children(wrapper->node));
+}
+
+// Filters and order for the traversal iterators
+struct TraversalOptions {
+    bool postorder;
+    int node_type;       // 0 matches every node type
+    VALUE name;          // UTF-16 node name to match, or Qnil
+    size_t name_length;  // in XMLCh
+};
+
+static int node_type_from_symbol(VALUE type) {
+    if (!SYMBOL_P(type)) {
+        rb_raise(rb_eTypeError, "type must be a Symbol");
+    }
+
+    ID id = SYM2ID(type);
+    if (id == rb_intern("element")) return DOMNode::ELEMENT_NODE;
+    if (id == rb_intern("text")) return DOMNode::TEXT_NODE;
+    if (id == rb_intern("cdata")) return DOMNode::CDATA_SECTION_NODE;
+    if (id == rb_intern("entity_reference")) return DOMNode::ENTITY_REFERENCE_NODE;
+    if (id == rb_intern("processing_instruction")) return DOMNode::PROCESSING_INSTRUCTION_NODE;
+    if (id == rb_intern("comment")) return DOMNode::COMMENT_NODE;
+    if (id == rb_intern("document_type")) return DOMNode::DOCUMENT_TYPE_NODE;
+
+    rb_raise(rb_eArgError, "unknown node type: %s (expected :element, :text, :cdata, :entity_reference, "
+             ":processing_instruction, :comment or :document_type)", rb_id2name(id));
+    return 0;
+}
+
+// Parse the order:, type: and name: options of the traversal iterators
+static void parse_traversal_options(VALUE options, bool default_postorder, TraversalOptions* result) {
+    result->postorder = default_postorder;
+    result->node_type = 0;
+    result->name = Qnil;
+    result->name_length = 0;
+
+    if (NIL_P(options)) {
+        return;
+    }
+
+    validate_option_keys(options, { "order", "type", "name" });
+
+    VALUE order = rb_hash_aref(options, ID2SYM(rb_intern("order")));
+    if (!NIL_P(order)) {
+        if (order == ID2SYM(rb_intern("pre"))) {
+            result->postorder = false;
+        } else if (order == ID2SYM(rb_intern("post"))) {
+            result->postorder = true;
+        } else {
+            rb_raise(rb_eArgError, "order must be :pre or :post");
+        }
+    }
+
+    VALUE type = rb_hash_aref(options, ID2SYM(rb_intern("type")));
+    if (!NIL_P(type)) {
+        result->node_type = node_type_from_symbol(type);
+    }
+
+    VALUE name = rb_hash_aref(options, ID2SYM(rb_intern("name")));
+    if (!NIL_P(name)) {
+        Check_Type(name, T_STRING);
+
+        // Keep the UTF-16 form in a Ruby string so that nothing needs
+        // freeing if the block breaks out of the traversal
+        native_xpath::XString xname = native_xpath::utf8_to_xstring(RSTRING_PTR(name), RSTRING_LEN(name));
+        result->name = rb_str_new((const char*)xname.c_str(), (long)(xname.length() * sizeof(XMLCh)));
+        result->name_length = xname.length();
+    }
+}
+
+static bool traversal_matches(DOMNode* node, const TraversalOptions& options) {
+    if (options.node_type && node->getNodeType() != options.node_type) {
+        return false;
+    }
+
+    if (!NIL_P(options.name)) {
+        const XMLCh* name = node->getNodeName();
+        const XMLCh* wanted = (const XMLCh*)RSTRING_PTR(options.name);
+        for (size_t i = 0; i < options.name_length; i++) {
+            if (name[i] != wanted[i]) {
+                return false;
+            }
+        }
+        return name[options.name_length] == 0;
+    }
+
+    return true;
+}
+
+static DOMNode* first_leaf(DOMNode* node) {
+    while (node->getFirstChild()) {
+        node = node->getFirstChild();
+    }
+    return node;
+}
+
+// Yield the nodes below scope (and scope itself if include_scope) that
+// match the options, in pre- or post-order, without building any arrays.
+// The block may break out; modifying the document raises.
+static void traverse_subtree(DOMNode* scope, bool include_scope, const TraversalOptions& options, VALUE doc_ref) {
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+    unsigned long mutation_count = doc_wrapper->mutation_count;
+    VALUE name = options.name;
+
+    DOMNode* node;
+    if (options.postorder) {
+        node = first_leaf(scope);
+    } else {
+        node = include_scope ? scope : scope->getFirstChild();
+    }
+
+    while (node) {
+        if (node == scope && !include_scope) {
+            break;
+        }
+
+        if (traversal_matches(node, options)) {
+            rb_yield(wrap_node(node, doc_ref));
+            if (doc_wrapper->mutation_count != mutation_count) {
+                rb_raise(rb_eRuntimeError, "document modified during traversal");
+            }
+        }
+
+        if (options.postorder) {
+            if (node == scope) {
+                break;
+            }
+            DOMNode* sibling = node->getNextSibling();
+            node = sibling ? first_leaf(sibling) : node->getParentNode();
+        } else {
+            DOMNode* next = node->getFirstChild();
+            while (!next && node != scope) {
+                next = node->getNextSibling();
+                if (!next) {
+                    node = node->getParentNode();
+                }
+            }
+            node = next;
+        }
+    }
+
+    RB_GC_GUARD(name);
 }
 
-// node.children
-static VALUE node_children(VALUE self) {
+// node.traverse(order: :post, type: nil, name: nil) { |node| ... } - yields
+// this node and its descendants, children before parents by default
+static VALUE node_traverse(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    TraversalOptions traversal;
+    parse_traversal_options(options, true, &traversal);
+
     NodeWrapper* wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
-    if (!wrapper->node) {
-        return rb_ary_new();
+    if (wrapper->node) {
+        traverse_subtree(wrapper->node, true, traversal, wrapper->doc_ref);
     }
 
-    VALUE doc_ref = wrapper->doc_ref;
-
-    DOMNodeList* child_nodes = wrapper->node->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
+    return self;
+}
 
-    // Pre-size array for better performance
-    VALUE children = rb_ary_new_capa((long)count);
+// node.each_descendant(order: :pre, type: nil, name: nil) { |node| ... }
+static VALUE node_each_descendant(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
 
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
-        rb_ary_push(children, wrap_node(child, doc_ref));
-    }
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
 
-    return children;
-}
+    TraversalOptions traversal;
+    parse_traversal_options(options, false, &traversal);
 
-// node.element_children - returns only element children (no text nodes)
-static VALUE node_element_children(VALUE self) {
     NodeWrapper* wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
-    if (!wrapper->node) {
-        return rb_ary_new();
+    if (wrapper->node) {
+        traverse_subtree(wrapper->node, false, traversal, wrapper->doc_ref);
     }
 
-    VALUE doc_ref = wrapper->doc_ref;
-    DOMNodeList* child_nodes = wrapper->node->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
+    return self;
+}
 
-    // Pre-size array (may be smaller than count, but good estimate)
-    VALUE children = rb_ary_new_capa((long)count);
+// Shared by Node#each_element and Document#each_element
+static void parse_each_element_args(int argc, VALUE* argv, TraversalOptions* traversal) {
+    VALUE name, options;
+    rb_scan_args(argc, argv, "02", &name, &options);
 
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
-        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
-            rb_ary_push(children, wrap_node(child, doc_ref));
+    // each_element(order: :post) passes the options as the only argument
+    if (NIL_P(options) && RB_TYPE_P(name, T_HASH)) {
+        options = name;
+        name = Qnil;
+    }
+
+    if (!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        if (!NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("name")))) ||
+            !NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("type"))))) {
+            rb_raise(rb_eArgError, "each_element takes the name as its first argument and only the order: option");
         }
     }
 
-    return children;
+    parse_traversal_options(options, false, traversal);
+    traversal->node_type = DOMNode::ELEMENT_NODE;
+
+    if (!NIL_P(name)) {
+        VALUE name_option = rb_hash_new();
+        rb_hash_aset(name_option, ID2SYM(rb_intern("name")), name);
+
+        TraversalOptions named;
+        parse_traversal_options(name_option, false, &named);
+        traversal->name = named.name;
+        traversal->name_length = named.name_length;
+    }
 }
 
-// node.first_element_child - returns first element child
-static VALUE node_first_element_child(VALUE self) {
+// node.each_element(name = nil, order: :pre) { |element| ... } - descendant
+// elements, optionally only those with the given name
+static VALUE node_each_element(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    TraversalOptions traversal;
+    parse_each_element_args(argc, argv, &traversal);
+
     NodeWrapper* wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
-    if (!wrapper->node) {
-        return Qnil;
+    if (wrapper->node) {
+        traverse_subtree(wrapper->node, false, traversal, wrapper->doc_ref);
     }
 
-    VALUE doc_ref = wrapper->doc_ref;
-    DOMNodeList* child_nodes = wrapper->node->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
+    return self;
+}
 
-    for (XMLSize_t i = 0; i < count; i++) {
-        DOMNode* child = child_nodes->item(i);
-        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
-            return wrap_node(child, doc_ref);
-        }
+// document.traverse(order: :post, type: nil, name: nil) { |node| ... } -
+// yields every node in the document
+static VALUE document_traverse(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    TraversalOptions traversal;
+    parse_traversal_options(options, true, &traversal);
+
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+
+    if (doc_wrapper->doc) {
+        traverse_subtree(doc_wrapper->doc, false, traversal, self);
     }
 
-    return Qnil;
+    return self;
 }
 
-// node.last_element_child - returns last element child
-static VALUE node_last_element_child(VALUE self) {
-    NodeWrapper* wrapper;
-    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+// document.each_element(name = nil, order: :pre) { |element| ... }
+static VALUE document_each_element(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
 
-    if (!wrapper->node) {
-        return Qnil;
-    }
+    TraversalOptions traversal;
+    parse_each_element_args(argc, argv, &traversal);
 
-    VALUE doc_ref = wrapper->doc_ref;
-    DOMNodeList* child_nodes = wrapper->node->getChildNodes();
-    XMLSize_t count = child_nodes->getLength();
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
 
-    // Search backwards for last element
-    for (XMLSize_t i = count; i > 0; i--) {
-        DOMNode* child = child_nodes->item(i - 1);
-        if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
-            return wrap_node(child, doc_ref);
-        }
+    if (doc_wrapper->doc) {
+        traverse_subtree(doc_wrapper->doc, false, traversal, self);
     }
 
-    return Qnil;
+    return self;
 }
 
 // node.document - returns the document that owns this node
@@ -1850,6 +4100,12 @@ static VALUE node_ancestors(int argc, VALUE* argv, VALUE self) {
         return ancestors;
     }
 
+    // Each ancestor is tested against the compiled selector directly
+    native_css::SelectorPtr compiled;
+    if (!NIL_P(selector)) {
+        compiled = css_selector_from_value(selector);
+    }
+
     VALUE doc_ref = wrapper->doc_ref;
     DOMNode* current = wrapper->node->getParentNode();
 
@@ -1859,53 +4115,85 @@ static VALUE node_ancestors(int argc, VALUE* argv, VALUE self) {
         if (current->getNodeType() == DOMNode::DOCUMENT_NODE) {
             break;
         }
-        rb_ary_push(ancestors, wrap_node(current, doc_ref));
+        if (!compiled || (current->getNodeType() == DOMNode::ELEMENT_NODE &&
+                          native_css::matches(*compiled, static_cast<DOMElement*>(current)))) {
+            rb_ary_push(ancestors, wrap_node(current, doc_ref));
+        }
         current = current->getParentNode();
     }
 
-    // If selector is provided, filter the ancestors
-    if (!NIL_P(selector)) {
-        Check_Type(selector, T_STRING);
-        const char* selector_str = StringValueCStr(selector);
+    return ancestors;
+}
 
-        // Convert CSS to XPath if needed (css_to_xpath adds // prefix)
-        std::string xpath_str = css_to_xpath(selector_str);
+// True if ancestor lies strictly above node in the same document.
+// Attributes count as part of their owner element's subtree. Labelled
+// nodes are compared in constant time; detached ones walk up instead.
+static bool node_is_ancestor(NodeWrapper* ancestor, NodeWrapper* node) {
+    if (!ancestor->node || !node->node || ancestor->node == node->node ||
+        ancestor->doc_ref != node->doc_ref) {
+        return false;
+    }
 
-        // Get all matching nodes from the document
-        VALUE all_matches = document_xpath(doc_ref, rb_str_new2(xpath_str.c_str()));
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(ancestor->doc_ref, DocumentWrapper, &document_type, doc_wrapper);
 
-        NodeSetWrapper* matches_wrapper;
-        TypedData_Get_Struct(all_matches, NodeSetWrapper, &nodeset_type, matches_wrapper);
+    const NodeIntervalMap& intervals = node_intervals(doc_wrapper);
+    auto outer = intervals.find(ancestor->node);
+    auto inner = intervals.find(node->node);
+    if (outer != intervals.end() && inner != intervals.end()) {
+        return outer->second.pre < inner->second.pre && inner->second.post < outer->second.post;
+    }
 
-        VALUE filtered = rb_ary_new();
-        long ancestor_len = RARRAY_LEN(ancestors);
-        long matches_len = RARRAY_LEN(matches_wrapper->nodes_array);
+    return node_in_subtree(node->node, ancestor->node);
+}
 
-        // For each ancestor, check if it's in the matches
-        for (long i = 0; i < ancestor_len; i++) {
-            VALUE ancestor = rb_ary_entry(ancestors, i);
+// node.ancestor_of?(other) - true if other lies below this node
+static VALUE node_ancestor_of_p(VALUE self, VALUE other) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+    NodeWrapper* other_wrapper;
+    TypedData_Get_Struct(other, NodeWrapper, &node_type, other_wrapper);
 
-            NodeWrapper* ancestor_wrapper;
-            TypedData_Get_Struct(ancestor, NodeWrapper, &node_type, ancestor_wrapper);
+    return node_is_ancestor(wrapper, other_wrapper) ? Qtrue : Qfalse;
+}
 
-            // Check if this ancestor node is in the matches
-            for (long j = 0; j < matches_len; j++) {
-                VALUE match = rb_ary_entry(matches_wrapper->nodes_array, j);
-                NodeWrapper* match_wrapper;
-                TypedData_Get_Struct(match, NodeWrapper, &node_type, match_wrapper);
+// node.descendant_of?(other) - true if this node lies below other
+static VALUE node_descendant_of_p(VALUE self, VALUE other) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+    NodeWrapper* other_wrapper;
+    TypedData_Get_Struct(other, NodeWrapper, &node_type, other_wrapper);
 
-                // Compare the actual DOM nodes
-                if (ancestor_wrapper->node == match_wrapper->node) {
-                    rb_ary_push(filtered, ancestor);
-                    break;
-                }
-            }
-        }
+    return node_is_ancestor(other_wrapper, wrapper) ? Qtrue : Qfalse;
+}
 
-        return filtered;
+// node <=> other - compares positions in document order. Returns nil if
+// other is not a node of the same document.
+static VALUE node_compare(VALUE self, VALUE other) {
+    if (!rb_typeddata_is_kind_of(other, &node_type)) {
+        return Qnil;
     }
 
-    return ancestors;
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+    NodeWrapper* other_wrapper;
+    TypedData_Get_Struct(other, NodeWrapper, &node_type, other_wrapper);
+
+    if (!wrapper->node || !other_wrapper->node || wrapper->doc_ref != other_wrapper->doc_ref) {
+        return Qnil;
+    }
+    if (wrapper->node == other_wrapper->node) {
+        return INT2FIX(0);
+    }
+
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(wrapper->doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+
+    const NodeIntervalMap& intervals = node_intervals(doc_wrapper);
+    DocumentOrderKey key = document_order_key(intervals, wrapper->node);
+    DocumentOrderKey other_key = document_order_key(intervals, other_wrapper->node);
+
+    return INT2FIX(key < other_key ? -1 : 1);
 }
 
 // node.attributes - returns hash of all attributes (only for element nodes)
@@ -2073,6 +4361,7 @@ static VALUE node_add_child(VALUE self, VALUE child) {
     if (!doc) {
         rb_raise(rb_eRuntimeError, "Node has no owner document");
     }
+    check_tree_writable(wrapper->node);
 
     DOMNode* child_node = NULL;
     VALUE doc_ref = wrapper->doc_ref;  // Keep track of the Ruby document reference
@@ -2122,7 +4411,18 @@ static VALUE node_add_child(VALUE self, VALUE child) {
 
     try {
         // appendChild will automatically detach the node from its current parent if it has one
+        DOMNode* old_parent = child_node->getParentNode();
         wrapper->node->appendChild(child_node);
+        document_modified(doc_ref);
+
+        native_source::SourceMap* source = document_source(doc_ref);
+        if (source) {
+            if (old_parent) {
+                source->children_changed(old_parent);
+            }
+            source->node_moved(child_node);
+            source->children_changed(wrapper->node);
+        }
     } catch (const DOMException& e) {
         char* message = XMLString::transcode(e.getMessage());
         VALUE rb_error = rb_str_new_cstr(message);
@@ -2157,9 +4457,16 @@ static VALUE node_remove(VALUE self) {
     if (!parent) {
         rb_raise(rb_eRuntimeError, "Node has no parent to remove from");
     }
+    check_tree_writable(wrapper->node);
 
     try {
         parent->removeChild(wrapper->node);
+        document_modified(wrapper->doc_ref);
+
+        native_source::SourceMap* source = document_source(wrapper->doc_ref);
+        if (source) {
+            source->children_changed(parent);
+        }
     } catch (const DOMException& e) {
         char* message = XMLString::transcode(e.getMessage());
         VALUE rb_error = rb_str_new_cstr(message);
@@ -2175,93 +4482,397 @@ static VALUE node_inner_html(VALUE self) {
     NodeWrapper* wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
+    VALUE result = rb_utf8_str_new("", 0);
     if (!wrapper->node) {
-        return rb_str_new_cstr("");
+        return result;
     }
 
-    try {
-        XStr ls_name("LS");
-        DOMImplementation* impl = DOMImplementationRegistry::getDOMImplementation(ls_name.unicodeForm());
-        DOMLSSerializer* serializer = ((DOMImplementationLS*)impl)->createLSSerializer();
+    std::vector<DOMNode*> children;
+    for (DOMNode* child = wrapper->node->getFirstChild(); child; child = child->getNextSibling()) {
+        children.push_back(child);
+    }
 
-        // Build a string by serializing each child
-        std::string result;
-        DOMNodeList* children = wrapper->node->getChildNodes();
-        XMLSize_t count = children->getLength();
+    serialize_nodes(std::move(children), result, "UTF-8", false);
+    return result;
+}
 
-        for (XMLSize_t i = 0; i < count; i++) {
-            DOMNode* child = children->item(i);
-            XMLCh* xml_str = serializer->writeToString(child);
-            CharStr utf8_str(xml_str);
-            result += utf8_str.localForm();
-            XMLString::release(&xml_str);
-        }
+// node.to_xml / node.to_s - returns the XML of this node and its content
+static VALUE node_to_xml(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
-        serializer->release();
-        return rb_str_new_cstr(result.c_str());
-    } catch (const DOMException& e) {
-        char* message = XMLString::transcode(e.getMessage());
-        VALUE rb_error = rb_str_new_cstr(message);
-        XMLString::release(&message);
-        rb_raise(rb_eRuntimeError, "Failed to serialize inner content: %s", StringValueCStr(rb_error));
-    } catch (...) {
-        rb_raise(rb_eRuntimeError, "Failed to serialize inner content");
+    VALUE result = rb_utf8_str_new("", 0);
+    if (wrapper->node) {
+        serialize_node(wrapper->node, result, "UTF-8", false);
+    }
+    return result;
+}
+
+// node.write_to(io, encoding: 'UTF-8', indent: false) - streams the XML
+// of this node into io, or appends it to a String
+static VALUE node_write_to(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    check_write_destination(io);
+
+    VALUE encoding;
+    bool indent;
+    parse_write_options(options, &encoding, &indent);
+
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (wrapper->node) {
+        serialize_node(wrapper->node, io, StringValueCStr(encoding), indent);
     }
 
-    return rb_str_new_cstr("");
+    RB_GC_GUARD(encoding);
+    return io;
 }
 
-// node.path - returns XPath to the node
-static VALUE node_path(VALUE self) {
+// node.canonicalize(mode: :exclusive, with_comments: false,
+// inclusive_namespaces: nil) - Canonical XML of the node's subtree
+static VALUE node_canonicalize(int argc, VALUE* argv, VALUE self) {
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    CanonicalOptions canonical = parse_canonical_options(options);
+
     NodeWrapper* wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
 
-    if (!wrapper->node) {
-        return rb_str_new_cstr("");
+    VALUE result = rb_utf8_str_new("", 0);
+    if (wrapper->node) {
+        canonicalize_node(wrapper->node, result, canonical);
+    }
+
+    RB_GC_GUARD(canonical.inclusive_namespaces);
+    return result;
+}
+
+// node.write_canonical(io, mode: :exclusive, with_comments: false,
+// inclusive_namespaces: nil) - streams the canonical subtree into io
+static VALUE node_write_canonical(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    canonical_destination_method(io);
+    CanonicalOptions canonical = parse_canonical_options(options);
+
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (wrapper->node) {
+        canonicalize_node(wrapper->node, io, canonical);
     }
 
-    std::string path = "";
-    DOMNode* current = wrapper->node;
+    RB_GC_GUARD(canonical.inclusive_namespaces);
+    return io;
+}
+
+// Location steps used by node.path: name[n] for elements, counting
+// same-name element siblings, and text()[n] for text nodes. Other nodes
+// add no step and share the path of their parent.
+static void append_element_step(std::string& path, const char* name, int position) {
+    path += '/';
+    path += name;
+    path += '[';
+    path += std::to_string(position);
+    path += ']';
+}
+
+static void append_text_step(std::string& path, int position) {
+    path += "/text()[";
+    path += std::to_string(position);
+    path += ']';
+}
+
+// XPath location of a single node, found by counting previous siblings at
+// each level
+static std::string path_of_node(DOMNode* node) {
+    std::vector<std::string> steps;
+    DOMNode* current = node;
 
-    // Build path from current node to root
+    // Collect steps from current node up to the root
     while (current && current->getNodeType() != DOMNode::DOCUMENT_NODE) {
-        std::string segment = "";
+        std::string step;
 
         if (current->getNodeType() == DOMNode::ELEMENT_NODE) {
-            CharStr name(current->getNodeName());
-            segment = std::string(name.localForm());
-
             // Count position among siblings with same name
             int position = 1;
-            DOMNode* sibling = current->getPreviousSibling();
-            while (sibling) {
+            for (DOMNode* sibling = current->getPreviousSibling(); sibling; sibling = sibling->getPreviousSibling()) {
                 if (sibling->getNodeType() == DOMNode::ELEMENT_NODE &&
                     XMLString::equals(sibling->getNodeName(), current->getNodeName())) {
                     position++;
                 }
-                sibling = sibling->getPreviousSibling();
             }
 
-            // Add position predicate
-            segment += "[" + std::to_string(position) + "]";
-            path = "/" + segment + path;
+            CharStr name(current->getNodeName());
+            append_element_step(step, name.localForm(), position);
+            steps.push_back(step);
         } else if (current->getNodeType() == DOMNode::TEXT_NODE) {
             // Count position among text node siblings
             int position = 1;
-            DOMNode* sibling = current->getPreviousSibling();
-            while (sibling) {
+            for (DOMNode* sibling = current->getPreviousSibling(); sibling; sibling = sibling->getPreviousSibling()) {
                 if (sibling->getNodeType() == DOMNode::TEXT_NODE) {
                     position++;
                 }
-                sibling = sibling->getPreviousSibling();
             }
-            path = "/text()[" + std::to_string(position) + "]" + path;
+
+            append_text_step(step, position);
+            steps.push_back(step);
+        }
+
+        current = current->getParentNode();
+    }
+
+    std::string path;
+    for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+        path += *it;
+    }
+    return path;
+}
+
+// node.path - returns XPath to the node
+static VALUE node_path(VALUE self) {
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (!wrapper->node) {
+        return rb_str_new_cstr("");
+    }
+
+    std::string path = path_of_node(wrapper->node);
+    return rb_str_new(path.data(), (long)path.size());
+}
+
+// Paths of many nodes at once. Sibling positions are computed for a whole
+// child list in one pass, and the path of each ancestor is built only once.
+class PathIndex {
+public:
+    const std::string& path(DOMNode* node) {
+        auto found = paths_.find(node);
+        if (found != paths_.end()) {
+            return found->second;
+        }
+
+        // Collect the ancestors whose paths are not known yet
+        std::vector<DOMNode*> pending;
+        DOMNode* current = node;
+        while (current && current->getNodeType() != DOMNode::DOCUMENT_NODE) {
+            found = paths_.find(current);
+            if (found != paths_.end()) {
+                break;
+            }
+            pending.push_back(current);
+            current = current->getParentNode();
+        }
+
+        std::string base = found != paths_.end() ? found->second : std::string();
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+            DOMNode* step_node = *it;
+            short type = step_node->getNodeType();
+            if (type == DOMNode::ELEMENT_NODE) {
+                CharStr name(step_node->getNodeName());
+                append_element_step(base, name.localForm(), position(step_node));
+            } else if (type == DOMNode::TEXT_NODE) {
+                append_text_step(base, position(step_node));
+            }
+            paths_[step_node] = base;
+        }
+
+        return paths_[node];
+    }
+
+private:
+    int position(DOMNode* node) {
+        auto found = positions_.find(node);
+        if (found != positions_.end()) {
+            return found->second;
+        }
+
+        DOMNode* parent = node->getParentNode();
+        if (!parent) {
+            return 1;
+        }
+
+        // Number every element and text child of parent with running
+        // per-name counters
+        std::unordered_map<std::string, int> elements;
+        int texts = 0;
+        for (DOMNode* child = parent->getFirstChild(); child; child = child->getNextSibling()) {
+            if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
+                CharStr name(child->getNodeName());
+                positions_[child] = ++elements[name.localForm()];
+            } else if (child->getNodeType() == DOMNode::TEXT_NODE) {
+                positions_[child] = ++texts;
+            }
+        }
+        return positions_[node];
+    }
+
+    std::unordered_map<const DOMNode*, int> positions_;
+    std::unordered_map<const DOMNode*, std::string> paths_;
+};
+
+// Running sibling counters for one child list during each_with_path
+struct PathFrame {
+    size_t length;  // Length of the parent's path
+    std::unordered_map<std::string, int> elements;
+    int texts;
+};
+
+struct PathYieldArgs {
+    VALUE path;
+    DOMNode* node;
+    VALUE doc_ref;
+};
+
+static VALUE yield_path_pair(VALUE arg) {
+    PathYieldArgs* args = reinterpret_cast<PathYieldArgs*>(arg);
+    return rb_yield_values(2, args->path, wrap_node(args->node, args->doc_ref));
+}
+
+// Yield (path, node) for the nodes below scope (and scope itself if
+// include_scope) that match the filters, in document order. Paths are
+// extended step by step as the walk descends. A raise, break or throw out
+// of the block is returned as a tag state once the C++ state is unwound.
+static int yield_paths(DOMNode* scope, const std::string& scope_path, bool include_scope,
+                       const TraversalOptions& options, VALUE doc_ref, bool* modified) {
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+    unsigned long mutation_count = doc_wrapper->mutation_count;
+
+    int state = 0;
+    std::string path = scope_path;
+
+    if (include_scope && traversal_matches(scope, options)) {
+        PathYieldArgs args = { rb_str_new(path.data(), (long)path.size()), scope, doc_ref };
+        rb_protect(yield_path_pair, reinterpret_cast<VALUE>(&args), &state);
+        if (state) {
+            return state;
+        }
+        if (doc_wrapper->mutation_count != mutation_count) {
+            *modified = true;
+            return 0;
+        }
+    }
+
+    std::vector<PathFrame> frames(1);
+    frames[0].length = path.size();
+    frames[0].texts = 0;
+    size_t depth = 0;
+
+    DOMNode* node = scope->getFirstChild();
+    while (node) {
+        PathFrame& frame = frames[depth];
+        path.resize(frame.length);
+
+        short type = node->getNodeType();
+        if (type == DOMNode::ELEMENT_NODE) {
+            CharStr name(node->getNodeName());
+            append_element_step(path, name.localForm(), ++frame.elements[name.localForm()]);
+        } else if (type == DOMNode::TEXT_NODE) {
+            append_text_step(path, ++frame.texts);
+        }
+
+        if (traversal_matches(node, options)) {
+            PathYieldArgs args = { rb_str_new(path.data(), (long)path.size()), node, doc_ref };
+            rb_protect(yield_path_pair, reinterpret_cast<VALUE>(&args), &state);
+            if (state) {
+                break;
+            }
+            if (doc_wrapper->mutation_count != mutation_count) {
+                *modified = true;
+                break;
+            }
+        }
+
+        DOMNode* child = node->getFirstChild();
+        if (child) {
+            // Counters for the children start afresh
+            depth++;
+            if (depth == frames.size()) {
+                frames.push_back(PathFrame());
+            }
+            frames[depth].length = path.size();
+            frames[depth].elements.clear();
+            frames[depth].texts = 0;
+            node = child;
+            continue;
+        }
+
+        while (node != scope && !node->getNextSibling()) {
+            node = node->getParentNode();
+            depth--;
         }
+        node = node == scope ? nullptr : node->getNextSibling();
+    }
+
+    return state;
+}
+
+// Shared by Node#each_with_path and Document#each_with_path
+static void each_with_path(DOMNode* scope, bool include_scope, VALUE options, VALUE doc_ref) {
+    if (!NIL_P(options)) {
+        validate_option_keys(options, { "type", "name" });
+    }
+
+    TraversalOptions traversal;
+    parse_traversal_options(options, false, &traversal);
+    VALUE name = traversal.name;
+
+    bool modified = false;
+    int state;
+    {
+        std::string scope_path = include_scope ? path_of_node(scope) : std::string();
+        state = yield_paths(scope, scope_path, include_scope, traversal, doc_ref, &modified);
+    }
+
+    RB_GC_GUARD(name);
+    if (state) {
+        rb_jump_tag(state);
+    }
+    if (modified) {
+        rb_raise(rb_eRuntimeError, "document modified during traversal");
+    }
+}
+
+// node.each_with_path(type: nil, name: nil) { |path, node| ... } - yields
+// this node and its descendants with their paths, in document order
+static VALUE node_each_with_path(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    NodeWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, wrapper);
+
+    if (wrapper->node) {
+        each_with_path(wrapper->node, true, options, wrapper->doc_ref);
+    }
+
+    return self;
+}
 
-        current = current->getParentNode();
+// document.each_with_path(type: nil, name: nil) { |path, node| ... } -
+// yields every node in the document with its path, in document order
+static VALUE document_each_with_path(int argc, VALUE* argv, VALUE self) {
+    RETURN_ENUMERATOR(self, argc, argv);
+
+    VALUE options;
+    rb_scan_args(argc, argv, "01", &options);
+
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+
+    if (doc_wrapper->doc) {
+        each_with_path(doc_wrapper->doc, false, options, self);
     }
 
-    return rb_str_new_cstr(path.c_str());
+    return self;
 }
 
 // node.blank? - returns true if node has no meaningful content
@@ -2294,16 +4905,8 @@ static VALUE node_blank_p(VALUE self) {
 
     // Element nodes are blank if they have no child elements and no non-blank text
     if (wrapper->node->getNodeType() == DOMNode::ELEMENT_NODE) {
-        DOMNodeList* children = wrapper->node->getChildNodes();
-        XMLSize_t count = children->getLength();
-
-        if (count == 0) {
-            return Qtrue;
-        }
-
         // Check if all children are blank text nodes
-        for (XMLSize_t i = 0; i < count; i++) {
-            DOMNode* child = children->item(i);
+        for (DOMNode* child = wrapper->node->getFirstChild(); child; child = child->getNextSibling()) {
 
             // If there's an element child, not blank
             if (child->getNodeType() == DOMNode::ELEMENT_NODE) {
@@ -2333,8 +4936,14 @@ static VALUE node_blank_p(VALUE self) {
     return Qtrue;
 }
 
-// node.xpath(path)
-static VALUE node_xpath(VALUE self, VALUE path) {
+// node.xpath(path, limit: nil, offset: 0)
+static VALUE node_xpath(int argc, VALUE* argv, VALUE self) {
+    VALUE path, options;
+    rb_scan_args(argc, argv, "11", &path, &options);
+
+    long offset, limit;
+    parse_xpath_options(options, &offset, &limit);
+
     NodeWrapper* node_wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
@@ -2351,71 +4960,70 @@ static VALUE node_xpath(VALUE self, VALUE path) {
     // Validate XPath expression before execution
     validate_xpath_expression(xpath_str);
 
-#ifdef HAVE_XALAN
-    // Use Xalan for full XPath 1.0 support
-    return execute_xpath_with_xalan(node_wrapper->node, xpath_str, doc_ref);
-#else
-    // Fall back to Xerces XPath subset
-    try {
-        DOMDocument* doc = node_wrapper->node->getOwnerDocument();
-        if (!doc) {
-            NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-            wrapper->nodes_array = rb_ary_new();
-            return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-        }
-
-        DOMXPathNSResolver* resolver = doc->createNSResolver(node_wrapper->node);
-        XStr xpath_xstr(xpath_str);
-        DOMXPathExpression* expression = doc->createExpression(
-            xpath_xstr.unicodeForm(), resolver);
-
-        DOMXPathResult* result = expression->evaluate(
-            node_wrapper->node,
-            DOMXPathResult::ORDERED_NODE_SNAPSHOT_TYPE,
-            NULL);
-
-        VALUE nodes_array = rb_ary_new();
-        XMLSize_t length = result->getSnapshotLength();
+    return execute_xpath(node_wrapper->node, xpath_str, doc_ref, offset, limit);
+}
 
-        for (XMLSize_t i = 0; i < length; i++) {
-            result->snapshotItem(i);
-            DOMNode* node = result->getNodeValue();
-            if (node) {
-                rb_ary_push(nodes_array, wrap_node(node, doc_ref));
-            }
+// Rewrite the absolute location paths that an expression selects from to
+// paths relative to the context node: / becomes . and /p or //p becomes
+// ./p or .//p wherever a path may start outside predicates, so every
+// branch of a union and every parenthesized path, as in (//p)[1], is
+// evaluated within the subtree. Paths inside predicates are left alone, as
+// they only test the nodes selected.
+static std::string relative_to_context(const char* xpath_str) {
+    std::string result;
+    char quote = 0;
+    int predicates = 0;
+    char previous = 0;  // Last character outside literals and whitespace
+    for (const char* p = xpath_str; *p; p++) {
+        char c = *p;
+        if (quote) {
+            if (c == quote) quote = 0;
+            result += c;
+            continue;
         }
-
-        expression->release();
-        resolver->release();
-        result->release();
-
-        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-        wrapper->nodes_array = nodes_array;
-        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-
-    } catch (const DOMXPathException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "XPath error: %s", message.localForm());
-    } catch (const DOMException& e) {
-        CharStr message(e.getMessage());
-        rb_raise(rb_eRuntimeError, "DOM error: %s", message.localForm());
-    } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown XPath error");
+        if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '[') {
+            predicates++;
+        } else if (c == ']') {
+            predicates--;
+        } else if (c == '/' && predicates == 0 && previous != '/' &&
+                   (previous == 0 || previous == '(' || previous == '|' || previous == ',')) {
+            // A lone / is the root; it becomes the context node itself
+            const char* next = p + 1;
+            while (*next == ' ' || *next == '\t' || *next == '\n' || *next == '\r') next++;
+            bool lone = *next == '\0' || *next == ')' || *next == '|' || *next == ',';
+            result += lone ? "." : "./";
+            previous = c;
+            continue;
+        }
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            previous = c;
+        }
+        result += c;
     }
-
-    NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
-    wrapper->nodes_array = rb_ary_new();
-    return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
-#endif
+    return result;
 }
 
-// node.at_xpath(path) - returns first matching node or nil
-static VALUE node_at_xpath(VALUE self, VALUE path) {
+// node.search_subtree(path, limit: nil, offset: 0) - XPath query confined to
+// this node and its descendants. Absolute paths are taken relative to the
+// node (see relative_to_context), so //p only walks the subtree; matches
+// that other steps reach outside it (parent::, following::, ...) are
+// dropped.
+static VALUE node_search_subtree(int argc, VALUE* argv, VALUE self) {
+    VALUE path, options;
+    rb_scan_args(argc, argv, "11", &path, &options);
+
+    long offset, limit;
+    parse_xpath_options(options, &offset, &limit);
+
     NodeWrapper* node_wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
     if (!node_wrapper->node) {
-        return Qnil;
+        NodeSetWrapper* wrapper = ALLOC(NodeSetWrapper);
+        wrapper->nodes_array = rb_ary_new();
+        return TypedData_Wrap_Struct(rb_cNodeSet, &nodeset_type, wrapper);
     }
 
     Check_Type(path, T_STRING);
@@ -2425,222 +5033,110 @@ static VALUE node_at_xpath(VALUE self, VALUE path) {
     // Validate XPath expression before execution
     validate_xpath_expression(xpath_str);
 
-#ifdef HAVE_XALAN
-    // Use optimized first-only version
-    return execute_xpath_with_xalan_first(node_wrapper->node, xpath_str, doc_ref);
-#else
-    // Fall back to getting all results and returning first
-    VALUE nodeset = node_xpath(self, path);
-    NodeSetWrapper* wrapper;
-    TypedData_Get_Struct(nodeset, NodeSetWrapper, &nodeset_type, wrapper);
-
-    if (RARRAY_LEN(wrapper->nodes_array) == 0) {
-        return Qnil;
+    VALUE scoped_path;
+    {
+        std::string relative = relative_to_context(xpath_str);
+        scoped_path = rb_str_new(relative.data(), (long)relative.size());
     }
 
-    return rb_ary_entry(wrapper->nodes_array, 0);
-#endif
+    VALUE result = execute_xpath(node_wrapper->node, StringValueCStr(scoped_path), doc_ref, offset, limit,
+                                 node_wrapper->node);
+    RB_GC_GUARD(scoped_path);
+    return result;
 }
 
-// node.at_css(selector) - returns first matching node or nil
-static VALUE node_at_css(VALUE self, VALUE selector) {
-    Check_Type(selector, T_STRING);
-    const char* css_str = StringValueCStr(selector);
-
-    // Convert CSS to XPath
-    std::string xpath_str = css_to_xpath(css_str);
+// node.xpath_each(path) { |node| ... } - yields matches in document order
+static VALUE node_xpath_each(VALUE self, VALUE path) {
+    RETURN_ENUMERATOR(self, 1, &path);
 
-#ifdef HAVE_XALAN
     NodeWrapper* node_wrapper;
     TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
     if (!node_wrapper->node) {
-        return Qnil;
+        return self;
     }
 
-    VALUE doc_ref = node_wrapper->doc_ref;
+    Check_Type(path, T_STRING);
+    const char* xpath_str = StringValueCStr(path);
 
-    // Use optimized first-only version
-    return execute_xpath_with_xalan_first(node_wrapper->node, xpath_str.c_str(), doc_ref);
-#else
-    VALUE nodeset = node_css(self, selector);
-    NodeSetWrapper* wrapper;
-    TypedData_Get_Struct(nodeset, NodeSetWrapper, &nodeset_type, wrapper);
+    // Validate XPath expression before execution
+    validate_xpath_expression(xpath_str);
 
-    if (RARRAY_LEN(wrapper->nodes_array) == 0) {
-        return Qnil;
-    }
+    each_xpath(node_wrapper->node, xpath_str, node_wrapper->doc_ref);
 
-    return rb_ary_entry(wrapper->nodes_array, 0);
-#endif
+    return self;
 }
 
-// Helper function to convert basic CSS selectors to XPath
-// Supports common patterns like: tag, .class, #id, tag.class, tag#id, [attr], [attr=value]
-static std::string css_to_xpath(const char* css) {
-    std::string selector(css);
-
-    // Trim whitespace
-    size_t start = selector.find_first_not_of(" \t\n\r");
-    size_t end = selector.find_last_not_of(" \t\n\r");
-    if (start == std::string::npos) return "//*";
-    selector = selector.substr(start, end - start + 1);
+// node.at_xpath(path) - returns first matching node or nil
+static VALUE node_at_xpath(VALUE self, VALUE path) {
+    NodeWrapper* node_wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
-    std::string result = "//";
-    std::string current_element = "*";
-    bool has_element = false;
-    bool in_brackets = false;
+    if (!node_wrapper->node) {
+        return Qnil;
+    }
 
-    for (size_t i = 0; i < selector.length(); i++) {
-        char c = selector[i];
+    Check_Type(path, T_STRING);
+    const char* xpath_str = StringValueCStr(path);
+    VALUE doc_ref = node_wrapper->doc_ref;
 
-        if (c == '[') in_brackets = true;
-        if (c == ']') in_brackets = false;
+    // Validate XPath expression before execution
+    validate_xpath_expression(xpath_str);
 
-        // Handle spaces (descendant combinator) outside of attribute selectors
-        if (c == ' ' && !in_brackets) {
-            // Flush current element
-            if (!has_element && current_element != "*") {
-                result += current_element;
-            }
-            // Skip multiple spaces
-            while (i + 1 < selector.length() && selector[i + 1] == ' ') i++;
-            result += "//";
-            current_element = "*";
-            has_element = false;
-            continue;
-        }
+    // Use optimized first-only version
+    return execute_xpath_first(node_wrapper->node, xpath_str, doc_ref);
+}
 
-        // Handle child combinator
-        if (c == '>' && !in_brackets) {
-            // Flush current element
-            if (!has_element && current_element != "*") {
-                result += current_element;
-            }
-            // Remove any trailing slashes and spaces
-            while (!result.empty() && (result.back() == ' ' || result.back() == '/')) {
-                if (result.back() == '/') {
-                    result.pop_back();
-                    break;
-                }
-                result.pop_back();
-            }
-            result += "/";
-            // Skip spaces after >
-            while (i + 1 < selector.length() && selector[i + 1] == ' ') i++;
-            current_element = "*";
-            has_element = false;
-            continue;
-        }
+// node.at_css(selector) - returns first matching node or nil
+static VALUE node_at_css(VALUE self, VALUE selector) {
+    NodeWrapper* node_wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
-        // Handle ID selector
-        if (c == '#' && !in_brackets) {
-            if (!has_element) {
-                result += "*";
-                has_element = true;
-            } else if (current_element != "*") {
-                result += current_element;
-                current_element = "*";
-                has_element = true;
-            }
-            result += "[@id='";
-            i++;
-            while (i < selector.length() && selector[i] != ' ' && selector[i] != '.' &&
-                   selector[i] != '[' && selector[i] != '>' && selector[i] != '+' && selector[i] != '~') {
-                result += selector[i++];
-            }
-            result += "']";
-            i--;
-            continue;
-        }
+    VALUE doc_ref = node_wrapper->doc_ref;
 
-        // Handle class selector
-        if (c == '.' && !in_brackets) {
-            if (!has_element) {
-                result += "*";
-                has_element = true;
-            } else if (current_element != "*") {
-                result += current_element;
-                current_element = "*";
-                has_element = true;
-            }
-            result += "[contains(concat(' ', @class, ' '), ' ";
-            i++;
-            while (i < selector.length() && selector[i] != ' ' && selector[i] != '.' &&
-                   selector[i] != '[' && selector[i] != '>' && selector[i] != '+' && selector[i] != '~' && selector[i] != '#') {
-                result += selector[i++];
-            }
-            result += " ')]";
-            i--;
-            continue;
-        }
+    if (css_engine == CSS_ENGINE_NATIVE) {
+        return select_css_with_native(node_wrapper->node, selector, doc_ref, true);
+    }
 
-        // Handle attribute selectors
-        if (c == '[') {
-            if (!has_element && current_element != "*") {
-                result += current_element;
-                has_element = true;
-            }
-            result += "[@";
-            i++;
-            // Get attribute name
-            while (i < selector.length() && selector[i] != ']' && selector[i] != '=' &&
-                   selector[i] != '!' && selector[i] != '~' && selector[i] != '^' && selector[i] != '$' && selector[i] != '*') {
-                result += selector[i++];
-            }
+    if (!node_wrapper->node) {
+        css_selector_to_xpath(selector);
+        return Qnil;
+    }
 
-            if (i < selector.length() && selector[i] == '=') {
-                result += "='";
-                i++;
-                // Skip quotes if present
-                if (i < selector.length() && (selector[i] == '"' || selector[i] == '\'')) {
-                    char quote = selector[i++];
-                    while (i < selector.length() && selector[i] != quote) {
-                        result += selector[i++];
-                    }
-                    if (i < selector.length()) i++; // Skip closing quote
-                } else {
-                    // No quotes, read until ]
-                    while (i < selector.length() && selector[i] != ']') {
-                        result += selector[i++];
-                    }
-                }
-                result += "'";
-            }
+    VALUE path = css_selector_to_xpath(selector);
+    VALUE found = execute_xpath_first(node_wrapper->node, StringValueCStr(path), doc_ref);
+    RB_GC_GUARD(path);
+    return found;
+}
 
-            // Skip to closing bracket
-            while (i < selector.length() && selector[i] != ']') i++;
-            result += ']';
-            continue;
-        }
+// node.matches?(selector) - true if this element matches a CSS selector
+static VALUE node_matches_p(VALUE self, VALUE selector) {
+    NodeWrapper* node_wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
-        // Regular character - part of element name
-        if (c != ' ' && c != '>' && c != '.' && c != '#' && c != '[' && !has_element) {
-            if (current_element == "*") {
-                current_element = "";
-            }
-            current_element += c;
-        }
-    }
+    native_css::SelectorPtr compiled = css_selector_from_value(selector);
 
-    // Flush any remaining element name
-    if (!has_element && current_element != "*") {
-        result += current_element;
+    if (!node_wrapper->node || node_wrapper->node->getNodeType() != DOMNode::ELEMENT_NODE) {
+        return Qfalse;
     }
 
-    return result;
+    return native_css::matches(*compiled, static_cast<DOMElement*>(node_wrapper->node)) ? Qtrue : Qfalse;
 }
 
-// node.css(selector) - Convert CSS to XPath and execute
+// node.css(selector) - descendants matching a CSS selector
 static VALUE node_css(VALUE self, VALUE selector) {
-    Check_Type(selector, T_STRING);
-    const char* css_str = StringValueCStr(selector);
+    NodeWrapper* node_wrapper;
+    TypedData_Get_Struct(self, NodeWrapper, &node_type, node_wrapper);
 
-    // Convert CSS to XPath
-    std::string xpath_str = css_to_xpath(css_str);
+    if (css_engine == CSS_ENGINE_NATIVE) {
+        return select_css_with_native(node_wrapper->node, selector, node_wrapper->doc_ref, false);
+    }
 
-    // Call the xpath method with converted selector
-    return node_xpath(self, rb_str_new2(xpath_str.c_str()));
+    if (!node_wrapper->node) {
+        css_selector_to_xpath(selector);
+        return wrap_nodeset(std::vector<DOMNode*>(), node_wrapper->doc_ref);
+    }
+    return select_css_with_xpath(node_wrapper->node, selector, node_wrapper->doc_ref);
 }
 
 // nodeset.length / nodeset.size
@@ -2717,21 +5213,292 @@ static VALUE nodeset_empty_p(VALUE self) {
     return RARRAY_LEN(wrapper->nodes_array) == 0 ? Qtrue : Qfalse;
 }
 
+// A node of a NodeSet together with its document order. Nodes of
+// different documents are kept apart by the document's rank, which is
+// the order in which the documents were first seen.
+struct OrderedNode {
+    VALUE value;
+    size_t document;
+    DocumentOrderKey key;
+
+    bool operator<(const OrderedNode& other) const {
+        return document != other.document ? document < other.document : key < other.key;
+    }
+
+    bool same_node(const OrderedNode& other) const {
+        return document == other.document && key == other.key;
+    }
+};
+
+// Resolves document order keys for the nodes of one or more NodeSets,
+// building each document's labels at most once
+class DocumentOrder {
+public:
+    void collect(VALUE nodeset, std::vector<OrderedNode>& out) {
+        NodeSetWrapper* wrapper;
+        TypedData_Get_Struct(nodeset, NodeSetWrapper, &nodeset_type, wrapper);
+
+        long len = RARRAY_LEN(wrapper->nodes_array);
+        out.reserve(out.size() + len);
+        for (long i = 0; i < len; i++) {
+            VALUE value = rb_ary_entry(wrapper->nodes_array, i);
+            NodeWrapper* node_wrapper;
+            TypedData_Get_Struct(value, NodeWrapper, &node_type, node_wrapper);
+
+            size_t document = rank(node_wrapper->doc_ref);
+            OrderedNode ordered;
+            ordered.value = value;
+            ordered.document = document;
+            ordered.key = document_order_key(*intervals_[document], node_wrapper->node);
+            out.push_back(ordered);
+        }
+    }
+
+    // Sort into document order unless already sorted, as XPath results are
+    static void sort(std::vector<OrderedNode>& nodes) {
+        if (!std::is_sorted(nodes.begin(), nodes.end())) {
+            std::stable_sort(nodes.begin(), nodes.end());
+        }
+    }
+
+    // Sort and drop repeated nodes, keeping the first occurrence
+    static void sort_unique(std::vector<OrderedNode>& nodes) {
+        sort(nodes);
+        nodes.erase(std::unique(nodes.begin(), nodes.end(),
+                                [](const OrderedNode& a, const OrderedNode& b) { return a.same_node(b); }),
+                    nodes.end());
+    }
+
+private:
+    size_t rank(VALUE doc_ref) {
+        for (size_t i = 0; i < documents_.size(); i++) {
+            if (documents_[i] == doc_ref) {
+                return i;
+            }
+        }
+
+        DocumentWrapper* doc_wrapper;
+        TypedData_Get_Struct(doc_ref, DocumentWrapper, &document_type, doc_wrapper);
+        documents_.push_back(doc_ref);
+        intervals_.push_back(&node_intervals(doc_wrapper));
+        return documents_.size() - 1;
+    }
+
+    std::vector<VALUE> documents_;
+    std::vector<const NodeIntervalMap*> intervals_;
+};
+
+static VALUE ordered_nodeset(const std::vector<OrderedNode>& nodes) {
+    VALUE nodes_array = rb_ary_new_capa((long)nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        rb_ary_push(nodes_array, nodes[i].value);
+    }
+    return wrap_nodeset_array(nodes_array);
+}
+
+enum NodeSetOperation {
+    NODESET_UNION,
+    NODESET_INTERSECTION,
+    NODESET_DIFFERENCE
+};
+
+// Merge two NodeSets in document order in a single pass over both
+static VALUE nodeset_merge(VALUE self, VALUE other, NodeSetOperation operation) {
+    // Checked before any C++ state is built, which the raise would skip
+    if (!rb_typeddata_is_kind_of(other, &nodeset_type)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected RXerces::XML::NodeSet)", rb_obj_classname(other));
+    }
+
+    DocumentOrder order;
+    std::vector<OrderedNode> left;
+    std::vector<OrderedNode> right;
+    order.collect(self, left);
+    order.collect(other, right);
+    DocumentOrder::sort_unique(left);
+    DocumentOrder::sort_unique(right);
+
+    std::vector<OrderedNode> result;
+    result.reserve(operation == NODESET_UNION ? left.size() + right.size() : left.size());
+
+    size_t i = 0;
+    size_t j = 0;
+    while (i < left.size() || j < right.size()) {
+        if (j == right.size() || (i < left.size() && left[i] < right[j])) {
+            if (operation != NODESET_INTERSECTION) {
+                result.push_back(left[i]);
+            }
+            i++;
+        } else if (i == left.size() || right[j] < left[i]) {
+            if (operation == NODESET_UNION) {
+                result.push_back(right[j]);
+            }
+            j++;
+        } else {
+            if (operation != NODESET_DIFFERENCE) {
+                result.push_back(left[i]);
+            }
+            i++;
+            j++;
+        }
+    }
+
+    return ordered_nodeset(result);
+}
+
+// nodeset | other - nodes in either set, in document order
+static VALUE nodeset_union(VALUE self, VALUE other) {
+    return nodeset_merge(self, other, NODESET_UNION);
+}
+
+// nodeset & other - nodes in both sets, in document order
+static VALUE nodeset_intersection(VALUE self, VALUE other) {
+    return nodeset_merge(self, other, NODESET_INTERSECTION);
+}
+
+// nodeset - other - nodes not in other, in document order
+static VALUE nodeset_difference(VALUE self, VALUE other) {
+    return nodeset_merge(self, other, NODESET_DIFFERENCE);
+}
+
+// nodeset.sort - the same nodes in document order. With a block the nodes
+// are ordered by it, and unlike Enumerable#sort the result is still a
+// NodeSet.
+static VALUE nodeset_sort(VALUE self) {
+    if (rb_block_given_p()) {
+        return wrap_nodeset_array(rb_block_call(nodeset_to_a(self), rb_intern("sort"), 0, 0,
+                                                rb_yield_block, Qnil));
+    }
+
+    DocumentOrder order;
+    std::vector<OrderedNode> nodes;
+    order.collect(self, nodes);
+    DocumentOrder::sort(nodes);
+
+    return ordered_nodeset(nodes);
+}
+
+// nodeset.uniq - drops repeated nodes, keeping the first occurrence of
+// each in its original position. With a block, nodes for which it returns
+// the same value count as repeats; the result is a NodeSet either way.
+static VALUE nodeset_uniq(VALUE self) {
+    if (rb_block_given_p()) {
+        return wrap_nodeset_array(rb_block_call(nodeset_to_a(self), rb_intern("uniq"), 0, 0,
+                                                rb_yield_block, Qnil));
+    }
+
+    DocumentOrder order;
+    std::vector<OrderedNode> nodes;
+    order.collect(self, nodes);
+
+    // Sort positions by node, then keep the first position of each run
+    std::vector<size_t> positions(nodes.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+        positions[i] = i;
+    }
+    std::stable_sort(positions.begin(), positions.end(),
+                     [&nodes](size_t a, size_t b) { return nodes[a] < nodes[b]; });
+
+    std::vector<bool> keep(nodes.size(), false);
+    for (size_t i = 0; i < positions.size(); i++) {
+        if (i == 0 || !nodes[positions[i]].same_node(nodes[positions[i - 1]])) {
+            keep[positions[i]] = true;
+        }
+    }
+
+    VALUE nodes_array = rb_ary_new_capa((long)nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (keep[i]) {
+            rb_ary_push(nodes_array, nodes[i].value);
+        }
+    }
+    return wrap_nodeset_array(nodes_array);
+}
+
+// The nodes of a NodeSet, for serializing in a single pass
+static std::vector<DOMNode*> nodeset_dom_nodes(VALUE self) {
+    NodeSetWrapper* wrapper;
+    TypedData_Get_Struct(self, NodeSetWrapper, &nodeset_type, wrapper);
+
+    long len = RARRAY_LEN(wrapper->nodes_array);
+    std::vector<DOMNode*> nodes;
+    nodes.reserve(len);
+    for (long i = 0; i < len; i++) {
+        VALUE node = rb_ary_entry(wrapper->nodes_array, i);
+        NodeWrapper* node_wrapper;
+        TypedData_Get_Struct(node, NodeWrapper, &node_type, node_wrapper);
+        if (node_wrapper->node) {
+            nodes.push_back(node_wrapper->node);
+        }
+    }
+    return nodes;
+}
+
 // nodeset.inner_html - returns concatenated inner_html of all nodes
 static VALUE nodeset_inner_html(VALUE self) {
+    std::vector<DOMNode*> children;
+    for (DOMNode* node : nodeset_dom_nodes(self)) {
+        for (DOMNode* child = node->getFirstChild(); child; child = child->getNextSibling()) {
+            children.push_back(child);
+        }
+    }
+
+    VALUE result = rb_utf8_str_new("", 0);
+    serialize_nodes(std::move(children), result, "UTF-8", false);
+    return result;
+}
+
+// nodeset.to_xml - returns the concatenated XML of all nodes
+static VALUE nodeset_to_xml(VALUE self) {
+    VALUE result = rb_utf8_str_new("", 0);
+    serialize_nodes(nodeset_dom_nodes(self), result, "UTF-8", false);
+    return result;
+}
+
+// nodeset.write_to(io, encoding: 'UTF-8', indent: false) - streams the XML
+// of all nodes into io, or appends it to a String
+static VALUE nodeset_write_to(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    check_write_destination(io);
+
+    VALUE encoding;
+    bool indent;
+    parse_write_options(options, &encoding, &indent);
+
+    serialize_nodes(nodeset_dom_nodes(self), io, StringValueCStr(encoding), indent);
+
+    RB_GC_GUARD(encoding);
+    return io;
+}
+
+// nodeset.paths - returns the XPath of every node, computed in one pass
+static VALUE nodeset_paths(VALUE self) {
     NodeSetWrapper* wrapper;
     TypedData_Get_Struct(self, NodeSetWrapper, &nodeset_type, wrapper);
 
-    std::string result;
     long len = RARRAY_LEN(wrapper->nodes_array);
-
+    std::vector<DOMNode*> nodes;
+    nodes.reserve(len);
     for (long i = 0; i < len; i++) {
         VALUE node = rb_ary_entry(wrapper->nodes_array, i);
-        VALUE inner_html = rb_funcall(node, rb_intern("inner_html"), 0);
-        result += StringValueCStr(inner_html);
+        NodeWrapper* node_wrapper;
+        TypedData_Get_Struct(node, NodeWrapper, &node_type, node_wrapper);
+        nodes.push_back(node_wrapper->node);
     }
 
-    return rb_str_new_cstr(result.c_str());
+    VALUE paths = rb_ary_new_capa(len);
+    PathIndex index;
+    for (DOMNode* node : nodes) {
+        if (!node) {
+            rb_ary_push(paths, rb_str_new_cstr(""));
+            continue;
+        }
+        const std::string& path = index.path(node);
+        rb_ary_push(paths, rb_str_new(path.data(), (long)path.size()));
+    }
+
+    return paths;
 }
 
 // nodeset.text - returns concatenated text content of all nodes
@@ -2911,6 +5678,38 @@ static VALUE nodeset_inspect(VALUE self) {
     return rb_result;
 }
 
+// Compile an XSD into a new grammar pool, so that it is parsed and fully
+// checked once rather than on every validation. Problems in the schema are
+// collected into errors, in the form validation reports them, and do not
+// stop the pool from being used.
+static XMLGrammarPool* compile_schema(const char* xsd, size_t length, std::vector<ErrorRecord>& errors) {
+    XMLGrammarPool* pool = new XMLGrammarPoolImpl(XMLPlatformUtils::fgMemoryManager);
+    try {
+        XercesDOMParser loader(nullptr, XMLPlatformUtils::fgMemoryManager, pool);
+        loader.setValidationScheme(XercesDOMParser::Val_Always);
+        loader.setDoNamespaces(true);
+        loader.setDoSchema(true);
+        loader.setValidationSchemaFullChecking(true);
+
+        ErrorCollector errorHandler;
+        loader.setErrorHandler(&errorHandler);
+
+        MemBufInputSource schemaSource((const XMLByte*)xsd, length, SCHEMA_SYSTEM_ID);
+        if (!loader.loadGrammar(schemaSource, Grammar::SchemaGrammarType, true)) {
+            errorHandler.add(ErrorRecord(ErrorRecord::LEVEL_WARNING, "Warning: Schema grammar could not be loaded"));
+        }
+        errors = errorHandler.errors;
+    } catch (...) {
+        delete pool;
+        throw;
+    }
+
+    // A locked pool is read-only, so any number of parsers in any number
+    // of threads can validate against it at once
+    pool->lockPool();
+    return pool;
+}
+
 // Schema.from_document(schema_doc) or Schema.from_string(xsd_string)
 static VALUE schema_from_document(int argc, VALUE* argv, VALUE klass) {
     VALUE schema_source;
@@ -2918,187 +5717,668 @@ static VALUE schema_from_document(int argc, VALUE* argv, VALUE klass) {
 
     ensure_xerces_initialized();
 
+    // Convert schema source to string
+    VALUE xsd = schema_source;
+    if (!rb_obj_is_kind_of(xsd, rb_cString)) {
+        // Assume it's a Document, call to_s
+        xsd = rb_funcall(schema_source, rb_intern("to_s"), 0);
+        StringValue(xsd);
+    }
+
+    char error_message[512] = "";
+    XMLGrammarPool* pool = nullptr;
+    std::vector<ErrorRecord>* grammar_errors = new std::vector<ErrorRecord>();
+
     try {
-        SchemaWrapper* wrapper = ALLOC(SchemaWrapper);
-        wrapper->schemaContent = new std::string();
+        pool = compile_schema(RSTRING_PTR(xsd), RSTRING_LEN(xsd), *grammar_errors);
+    } catch (const XMLException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, sizeof(error_message), "Schema parsing failed: %s", message.localForm());
+    } catch (const SAXException& e) {
+        CharStr message(e.getMessage());
+        snprintf(error_message, sizeof(error_message), "Schema parsing failed: %s", message.localForm());
+    } catch (...) {
+        snprintf(error_message, sizeof(error_message), "Schema parsing failed: Invalid XML");
+    }
+
+    RB_GC_GUARD(xsd);
+    if (!pool) {
+        delete grammar_errors;
+        rb_raise(rb_eRuntimeError, "%s", error_message);
+    }
+
+    SchemaWrapper* wrapper = ALLOC(SchemaWrapper);
+    wrapper->grammar_pool = pool;
+    wrapper->grammar_errors = grammar_errors;
+    return rb_obj_freeze(TypedData_Wrap_Struct(klass, &schema_type, wrapper));
+}
+
+// Serialize a document as UTF-8 input for the validating scanner.
+// Documents parsed with preserve_source: true are copied from the source
+// wherever they are unchanged.
+static void write_validation_input(DocumentWrapper* doc_wrapper, MemBufFormatTarget& target) {
+    DOMLSSerializer* serializer = acquire_serializer(false);
+    DOMLSOutput* output = ls_implementation()->createLSOutput();
+    XStr encoding("UTF-8");
+    output->setEncoding(encoding.unicodeForm());
+    output->setByteStream(&target);
 
-        // Convert schema source to string
-        std::string xsd_content;
-        if (rb_obj_is_kind_of(schema_source, rb_cString)) {
-            xsd_content = std::string(RSTRING_PTR(schema_source), RSTRING_LEN(schema_source));
+    try {
+        if (doc_wrapper->source) {
+            doc_wrapper->source->write(doc_wrapper->doc, target,
+                [serializer, output](DOMNode* changed) { return serializer->write(changed, output); });
         } else {
-            // Assume it's a Document, call to_s
-            VALUE str = rb_funcall(schema_source, rb_intern("to_s"), 0);
-            xsd_content = std::string(RSTRING_PTR(str), RSTRING_LEN(str));
+            serializer->write(doc_wrapper->doc, output);
         }
+    } catch (...) {
+        output->release();
+        release_serializer(serializer);
+        throw;
+    }
 
-        // Store the schema content
-        *wrapper->schemaContent = xsd_content;
-
-        // Validate that it's valid XML by trying to parse it
-        XercesDOMParser* schemaParser = new XercesDOMParser();
-        schemaParser->setValidationScheme(XercesDOMParser::Val_Never);
-        schemaParser->setDoNamespaces(true);
+    output->release();
+    release_serializer(serializer);
+}
 
-        // Parse the schema using MemBufInputSource
-        MemBufInputSource schemaInput(
-            (const XMLByte*)xsd_content.c_str(),
-            xsd_content.length(),
-            "schema"
-        );
+// Scan source with a SAX reader against the schema's compiled grammar, so
+// that no DOM is built. Problems, including a scanner failure, are reported
+// to handler; ValidationStopped from the handler ends the scan quietly.
+// Unless allow_external is set, external entities and DTDs are not loaded,
+// as in Document.parse.
+static void scan_with_schema(SchemaWrapper* schema, const InputSource& source, ErrorCollector& handler,
+                             bool allow_external) {
+    SAX2XMLReader* reader = XMLReaderFactory::createXMLReader(XMLPlatformUtils::fgMemoryManager, schema->grammar_pool);
+    reader->setFeature(XMLUni::fgSAX2CoreNameSpaces, true);
+    reader->setFeature(XMLUni::fgSAX2CoreValidation, true);
+    reader->setFeature(XMLUni::fgXercesDynamic, false);
+    reader->setFeature(XMLUni::fgXercesSchema, true);
+    reader->setFeature(XMLUni::fgXercesUseCachedGrammarInParse, true);
+    reader->setFeature(XMLUni::fgXercesLoadExternalDTD, allow_external);
+    reader->setFeature(XMLUni::fgXercesDisableDefaultEntityResolution, !allow_external);
+
+    // Bounds entity expansion, so internal entities cannot blow up either
+    SecurityManager security;
+    reader->setProperty(XMLUni::fgXercesSecurityManager, &security);
+
+    XStr schema_location(SCHEMA_SYSTEM_ID);
+    reader->setProperty(XMLUni::fgXercesSchemaExternalNoNameSpaceSchemaLocation, (void*)schema_location.unicodeForm());
+    reader->setErrorHandler(&handler);
+
+    std::string failure;
+    try {
+        reader->parse(source);
+    } catch (const ValidationStopped&) {
+    } catch (const XMLException& e) {
+        CharStr message(e.getMessage());
+        failure = std::string("XMLException: ") + message.localForm();
+    } catch (const SAXException& e) {
+        CharStr message(e.getMessage());
+        failure = std::string("SAXException: ") + message.localForm();
+    } catch (...) {
+        failure = "Unknown parsing exception";
+    }
+    delete reader;
 
+    if (!failure.empty()) {
         try {
-            schemaParser->parse(schemaInput);
-        } catch (const XMLException& e) {
-            delete schemaParser;
-            delete wrapper->schemaContent;
-            xfree(wrapper);
-            CharStr message(e.getMessage());
-            rb_raise(rb_eRuntimeError, "Schema parsing failed: %s", message.localForm());
-        } catch (const SAXException& e) {
-            delete schemaParser;
-            delete wrapper->schemaContent;
-            xfree(wrapper);
-            CharStr message(e.getMessage());
-            rb_raise(rb_eRuntimeError, "Schema parsing failed: %s", message.localForm());
-        } catch (...) {
-            delete schemaParser;
-            delete wrapper->schemaContent;
-            xfree(wrapper);
-            rb_raise(rb_eRuntimeError, "Schema parsing failed: Invalid XML");
+            handler.add(ErrorRecord(ErrorRecord::LEVEL_FATAL, failure.c_str()));
+        } catch (const ValidationStopped&) {
+        }
+    }
+}
+
+// Validate XML text against the schema, appending problems to errors
+// until the limits are reached
+static void validate_with_schema(SchemaWrapper* schema, const char* data, size_t length, const ErrorLimits& limits,
+                                 bool allow_external, std::vector<ErrorRecord>& errors) {
+    ErrorCollector errorHandler;
+    errorHandler.limits = limits;
+    MemBufInputSource docSource((const XMLByte*)data, length, "document.xml");
+    RXERCES_PROBE1(validate__start, length);
+    scan_with_schema(schema, docSource, errorHandler, allow_external);
+    RXERCES_PROBE2(validate__done, length, errorHandler.errors.size());
+
+    errors.insert(errors.end(), errorHandler.errors.begin(), errorHandler.errors.end());
+}
+
+static VALUE check_interrupts(VALUE unused) {
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+// Streaming validation of a file or an IO. The scan runs with the GVL
+// released and holds no more than the scanner's buffers, however large
+// the input. Reading the IO and yielding messages to the block reacquire
+// the GVL; if either raises, or an interrupt raises, the scan stops.
+// Anything else that cancels it (such as Thread#wakeup) resumes it.
+class StreamValidator : public ErrorCollector {
+public:
+    StreamValidator(SchemaWrapper* schema, VALUE io, const std::string& path, bool yield)
+        : schema(schema), io(io), path(path), allow_external(false), cancelled(false), bytes_read(0), yield_(yield),
+          state_(0) {
+        error[0] = '\0';
+    }
+
+    SchemaWrapper* schema;
+    VALUE io;           // Read with io.read unless path is set
+    std::string path;
+    bool allow_external;
+    std::atomic<bool> cancelled;
+    size_t bytes_read;  // Input scanned so far
+    char error[512];    // Set if the scan could not run
+
+    int state() const { return state_; }
+
+    // Throw ValidationStopped if Ruby raised, checking for interrupts
+    // first if the scan was cancelled
+    void check() {
+        if (cancelled && !state_) {
+            cancelled = false;
+            rb_thread_call_with_gvl(check_interrupts_with_gvl, this);
+        }
+        if (state_) {
+            throw ValidationStopped();
+        }
+    }
+
+    // Read up to max_length bytes of io into buffer; 0 at the end
+    XMLSize_t read(XMLByte* buffer, XMLSize_t max_length) {
+        check();
+        read_buffer_ = buffer;
+        read_max_ = max_length;
+        read_length_ = 0;
+        rb_thread_call_with_gvl(read_with_gvl, this);
+        check();
+        return read_length_;
+    }
+
+protected:
+    void report(const ErrorRecord& record) {
+        if (!yield_) {
+            ErrorCollector::report(record);
+            return;
+        }
+        message_ = record.format();
+        rb_thread_call_with_gvl(yield_with_gvl, this);
+        check();
+    }
+
+private:
+    static void* check_interrupts_with_gvl(void* arg) {
+        StreamValidator* validator = static_cast<StreamValidator*>(arg);
+        rb_protect(check_interrupts, Qnil, &validator->state_);
+        return nullptr;
+    }
+
+    static void* read_with_gvl(void* arg) {
+        StreamValidator* validator = static_cast<StreamValidator*>(arg);
+        rb_protect(read_chunk, reinterpret_cast<VALUE>(validator), &validator->state_);
+        return nullptr;
+    }
+
+    static VALUE read_chunk(VALUE arg) {
+        StreamValidator* validator = reinterpret_cast<StreamValidator*>(arg);
+        VALUE chunk = rb_funcall(validator->io, rb_intern("read"), 1, SIZET2NUM(validator->read_max_));
+        if (!NIL_P(chunk)) {
+            StringValue(chunk);
+            validator->read_length_ = std::min((XMLSize_t)RSTRING_LEN(chunk), validator->read_max_);
+            memcpy(validator->read_buffer_, RSTRING_PTR(chunk), validator->read_length_);
+        }
+        return Qnil;
+    }
+
+    static void* yield_with_gvl(void* arg) {
+        StreamValidator* validator = static_cast<StreamValidator*>(arg);
+        rb_protect(yield_message, reinterpret_cast<VALUE>(validator), &validator->state_);
+        return nullptr;
+    }
+
+    static VALUE yield_message(VALUE arg) {
+        StreamValidator* validator = reinterpret_cast<StreamValidator*>(arg);
+        return rb_yield(rb_utf8_str_new(validator->message_.data(), (long)validator->message_.size()));
+    }
+
+    bool yield_;
+    int state_;
+    std::string message_;
+    XMLByte* read_buffer_;
+    XMLSize_t read_max_;
+    XMLSize_t read_length_;
+};
+
+// Input for a StreamValidator: the file's stream, or io.read, checked for
+// interrupts before every read
+class StreamInputStream : public BinInputStream {
+public:
+    StreamInputStream(StreamValidator* validator, BinInputStream* file)
+        : validator_(validator), file_(file), position_(0) {}
+
+    ~StreamInputStream() {
+        delete file_;
+    }
+
+    XMLFilePos curPos() const {
+        return position_;
+    }
+
+    XMLSize_t readBytes(XMLByte* const toFill, const XMLSize_t maxToRead) {
+        validator_->check();
+        XMLSize_t length = file_ ? file_->readBytes(toFill, maxToRead) : validator_->read(toFill, maxToRead);
+        position_ += length;
+        validator_->bytes_read += length;
+        return length;
+    }
+
+    const XMLCh* getContentType() const {
+        return file_ ? file_->getContentType() : nullptr;
+    }
+
+private:
+    StreamValidator* validator_;
+    BinInputStream* file_;
+    XMLFilePos position_;
+};
+
+class StreamInputSource : public InputSource {
+public:
+    StreamInputSource(StreamValidator* validator, const XMLCh* system_id, const InputSource* file)
+        : InputSource(system_id), validator_(validator), file_(file) {}
+
+    BinInputStream* makeStream() const {
+        BinInputStream* file_stream = nullptr;
+        if (file_) {
+            file_stream = file_->makeStream();
+            if (!file_stream) {
+                return nullptr;
+            }
         }
+        return new StreamInputStream(validator_, file_stream);
+    }
 
-        delete schemaParser;
+private:
+    StreamValidator* validator_;
+    const InputSource* file_;
+};
 
-        VALUE rb_schema = TypedData_Wrap_Struct(klass, &schema_type, wrapper);
-        return rb_schema;
+static void* validate_stream_without_gvl(void* arg) {
+    StreamValidator* validator = static_cast<StreamValidator*>(arg);
+    try {
+        for (const auto& err : *validator->schema->grammar_errors) {
+            validator->add(err);
+        }
 
+        if (validator->path.empty()) {
+            XStr system_id("document.xml");
+            StreamInputSource source(validator, system_id.unicodeForm(), nullptr);
+            scan_with_schema(validator->schema, source, *validator, validator->allow_external);
+        } else {
+            XStr path(validator->path.c_str());
+            LocalFileInputSource file(path.unicodeForm());
+            StreamInputSource source(validator, path.unicodeForm(), &file);
+            scan_with_schema(validator->schema, source, *validator, validator->allow_external);
+        }
+    } catch (const ValidationStopped&) {
     } catch (const XMLException& e) {
-        char* message = XMLString::transcode(e.getMessage());
-        VALUE rb_error = rb_str_new_cstr(message);
-        XMLString::release(&message);
-        rb_raise(rb_eRuntimeError, "XMLException: %s", StringValueCStr(rb_error));
-    } catch (const DOMException& e) {
-        char* message = XMLString::transcode(e.getMessage());
-        VALUE rb_error = rb_str_new_cstr(message);
-        XMLString::release(&message);
-        rb_raise(rb_eRuntimeError, "DOMException: %s", StringValueCStr(rb_error));
+        CharStr message(e.getMessage());
+        snprintf(validator->error, sizeof(validator->error), "XMLException during validation: %s", message.localForm());
     } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown exception during schema parsing");
+        snprintf(validator->error, sizeof(validator->error), "Unknown exception during validation");
     }
+    return nullptr;
+}
 
-    return Qnil;
+static void cancel_stream_validation(void* arg) {
+    static_cast<StreamValidator*>(arg)->cancelled = true;
 }
 
-// document.validate(schema) - returns array of error messages (empty if valid)
-static VALUE document_validate(VALUE self, VALUE rb_schema) {
-    DocumentWrapper* doc_wrapper;
-    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+// Shared by schema.validate_file and schema.validate_io: yields each
+// message to the block and returns how many there were, or without a
+// block returns them in an array
+static VALUE validate_stream(VALUE self, VALUE io, VALUE path, VALUE options) {
+    if (!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        validate_option_keys(options, {"max_errors", "fatal_on_first", "allow_external_entities"});
+    }
+    ErrorLimits limits = error_limits(options);
 
     SchemaWrapper* schema_wrapper;
-    TypedData_Get_Struct(rb_schema, SchemaWrapper, &schema_type, schema_wrapper);
+    TypedData_Get_Struct(self, SchemaWrapper, &schema_type, schema_wrapper);
+    ensure_xerces_initialized();
 
-    try {
-        // Serialize the document to UTF-8 for validation
-        DOMImplementation* impl = DOMImplementationRegistry::getDOMImplementation(XMLString::transcode("LS"));
-        DOMLSSerializer* serializer = ((DOMImplementationLS*)impl)->createLSSerializer();
+    bool yield = rb_block_given_p();
+    VALUE errors_array = yield ? Qnil : rb_ary_new();
+    char error_message[512] = "";
+    size_t reported;
+    int interrupted;
+    int state;
+    {
+        StreamValidator validator(schema_wrapper, io, NIL_P(path) ? std::string() : std::string(RSTRING_PTR(path), RSTRING_LEN(path)), yield);
+        validator.limits = limits;
+        validator.allow_external = allow_external_entities(options);
+        native_stats::count(native_stats::VALIDATIONS);
+        native_stats::Timer timer;
+        RXERCES_PROBE1(validate__start, 0);  // The size of a stream is not known up front
+        interrupted = call_without_gvl(validate_stream_without_gvl, &validator, cancel_stream_validation, &validator);
+        timer.stop(native_stats::VALIDATE_TIME);
+        RXERCES_PROBE2(validate__done, validator.bytes_read, validator.reported());
+
+        for (const auto& err : validator.errors) {
+            std::string message = err.format();
+            rb_ary_push(errors_array, rb_utf8_str_new(message.data(), (long)message.size()));
+        }
+        snprintf(error_message, sizeof(error_message), "%s", validator.error);
+        reported = validator.reported();
+        state = validator.state();
+    }
 
-        // Use a MemBufFormatTarget to get UTF-8 encoded output
-        MemBufFormatTarget target;
-        DOMLSOutput* output = ((DOMImplementationLS*)impl)->createLSOutput();
-        output->setByteStream(&target);
+    if (state) {
+        rb_jump_tag(state);
+    }
+    // Cancelled after the scan's last check; raise the interrupt
+    if (interrupted) {
+        rb_jump_tag(interrupted);
+    }
+    if (error_message[0]) {
+        rb_raise(rb_eRuntimeError, "%s", error_message);
+    }
+    RB_GC_GUARD(io);
+    RB_GC_GUARD(path);
+    return yield ? SIZET2NUM(reported) : errors_array;
+}
+
+// schema.validate_file(path, max_errors: nil, fatal_on_first: false,
+// allow_external_entities: false) { |message| ... } - validates
+// a file of any size without loading it
+static VALUE schema_validate_file(int argc, VALUE* argv, VALUE self) {
+    VALUE path, options;
+    rb_scan_args(argc, argv, "11", &path, &options);
+    FilePathValue(path);
 
-        serializer->write(doc_wrapper->doc, output);
+    FILE* file = fopen(RSTRING_PTR(path), "rb");
+    if (!file) {
+        rb_sys_fail_str(path);
+    }
+    fclose(file);
 
-        // Get the UTF-8 content
-        std::string xml_content((const char*)target.getRawBuffer(), target.getLen());
+    return validate_stream(self, Qnil, path, options);
+}
 
-        output->release();
-        serializer->release();
-
-        // Create a validating parser
-        XercesDOMParser* validator = new XercesDOMParser();
-        validator->setValidationScheme(XercesDOMParser::Val_Always);
-        validator->setDoNamespaces(true);
-        validator->setDoSchema(true);
-        validator->setValidationSchemaFullChecking(true);
-
-        ValidationErrorHandler errorHandler;
-        validator->setErrorHandler(&errorHandler);
-
-        // Create a combined input with both the schema and the document
-        // First, we need to add schema location to the document
-        std::string schema_location = "http://example.com/schema";
-
-        // Create memory buffers for both schema and document
-        MemBufInputSource schemaSource(
-            (const XMLByte*)schema_wrapper->schemaContent->c_str(),
-            schema_wrapper->schemaContent->length(),
-            "schema.xsd"
-        );
-
-        // Load the schema grammar
+// schema.validate_io(io, max_errors: nil, fatal_on_first: false,
+// allow_external_entities: false) { |message| ... } - validates
+// XML read from io in chunks
+static VALUE schema_validate_io(int argc, VALUE* argv, VALUE self) {
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+    if (!rb_respond_to(io, rb_intern("read"))) {
+        rb_raise(rb_eTypeError, "io must respond to read");
+    }
+    return validate_stream(self, io, Qnil, options);
+}
+
+// A document or a string to validate
+struct ValidationInput {
+    DocumentWrapper* document;  // nullptr when validating text
+    const char* text;
+    size_t length;
+};
+
+// Validate one input, serializing documents as needed. Only Xerces is
+// called here, so the GVL need not be held.
+static void validate_input(SchemaWrapper* schema, const ValidationInput& input, const ErrorLimits& limits,
+                           bool allow_external, std::vector<ErrorRecord>& errors) {
+    DocumentWrapper* doc_wrapper = input.document;
+    if (!doc_wrapper) {
+        validate_with_schema(schema, input.text, input.length, limits, allow_external, errors);
+        return;
+    }
+    if (!doc_wrapper->doc) {
+        return;
+    }
+
+    // An unmodified preserve_source document is validated from its
+    // source; anything else is serialized first
+    const std::string* text = doc_wrapper->source ? doc_wrapper->source->unchanged_text(doc_wrapper->doc) : nullptr;
+    if (text) {
+        validate_with_schema(schema, text->data(), text->size(), limits, allow_external, errors);
+    } else {
+        MemBufFormatTarget target;
+        write_validation_input(doc_wrapper, target);
+        validate_with_schema(schema, (const char*)target.getRawBuffer(), target.getLen(), limits, allow_external, errors);
+    }
+}
+
+// Inputs validated against one schema by a pool of native threads. The
+// grammar pool is locked, so the threads share it without copying it.
+struct ValidationBatch {
+    SchemaWrapper* schema;
+    std::vector<ValidationInput> inputs;
+    ErrorLimits limits;                              // Applied to each input
+    bool allow_external;                             // Load external entities and DTDs
+    std::vector<std::vector<ErrorRecord> > errors;  // Per input
+    std::vector<std::string> failures;               // Per input, set if validation could not run
+    unsigned threads;
+    std::atomic<size_t> next;
+    std::atomic<bool> cancelled;
+};
+
+static void validation_worker(ValidationBatch* batch) {
+    size_t index;
+    while (!batch->cancelled && (index = batch->next++) < batch->inputs.size()) {
+        char error_message[512] = "";
+        native_stats::Timer timer;
         try {
-            validator->loadGrammar(schemaSource, Grammar::SchemaGrammarType, true);
-            validator->setExternalNoNamespaceSchemaLocation("schema.xsd");
-            validator->useCachedGrammarInParse(true);
+            validate_input(batch->schema, batch->inputs[index], batch->limits, batch->allow_external, batch->errors[index]);
         } catch (const XMLException& e) {
             CharStr message(e.getMessage());
-            errorHandler.errors.push_back(std::string("Warning: Schema grammar could not be loaded: ") + message.localForm());
-        } catch (const SAXException& e) {
+            snprintf(error_message, sizeof(error_message), "XMLException during validation: %s", message.localForm());
+        } catch (const DOMException& e) {
             CharStr message(e.getMessage());
-            errorHandler.errors.push_back(std::string("Warning: Schema grammar could not be loaded: ") + message.localForm());
+            snprintf(error_message, sizeof(error_message), "DOMException during validation: %s", message.localForm());
         } catch (...) {
-            // If grammar loading fails, just note it
-            errorHandler.errors.push_back("Warning: Schema grammar could not be loaded");
+            snprintf(error_message, sizeof(error_message), "Unknown exception during validation");
+        }
+        timer.stop(native_stats::VALIDATE_TIME);
+        if (error_message[0]) {
+            batch->failures[index] = error_message;
+        }
+    }
+}
+
+// Runs the batch with the GVL released. The calling thread works
+// alongside the extra threads it starts.
+static void* validate_batch_without_gvl(void* arg) {
+    ValidationBatch* batch = static_cast<ValidationBatch*>(arg);
+    std::vector<std::thread> workers;
+    try {
+        for (unsigned i = 1; i < batch->threads; i++) {
+            workers.emplace_back(validation_worker, batch);
         }
+    } catch (const std::system_error&) {
+        // Carry on with the threads that did start
+    }
 
-        // Now parse and validate the document
-        MemBufInputSource docSource(
-            (const XMLByte*)xml_content.c_str(),
-            xml_content.length(),
-            "document.xml"
-        );
+    validation_worker(batch);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return nullptr;
+}
 
-        try {
-            validator->parse(docSource);
-        } catch (const XMLException& e) {
-            char* message = XMLString::transcode(e.getMessage());
-            errorHandler.errors.push_back(std::string("XMLException: ") + message);
-            XMLString::release(&message);
-        } catch (const DOMException& e) {
-            char* message = XMLString::transcode(e.getMessage());
-            errorHandler.errors.push_back(std::string("DOMException: ") + message);
-            XMLString::release(&message);
-        } catch (...) {
-            errorHandler.errors.push_back("Unknown parsing exception");
+// Interrupt handler: stop handing out inputs, so the workers finish what
+// they have and return
+static void cancel_validation_batch(void* arg) {
+    static_cast<ValidationBatch*>(arg)->cancelled = true;
+}
+
+// Validate every input of batch, pushing an array of error messages for
+// each onto results. If an input could not be validated its message is
+// copied to error_message. Returns the state of a pending interrupt, to be
+// raised with rb_jump_tag once the batch is freed.
+static int run_validation_batch(ValidationBatch& batch, VALUE results, char* error_message, size_t error_size) {
+    size_t count = batch.inputs.size();
+    batch.errors.assign(count, *batch.schema->grammar_errors);
+    batch.failures.assign(count, std::string());
+    batch.next = 0;
+    native_stats::count(native_stats::VALIDATIONS, count);
+
+    // Documents are serialized by the workers, so they cannot be modified
+    // during a round
+    std::vector<DOMNode*> documents;
+    for (const ValidationInput& input : batch.inputs) {
+        if (input.document) {
+            documents.push_back(input.document->doc);
         }
+    }
 
-        delete validator;
+    // Interrupts are handled between rounds; anything else that cancelled
+    // the batch (such as Thread#wakeup) just resumes it
+    while (batch.next < count) {
+        batch.cancelled = false;
+        int state = call_without_gvl_reading(documents, validate_batch_without_gvl, &batch,
+                                             cancel_validation_batch, &batch);
+        if (!state) {
+            rb_protect(check_interrupts, Qnil, &state);
+        }
+        if (state) {
+            return state;
+        }
+    }
 
-        // Return array of error messages
-        VALUE errors_array = rb_ary_new();
-        for (const auto& err : errorHandler.errors) {
-            rb_ary_push(errors_array, rb_str_new_cstr(err.c_str()));
+    for (size_t i = 0; i < count; i++) {
+        if (!batch.failures[i].empty()) {
+            snprintf(error_message, error_size, "%s", batch.failures[i].c_str());
+            return 0;
+        }
+        VALUE errors_array = rb_ary_new_capa(batch.errors[i].size());
+        for (const auto& err : batch.errors[i]) {
+            std::string message = err.format();
+            rb_ary_push(errors_array, rb_utf8_str_new(message.data(), (long)message.size()));
         }
+        rb_ary_push(results, errors_array);
+    }
+    return 0;
+}
 
-        return errors_array;
+// document.validate(schema, max_errors: nil, fatal_on_first: false,
+// allow_external_entities: false) - returns array of error messages
+// (empty if valid)
+static VALUE document_validate(int argc, VALUE* argv, VALUE self) {
+    VALUE rb_schema, options;
+    rb_scan_args(argc, argv, "11", &rb_schema, &options);
+    if (!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        validate_option_keys(options, {"max_errors", "fatal_on_first", "allow_external_entities"});
+    }
+    ErrorLimits limits = error_limits(options);
 
-    } catch (const XMLException& e) {
-        char* message = XMLString::transcode(e.getMessage());
-        VALUE rb_error = rb_str_new_cstr(message);
-        XMLString::release(&message);
-        rb_raise(rb_eRuntimeError, "XMLException during validation: %s", StringValueCStr(rb_error));
-    } catch (const DOMException& e) {
-        char* message = XMLString::transcode(e.getMessage());
-        VALUE rb_error = rb_str_new_cstr(message);
-        XMLString::release(&message);
-        rb_raise(rb_eRuntimeError, "DOMException during validation: %s", StringValueCStr(rb_error));
-    } catch (...) {
-        rb_raise(rb_eRuntimeError, "Unknown exception during validation");
+    DocumentWrapper* doc_wrapper;
+    TypedData_Get_Struct(self, DocumentWrapper, &document_type, doc_wrapper);
+
+    SchemaWrapper* schema_wrapper;
+    TypedData_Get_Struct(rb_schema, SchemaWrapper, &schema_type, schema_wrapper);
+
+    VALUE results = rb_ary_new_capa(1);
+    char error_message[512] = "";
+    int state;
+    {
+        ValidationBatch batch;
+        batch.schema = schema_wrapper;
+        batch.limits = limits;
+        batch.allow_external = allow_external_entities(options);
+        batch.threads = 1;
+        batch.inputs.push_back(ValidationInput{doc_wrapper, nullptr, 0});
+        state = run_validation_batch(batch, results, error_message, sizeof(error_message));
     }
 
-    return Qnil;
+    if (state) {
+        rb_jump_tag(state);
+    }
+    if (error_message[0]) {
+        rb_raise(rb_eRuntimeError, "%s", error_message);
+    }
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(rb_schema);
+    return rb_ary_entry(results, 0);
+}
+
+// schema.validate_many(docs_or_strings, threads: n, max_errors: nil,
+// fatal_on_first: false, allow_external_entities: false) - validates each Document or XML string on a pool
+// of native threads, returning an array of error message arrays in the
+// same order. The documents cannot be modified until it returns.
+static VALUE schema_validate_many(int argc, VALUE* argv, VALUE self) {
+    VALUE rb_inputs, options;
+    rb_scan_args(argc, argv, "11", &rb_inputs, &options);
+    rb_inputs = rb_convert_type(rb_inputs, T_ARRAY, "Array", "to_a");
+
+    unsigned threads = std::thread::hardware_concurrency();
+    if (!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        validate_option_keys(options, {"threads", "max_errors", "fatal_on_first", "allow_external_entities"});
+
+        VALUE rb_threads = rb_hash_aref(options, ID2SYM(rb_intern("threads")));
+        if (!NIL_P(rb_threads)) {
+            long requested = NUM2LONG(rb_threads);
+            if (requested < 1) {
+                rb_raise(rb_eArgError, "threads must be at least 1");
+            }
+            threads = (unsigned)std::min(requested, (long)UINT_MAX);
+        }
+    }
+
+    ErrorLimits limits = error_limits(options);
+
+    SchemaWrapper* schema_wrapper;
+    TypedData_Get_Struct(self, SchemaWrapper, &schema_type, schema_wrapper);
+
+    // Frozen copies of the strings, so other threads cannot change them
+    // while they are being validated
+    long count = RARRAY_LEN(rb_inputs);
+    VALUE keep = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        VALUE item = rb_ary_entry(rb_inputs, i);
+        if (RB_TYPE_P(item, T_STRING)) {
+            rb_ary_push(keep, rb_str_new_frozen(item));
+        } else if (rb_obj_is_kind_of(item, rb_cDocument)) {
+            rb_ary_push(keep, item);
+        } else {
+            rb_raise(rb_eTypeError, "expected an RXerces::XML::Document or String, got %s", rb_obj_classname(item));
+        }
+    }
+
+    ensure_xerces_initialized();
+
+    VALUE results = rb_ary_new_capa(count);
+    char error_message[512] = "";
+    int state;
+    {
+        ValidationBatch batch;
+        batch.schema = schema_wrapper;
+        batch.limits = limits;
+        batch.allow_external = allow_external_entities(options);
+        batch.threads = std::max(1u, std::min(threads, (unsigned)std::max(count, 1L)));
+        batch.inputs.reserve(count);
+        for (long i = 0; i < count; i++) {
+            VALUE item = rb_ary_entry(keep, i);
+            if (RB_TYPE_P(item, T_STRING)) {
+                batch.inputs.push_back(ValidationInput{nullptr, RSTRING_PTR(item), (size_t)RSTRING_LEN(item)});
+            } else {
+                DocumentWrapper* doc_wrapper;
+                TypedData_Get_Struct(item, DocumentWrapper, &document_type, doc_wrapper);
+                batch.inputs.push_back(ValidationInput{doc_wrapper, nullptr, 0});
+            }
+        }
+        state = run_validation_batch(batch, results, error_message, sizeof(error_message));
+    }
+
+    if (state) {
+        rb_jump_tag(state);
+    }
+    if (error_message[0]) {
+        rb_raise(rb_eRuntimeError, "%s", error_message);
+    }
+    RB_GC_GUARD(keep);
+    RB_GC_GUARD(self);
+    return results;
 }
 
 // RXerces.cache_xpath_validation? - check if XPath validation caching is enabled
@@ -3163,6 +6443,137 @@ static VALUE rxerces_xalan_enabled_p(VALUE self) {
 #endif
 }
 
+// RXerces.xpath_engine - returns the engine used for XPath queries
+static VALUE rxerces_xpath_engine(VALUE self) {
+    switch (xpath_engine) {
+        case XPATH_ENGINE_XALAN:
+            return ID2SYM(rb_intern("xalan"));
+        case XPATH_ENGINE_XERCES:
+            return ID2SYM(rb_intern("xerces"));
+        default:
+            return ID2SYM(rb_intern("native"));
+    }
+}
+
+// RXerces.xpath_engine = :native, :xalan or :xerces - select the XPath engine
+static VALUE rxerces_set_xpath_engine(VALUE self, VALUE val) {
+    if (!SYMBOL_P(val)) {
+        rb_raise(rb_eTypeError, "xpath_engine must be a Symbol");
+    }
+
+    ID engine = SYM2ID(val);
+    if (engine == rb_intern("native")) {
+        xpath_engine = XPATH_ENGINE_NATIVE;
+    } else if (engine == rb_intern("xerces")) {
+        xpath_engine = XPATH_ENGINE_XERCES;
+    } else if (engine == rb_intern("xalan")) {
+#ifdef HAVE_XALAN
+        xpath_engine = XPATH_ENGINE_XALAN;
+#else
+        rb_raise(rb_eArgError, "Xalan support is not available");
+#endif
+    } else {
+        rb_raise(rb_eArgError, "unknown XPath engine: %s (expected :native, :xalan or :xerces)", rb_id2name(engine));
+    }
+
+    return val;
+}
+
+// Selector.compile(css) - parse a CSS selector once for reuse. Compiled
+// selectors are shared through the process-wide selector cache.
+static VALUE selector_compile(VALUE klass, VALUE css) {
+    Check_Type(css, T_STRING);
+    native_css::SelectorPtr compiled = css_selector_from_value(css);
+
+    SelectorWrapper* wrapper = ALLOC(SelectorWrapper);
+    wrapper->selector = new native_css::SelectorPtr(compiled);
+    return TypedData_Wrap_Struct(klass, &selector_type, wrapper);
+}
+
+// selector.source / selector.to_s - the selector text
+static VALUE selector_source(VALUE self) {
+    SelectorWrapper* wrapper;
+    TypedData_Get_Struct(self, SelectorWrapper, &selector_type, wrapper);
+
+    const std::string& source = (*wrapper->selector)->source();
+    return rb_utf8_str_new(source.data(), source.length());
+}
+
+// selector.inspect
+static VALUE selector_inspect(VALUE self) {
+    VALUE source = selector_source(self);
+    return rb_sprintf("#<RXerces::XML::Selector %" PRIsVALUE ">", rb_inspect(source));
+}
+
+// selector.matches?(node) - true if node is an element matching the selector
+static VALUE selector_matches_p(VALUE self, VALUE node) {
+    return node_matches_p(node, self);
+}
+
+// selector.to_xpath - the XPath the :xpath CSS engine evaluates, relative
+// to the node searched
+static VALUE selector_to_xpath(VALUE self) {
+    return css_selector_to_xpath(self);
+}
+
+// RXerces.css_engine - returns the engine used for CSS queries
+static VALUE rxerces_css_engine(VALUE self) {
+    return ID2SYM(rb_intern(css_engine == CSS_ENGINE_XPATH ? "xpath" : "native"));
+}
+
+// RXerces.css_engine = :native or :xpath - select the CSS engine
+static VALUE rxerces_set_css_engine(VALUE self, VALUE val) {
+    if (!SYMBOL_P(val)) {
+        rb_raise(rb_eTypeError, "css_engine must be a Symbol");
+    }
+
+    ID engine = SYM2ID(val);
+    if (engine == rb_intern("native")) {
+        css_engine = CSS_ENGINE_NATIVE;
+    } else if (engine == rb_intern("xpath")) {
+        css_engine = CSS_ENGINE_XPATH;
+    } else {
+        rb_raise(rb_eArgError, "unknown CSS engine: %s (expected :native or :xpath)", rb_id2name(engine));
+    }
+
+    return val;
+}
+
+// RXerces.stats - counters and latency histograms for the whole process.
+// Histograms are hashes of count, total seconds and buckets, which map the
+// upper bound of each bucket in seconds to the number of events in it.
+static VALUE rxerces_stats(VALUE self) {
+    VALUE stats = rb_hash_new();
+    for (size_t i = 0; i < native_stats::COUNTER_COUNT; i++) {
+        rb_hash_aset(stats, ID2SYM(rb_intern(native_stats::counter_names[i])),
+                     ULL2NUM(native_stats::counter_value((native_stats::Counter)i)));
+    }
+
+    for (size_t i = 0; i < native_stats::HISTOGRAM_COUNT; i++) {
+        native_stats::HistogramSnapshot snapshot;
+        native_stats::snapshot((native_stats::Histogram)i, snapshot);
+
+        VALUE buckets = rb_hash_new();
+        for (size_t j = 0; j < native_stats::HISTOGRAM_BUCKETS; j++) {
+            uint64_t limit = native_stats::bucket_limit(j);
+            rb_hash_aset(buckets, DBL2NUM(limit ? limit / 1e6 : HUGE_VAL), ULL2NUM(snapshot.buckets[j]));
+        }
+
+        VALUE histogram = rb_hash_new();
+        rb_hash_aset(histogram, ID2SYM(rb_intern("count")), ULL2NUM(snapshot.count));
+        rb_hash_aset(histogram, ID2SYM(rb_intern("total")), DBL2NUM(snapshot.total_nanoseconds / 1e9));
+        rb_hash_aset(histogram, ID2SYM(rb_intern("buckets")), buckets);
+        rb_hash_aset(stats, ID2SYM(rb_intern(native_stats::histogram_names[i])), histogram);
+    }
+    return stats;
+}
+
+// RXerces.reset_stats - set every counter and histogram back to zero
+static VALUE rxerces_reset_stats(VALUE self) {
+    native_stats::reset();
+    return Qnil;
+}
+
 // RXerces.xpath_max_length - get max XPath expression length
 static VALUE rxerces_xpath_max_length(VALUE self) {
     return LONG2NUM((long)xpath_max_length);
@@ -3197,6 +6608,12 @@ extern "C" void Init_rxerces(void) {
     rb_define_singleton_method(rb_mRXerces, "xpath_max_length", RUBY_METHOD_FUNC(rxerces_xpath_max_length), 0);
     rb_define_singleton_method(rb_mRXerces, "xpath_max_length=", RUBY_METHOD_FUNC(rxerces_set_xpath_max_length), 1);
     rb_define_singleton_method(rb_mRXerces, "xalan_enabled?", RUBY_METHOD_FUNC(rxerces_xalan_enabled_p), 0);
+    rb_define_singleton_method(rb_mRXerces, "xpath_engine", RUBY_METHOD_FUNC(rxerces_xpath_engine), 0);
+    rb_define_singleton_method(rb_mRXerces, "xpath_engine=", RUBY_METHOD_FUNC(rxerces_set_xpath_engine), 1);
+    rb_define_singleton_method(rb_mRXerces, "css_engine", RUBY_METHOD_FUNC(rxerces_css_engine), 0);
+    rb_define_singleton_method(rb_mRXerces, "css_engine=", RUBY_METHOD_FUNC(rxerces_set_css_engine), 1);
+    rb_define_singleton_method(rb_mRXerces, "stats", RUBY_METHOD_FUNC(rxerces_stats), 0);
+    rb_define_singleton_method(rb_mRXerces, "reset_stats", RUBY_METHOD_FUNC(rxerces_reset_stats), 0);
 
     rb_mXML = rb_define_module_under(rb_mRXerces, "XML");
 
@@ -3205,10 +6622,17 @@ extern "C" void Init_rxerces(void) {
     rb_define_singleton_method(rb_cDocument, "parse", RUBY_METHOD_FUNC(document_parse), -1);
     rb_define_method(rb_cDocument, "root", RUBY_METHOD_FUNC(document_root), 0);
     rb_define_method(rb_cDocument, "errors", RUBY_METHOD_FUNC(document_errors), 0);
+    rb_define_method(rb_cDocument, "parse_stats", RUBY_METHOD_FUNC(document_parse_stats), 0);
+    rb_define_method(rb_cDocument, "memory_stats", RUBY_METHOD_FUNC(document_memory_stats), 0);
     rb_define_method(rb_cDocument, "to_s", RUBY_METHOD_FUNC(document_to_s), 0);
+    rb_define_method(rb_cDocument, "write_to", RUBY_METHOD_FUNC(document_write_to), -1);
+    rb_define_method(rb_cDocument, "canonicalize", RUBY_METHOD_FUNC(document_canonicalize), -1);
+    rb_define_method(rb_cDocument, "write_canonical", RUBY_METHOD_FUNC(document_write_canonical), -1);
     rb_define_alias(rb_cDocument, "to_xml", "to_s");
     rb_define_method(rb_cDocument, "inspect", RUBY_METHOD_FUNC(document_inspect), 0);
-    rb_define_method(rb_cDocument, "xpath", RUBY_METHOD_FUNC(document_xpath), 1);
+    rb_define_method(rb_cDocument, "xpath", RUBY_METHOD_FUNC(document_xpath), -1);
+    rb_define_method(rb_cDocument, "xpath_profile", RUBY_METHOD_FUNC(document_xpath_profile), 1);
+    rb_define_method(rb_cDocument, "xpath_each", RUBY_METHOD_FUNC(document_xpath_each), 1);
     rb_define_method(rb_cDocument, "at_xpath", RUBY_METHOD_FUNC(document_at_xpath), 1);
     rb_define_alias(rb_cDocument, "at", "at_xpath");
     rb_define_method(rb_cDocument, "css", RUBY_METHOD_FUNC(document_css), 1);
@@ -3222,6 +6646,9 @@ extern "C" void Init_rxerces(void) {
     rb_define_alias(rb_cDocument, "elements", "element_children");
     rb_define_method(rb_cDocument, "first_element_child", RUBY_METHOD_FUNC(document_first_element_child), 0);
     rb_define_method(rb_cDocument, "last_element_child", RUBY_METHOD_FUNC(document_last_element_child), 0);
+    rb_define_method(rb_cDocument, "traverse", RUBY_METHOD_FUNC(document_traverse), -1);
+    rb_define_method(rb_cDocument, "each_element", RUBY_METHOD_FUNC(document_each_element), -1);
+    rb_define_method(rb_cDocument, "each_with_path", RUBY_METHOD_FUNC(document_each_with_path), -1);
 
     rb_cNode = rb_define_class_under(rb_mXML, "Node", rb_cObject);
     rb_undef_alloc_func(rb_cNode);
@@ -3242,9 +6669,17 @@ extern "C" void Init_rxerces(void) {
     rb_define_alias(rb_cNode, "elements", "element_children");
     rb_define_method(rb_cNode, "first_element_child", RUBY_METHOD_FUNC(node_first_element_child), 0);
     rb_define_method(rb_cNode, "last_element_child", RUBY_METHOD_FUNC(node_last_element_child), 0);
+    rb_define_method(rb_cNode, "child_at", RUBY_METHOD_FUNC(node_child_at), 1);
+    rb_define_method(rb_cNode, "child_count", RUBY_METHOD_FUNC(node_child_count), 0);
+    rb_define_method(rb_cNode, "traverse", RUBY_METHOD_FUNC(node_traverse), -1);
+    rb_define_method(rb_cNode, "each_descendant", RUBY_METHOD_FUNC(node_each_descendant), -1);
+    rb_define_method(rb_cNode, "each_element", RUBY_METHOD_FUNC(node_each_element), -1);
     rb_define_method(rb_cNode, "document", RUBY_METHOD_FUNC(node_document), 0);
     rb_define_method(rb_cNode, "parent", RUBY_METHOD_FUNC(node_parent), 0);
     rb_define_method(rb_cNode, "ancestors", RUBY_METHOD_FUNC(node_ancestors), -1);
+    rb_define_method(rb_cNode, "ancestor_of?", RUBY_METHOD_FUNC(node_ancestor_of_p), 1);
+    rb_define_method(rb_cNode, "descendant_of?", RUBY_METHOD_FUNC(node_descendant_of_p), 1);
+    rb_define_method(rb_cNode, "<=>", RUBY_METHOD_FUNC(node_compare), 1);
     rb_define_method(rb_cNode, "attributes", RUBY_METHOD_FUNC(node_attributes), 0);
     rb_define_method(rb_cNode, "attribute_nodes", RUBY_METHOD_FUNC(node_attribute_nodes), 0);
     rb_define_method(rb_cNode, "next_sibling", RUBY_METHOD_FUNC(node_next_sibling), 0);
@@ -3256,14 +6691,23 @@ extern "C" void Init_rxerces(void) {
     rb_define_alias(rb_cNode, "unlink", "remove");
     rb_define_method(rb_cNode, "inner_html", RUBY_METHOD_FUNC(node_inner_html), 0);
     rb_define_alias(rb_cNode, "inner_xml", "inner_html");
+    rb_define_method(rb_cNode, "to_xml", RUBY_METHOD_FUNC(node_to_xml), 0);
+    rb_define_alias(rb_cNode, "to_s", "to_xml");
+    rb_define_method(rb_cNode, "write_to", RUBY_METHOD_FUNC(node_write_to), -1);
+    rb_define_method(rb_cNode, "canonicalize", RUBY_METHOD_FUNC(node_canonicalize), -1);
+    rb_define_method(rb_cNode, "write_canonical", RUBY_METHOD_FUNC(node_write_canonical), -1);
     rb_define_method(rb_cNode, "path", RUBY_METHOD_FUNC(node_path), 0);
+    rb_define_method(rb_cNode, "each_with_path", RUBY_METHOD_FUNC(node_each_with_path), -1);
     rb_define_method(rb_cNode, "blank?", RUBY_METHOD_FUNC(node_blank_p), 0);
-    rb_define_method(rb_cNode, "xpath", RUBY_METHOD_FUNC(node_xpath), 1);
+    rb_define_method(rb_cNode, "xpath", RUBY_METHOD_FUNC(node_xpath), -1);
+    rb_define_method(rb_cNode, "xpath_each", RUBY_METHOD_FUNC(node_xpath_each), 1);
     rb_define_alias(rb_cNode, "search", "xpath");
+    rb_define_method(rb_cNode, "search_subtree", RUBY_METHOD_FUNC(node_search_subtree), -1);
     rb_define_method(rb_cNode, "at_xpath", RUBY_METHOD_FUNC(node_at_xpath), 1);
     rb_define_alias(rb_cNode, "at", "at_xpath");
     rb_define_method(rb_cNode, "css", RUBY_METHOD_FUNC(node_css), 1);
     rb_define_method(rb_cNode, "at_css", RUBY_METHOD_FUNC(node_at_css), 1);
+    rb_define_method(rb_cNode, "matches?", RUBY_METHOD_FUNC(node_matches_p), 1);
     rb_define_alias(rb_cNode, "get_attribute", "[]");
     rb_define_alias(rb_cNode, "attribute", "[]");
 
@@ -3283,8 +6727,16 @@ extern "C" void Init_rxerces(void) {
     rb_define_method(rb_cNodeSet, "empty?", RUBY_METHOD_FUNC(nodeset_empty_p), 0);
     rb_define_method(rb_cNodeSet, "each", RUBY_METHOD_FUNC(nodeset_each), 0);
     rb_define_method(rb_cNodeSet, "to_a", RUBY_METHOD_FUNC(nodeset_to_a), 0);
+    rb_define_method(rb_cNodeSet, "|", RUBY_METHOD_FUNC(nodeset_union), 1);
+    rb_define_method(rb_cNodeSet, "&", RUBY_METHOD_FUNC(nodeset_intersection), 1);
+    rb_define_method(rb_cNodeSet, "-", RUBY_METHOD_FUNC(nodeset_difference), 1);
+    rb_define_method(rb_cNodeSet, "sort", RUBY_METHOD_FUNC(nodeset_sort), 0);
+    rb_define_method(rb_cNodeSet, "uniq", RUBY_METHOD_FUNC(nodeset_uniq), 0);
     rb_define_method(rb_cNodeSet, "text", RUBY_METHOD_FUNC(nodeset_text), 0);
+    rb_define_method(rb_cNodeSet, "paths", RUBY_METHOD_FUNC(nodeset_paths), 0);
     rb_define_method(rb_cNodeSet, "inner_html", RUBY_METHOD_FUNC(nodeset_inner_html), 0);
+    rb_define_method(rb_cNodeSet, "to_xml", RUBY_METHOD_FUNC(nodeset_to_xml), 0);
+    rb_define_method(rb_cNodeSet, "write_to", RUBY_METHOD_FUNC(nodeset_write_to), -1);
     rb_define_method(rb_cNodeSet, "inspect", RUBY_METHOD_FUNC(nodeset_inspect), 0);
     rb_define_alias(rb_cNodeSet, "to_s", "inspect");
     rb_include_module(rb_cNodeSet, rb_mEnumerable);
@@ -3293,8 +6745,29 @@ extern "C" void Init_rxerces(void) {
     rb_undef_alloc_func(rb_cSchema);
     rb_define_singleton_method(rb_cSchema, "from_document", RUBY_METHOD_FUNC(schema_from_document), -1);
     rb_define_singleton_method(rb_cSchema, "from_string", RUBY_METHOD_FUNC(schema_from_document), -1);
-
-    rb_define_method(rb_cDocument, "validate", RUBY_METHOD_FUNC(document_validate), 1);
+    rb_define_method(rb_cSchema, "validate_many", RUBY_METHOD_FUNC(schema_validate_many), -1);
+    rb_define_method(rb_cSchema, "validate_file", RUBY_METHOD_FUNC(schema_validate_file), -1);
+    rb_define_method(rb_cSchema, "validate_io", RUBY_METHOD_FUNC(schema_validate_io), -1);
+
+    rb_define_method(rb_cDocument, "validate", RUBY_METHOD_FUNC(document_validate), -1);
+
+    rb_cSyntaxError = rb_define_class_under(rb_mXML, "SyntaxError", rb_eStandardError);
+    rb_define_attr(rb_cSyntaxError, "level", 1, 0);
+    rb_define_attr(rb_cSyntaxError, "line", 1, 0);
+    rb_define_attr(rb_cSyntaxError, "column", 1, 0);
+    rb_define_attr(rb_cSyntaxError, "errors", 1, 0);
+    rb_define_method(rb_cSyntaxError, "warning?", RUBY_METHOD_FUNC(syntax_error_warning_p), 0);
+    rb_define_method(rb_cSyntaxError, "error?", RUBY_METHOD_FUNC(syntax_error_error_p), 0);
+    rb_define_method(rb_cSyntaxError, "fatal?", RUBY_METHOD_FUNC(syntax_error_fatal_p), 0);
+
+    rb_cSelector = rb_define_class_under(rb_mXML, "Selector", rb_cObject);
+    rb_undef_alloc_func(rb_cSelector);
+    rb_define_singleton_method(rb_cSelector, "compile", RUBY_METHOD_FUNC(selector_compile), 1);
+    rb_define_method(rb_cSelector, "source", RUBY_METHOD_FUNC(selector_source), 0);
+    rb_define_alias(rb_cSelector, "to_s", "source");
+    rb_define_method(rb_cSelector, "inspect", RUBY_METHOD_FUNC(selector_inspect), 0);
+    rb_define_method(rb_cSelector, "matches?", RUBY_METHOD_FUNC(selector_matches_p), 1);
+    rb_define_method(rb_cSelector, "to_xpath", RUBY_METHOD_FUNC(selector_to_xpath), 0);
 
     // Register cleanup handler
     atexit(cleanup_xerces);
@@ -0,0 +1,440 @@
+#include "source_map.h"
+#include "xpath_engine.h"
+#include <algorithm>
+#include <cctype>
+
+using namespace xercesc;
+
+namespace native_source {
+
+static const size_t NO_OFFSET = (size_t)-1;
+
+// Output is passed to the target in blocks of about this size
+static const size_t FLUSH_SIZE = 16 * 1024;
+
+void SourceMap::add(const DOMNode* node, size_t start, size_t content, size_t end) {
+    Span span;
+    span.start = start;
+    span.content = content;
+    span.end = end;
+    span.clean = true;
+    span.tag_clean = true;
+    spans_[node] = span;
+}
+
+void SourceMap::content_changed(const DOMNode* node) {
+    if (node && node->getNodeType() == DOMNode::ATTRIBUTE_NODE) {
+        attributes_changed(static_cast<const DOMAttr*>(node)->getOwnerElement());
+        return;
+    }
+
+    // Walk all the way up: elements expanded from entities have no span,
+    // but their ancestors do
+    for (; node; node = node->getParentNode()) {
+        auto it = spans_.find(node);
+        if (it != spans_.end()) {
+            it->second.clean = false;
+        }
+    }
+}
+
+void SourceMap::attributes_changed(const DOMNode* element) {
+    auto it = spans_.find(element);
+    if (it != spans_.end()) {
+        it->second.tag_clean = false;
+    }
+    content_changed(element);
+}
+
+void SourceMap::children_changed(const DOMNode* parent) {
+    if (parent && parent->getNodeType() == DOMNode::DOCUMENT_NODE) {
+        spans_.erase(parent);
+    } else {
+        content_changed(parent);
+    }
+}
+
+const std::string* SourceMap::unchanged_text(const DOMDocument* document) const {
+    auto it = spans_.find(document);
+    return it != spans_.end() && it->second.clean ? &text_ : nullptr;
+}
+
+void SourceMap::node_moved(const DOMNode* node) {
+    spans_.erase(node);
+}
+
+void SourceMap::forget_descendants(const DOMNode* node) {
+    std::vector<const DOMNode*> pending;
+    for (const DOMNode* child = node->getFirstChild(); child; child = child->getNextSibling()) {
+        pending.push_back(child);
+    }
+
+    while (!pending.empty()) {
+        const DOMNode* current = pending.back();
+        pending.pop_back();
+        if (current->getNodeType() != DOMNode::ELEMENT_NODE) {
+            continue;
+        }
+        spans_.erase(current);
+        for (const DOMNode* child = current->getFirstChild(); child; child = child->getNextSibling()) {
+            pending.push_back(child);
+        }
+    }
+}
+
+static std::string utf8(const XMLCh* str) {
+    if (!str) {
+        return std::string();
+    }
+    return native_xpath::xstring_to_utf8(str, XMLString::stringLen(str));
+}
+
+// Walks the dirty part of a document, copying the clean parts from the
+// source text
+class SourceWriter {
+public:
+    SourceWriter(const std::string& text, const std::unordered_map<const DOMNode*, Span>& spans,
+                 XMLFormatTarget& target, const NodeWriter& write_node)
+        : text_(text), spans_(spans), target_(target), write_node_(write_node) {}
+
+    bool write_document(DOMDocument* document) {
+        auto doc_span = spans_.find(document);
+        if (doc_span == spans_.end()) {
+            return write_node(document);
+        }
+        if (doc_span->second.clean) {
+            copy(0, text_.size());
+            return true;
+        }
+
+        // The prolog and epilog are unchanged; only the document element
+        // needs rebuilding
+        DOMElement* root = document->getDocumentElement();
+        const Span* root_span = root ? span_of(root) : nullptr;
+        if (!root_span) {
+            return write_node(document);
+        }
+
+        copy(0, root_span->start);
+        if (!write_element(root)) {
+            return false;
+        }
+        copy(root_span->end, text_.size());
+        flush();
+        return true;
+    }
+
+private:
+    const Span* span_of(const DOMNode* node) const {
+        auto it = spans_.find(node);
+        return it == spans_.end() ? nullptr : &it->second;
+    }
+
+    bool write_element(DOMElement* element) {
+        // Same walk as the canonicalizer: opening markup on the way down,
+        // end tags on the way back up
+        DOMNode* node = element;
+        while (node) {
+            bool descend;
+            if (!enter(node, descend)) {
+                return false;
+            }
+
+            DOMNode* child = descend ? node->getFirstChild() : nullptr;
+            if (child) {
+                node = child;
+                continue;
+            }
+
+            while (node) {
+                leave(node, descend);
+                descend = false;
+                if (node == element) {
+                    node = nullptr;
+                } else if (node->getNextSibling()) {
+                    node = node->getNextSibling();
+                    break;
+                } else {
+                    node = node->getParentNode();
+                    descend = true;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Write the opening markup of node. descend is set when its children
+    // are to be written one by one, followed by an end tag.
+    bool enter(DOMNode* node, bool& descend) {
+        descend = false;
+        switch (node->getNodeType()) {
+            case DOMNode::ELEMENT_NODE: {
+                const Span* span = span_of(node);
+                if (!span) {
+                    return write_node(node);
+                }
+                if (span->clean) {
+                    copy(span->start, span->end);
+                    return true;
+                }
+                // An unchanged start tag is copied too, unless the element
+                // was written as an empty tag
+                if (span->tag_clean && span->content < span->end) {
+                    copy(span->start, span->content);
+                    descend = true;
+                } else {
+                    descend = start_tag(static_cast<DOMElement*>(node));
+                }
+                return true;
+            }
+            case DOMNode::TEXT_NODE:
+                escape(node->getNodeValue(), false);
+                return true;
+            case DOMNode::CDATA_SECTION_NODE: {
+                std::string data = utf8(node->getNodeValue());
+                if (data.find("]]>") == std::string::npos) {
+                    out_ += "<![CDATA[";
+                    out_ += data;
+                    out_ += "]]>";
+                } else {
+                    escape(node->getNodeValue(), false);
+                }
+                return true;
+            }
+            case DOMNode::COMMENT_NODE:
+                out_ += "<!--";
+                out_ += utf8(node->getNodeValue());
+                out_ += "-->";
+                return true;
+            case DOMNode::PROCESSING_INSTRUCTION_NODE: {
+                out_ += "<?";
+                out_ += utf8(node->getNodeName());
+                std::string data = utf8(node->getNodeValue());
+                if (!data.empty()) {
+                    out_ += ' ';
+                    out_ += data;
+                }
+                out_ += "?>";
+                return true;
+            }
+            case DOMNode::ENTITY_REFERENCE_NODE:
+                out_ += '&';
+                out_ += utf8(node->getNodeName());
+                out_ += ';';
+                return true;
+            default:
+                return write_node(node);
+        }
+    }
+
+    // Called once node and everything below it is written. had_children
+    // is true when node's children were written one by one.
+    void leave(DOMNode* node, bool had_children) {
+        if (had_children) {
+            out_ += "</";
+            out_ += utf8(node->getNodeName());
+            out_ += '>';
+        }
+        if (out_.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    // Returns true if the tag needs a matching end tag
+    bool start_tag(DOMElement* element) {
+        out_ += '<';
+        out_ += utf8(element->getNodeName());
+
+        DOMNamedNodeMap* attributes = element->getAttributes();
+        XMLSize_t length = attributes ? attributes->getLength() : 0;
+        for (XMLSize_t i = 0; i < length; i++) {
+            DOMNode* attribute = attributes->item(i);
+            out_ += ' ';
+            out_ += utf8(attribute->getNodeName());
+            out_ += "=\"";
+            escape(attribute->getNodeValue(), true);
+            out_ += '"';
+        }
+
+        if (!element->hasChildNodes()) {
+            out_ += "/>";
+            return false;
+        }
+        out_ += '>';
+        return true;
+    }
+
+    void escape(const XMLCh* value, bool attribute) {
+        for (char c : utf8(value)) {
+            switch (c) {
+                case '&': out_ += "&amp;"; break;
+                case '<': out_ += "&lt;"; break;
+                case '>': out_ += "&gt;"; break;
+                case '"':
+                    if (attribute) {
+                        out_ += "&quot;";
+                    } else {
+                        out_ += c;
+                    }
+                    break;
+                case '\r': out_ += "&#xD;"; break;
+                case '\n':
+                case '\t':
+                    if (attribute) {
+                        out_ += c == '\n' ? "&#xA;" : "&#x9;";
+                    } else {
+                        out_ += c;
+                    }
+                    break;
+                default: out_ += c; break;
+            }
+        }
+    }
+
+    bool write_node(DOMNode* node) {
+        flush();
+        return write_node_(node);
+    }
+
+    // Copy source bytes straight through in target-sized pieces
+    void copy(size_t start, size_t end) {
+        flush();
+        while (start < end) {
+            size_t length = std::min(end - start, FLUSH_SIZE * 4);
+            target_.writeChars((const XMLByte*)text_.data() + start, length, nullptr);
+            start += length;
+        }
+    }
+
+    void flush() {
+        if (!out_.empty()) {
+            target_.writeChars((const XMLByte*)out_.data(), out_.size(), nullptr);
+            out_.clear();
+        }
+    }
+
+    const std::string& text_;
+    const std::unordered_map<const DOMNode*, Span>& spans_;
+    XMLFormatTarget& target_;
+    const NodeWriter& write_node_;
+    std::string out_;
+};
+
+bool SourceMap::write(DOMDocument* document, XMLFormatTarget& out, const NodeWriter& write_node) const {
+    SourceWriter writer(text_, spans_, out, write_node);
+    return writer.write_document(document);
+}
+
+SourceTrackingParser::SourceTrackingParser(const char* text, size_t length, XMLGrammarPool* grammar_pool,
+                                           MemoryManager* manager)
+    : XercesDOMParser(nullptr, manager, grammar_pool),
+      text_(text), length_(length), entity_depth_(0), failed_(false) {}
+
+SourceMap* SourceTrackingParser::release_source() {
+    SourceMap* map = map_.release();
+    starts_.clear();
+    entity_depth_ = 0;
+
+    DOMDocument* document = getDocument();
+    if (!map || failed_ || !document || !document->getDocumentElement()) {
+        delete map;
+        return nullptr;
+    }
+
+    // Spans are byte offsets into the source as given, which only carry
+    // over to UTF-8 output when the source is UTF-8 (or ASCII) too
+    std::string encoding = utf8(document->getInputEncoding());
+    std::transform(encoding.begin(), encoding.end(), encoding.begin(), ::toupper);
+    if (encoding != "UTF-8" && encoding != "US-ASCII") {
+        delete map;
+        return nullptr;
+    }
+
+    map->add(document, 0, length_, length_);
+    return map;
+}
+
+bool SourceTrackingParser::source_offset(size_t& offset) {
+    if (failed_ || entity_depth_ > 0) {
+        return false;
+    }
+
+    try {
+        offset = (size_t)getSrcOffset();
+    } catch (...) {
+        // Not every reader can report offsets; give up on the whole map
+        failed_ = true;
+        return false;
+    }
+
+    if (offset == 0 || offset > length_ || text_[offset - 1] != '>') {
+        failed_ = true;
+        return false;
+    }
+    return true;
+}
+
+void SourceTrackingParser::startElement(const XMLElementDecl& elemDecl, const unsigned int urlId,
+                                        const XMLCh* const elemPrefix, const RefVectorOf<XMLAttr>& attrList,
+                                        const XMLSize_t attrCount, const bool isEmpty, const bool isRoot) {
+    if (!map_ && !failed_) {
+        map_.reset(new SourceMap(std::string(text_, length_)));
+    }
+
+    // The scanner has just read the whole start tag. Attribute values
+    // cannot contain '<', so the last one before here opens the tag.
+    size_t start = NO_OFFSET;
+    size_t offset = NO_OFFSET;
+    if (source_offset(offset)) {
+        for (size_t i = offset - 1; i > 0; i--) {
+            if (text_[i - 1] == '<') {
+                start = i - 1;
+                break;
+            }
+        }
+    }
+    starts_.push_back(std::make_pair(start, offset));
+
+    // Empty elements are ended from in here
+    XercesDOMParser::startElement(elemDecl, urlId, elemPrefix, attrList, attrCount, isEmpty, isRoot);
+}
+
+void SourceTrackingParser::endElement(const XMLElementDecl& elemDecl, const unsigned int urlId,
+                                      const bool isRoot, const XMLCh* const elemPrefix) {
+    XercesDOMParser::endElement(elemDecl, urlId, isRoot, elemPrefix);
+
+    if (starts_.empty()) {
+        return;
+    }
+    size_t start = starts_.back().first;
+    size_t content = starts_.back().second;
+    starts_.pop_back();
+
+    size_t end;
+    if (start == NO_OFFSET || !map_ || !source_offset(end) || end <= start) {
+        return;
+    }
+
+    // The markup must end with "/>" for an empty element or an end tag
+    size_t open = end - 1;
+    while (open > start && text_[open] != '<') {
+        open--;
+    }
+    bool empty = open == start && text_[end - 2] == '/';
+    bool closed = open > start && text_[open + 1] == '/';
+    if (empty || closed) {
+        map_->add(getCurrentNode(), start, content, end);
+    }
+}
+
+void SourceTrackingParser::startEntityReference(const XMLEntityDecl& entDecl) {
+    entity_depth_++;
+    XercesDOMParser::startEntityReference(entDecl);
+}
+
+void SourceTrackingParser::endEntityReference(const XMLEntityDecl& entDecl) {
+    XercesDOMParser::endEntityReference(entDecl);
+    entity_depth_--;
+}
+
+} // namespace native_source
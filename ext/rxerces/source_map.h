@@ -0,0 +1,110 @@
+#ifndef RXERCES_SOURCE_MAP_H
+#define RXERCES_SOURCE_MAP_H
+
+#include <xercesc/util/XercesDefs.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/parsers/XercesDOMParser.hpp>
+#include <xercesc/framework/XMLFormatter.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Incremental re-serialization. A document parsed with a
+// SourceTrackingParser keeps its source text and the byte range of every
+// element's markup in it. Mutations mark the changed element and its
+// ancestors dirty; serializing then copies the markup of clean elements
+// verbatim and rebuilds only the dirty start and end tags around them.
+namespace native_source {
+
+// Byte range of an element's markup, start tag to end tag inclusive
+struct Span {
+    size_t start;
+    size_t content;  // End of the start tag
+    size_t end;
+    bool clean;      // false once anything in the element has changed
+    bool tag_clean;  // false once its attributes have changed
+};
+
+// Writes a node that has no usable span, such as a newly created or moved
+// element. Returns false if the node could not be written.
+typedef std::function<bool(xercesc::DOMNode*)> NodeWriter;
+
+class SourceMap {
+public:
+    explicit SourceMap(const std::string& text) : text_(text) {}
+
+    void add(const xercesc::DOMNode* node, size_t start, size_t content, size_t end);
+
+    // node's content changed: it and its ancestors are dirty. For an
+    // attribute, its owner element's attributes have changed.
+    void content_changed(const xercesc::DOMNode* node);
+
+    // An attribute of element was set, so its start tag must be rebuilt
+    void attributes_changed(const xercesc::DOMNode* element);
+
+    // A child was added to or removed from parent. Changes to the
+    // document's own children make the whole document dirty.
+    void children_changed(const xercesc::DOMNode* parent);
+
+    // node now sits somewhere else, so its source markup no longer fits
+    void node_moved(const xercesc::DOMNode* node);
+
+    // The children of node are about to be released. Xerces recycles the
+    // memory of released nodes, so their spans must not outlive them.
+    void forget_descendants(const xercesc::DOMNode* node);
+
+    // Write document to out as UTF-8, using write_node for whatever has no
+    // source markup. Returns false if write_node failed. This may run on
+    // another thread, but nothing else may touch the map meanwhile; the
+    // extension refuses tree changes, and so span updates, until it returns.
+    bool write(xercesc::DOMDocument* document, xercesc::XMLFormatTarget& out,
+               const NodeWriter& write_node) const;
+
+    // The source text if document has not been modified since it was
+    // parsed, otherwise nullptr
+    const std::string* unchanged_text(const xercesc::DOMDocument* document) const;
+
+    size_t size() const { return spans_.size(); }
+
+private:
+    std::string text_;
+    std::unordered_map<const xercesc::DOMNode*, Span> spans_;
+};
+
+// DOM parser that records the span of each element as it is built. Only
+// elements written directly in the source get a span; those expanded from
+// entity references do not.
+class SourceTrackingParser : public xercesc::XercesDOMParser {
+public:
+    SourceTrackingParser(const char* text, size_t length, xercesc::XMLGrammarPool* grammar_pool = nullptr,
+                         xercesc::MemoryManager* manager = xercesc::XMLPlatformUtils::fgMemoryManager);
+
+    // The spans of the last parse, or nullptr if the source could not be
+    // mapped (for example when it is not UTF-8). Ownership passes to the
+    // caller.
+    SourceMap* release_source();
+
+    void startElement(const xercesc::XMLElementDecl& elemDecl, const unsigned int urlId,
+                      const XMLCh* const elemPrefix, const xercesc::RefVectorOf<xercesc::XMLAttr>& attrList,
+                      const XMLSize_t attrCount, const bool isEmpty, const bool isRoot);
+    void endElement(const xercesc::XMLElementDecl& elemDecl, const unsigned int urlId,
+                    const bool isRoot, const XMLCh* const elemPrefix);
+    void startEntityReference(const xercesc::XMLEntityDecl& entDecl);
+    void endEntityReference(const xercesc::XMLEntityDecl& entDecl);
+
+private:
+    bool source_offset(size_t& offset);
+
+    const char* text_;
+    size_t length_;
+    std::unique_ptr<SourceMap> map_;
+    std::vector<std::pair<size_t, size_t> > starts_;  // Start tags of the open elements
+    int entity_depth_;
+    bool failed_;
+};
+
+} // namespace native_source
+
+#endif
@@ -0,0 +1,82 @@
+#include "stats.h"
+
+namespace native_stats {
+
+const char* const counter_names[COUNTER_COUNT] = {
+    "parses",
+    "parse_bytes",
+    "xpath_queries",
+    "xpath_compile_hits",
+    "xpath_compile_misses",
+    "xpath_validation_hits",
+    "xpath_validation_misses",
+    "nodes_wrapped",
+    "serializations",
+    "validations"
+};
+
+const char* const histogram_names[HISTOGRAM_COUNT] = {
+    "parse_time",
+    "xpath_time",
+    "serialize_time",
+    "validate_time"
+};
+
+std::atomic<uint64_t> counters[COUNTER_COUNT];
+
+struct AtomicHistogram {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_nanoseconds;
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+};
+
+static AtomicHistogram histograms[HISTOGRAM_COUNT];
+
+void record(Histogram histogram, uint64_t nanoseconds) {
+    AtomicHistogram& h = histograms[histogram];
+
+    // The bucket is the position of the highest set bit of the duration
+    // in microseconds
+    uint64_t microseconds = nanoseconds / 1000;
+    size_t bucket = 0;
+    while (microseconds > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.total_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t counter_value(Counter counter) {
+    return counters[counter].load(std::memory_order_relaxed);
+}
+
+void snapshot(Histogram histogram, HistogramSnapshot& out) {
+    AtomicHistogram& h = histograms[histogram];
+    out.count = h.count.load(std::memory_order_relaxed);
+    out.total_nanoseconds = h.total_nanoseconds.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        out.buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+uint64_t bucket_limit(size_t bucket) {
+    return bucket + 1 < HISTOGRAM_BUCKETS ? (uint64_t)2 << bucket : 0;
+}
+
+void reset() {
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+        histograms[i].count.store(0, std::memory_order_relaxed);
+        histograms[i].total_nanoseconds.store(0, std::memory_order_relaxed);
+        for (size_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            histograms[i].buckets[j].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+} // namespace native_stats
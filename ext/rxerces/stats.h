@@ -0,0 +1,90 @@
+#ifndef RXERCES_STATS_H
+#define RXERCES_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Process-wide instrumentation: event counters and latency histograms.
+// Recording is a relaxed atomic add, cheap enough to leave on everywhere
+// and safe from any thread, including code running without the GVL.
+// Snapshots are not atomic as a whole; a counter read while another
+// thread records may be one event ahead of its neighbours.
+namespace native_stats {
+
+enum Counter {
+    PARSES,
+    PARSE_BYTES,
+    XPATH_QUERIES,
+    XPATH_COMPILE_HITS,       // Compiled expression found in a cache
+    XPATH_COMPILE_MISSES,
+    XPATH_VALIDATION_HITS,    // Expression found in the validation cache
+    XPATH_VALIDATION_MISSES,
+    NODES_WRAPPED,            // Ruby Node objects created
+    SERIALIZATIONS,
+    VALIDATIONS,
+    COUNTER_COUNT
+};
+
+enum Histogram {
+    PARSE_TIME,
+    XPATH_TIME,
+    SERIALIZE_TIME,
+    VALIDATE_TIME,
+    HISTOGRAM_COUNT
+};
+
+// Bucket i counts durations below 2^(i+1) microseconds that did not fit
+// in an earlier bucket; the last bucket takes everything longer
+static const size_t HISTOGRAM_BUCKETS = 25;
+
+extern const char* const counter_names[COUNTER_COUNT];
+extern const char* const histogram_names[HISTOGRAM_COUNT];
+
+extern std::atomic<uint64_t> counters[COUNTER_COUNT];
+
+inline void count(Counter counter, uint64_t amount = 1) {
+    counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void record(Histogram histogram, uint64_t nanoseconds);
+
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t total_nanoseconds;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+uint64_t counter_value(Counter counter);
+void snapshot(Histogram histogram, HistogramSnapshot& out);
+
+// Upper bound of bucket in microseconds; 0 for the last, unbounded one
+uint64_t bucket_limit(size_t bucket);
+
+void reset();
+
+// Measures the time from construction to stop()
+class Timer {
+public:
+    Timer() : start_(std::chrono::steady_clock::now()) {}
+
+    uint64_t elapsed() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    }
+
+    // Record the elapsed time in histogram and return it
+    uint64_t stop(Histogram histogram) const {
+        uint64_t nanoseconds = elapsed();
+        record(histogram, nanoseconds);
+        return nanoseconds;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace native_stats
+
+#endif
@@ -0,0 +1,114 @@
+#include "xalan_context.h"
+
+#ifdef HAVE_XALAN
+
+using namespace xercesc;
+using namespace xalanc;
+
+namespace native_xalan {
+
+Context::Context() : liaison(nullptr), domSupport(nullptr), xalanDoc(nullptr),
+                     docWrapper(nullptr), envSupport(nullptr), objectFactory(nullptr),
+                     executionContext(nullptr), constructionContext(nullptr),
+                     factory(nullptr), processor(nullptr) {}
+
+Context::~Context() {
+    // Clean up in reverse order of creation
+    delete executionContext;
+    delete constructionContext;
+    delete objectFactory;
+    delete envSupport;
+    delete factory;
+    delete processor;
+    // domSupport must be deleted before liaison
+    delete domSupport;
+    // liaison owns xalanDoc/docWrapper, so don't delete them separately
+    delete liaison;
+}
+
+XPath* Context::compile(const char* expression, const DOMElement* namespace_element) {
+    XPath* xpath = factory->create();
+
+    // Resolve against the given element, or the document element (which
+    // can be null, that's ok)
+    const XalanElement* scope = docWrapper->getDocumentElement();
+    if (namespace_element) {
+        XalanNode* mapped = docWrapper->mapNode(namespace_element);
+        if (mapped && mapped->getNodeType() == XalanNode::ELEMENT_NODE) {
+            scope = static_cast<const XalanElement*>(mapped);
+        }
+    }
+    ElementPrefixResolverProxy resolver(scope, *envSupport, *domSupport);
+    processor->initXPath(*xpath, *constructionContext, XalanDOMString(expression), resolver);
+    return xpath;
+}
+
+void Context::select(const XPath& xpath, DOMNode* context, std::vector<DOMNode*>& out) {
+    // Map the context node to Xalan
+    XalanNode* xalanContextNode = docWrapper->mapNode(context);
+    if (!xalanContextNode) {
+        xalanContextNode = docWrapper;
+    }
+
+    // Create resolver for execution
+    XalanElement* docElem = docWrapper->getDocumentElement();
+    ElementPrefixResolverProxy resolver(docElem, *envSupport, *domSupport);
+
+    // Reset execution context for clean state
+    objectFactory->reset();
+
+    const XObjectPtr result = xpath.execute(xalanContextNode, resolver, *executionContext);
+
+    if (result.get() != 0) {
+        // Check if result is a node set
+        const NodeRefListBase& nodeList = result->nodeset();
+        const NodeRefListBase::size_type length = nodeList.getLength();
+        out.reserve(out.size() + length);
+
+        for (NodeRefListBase::size_type i = 0; i < length; ++i) {
+            XalanNode* xalanNode = nodeList.item(i);
+            if (xalanNode) {
+                // Map back to Xerces DOM node
+                const DOMNode* domNode = docWrapper->mapNode(xalanNode);
+                if (domNode) {
+                    out.push_back(const_cast<DOMNode*>(domNode));
+                }
+            }
+        }
+    }
+}
+
+Context* create_context(DOMDocument* doc) {
+    Context* ctx = new Context();
+
+    try {
+        // The liaison allocates the document wrapper, and the Xalan nodes it
+        // builds as queries reach them, from bridgeMemory
+        ctx->liaison = new XercesParserLiaison(ctx->bridgeMemory);
+        ctx->domSupport = new XercesDOMSupport(*ctx->liaison);
+
+        // Create Xalan document wrapper - this is owned by liaison
+        ctx->xalanDoc = ctx->liaison->createDocument(doc, false, false, false);
+        if (!ctx->xalanDoc) {
+            delete ctx;
+            return nullptr;
+        }
+        ctx->docWrapper = static_cast<XercesDocumentWrapper*>(ctx->xalanDoc);
+
+        // Create XPath infrastructure
+        ctx->envSupport = new XPathEnvSupportDefault();
+        ctx->objectFactory = new XObjectFactoryDefault();
+        ctx->executionContext = new XPathExecutionContextDefault(*ctx->envSupport, *ctx->domSupport, *ctx->objectFactory);
+        ctx->constructionContext = new XPathConstructionContextDefault(ctx->xpathMemory);
+        ctx->factory = new XPathFactoryDefault(ctx->xpathMemory);
+        ctx->processor = new XPathProcessorImpl(ctx->xpathMemory);
+        return ctx;
+    } catch (...) {
+        delete ctx;
+        return nullptr;
+    }
+}
+
+} // namespace native_xalan
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef RXERCES_XALAN_CONTEXT_H
+#define RXERCES_XALAN_CONTEXT_H
+
+#ifdef HAVE_XALAN
+
+#include <xercesc/dom/DOM.hpp>
+#include <xalanc/XPath/NodeRefList.hpp>
+#include <xalanc/XPath/XObject.hpp>
+#include <xalanc/XPath/XObjectFactoryDefault.hpp>
+#include <xalanc/XPath/XPathEnvSupportDefault.hpp>
+#include <xalanc/XPath/XPathExecutionContextDefault.hpp>
+#include <xalanc/XPath/XPathConstructionContextDefault.hpp>
+#include <xalanc/XPath/ElementPrefixResolverProxy.hpp>
+#include <xalanc/XPath/XPathFactoryDefault.hpp>
+#include <xalanc/XPath/XPathProcessorImpl.hpp>
+#include <xalanc/XPath/XPath.hpp>
+#include <xalanc/XercesParserLiaison/XercesParserLiaison.hpp>
+#include <xalanc/XercesParserLiaison/XercesDOMSupport.hpp>
+#include <xalanc/XercesParserLiaison/XercesDocumentWrapper.hpp>
+#include <vector>
+#include "counting_memory.h"
+
+// The Xalan view of one Xerces document and the XPath machinery bound to
+// it. Building one is expensive, so each document keeps its context for
+// every Xalan query after the first. Xalan errors are thrown as they are,
+// usually as xalanc::XalanXPathException.
+namespace native_xalan {
+
+struct Context {
+    // Declared first so they outlive everything allocated from them
+    native_memory::CountingMemoryManager bridgeMemory;  // The liaison and its document wrapper
+    native_memory::CountingMemoryManager xpathMemory;   // Compiled expressions
+    xalanc::XercesParserLiaison* liaison;
+    xalanc::XercesDOMSupport* domSupport;
+    xalanc::XalanDocument* xalanDoc;
+    xalanc::XercesDocumentWrapper* docWrapper;
+    xalanc::XPathEnvSupportDefault* envSupport;
+    xalanc::XObjectFactoryDefault* objectFactory;
+    xalanc::XPathExecutionContextDefault* executionContext;
+    xalanc::XPathConstructionContextDefault* constructionContext;
+    xalanc::XPathFactoryDefault* factory;
+    xalanc::XPathProcessorImpl* processor;
+
+    Context();
+    ~Context();
+
+    // Compile an expression, resolving prefixes against the namespaces in
+    // scope on namespace_element, or on the document element if it is
+    // null. Give it back with factory->returnObject.
+    xalanc::XPath* compile(const char* expression, const xercesc::DOMElement* namespace_element = nullptr);
+
+    // Evaluate a compiled expression from context (the document when
+    // context has no Xalan counterpart), appending the matching Xerces
+    // nodes to out
+    void select(const xalanc::XPath& xpath, xercesc::DOMNode* context, std::vector<xercesc::DOMNode*>& out);
+};
+
+// Build the context for a document. Returns nullptr if Xalan cannot wrap it.
+Context* create_context(xercesc::DOMDocument* doc);
+
+} // namespace native_xalan
+
+#endif
+
+#endif
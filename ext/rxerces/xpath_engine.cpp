@@ -0,0 +1,2682 @@
+#include "xpath_engine.h"
+#include <xercesc/util/XMLString.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace xercesc;
+
+namespace native_xpath {
+
+// ---------------------------------------------------------------------------
+// String helpers
+// ---------------------------------------------------------------------------
+
+XString utf8_to_xstring(const char* str, size_t length) {
+    XString result;
+    result.reserve(length);
+
+    size_t i = 0;
+    while (i < length) {
+        unsigned char c = (unsigned char)str[i];
+        unsigned long cp;
+        size_t extra;
+
+        if (c < 0x80) {
+            cp = c;
+            extra = 0;
+        } else if ((c & 0xE0) == 0xC0) {
+            cp = c & 0x1F;
+            extra = 1;
+        } else if ((c & 0xF0) == 0xE0) {
+            cp = c & 0x0F;
+            extra = 2;
+        } else if ((c & 0xF8) == 0xF0) {
+            cp = c & 0x07;
+            extra = 3;
+        } else {
+            // Invalid lead byte - substitute the replacement character
+            result.push_back((XMLCh)0xFFFD);
+            i++;
+            continue;
+        }
+
+        bool valid = true;
+        for (size_t j = 1; j <= extra; j++) {
+            if (i + j >= length || ((unsigned char)str[i + j] & 0xC0) != 0x80) {
+                valid = false;
+                break;
+            }
+            cp = (cp << 6) | ((unsigned char)str[i + j] & 0x3F);
+        }
+
+        if (!valid) {
+            result.push_back((XMLCh)0xFFFD);
+            i++;
+            continue;
+        }
+
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            result.push_back((XMLCh)(0xD800 + (cp >> 10)));
+            result.push_back((XMLCh)(0xDC00 + (cp & 0x3FF)));
+        } else {
+            result.push_back((XMLCh)cp);
+        }
+        i += extra + 1;
+    }
+
+    return result;
+}
+
+std::string xstring_to_utf8(const XMLCh* str, size_t length) {
+    std::string result;
+    result.reserve(length);
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned long cp = str[i];
+
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < length &&
+            str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (str[i + 1] - 0xDC00);
+            i++;
+        }
+
+        if (cp < 0x80) {
+            result.push_back((char)cp);
+        } else if (cp < 0x800) {
+            result.push_back((char)(0xC0 | (cp >> 6)));
+            result.push_back((char)(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            result.push_back((char)(0xE0 | (cp >> 12)));
+            result.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            result.push_back((char)(0x80 | (cp & 0x3F)));
+        } else {
+            result.push_back((char)(0xF0 | (cp >> 18)));
+            result.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+            result.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            result.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    return result;
+}
+
+static XString xstr(const char* ascii) {
+    return utf8_to_xstring(ascii, strlen(ascii));
+}
+
+static std::string to_utf8(const XString& str) {
+    return xstring_to_utf8(str.c_str(), str.length());
+}
+
+static bool xequals(const XMLCh* a, const XString& b) {
+    if (!a) {
+        return b.empty();
+    }
+    return b.compare(a) == 0;
+}
+
+static inline bool is_xml_space(XMLCh c) {
+    return c == 0x20 || c == 0x09 || c == 0x0D || c == 0x0A;
+}
+
+// Decode UTF-16 into code points so that string functions count characters
+// rather than UTF-16 code units.
+static std::vector<unsigned long> to_code_points(const XString& str) {
+    std::vector<unsigned long> result;
+    result.reserve(str.length());
+    for (size_t i = 0; i < str.length(); i++) {
+        unsigned long cp = str[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < str.length() &&
+            str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (str[i + 1] - 0xDC00);
+            i++;
+        }
+        result.push_back(cp);
+    }
+    return result;
+}
+
+static void append_code_point(XString& out, unsigned long cp) {
+    if (cp >= 0x10000) {
+        cp -= 0x10000;
+        out.push_back((XMLCh)(0xD800 + (cp >> 10)));
+        out.push_back((XMLCh)(0xDC00 + (cp & 0x3FF)));
+    } else {
+        out.push_back((XMLCh)cp);
+    }
+}
+
+static const XMLCh XMLNS_URI[] = {
+    'h','t','t','p',':','/','/','w','w','w','.','w','3','.','o','r','g','/',
+    '2','0','0','0','/','x','m','l','n','s','/', 0
+};
+
+static const XMLCh XML_URI[] = {
+    'h','t','t','p',':','/','/','w','w','w','.','w','3','.','o','r','g','/',
+    'X','M','L','/','1','9','9','8','/','n','a','m','e','s','p','a','c','e', 0
+};
+
+// ---------------------------------------------------------------------------
+// XPath data model over the DOM
+//
+// Entity reference nodes are transparent (their children are treated as
+// children of the entity reference's parent) and doctype/entity/notation
+// nodes are not part of the XPath tree. Namespace declarations are not
+// attributes in XPath; they are exposed on the namespace axis instead.
+// ---------------------------------------------------------------------------
+
+static inline bool is_namespace_decl(const DOMNode* attr) {
+    const XMLCh* uri = attr->getNamespaceURI();
+    if (uri && XMLString::equals(uri, XMLNS_URI)) {
+        return true;
+    }
+    const XMLCh* name = attr->getNodeName();
+    // Level 1 attributes (no namespace processing) still declare namespaces
+    return name && name[0] == 'x' && name[1] == 'm' && name[2] == 'l' &&
+           name[3] == 'n' && name[4] == 's' && (name[5] == 0 || name[5] == ':');
+}
+
+static inline bool is_hidden_node(const DOMNode* node) {
+    DOMNode::NodeType type = node->getNodeType();
+    return type == DOMNode::DOCUMENT_TYPE_NODE || type == DOMNode::ENTITY_NODE ||
+           type == DOMNode::NOTATION_NODE;
+}
+
+static DOMNode* step_out_forward(DOMNode* node) {
+    while (node) {
+        DOMNode* next = node->getNextSibling();
+        if (next) {
+            return next;
+        }
+        DOMNode* parent = node->getParentNode();
+        if (parent && parent->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+            node = parent;
+        } else {
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+static DOMNode* step_out_backward(DOMNode* node) {
+    while (node) {
+        DOMNode* prev = node->getPreviousSibling();
+        if (prev) {
+            return prev;
+        }
+        DOMNode* parent = node->getParentNode();
+        if (parent && parent->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+            node = parent;
+        } else {
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+static DOMNode* skip_forward(DOMNode* node) {
+    while (node) {
+        if (node->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+            DOMNode* inner = node->getFirstChild();
+            node = inner ? inner : step_out_forward(node);
+            continue;
+        }
+        if (is_hidden_node(node)) {
+            node = step_out_forward(node);
+            continue;
+        }
+        return node;
+    }
+    return nullptr;
+}
+
+static DOMNode* skip_backward(DOMNode* node) {
+    while (node) {
+        if (node->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+            DOMNode* inner = node->getLastChild();
+            node = inner ? inner : step_out_backward(node);
+            continue;
+        }
+        if (is_hidden_node(node)) {
+            node = step_out_backward(node);
+            continue;
+        }
+        return node;
+    }
+    return nullptr;
+}
+
+static inline bool is_attribute(const DOMNode* node) {
+    return node->getNodeType() == DOMNode::ATTRIBUTE_NODE;
+}
+
+static DOMNode* xp_parent(const DOMNode* node) {
+    if (is_attribute(node)) {
+        return static_cast<const DOMAttr*>(node)->getOwnerElement();
+    }
+    DOMNode* parent = node->getParentNode();
+    while (parent && parent->getNodeType() == DOMNode::ENTITY_REFERENCE_NODE) {
+        parent = parent->getParentNode();
+    }
+    return parent;
+}
+
+static DOMNode* xp_first_child(const DOMNode* node) {
+    if (is_attribute(node)) {
+        return nullptr;
+    }
+    return skip_forward(node->getFirstChild());
+}
+
+static DOMNode* xp_last_child(const DOMNode* node) {
+    if (is_attribute(node)) {
+        return nullptr;
+    }
+    return skip_backward(node->getLastChild());
+}
+
+static DOMNode* xp_next_sibling(DOMNode* node) {
+    if (is_attribute(node)) {
+        return nullptr;
+    }
+    return skip_forward(step_out_forward(node));
+}
+
+static DOMNode* xp_prev_sibling(DOMNode* node) {
+    if (is_attribute(node)) {
+        return nullptr;
+    }
+    return skip_backward(step_out_backward(node));
+}
+
+// Next node in document order within the subtree rooted at root
+static DOMNode* next_preorder(DOMNode* node, const DOMNode* root) {
+    DOMNode* child = xp_first_child(node);
+    if (child) {
+        return child;
+    }
+    while (node && node != root) {
+        DOMNode* next = xp_next_sibling(node);
+        if (next) {
+            return next;
+        }
+        node = xp_parent(node);
+    }
+    return nullptr;
+}
+
+static DOMNode* tree_root(DOMNode* node) {
+    DOMNode* parent;
+    while ((parent = xp_parent(node)) != nullptr) {
+        node = parent;
+    }
+    return node;
+}
+
+static bool is_text(const DOMNode* node) {
+    DOMNode::NodeType type = node->getNodeType();
+    return type == DOMNode::TEXT_NODE || type == DOMNode::CDATA_SECTION_NODE;
+}
+
+// The data model has no adjacent text nodes: a run of DOM text and CDATA
+// siblings is one text node, which the first of them stands for
+static bool continues_text(DOMNode* node) {
+    if (!is_text(node)) {
+        return false;
+    }
+    DOMNode* previous = xp_prev_sibling(node);
+    return previous && is_text(previous);
+}
+
+static void append_string_value(DOMNode* node, XString& out) {
+    switch (node->getNodeType()) {
+        case DOMNode::ELEMENT_NODE:
+        case DOMNode::DOCUMENT_NODE:
+        case DOMNode::DOCUMENT_FRAGMENT_NODE:
+        case DOMNode::ENTITY_REFERENCE_NODE: {
+            // Concatenate descendant text without DOMNode::getTextContent,
+            // which allocates from the document heap on every call
+            DOMNode* current = xp_first_child(node);
+            while (current) {
+                if (is_text(current)) {
+                    const XMLCh* data = current->getNodeValue();
+                    if (data) {
+                        out.append(data);
+                    }
+                }
+                current = next_preorder(current, node);
+            }
+            break;
+        }
+        case DOMNode::TEXT_NODE:
+        case DOMNode::CDATA_SECTION_NODE:
+            // The whole run of adjacent text siblings
+            for (DOMNode* text = node; text && is_text(text); text = xp_next_sibling(text)) {
+                const XMLCh* data = text->getNodeValue();
+                if (data) {
+                    out.append(data);
+                }
+            }
+            break;
+        default: {
+            const XMLCh* value = node->getNodeValue();
+            if (value) {
+                out.append(value);
+            }
+            break;
+        }
+    }
+}
+
+static XString string_value(DOMNode* node) {
+    XString result;
+    append_string_value(node, result);
+    return result;
+}
+
+static const XMLCh* local_name_ptr(const DOMNode* node, size_t* length) {
+    const XMLCh* local = node->getLocalName();
+    if (local) {
+        *length = XMLString::stringLen(local);
+        return local;
+    }
+    // DOM level 1 nodes have no local name; strip any prefix ourselves
+    const XMLCh* name = node->getNodeName();
+    const XMLCh* start = name;
+    for (const XMLCh* p = name; p && *p; p++) {
+        if (*p == ':') {
+            start = p + 1;
+        }
+    }
+    *length = start ? XMLString::stringLen(start) : 0;
+    return start;
+}
+
+static bool local_name_equals(const DOMNode* node, const XString& expected) {
+    size_t length;
+    const XMLCh* local = local_name_ptr(node, &length);
+    return length == expected.length() && (length == 0 || expected.compare(0, length, local, length) == 0);
+}
+
+// Prefix declared by a namespace declaration attribute ("" for xmlns)
+static XString namespace_decl_prefix(const DOMNode* attr) {
+    const XMLCh* name = attr->getNodeName();
+    if (!name || name[5] != ':') {
+        return XString();
+    }
+    return XString(name + 6);
+}
+
+// ---------------------------------------------------------------------------
+// Document order
+// ---------------------------------------------------------------------------
+
+static size_t attribute_index(DOMNode* attr) {
+    DOMElement* owner = static_cast<DOMAttr*>(attr)->getOwnerElement();
+    if (!owner) {
+        return 0;
+    }
+    DOMNamedNodeMap* attributes = owner->getAttributes();
+    XMLSize_t length = attributes ? attributes->getLength() : 0;
+    for (XMLSize_t i = 0; i < length; i++) {
+        if (attributes->item(i) == attr) {
+            return (size_t)i;
+        }
+    }
+    return (size_t)length;
+}
+
+// Returns <0 if a precedes b in document order, >0 if it follows, 0 if same
+static int compare_document_order(DOMNode* a, DOMNode* b) {
+    if (a == b) {
+        return 0;
+    }
+
+    DOMNode* ta = is_attribute(a) ? xp_parent(a) : a;
+    DOMNode* tb = is_attribute(b) ? xp_parent(b) : b;
+
+    if (ta == tb && ta) {
+        // Element precedes its attributes; attributes keep map order
+        if (!is_attribute(a)) return -1;
+        if (!is_attribute(b)) return 1;
+        return attribute_index(a) < attribute_index(b) ? -1 : 1;
+    }
+    if (!ta || !tb) {
+        return a < b ? -1 : 1;
+    }
+
+    std::vector<DOMNode*> path_a;
+    std::vector<DOMNode*> path_b;
+    for (DOMNode* n = ta; n; n = xp_parent(n)) path_a.push_back(n);
+    for (DOMNode* n = tb; n; n = xp_parent(n)) path_b.push_back(n);
+
+    if (path_a.back() != path_b.back()) {
+        // Different trees: order is implementation dependent but stable
+        return path_a.back() < path_b.back() ? -1 : 1;
+    }
+
+    size_t ia = path_a.size();
+    size_t ib = path_b.size();
+    while (ia > 0 && ib > 0 && path_a[ia - 1] == path_b[ib - 1]) {
+        ia--;
+        ib--;
+    }
+
+    // One tree node is a proper ancestor of the other; an element and its
+    // attributes both precede the element's descendants
+    if (ia == 0) return -1;
+    if (ib == 0) return 1;
+
+    DOMNode* sa = path_a[ia - 1];
+    DOMNode* sb = path_b[ib - 1];
+    for (DOMNode* n = xp_next_sibling(sa); n; n = xp_next_sibling(n)) {
+        if (n == sb) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static bool document_order_less(DOMNode* a, DOMNode* b) {
+    return compare_document_order(a, b) < 0;
+}
+
+static const size_t SMALL_SORT_THRESHOLD = 64;
+
+// Sort nodes into document order and remove duplicates
+static void sort_document_order(std::vector<DOMNode*>& nodes) {
+    if (nodes.size() < 2) {
+        return;
+    }
+
+    // Most merges are already ordered; verify with a linear pass first
+    bool ordered = true;
+    for (size_t i = 1; i < nodes.size(); i++) {
+        if (compare_document_order(nodes[i - 1], nodes[i]) >= 0) {
+            ordered = false;
+            break;
+        }
+    }
+    if (ordered) {
+        return;
+    }
+
+    if (nodes.size() <= SMALL_SORT_THRESHOLD) {
+        std::sort(nodes.begin(), nodes.end(), document_order_less);
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        return;
+    }
+
+    // Large sets: one traversal of the tree beats n log n comparisons that
+    // each walk ancestor chains
+    std::unordered_set<DOMNode*> wanted(nodes.begin(), nodes.end());
+    bool has_attributes = false;
+    for (DOMNode* n : wanted) {
+        if (is_attribute(n)) {
+            has_attributes = true;
+            break;
+        }
+    }
+
+    DOMNode* root = tree_root(nodes[0]);
+    std::vector<DOMNode*> sorted;
+    sorted.reserve(wanted.size());
+
+    for (DOMNode* n = root; n && sorted.size() < wanted.size(); n = next_preorder(n, root)) {
+        if (wanted.count(n)) {
+            sorted.push_back(n);
+        }
+        if (has_attributes && n->getNodeType() == DOMNode::ELEMENT_NODE) {
+            DOMNamedNodeMap* attributes = n->getAttributes();
+            XMLSize_t length = attributes ? attributes->getLength() : 0;
+            for (XMLSize_t i = 0; i < length; i++) {
+                DOMNode* attr = attributes->item(i);
+                if (wanted.count(attr)) {
+                    sorted.push_back(attr);
+                }
+            }
+        }
+    }
+
+    if (sorted.size() < wanted.size()) {
+        // Nodes from other trees (e.g. detached elements) go last
+        std::unordered_set<DOMNode*> seen(sorted.begin(), sorted.end());
+        std::vector<DOMNode*> rest;
+        for (DOMNode* n : wanted) {
+            if (!seen.count(n)) rest.push_back(n);
+        }
+        std::sort(rest.begin(), rest.end(), document_order_less);
+        sorted.insert(sorted.end(), rest.begin(), rest.end());
+    }
+
+    nodes.swap(sorted);
+}
+
+// ---------------------------------------------------------------------------
+// Value conversions
+// ---------------------------------------------------------------------------
+
+static Value make_boolean(bool b) {
+    Value v;
+    v.type = Value::BOOLEAN;
+    v.boolean = b;
+    return v;
+}
+
+static Value make_number(double d) {
+    Value v;
+    v.type = Value::NUMBER;
+    v.number = d;
+    return v;
+}
+
+static Value make_string(const XString& s) {
+    Value v;
+    v.type = Value::STRING;
+    v.string = s;
+    return v;
+}
+
+static Value make_nodeset(std::vector<DOMNode*>& nodes) {
+    Value v;
+    v.type = Value::NODESET;
+    v.nodes.swap(nodes);
+    return v;
+}
+
+static XString number_to_string(double d) {
+    if (std::isnan(d)) return xstr("NaN");
+    if (std::isinf(d)) return xstr(d > 0 ? "Infinity" : "-Infinity");
+    if (d == 0) return xstr("0");
+
+    char buf[64];
+    if (d == std::floor(d) && std::fabs(d) < 1e15) {
+        snprintf(buf, sizeof(buf), "%.0f", d);
+        return xstr(buf);
+    }
+
+    // Shortest representation that round-trips, written without exponent
+    int precision = 1;
+    for (; precision <= 17; precision++) {
+        snprintf(buf, sizeof(buf), "%.*e", precision - 1, d);
+        if (strtod(buf, nullptr) == d) {
+            break;
+        }
+    }
+
+    std::string formatted(buf);
+    bool negative = formatted[0] == '-';
+    if (negative) formatted.erase(0, 1);
+
+    size_t e_pos = formatted.find('e');
+    int exponent = atoi(formatted.c_str() + e_pos + 1);
+    std::string digits;
+    for (size_t i = 0; i < e_pos; i++) {
+        if (formatted[i] != '.') digits += formatted[i];
+    }
+    while (digits.length() > 1 && digits[digits.length() - 1] == '0') {
+        digits.erase(digits.length() - 1);
+    }
+
+    std::string result;
+    int point = exponent + 1;
+    if (point <= 0) {
+        result = "0." + std::string((size_t)(-point), '0') + digits;
+    } else if ((size_t)point >= digits.length()) {
+        result = digits + std::string((size_t)point - digits.length(), '0');
+    } else {
+        result = digits.substr(0, (size_t)point) + "." + digits.substr((size_t)point);
+    }
+
+    if (negative) result = "-" + result;
+    return xstr(result.c_str());
+}
+
+static double string_to_number(const XString& s) {
+    size_t start = 0;
+    size_t end = s.length();
+    while (start < end && is_xml_space(s[start])) start++;
+    while (end > start && is_xml_space(s[end - 1])) end--;
+    if (start == end) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    std::string ascii;
+    size_t i = start;
+    if (s[i] == '-') {
+        ascii += '-';
+        i++;
+    }
+
+    bool digits = false;
+    bool point = false;
+    for (; i < end; i++) {
+        XMLCh c = s[i];
+        if (c >= '0' && c <= '9') {
+            digits = true;
+            ascii += (char)c;
+        } else if (c == '.' && !point) {
+            point = true;
+            ascii += '.';
+        } else {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+
+    if (!digits) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return strtod(ascii.c_str(), nullptr);
+}
+
+static XString to_string(const Value& v) {
+    switch (v.type) {
+        case Value::STRING:
+            return v.string;
+        case Value::BOOLEAN:
+            return xstr(v.boolean ? "true" : "false");
+        case Value::NUMBER:
+            return number_to_string(v.number);
+        case Value::NODESET:
+        default:
+            return v.nodes.empty() ? XString() : string_value(v.nodes[0]);
+    }
+}
+
+static double to_number(const Value& v) {
+    switch (v.type) {
+        case Value::NUMBER:
+            return v.number;
+        case Value::BOOLEAN:
+            return v.boolean ? 1.0 : 0.0;
+        case Value::STRING:
+            return string_to_number(v.string);
+        case Value::NODESET:
+        default:
+            return string_to_number(to_string(v));
+    }
+}
+
+static bool to_boolean(const Value& v) {
+    switch (v.type) {
+        case Value::BOOLEAN:
+            return v.boolean;
+        case Value::NUMBER:
+            return v.number != 0 && !std::isnan(v.number);
+        case Value::STRING:
+            return !v.string.empty();
+        case Value::NODESET:
+        default:
+            return !v.nodes.empty();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Abstract syntax tree
+// ---------------------------------------------------------------------------
+
+enum StaticType { TYPE_NODESET, TYPE_BOOLEAN, TYPE_NUMBER, TYPE_STRING, TYPE_ANY };
+
+struct Environment {
+    const VariableMap* variables;
+    DOMNode* namespace_node;
+    Profile* profile;  // Counts the work of each step when profiling
+};
+
+struct Context {
+    DOMNode* node;
+    size_t position;
+    size_t size;
+    const Environment* env;
+};
+
+class Expr {
+public:
+    virtual ~Expr() {}
+    virtual Value evaluate(const Context& ctx) const = 0;
+    virtual StaticType static_type() const = 0;
+    // True if the result depends on the context position or size
+    virtual bool uses_position() const { return false; }
+    virtual bool is_number_literal() const { return false; }
+    // True if stream() produces nodes lazily rather than evaluating first
+    virtual bool streamable() const { return false; }
+    // Pass the node-set result to visitor in document order
+    virtual bool stream(const Context& ctx, NodeVisitor& visitor) const;
+    // Describe this node and its children to plan
+    virtual void explain(Profile& plan, int depth) const = 0;
+};
+
+bool Expr::stream(const Context& ctx, NodeVisitor& visitor) const {
+    Value v = evaluate(ctx);
+    if (v.type != Value::NODESET) {
+        throw Error("Expression does not evaluate to a node-set");
+    }
+    for (DOMNode* node : v.nodes) {
+        if (!visitor.visit(node)) return false;
+    }
+    return true;
+}
+
+CompiledExpression::CompiledExpression(Expr* root, const std::string& source)
+    : root_(root), source_(source) {}
+
+CompiledExpression::~CompiledExpression() {
+    delete root_;
+}
+
+bool CompiledExpression::returns_nodeset() const {
+    return root_->static_type() == TYPE_NODESET;
+}
+
+bool CompiledExpression::streamable() const {
+    return root_->streamable();
+}
+
+class LiteralExpr : public Expr {
+public:
+    explicit LiteralExpr(const XString& value) : value_(value) {}
+    Value evaluate(const Context&) const { return make_string(value_); }
+    StaticType static_type() const { return TYPE_STRING; }
+    void explain(Profile& plan, int depth) const { plan.add_line(depth, "literal '" + to_utf8(value_) + "'"); }
+private:
+    XString value_;
+};
+
+class NumberExpr : public Expr {
+public:
+    explicit NumberExpr(double value) : value_(value) {}
+    Value evaluate(const Context&) const { return make_number(value_); }
+    StaticType static_type() const { return TYPE_NUMBER; }
+    bool is_number_literal() const { return true; }
+    double value() const { return value_; }
+    void explain(Profile& plan, int depth) const { plan.add_line(depth, "number " + to_utf8(number_to_string(value_))); }
+private:
+    double value_;
+};
+
+class VariableExpr : public Expr {
+public:
+    explicit VariableExpr(const XString& name) : name_(name) {}
+
+    Value evaluate(const Context& ctx) const {
+        if (ctx.env->variables) {
+            VariableMap::const_iterator it = ctx.env->variables->find(name_);
+            if (it != ctx.env->variables->end()) {
+                return it->second;
+            }
+        }
+        throw Error("Undefined variable: $" + to_utf8(name_));
+    }
+
+    StaticType static_type() const { return TYPE_ANY; }
+    void explain(Profile& plan, int depth) const { plan.add_line(depth, "variable $" + to_utf8(name_)); }
+private:
+    XString name_;
+};
+
+enum BinaryOp { OP_OR, OP_AND, OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+                OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD };
+
+static const char* const BINARY_OP_NAMES[] = {
+    "or", "and", "=", "!=", "<", "<=", ">", ">=", "+", "-", "*", "div", "mod"
+};
+
+static bool compare_numbers(BinaryOp op, double a, double b) {
+    switch (op) {
+        case OP_EQ: return a == b;
+        case OP_NE: return a != b;
+        case OP_LT: return a < b;
+        case OP_LE: return a <= b;
+        case OP_GT: return a > b;
+        case OP_GE: return a >= b;
+        default: return false;
+    }
+}
+
+static BinaryOp swap_relational(BinaryOp op) {
+    switch (op) {
+        case OP_LT: return OP_GT;
+        case OP_LE: return OP_GE;
+        case OP_GT: return OP_LT;
+        case OP_GE: return OP_LE;
+        default: return op;
+    }
+}
+
+// Compare a node-set against a non-node-set value (node-set on the left)
+static bool compare_nodeset_scalar(BinaryOp op, const Value& set, const Value& other) {
+    bool equality = (op == OP_EQ || op == OP_NE);
+
+    if (other.type == Value::BOOLEAN) {
+        bool b = !set.nodes.empty();
+        if (equality) {
+            return op == OP_EQ ? b == other.boolean : b != other.boolean;
+        }
+        return compare_numbers(op, b ? 1.0 : 0.0, other.boolean ? 1.0 : 0.0);
+    }
+
+    if (other.type == Value::NUMBER || !equality) {
+        double rhs = to_number(other);
+        for (DOMNode* n : set.nodes) {
+            if (compare_numbers(op, string_to_number(string_value(n)), rhs)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    for (DOMNode* n : set.nodes) {
+        bool same = string_value(n) == other.string;
+        if (op == OP_EQ ? same : !same) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool compare_values(BinaryOp op, const Value& a, const Value& b) {
+    bool equality = (op == OP_EQ || op == OP_NE);
+
+    if (a.type == Value::NODESET && b.type == Value::NODESET) {
+        if (a.nodes.empty() || b.nodes.empty()) {
+            return false;
+        }
+        if (equality) {
+            std::vector<XString> right;
+            right.reserve(b.nodes.size());
+            for (DOMNode* n : b.nodes) right.push_back(string_value(n));
+            for (DOMNode* n : a.nodes) {
+                XString left = string_value(n);
+                for (const XString& r : right) {
+                    if (op == OP_EQ ? left == r : left != r) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        std::vector<double> right;
+        right.reserve(b.nodes.size());
+        for (DOMNode* n : b.nodes) right.push_back(string_to_number(string_value(n)));
+        for (DOMNode* n : a.nodes) {
+            double left = string_to_number(string_value(n));
+            for (double r : right) {
+                if (compare_numbers(op, left, r)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    if (a.type == Value::NODESET) {
+        return compare_nodeset_scalar(op, a, b);
+    }
+    if (b.type == Value::NODESET) {
+        return compare_nodeset_scalar(swap_relational(op), b, a);
+    }
+
+    if (equality) {
+        bool result;
+        if (a.type == Value::BOOLEAN || b.type == Value::BOOLEAN) {
+            result = to_boolean(a) == to_boolean(b);
+        } else if (a.type == Value::NUMBER || b.type == Value::NUMBER) {
+            result = to_number(a) == to_number(b);
+        } else {
+            result = to_string(a) == to_string(b);
+        }
+        return op == OP_EQ ? result : !result;
+    }
+
+    return compare_numbers(op, to_number(a), to_number(b));
+}
+
+class BinaryExpr : public Expr {
+public:
+    BinaryExpr(BinaryOp op, Expr* left, Expr* right) : op_(op), left_(left), right_(right) {}
+    ~BinaryExpr() {
+        delete left_;
+        delete right_;
+    }
+
+    Value evaluate(const Context& ctx) const {
+        switch (op_) {
+            case OP_OR:
+                if (to_boolean(left_->evaluate(ctx))) return make_boolean(true);
+                return make_boolean(to_boolean(right_->evaluate(ctx)));
+            case OP_AND:
+                if (!to_boolean(left_->evaluate(ctx))) return make_boolean(false);
+                return make_boolean(to_boolean(right_->evaluate(ctx)));
+            case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE: {
+                Value a = left_->evaluate(ctx);
+                Value b = right_->evaluate(ctx);
+                return make_boolean(compare_values(op_, a, b));
+            }
+            default:
+                break;
+        }
+
+        double a = to_number(left_->evaluate(ctx));
+        double b = to_number(right_->evaluate(ctx));
+        switch (op_) {
+            case OP_ADD: return make_number(a + b);
+            case OP_SUB: return make_number(a - b);
+            case OP_MUL: return make_number(a * b);
+            case OP_DIV: return make_number(a / b);
+            case OP_MOD: return make_number(std::fmod(a, b));
+            default: return make_number(std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+
+    StaticType static_type() const {
+        return op_ <= OP_GE ? TYPE_BOOLEAN : TYPE_NUMBER;
+    }
+
+    bool uses_position() const {
+        return left_->uses_position() || right_->uses_position();
+    }
+
+    void explain(Profile& plan, int depth) const {
+        plan.add_line(depth, std::string("binary ") + BINARY_OP_NAMES[op_]);
+        left_->explain(plan, depth + 1);
+        right_->explain(plan, depth + 1);
+    }
+
+private:
+    BinaryOp op_;
+    Expr* left_;
+    Expr* right_;
+};
+
+class NegateExpr : public Expr {
+public:
+    explicit NegateExpr(Expr* operand) : operand_(operand) {}
+    ~NegateExpr() { delete operand_; }
+    Value evaluate(const Context& ctx) const { return make_number(-to_number(operand_->evaluate(ctx))); }
+    StaticType static_type() const { return TYPE_NUMBER; }
+    bool uses_position() const { return operand_->uses_position(); }
+    void explain(Profile& plan, int depth) const {
+        plan.add_line(depth, "negate");
+        operand_->explain(plan, depth + 1);
+    }
+private:
+    Expr* operand_;
+};
+
+class UnionExpr : public Expr {
+public:
+    UnionExpr(Expr* left, Expr* right) : left_(left), right_(right) {}
+    ~UnionExpr() {
+        delete left_;
+        delete right_;
+    }
+
+    Value evaluate(const Context& ctx) const {
+        Value a = left_->evaluate(ctx);
+        Value b = right_->evaluate(ctx);
+        if (a.type != Value::NODESET || b.type != Value::NODESET) {
+            throw Error("Operands of '|' must be node-sets");
+        }
+        a.nodes.insert(a.nodes.end(), b.nodes.begin(), b.nodes.end());
+        sort_document_order(a.nodes);
+        return a;
+    }
+
+    StaticType static_type() const { return TYPE_NODESET; }
+    bool uses_position() const { return left_->uses_position() || right_->uses_position(); }
+
+    void explain(Profile& plan, int depth) const {
+        plan.add_line(depth, "union");
+        left_->explain(plan, depth + 1);
+        right_->explain(plan, depth + 1);
+    }
+
+private:
+    Expr* left_;
+    Expr* right_;
+};
+
+// Apply a predicate list to nodes (which are in axis order)
+static void apply_predicates(const std::vector<Expr*>& predicates, std::vector<DOMNode*>& nodes,
+                             const Environment* env) {
+    for (const Expr* predicate : predicates) {
+        if (nodes.empty()) {
+            return;
+        }
+
+        std::vector<DOMNode*> kept;
+        size_t size = nodes.size();
+
+        if (predicate->is_number_literal()) {
+            // [n] selects a single node without evaluating anything
+            double n = static_cast<const NumberExpr*>(predicate)->value();
+            if (n >= 1 && n <= (double)size && n == std::floor(n)) {
+                kept.push_back(nodes[(size_t)n - 1]);
+            }
+            nodes.swap(kept);
+            continue;
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            Context c = { nodes[i], i + 1, size, env };
+            Value v = predicate->evaluate(c);
+            bool keep = (v.type == Value::NUMBER) ? (v.number == (double)(i + 1)) : to_boolean(v);
+            if (keep) {
+                kept.push_back(nodes[i]);
+            }
+        }
+        nodes.swap(kept);
+    }
+}
+
+static void explain_predicates(const std::vector<Expr*>& predicates, Profile& plan, int depth) {
+    for (const Expr* predicate : predicates) {
+        plan.add_line(depth, "predicate");
+        predicate->explain(plan, depth + 1);
+    }
+}
+
+// True if a predicate may select by proximity position; a number result
+// is compared against the position
+static bool positional_predicate(const Expr* predicate) {
+    StaticType type = predicate->static_type();
+    return type == TYPE_NUMBER || type == TYPE_ANY || predicate->uses_position();
+}
+
+class FilterExpr : public Expr {
+public:
+    FilterExpr(Expr* primary, const std::vector<Expr*>& predicates)
+        : primary_(primary), predicates_(predicates) {}
+    ~FilterExpr() {
+        delete primary_;
+        for (Expr* p : predicates_) delete p;
+    }
+
+    Value evaluate(const Context& ctx) const {
+        Value v = primary_->evaluate(ctx);
+        if (v.type != Value::NODESET) {
+            throw Error("Predicates can only be applied to node-sets");
+        }
+        apply_predicates(predicates_, v.nodes, ctx.env);
+        return v;
+    }
+
+    StaticType static_type() const { return TYPE_NODESET; }
+    bool uses_position() const { return primary_->uses_position(); }
+
+    void explain(Profile& plan, int depth) const {
+        plan.add_line(depth, "filter");
+        primary_->explain(plan, depth + 1);
+        explain_predicates(predicates_, plan, depth + 1);
+    }
+
+private:
+    Expr* primary_;
+    std::vector<Expr*> predicates_;
+};
+
+enum Axis {
+    AXIS_ANCESTOR, AXIS_ANCESTOR_OR_SELF, AXIS_ATTRIBUTE, AXIS_CHILD, AXIS_DESCENDANT,
+    AXIS_DESCENDANT_OR_SELF, AXIS_FOLLOWING, AXIS_FOLLOWING_SIBLING, AXIS_NAMESPACE,
+    AXIS_PARENT, AXIS_PRECEDING, AXIS_PRECEDING_SIBLING, AXIS_SELF
+};
+
+// In the order of Axis, so AXES[axis] names axis
+struct AxisName {
+    const char* name;
+    Axis axis;
+};
+
+static const AxisName AXES[] = {
+    { "ancestor", AXIS_ANCESTOR },
+    { "ancestor-or-self", AXIS_ANCESTOR_OR_SELF },
+    { "attribute", AXIS_ATTRIBUTE },
+    { "child", AXIS_CHILD },
+    { "descendant", AXIS_DESCENDANT },
+    { "descendant-or-self", AXIS_DESCENDANT_OR_SELF },
+    { "following", AXIS_FOLLOWING },
+    { "following-sibling", AXIS_FOLLOWING_SIBLING },
+    { "namespace", AXIS_NAMESPACE },
+    { "parent", AXIS_PARENT },
+    { "preceding", AXIS_PRECEDING },
+    { "preceding-sibling", AXIS_PRECEDING_SIBLING },
+    { "self", AXIS_SELF },
+};
+
+static bool is_reverse_axis(Axis axis) {
+    return axis == AXIS_ANCESTOR || axis == AXIS_ANCESTOR_OR_SELF || axis == AXIS_PRECEDING ||
+           axis == AXIS_PRECEDING_SIBLING;
+}
+
+struct NodeTest {
+    enum Kind { ANY_NODE, TEXT, COMMENT, PI, NAME, ANY_NAME, NAMESPACE_ANY };
+
+    Kind kind;
+    XString prefix;
+    XString local;      // local name for NAME, target for PI
+    bool has_target;
+
+    NodeTest() : kind(ANY_NODE), has_target(false) {}
+};
+
+struct Step {
+    Axis axis;
+    NodeTest test;
+    std::vector<Expr*> predicates;
+};
+
+// The step as written in full, such as "child::item"
+static std::string step_text(const Step& step) {
+    std::string text = std::string(AXES[step.axis].name) + "::";
+    const NodeTest& test = step.test;
+    switch (test.kind) {
+        case NodeTest::ANY_NODE: return text + "node()";
+        case NodeTest::TEXT: return text + "text()";
+        case NodeTest::COMMENT: return text + "comment()";
+        case NodeTest::PI:
+            return text + "processing-instruction(" + (test.has_target ? "'" + to_utf8(test.local) + "'" : "") + ")";
+        case NodeTest::ANY_NAME: return text + "*";
+        case NodeTest::NAMESPACE_ANY: return text + to_utf8(test.prefix) + ":*";
+        default:
+            break;
+    }
+    if (!test.prefix.empty()) {
+        text += to_utf8(test.prefix) + ":";
+    }
+    return text + to_utf8(test.local);
+}
+
+// Prefixes are bound by the declarations in scope at the evaluation's
+// context node, whichever node a step is applied to, as the Xerces engine
+// binds them
+static XString resolve_prefix(const XString& prefix, const Environment* env) {
+    static const XString xml_prefix = xstr("xml");
+    if (prefix == xml_prefix) {
+        return XString(XML_URI);
+    }
+
+    const XMLCh* uri = env->namespace_node ? env->namespace_node->lookupNamespaceURI(prefix.c_str()) : nullptr;
+    if (!uri) {
+        throw Error("Undeclared namespace prefix: " + to_utf8(prefix));
+    }
+    return XString(uri);
+}
+
+static inline bool has_prefixed_name(const NodeTest& test) {
+    return (test.kind == NodeTest::NAME || test.kind == NodeTest::NAMESPACE_ANY) && !test.prefix.empty();
+}
+
+static inline bool namespace_matches(const DOMNode* node, const XString* uri) {
+    const XMLCh* ns = node->getNamespaceURI();
+    if (!uri || uri->empty()) {
+        return !ns || !*ns;
+    }
+    return ns && uri->compare(ns) == 0;
+}
+
+static bool node_test_matches(const NodeTest& test, DOMNode* node, Axis axis, const XString* uri) {
+    DOMNode::NodeType type = node->getNodeType();
+
+    switch (test.kind) {
+        case NodeTest::ANY_NODE:
+            return axis == AXIS_SELF || !continues_text(node);
+        case NodeTest::TEXT:
+            return is_text(node) && (axis == AXIS_SELF || !continues_text(node));
+        case NodeTest::COMMENT:
+            return type == DOMNode::COMMENT_NODE;
+        case NodeTest::PI:
+            return type == DOMNode::PROCESSING_INSTRUCTION_NODE &&
+                   (!test.has_target || xequals(node->getNodeName(), test.local));
+        default:
+            break;
+    }
+
+    // Name tests only match the axis' principal node type
+    if (axis == AXIS_NAMESPACE) {
+        if (test.kind == NodeTest::ANY_NAME) return true;
+        if (test.kind == NodeTest::NAME && test.prefix.empty()) return namespace_decl_prefix(node) == test.local;
+        return false;
+    }
+    if (axis == AXIS_ATTRIBUTE) {
+        if (type != DOMNode::ATTRIBUTE_NODE) return false;
+    } else if (type != DOMNode::ELEMENT_NODE) {
+        return false;
+    }
+
+    switch (test.kind) {
+        case NodeTest::ANY_NAME:
+            return true;
+        case NodeTest::NAMESPACE_ANY:
+            return namespace_matches(node, uri);
+        case NodeTest::NAME:
+            return local_name_equals(node, test.local) && namespace_matches(node, uri);
+        default:
+            return false;
+    }
+}
+
+// Pass the nodes on an axis that pass the node test to visit, in axis
+// order. Returns false as soon as visit does.
+template <class Visitor>
+static bool visit_axis(DOMNode* node, Axis axis, const NodeTest& test, const XString* uri,
+                       Visitor& visit) {
+    switch (axis) {
+        case AXIS_SELF:
+            if (node_test_matches(test, node, axis, uri) && !visit(node)) return false;
+            break;
+
+        case AXIS_CHILD:
+            for (DOMNode* c = xp_first_child(node); c; c = xp_next_sibling(c)) {
+                if (node_test_matches(test, c, axis, uri) && !visit(c)) return false;
+            }
+            break;
+
+        case AXIS_PARENT: {
+            DOMNode* parent = xp_parent(node);
+            if (parent && node_test_matches(test, parent, axis, uri) && !visit(parent)) return false;
+            break;
+        }
+
+        case AXIS_ANCESTOR_OR_SELF:
+            if (node_test_matches(test, node, axis, uri) && !visit(node)) return false;
+            // fall through
+        case AXIS_ANCESTOR:
+            for (DOMNode* a = xp_parent(node); a; a = xp_parent(a)) {
+                if (node_test_matches(test, a, axis, uri) && !visit(a)) return false;
+            }
+            break;
+
+        case AXIS_DESCENDANT_OR_SELF:
+            if (node_test_matches(test, node, axis, uri) && !visit(node)) return false;
+            // fall through
+        case AXIS_DESCENDANT:
+            for (DOMNode* d = xp_first_child(node); d; d = next_preorder(d, node)) {
+                if (node_test_matches(test, d, axis, uri) && !visit(d)) return false;
+            }
+            break;
+
+        case AXIS_FOLLOWING_SIBLING:
+            for (DOMNode* s = xp_next_sibling(node); s; s = xp_next_sibling(s)) {
+                if (node_test_matches(test, s, axis, uri) && !visit(s)) return false;
+            }
+            break;
+
+        case AXIS_PRECEDING_SIBLING:
+            for (DOMNode* s = xp_prev_sibling(node); s; s = xp_prev_sibling(s)) {
+                if (node_test_matches(test, s, axis, uri) && !visit(s)) return false;
+            }
+            break;
+
+        case AXIS_ATTRIBUTE:
+        case AXIS_NAMESPACE: {
+            if (node->getNodeType() != DOMNode::ELEMENT_NODE) break;
+
+            if (axis == AXIS_ATTRIBUTE) {
+                DOMNamedNodeMap* attributes = node->getAttributes();
+                XMLSize_t length = attributes ? attributes->getLength() : 0;
+                for (XMLSize_t i = 0; i < length; i++) {
+                    DOMNode* attr = attributes->item(i);
+                    if (!is_namespace_decl(attr) && node_test_matches(test, attr, axis, uri)) {
+                        if (!visit(attr)) return false;
+                    }
+                }
+                break;
+            }
+
+            // The DOM has no namespace nodes; the nearest in-scope
+            // declaration attribute for each prefix stands in for one.
+            // The implicit xml namespace has no attribute to stand in for
+            // it, so unlike Xalan the axis never includes it.
+            std::vector<XString> seen;
+            for (DOMNode* e = node; e && e->getNodeType() == DOMNode::ELEMENT_NODE; e = xp_parent(e)) {
+                DOMNamedNodeMap* attributes = e->getAttributes();
+                XMLSize_t length = attributes ? attributes->getLength() : 0;
+                for (XMLSize_t i = 0; i < length; i++) {
+                    DOMNode* attr = attributes->item(i);
+                    if (!is_namespace_decl(attr)) continue;
+                    XString prefix = namespace_decl_prefix(attr);
+                    if (std::find(seen.begin(), seen.end(), prefix) != seen.end()) continue;
+                    seen.push_back(prefix);
+                    const XMLCh* value = attr->getNodeValue();
+                    // xmlns="" undeclares the default namespace
+                    if (value && *value && node_test_matches(test, attr, axis, uri)) {
+                        if (!visit(attr)) return false;
+                    }
+                }
+            }
+            break;
+        }
+
+        case AXIS_FOLLOWING: {
+            DOMNode* start = node;
+            if (is_attribute(node)) {
+                // Following nodes of an attribute include its element's content
+                start = xp_parent(node);
+                if (!start) break;
+                for (DOMNode* d = xp_first_child(start); d; d = next_preorder(d, start)) {
+                    if (node_test_matches(test, d, axis, uri) && !visit(d)) return false;
+                }
+            }
+            for (DOMNode* a = start; a; a = xp_parent(a)) {
+                for (DOMNode* s = xp_next_sibling(a); s; s = xp_next_sibling(s)) {
+                    for (DOMNode* d = s; d; d = next_preorder(d, s)) {
+                        if (node_test_matches(test, d, axis, uri) && !visit(d)) return false;
+                    }
+                }
+            }
+            break;
+        }
+
+        case AXIS_PRECEDING: {
+            DOMNode* start = is_attribute(node) ? xp_parent(node) : node;
+            for (DOMNode* a = start; a; a = xp_parent(a)) {
+                for (DOMNode* s = xp_prev_sibling(a); s; s = xp_prev_sibling(s)) {
+                    // Emit the sibling's subtree in reverse document order
+                    std::vector<DOMNode*> subtree;
+                    for (DOMNode* d = s; d; d = next_preorder(d, s)) subtree.push_back(d);
+                    for (size_t i = subtree.size(); i > 0; i--) {
+                        DOMNode* d = subtree[i - 1];
+                        if (node_test_matches(test, d, axis, uri) && !visit(d)) return false;
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+// visit_axis that also counts every node on the axis into visited, for
+// profiling. The node test is applied here so that nodes failing it are
+// counted too.
+template <class Visitor>
+static bool visit_axis_counted(DOMNode* node, Axis axis, const NodeTest& test, const XString* uri,
+                               Visitor& visit, unsigned long& visited) {
+    NodeTest any;
+    auto counting = [&](DOMNode* n) -> bool {
+        visited++;
+        return !node_test_matches(test, n, axis, uri) || visit(n);
+    };
+    return visit_axis(node, axis, any, nullptr, counting);
+}
+
+// Collect the nodes on an axis that pass the node test, in axis order,
+// adding the nodes visited to profile if there is one
+static void collect_axis(DOMNode* node, Axis axis, const NodeTest& test, const XString* uri,
+                         std::vector<DOMNode*>& out, StepProfile* profile = nullptr) {
+    auto push = [&out](DOMNode* n) -> bool {
+        out.push_back(n);
+        return true;
+    };
+    if (profile) {
+        visit_axis_counted(node, axis, test, uri, push, profile->visited);
+    } else {
+        visit_axis(node, axis, test, uri, push);
+    }
+}
+
+class PathExpr : public Expr {
+public:
+    PathExpr(Expr* filter, bool absolute) : filter_(filter), absolute_(absolute) {}
+    ~PathExpr() {
+        delete filter_;
+        for (Step& step : steps_) {
+            for (Expr* p : step.predicates) delete p;
+        }
+    }
+
+    std::vector<Step>& steps() { return steps_; }
+
+    Value evaluate(const Context& ctx) const {
+        std::vector<DOMNode*> current;
+
+        if (filter_) {
+            Value v = filter_->evaluate(ctx);
+            if (v.type != Value::NODESET) {
+                throw Error("Path step applied to a value that is not a node-set");
+            }
+            current.swap(v.nodes);
+        } else if (absolute_) {
+            current.push_back(tree_root(ctx.node));
+        } else {
+            current.push_back(ctx.node);
+        }
+
+        std::vector<DOMNode*> next;
+        std::vector<DOMNode*> candidates;
+        for (const Step& step : steps_) {
+            if (current.empty()) break;
+
+            XString uri;
+            const XString* uri_ptr = nullptr;
+            if (has_prefixed_name(step.test)) {
+                uri = resolve_prefix(step.test.prefix, ctx.env);
+                uri_ptr = &uri;
+            }
+
+            next.clear();
+            bool reverse = is_reverse_axis(step.axis);
+            StepProfile* profile = ctx.env->profile ? ctx.env->profile->step(&step) : nullptr;
+            for (DOMNode* node : current) {
+                candidates.clear();
+                collect_axis(node, step.axis, step.test, uri_ptr, candidates, profile);
+                apply_predicates(step.predicates, candidates, ctx.env);
+                if (profile) {
+                    profile->contexts++;
+                    profile->selected += candidates.size();
+                }
+                if (reverse) {
+                    next.insert(next.end(), candidates.rbegin(), candidates.rend());
+                } else {
+                    next.insert(next.end(), candidates.begin(), candidates.end());
+                }
+            }
+
+            if (current.size() > 1) {
+                sort_document_order(next);
+            }
+            current.swap(next);
+        }
+
+        return make_nodeset(current);
+    }
+
+    // Each step is checked against the shape of the node sequence feeding
+    // it: a single node, nodes in document order none of which contains
+    // another, or nodes in document order that may nest. Expanding a step
+    // depth-first is only in document order without duplicates for some
+    // axis/shape combinations.
+    bool streamable() const {
+        if (filter_) return false;
+
+        enum Shape { SINGLE, DISJOINT, NESTED } shape = SINGLE;
+        for (const Step& step : steps_) {
+            switch (step.axis) {
+                case AXIS_SELF:
+                    break;
+                case AXIS_ATTRIBUTE:
+                    shape = DISJOINT;
+                    break;
+                case AXIS_CHILD:
+                    if (shape == NESTED) return false;
+                    shape = DISJOINT;
+                    break;
+                case AXIS_DESCENDANT:
+                case AXIS_DESCENDANT_OR_SELF:
+                    if (shape == NESTED) return false;
+                    shape = NESTED;
+                    break;
+                case AXIS_PARENT:
+                    if (shape != SINGLE) return false;
+                    break;
+                case AXIS_FOLLOWING_SIBLING:
+                case AXIS_PRECEDING_SIBLING:
+                case AXIS_NAMESPACE:
+                    if (shape != SINGLE) return false;
+                    shape = DISJOINT;
+                    break;
+                default:
+                    if (shape != SINGLE) return false;
+                    shape = NESTED;
+                    break;
+            }
+        }
+        return true;
+    }
+
+    bool stream(const Context& ctx, NodeVisitor& visitor) const {
+        if (!streamable()) {
+            return Expr::stream(ctx, visitor);
+        }
+
+        StreamState state = { ctx.env, &visitor,
+                              std::vector<XString>(steps_.size()),
+                              std::vector<bool>(steps_.size(), false) };
+        return stream_step(0, absolute_ ? tree_root(ctx.node) : ctx.node, state);
+    }
+
+    StaticType static_type() const { return TYPE_NODESET; }
+    bool uses_position() const { return filter_ && filter_->uses_position(); }
+
+    void explain(Profile& plan, int depth) const {
+        std::string text = absolute_ ? "path /" : "path";
+        if (streamable()) {
+            text += " (streamable)";
+        }
+        plan.add_line(depth, text);
+        if (filter_) {
+            filter_->explain(plan, depth + 1);
+        }
+        for (const Step& step : steps_) {
+            plan.add_step(&step, depth + 1, step_text(step));
+            explain_predicates(step.predicates, plan, depth + 2);
+        }
+    }
+
+private:
+    struct StreamState {
+        const Environment* env;
+        NodeVisitor* visitor;
+        std::vector<XString> uris;
+        std::vector<bool> resolved;
+    };
+
+    // Prefixes are resolved on first use, as evaluate() does
+    const XString* step_uri(size_t index, StreamState& state) const {
+        const Step& step = steps_[index];
+        if (!has_prefixed_name(step.test)) return nullptr;
+        if (!state.resolved[index]) {
+            state.uris[index] = resolve_prefix(step.test.prefix, state.env);
+            state.resolved[index] = true;
+        }
+        return &state.uris[index];
+    }
+
+    bool stream_step(size_t index, DOMNode* node, StreamState& state) const {
+        if (index == steps_.size()) {
+            return state.visitor->visit(node);
+        }
+
+        const Step& step = steps_[index];
+        const XString* uri = step_uri(index, state);
+        StepProfile* profile = state.env->profile ? state.env->profile->step(&step) : nullptr;
+        if (profile) {
+            profile->contexts++;
+        }
+
+        bool positional = false;
+        for (const Expr* p : step.predicates) {
+            if (positional_predicate(p)) {
+                positional = true;
+                break;
+            }
+        }
+
+        if (positional || is_reverse_axis(step.axis)) {
+            // Proximity positions need the whole axis for this node
+            std::vector<DOMNode*> candidates;
+            collect_axis(node, step.axis, step.test, uri, candidates, profile);
+            apply_predicates(step.predicates, candidates, state.env);
+            if (profile) {
+                profile->selected += candidates.size();
+            }
+            if (is_reverse_axis(step.axis)) {
+                for (size_t i = candidates.size(); i > 0; i--) {
+                    if (!stream_step(index + 1, candidates[i - 1], state)) return false;
+                }
+            } else {
+                for (DOMNode* candidate : candidates) {
+                    if (!stream_step(index + 1, candidate, state)) return false;
+                }
+            }
+            return true;
+        }
+
+        auto next = [&](DOMNode* candidate) -> bool {
+            for (const Expr* p : step.predicates) {
+                Context c = { candidate, 1, 1, state.env };
+                if (!to_boolean(p->evaluate(c))) return true;
+            }
+            if (profile) {
+                profile->selected++;
+            }
+            return stream_step(index + 1, candidate, state);
+        };
+        if (profile) {
+            return visit_axis_counted(node, step.axis, step.test, uri, next, profile->visited);
+        }
+        return visit_axis(node, step.axis, step.test, uri, next);
+    }
+
+    Expr* filter_;
+    bool absolute_;
+    std::vector<Step> steps_;
+};
+
+// ---------------------------------------------------------------------------
+// Core function library
+// ---------------------------------------------------------------------------
+
+enum FunctionId {
+    FN_LAST, FN_POSITION, FN_COUNT, FN_ID, FN_LOCAL_NAME, FN_NAMESPACE_URI, FN_NAME,
+    FN_STRING, FN_CONCAT, FN_STARTS_WITH, FN_CONTAINS, FN_SUBSTRING_BEFORE,
+    FN_SUBSTRING_AFTER, FN_SUBSTRING, FN_STRING_LENGTH, FN_NORMALIZE_SPACE, FN_TRANSLATE,
+    FN_BOOLEAN, FN_NOT, FN_TRUE, FN_FALSE, FN_LANG, FN_NUMBER, FN_SUM, FN_FLOOR,
+    FN_CEILING, FN_ROUND
+};
+
+struct FunctionInfo {
+    const char* name;
+    FunctionId id;
+    size_t min_args;
+    size_t max_args;
+    StaticType type;
+};
+
+static const size_t UNBOUNDED = (size_t)-1;
+
+static const FunctionInfo FUNCTIONS[] = {
+    { "last", FN_LAST, 0, 0, TYPE_NUMBER },
+    { "position", FN_POSITION, 0, 0, TYPE_NUMBER },
+    { "count", FN_COUNT, 1, 1, TYPE_NUMBER },
+    { "id", FN_ID, 1, 1, TYPE_NODESET },
+    { "local-name", FN_LOCAL_NAME, 0, 1, TYPE_STRING },
+    { "namespace-uri", FN_NAMESPACE_URI, 0, 1, TYPE_STRING },
+    { "name", FN_NAME, 0, 1, TYPE_STRING },
+    { "string", FN_STRING, 0, 1, TYPE_STRING },
+    { "concat", FN_CONCAT, 2, UNBOUNDED, TYPE_STRING },
+    { "starts-with", FN_STARTS_WITH, 2, 2, TYPE_BOOLEAN },
+    { "contains", FN_CONTAINS, 2, 2, TYPE_BOOLEAN },
+    { "substring-before", FN_SUBSTRING_BEFORE, 2, 2, TYPE_STRING },
+    { "substring-after", FN_SUBSTRING_AFTER, 2, 2, TYPE_STRING },
+    { "substring", FN_SUBSTRING, 2, 3, TYPE_STRING },
+    { "string-length", FN_STRING_LENGTH, 0, 1, TYPE_NUMBER },
+    { "normalize-space", FN_NORMALIZE_SPACE, 0, 1, TYPE_STRING },
+    { "translate", FN_TRANSLATE, 3, 3, TYPE_STRING },
+    { "boolean", FN_BOOLEAN, 1, 1, TYPE_BOOLEAN },
+    { "not", FN_NOT, 1, 1, TYPE_BOOLEAN },
+    { "true", FN_TRUE, 0, 0, TYPE_BOOLEAN },
+    { "false", FN_FALSE, 0, 0, TYPE_BOOLEAN },
+    { "lang", FN_LANG, 1, 1, TYPE_BOOLEAN },
+    { "number", FN_NUMBER, 0, 1, TYPE_NUMBER },
+    { "sum", FN_SUM, 1, 1, TYPE_NUMBER },
+    { "floor", FN_FLOOR, 1, 1, TYPE_NUMBER },
+    { "ceiling", FN_CEILING, 1, 1, TYPE_NUMBER },
+    { "round", FN_ROUND, 1, 1, TYPE_NUMBER },
+};
+
+static double xpath_round(double d) {
+    if (std::isnan(d) || std::isinf(d)) return d;
+    if (d < 0 && d >= -0.5) return -0.0;
+    return std::floor(d + 0.5);
+}
+
+class FunctionCall : public Expr {
+public:
+    FunctionCall(const FunctionInfo& info, const std::vector<Expr*>& args) : info_(info), args_(args) {}
+    ~FunctionCall() {
+        for (Expr* a : args_) delete a;
+    }
+
+    StaticType static_type() const { return info_.type; }
+
+    bool uses_position() const {
+        if (info_.id == FN_LAST || info_.id == FN_POSITION) return true;
+        for (const Expr* a : args_) {
+            if (a->uses_position()) return true;
+        }
+        return false;
+    }
+
+    void explain(Profile& plan, int depth) const {
+        plan.add_line(depth, std::string("function ") + info_.name + "()");
+        for (const Expr* a : args_) {
+            a->explain(plan, depth + 1);
+        }
+    }
+
+    Value evaluate(const Context& ctx) const {
+        switch (info_.id) {
+            case FN_LAST: return make_number((double)ctx.size);
+            case FN_POSITION: return make_number((double)ctx.position);
+            case FN_COUNT: return make_number((double)nodeset_arg(ctx, 0).nodes.size());
+            case FN_ID: return id(ctx);
+            case FN_LOCAL_NAME:
+            case FN_NAMESPACE_URI:
+            case FN_NAME: return make_string(name_function(ctx));
+            case FN_STRING: return make_string(string_arg(ctx, 0));
+            case FN_CONCAT: {
+                XString result;
+                for (size_t i = 0; i < args_.size(); i++) result += string_arg(ctx, i);
+                return make_string(result);
+            }
+            case FN_STARTS_WITH: {
+                XString s = string_arg(ctx, 0);
+                XString prefix = string_arg(ctx, 1);
+                return make_boolean(s.compare(0, prefix.length(), prefix) == 0);
+            }
+            case FN_CONTAINS: {
+                XString s = string_arg(ctx, 0);
+                return make_boolean(s.find(string_arg(ctx, 1)) != XString::npos);
+            }
+            case FN_SUBSTRING_BEFORE: {
+                XString s = string_arg(ctx, 0);
+                size_t pos = s.find(string_arg(ctx, 1));
+                return make_string(pos == XString::npos ? XString() : s.substr(0, pos));
+            }
+            case FN_SUBSTRING_AFTER: {
+                XString s = string_arg(ctx, 0);
+                XString needle = string_arg(ctx, 1);
+                size_t pos = s.find(needle);
+                return make_string(pos == XString::npos ? XString() : s.substr(pos + needle.length()));
+            }
+            case FN_SUBSTRING: return make_string(substring(ctx));
+            case FN_STRING_LENGTH: return make_number((double)to_code_points(string_arg(ctx, 0)).size());
+            case FN_NORMALIZE_SPACE: return make_string(normalize_space(string_arg(ctx, 0)));
+            case FN_TRANSLATE: return make_string(translate(ctx));
+            case FN_BOOLEAN: return make_boolean(to_boolean(args_[0]->evaluate(ctx)));
+            case FN_NOT: return make_boolean(!to_boolean(args_[0]->evaluate(ctx)));
+            case FN_TRUE: return make_boolean(true);
+            case FN_FALSE: return make_boolean(false);
+            case FN_LANG: return make_boolean(lang(ctx));
+            case FN_NUMBER: {
+                if (args_.empty()) return make_number(string_to_number(string_value(ctx.node)));
+                return make_number(to_number(args_[0]->evaluate(ctx)));
+            }
+            case FN_SUM: {
+                double total = 0;
+                Value set = nodeset_arg(ctx, 0);
+                for (DOMNode* n : set.nodes) total += string_to_number(string_value(n));
+                return make_number(total);
+            }
+            case FN_FLOOR: return make_number(std::floor(to_number(args_[0]->evaluate(ctx))));
+            case FN_CEILING: return make_number(std::ceil(to_number(args_[0]->evaluate(ctx))));
+            case FN_ROUND: return make_number(xpath_round(to_number(args_[0]->evaluate(ctx))));
+        }
+        return Value();
+    }
+
+private:
+    Value nodeset_arg(const Context& ctx, size_t index) const {
+        Value v = args_[index]->evaluate(ctx);
+        if (v.type != Value::NODESET) {
+            throw Error(std::string("Argument to ") + info_.name + "() must be a node-set");
+        }
+        return v;
+    }
+
+    XString string_arg(const Context& ctx, size_t index) const {
+        if (index >= args_.size()) {
+            return string_value(ctx.node);
+        }
+        return to_string(args_[index]->evaluate(ctx));
+    }
+
+    XString name_function(const Context& ctx) const {
+        DOMNode* node = ctx.node;
+        if (!args_.empty()) {
+            Value v = nodeset_arg(ctx, 0);
+            if (v.nodes.empty()) return XString();
+            node = v.nodes[0];
+        }
+
+        DOMNode::NodeType type = node->getNodeType();
+        bool named = type == DOMNode::ELEMENT_NODE || type == DOMNode::ATTRIBUTE_NODE ||
+                     type == DOMNode::PROCESSING_INSTRUCTION_NODE;
+        if (!named) return XString();
+
+        if (type == DOMNode::ATTRIBUTE_NODE && is_namespace_decl(node)) {
+            // Stand-in namespace node: its name is the declared prefix
+            return info_.id == FN_NAMESPACE_URI ? XString() : namespace_decl_prefix(node);
+        }
+
+        if (info_.id == FN_NAMESPACE_URI) {
+            const XMLCh* uri = node->getNamespaceURI();
+            return uri ? XString(uri) : XString();
+        }
+        if (info_.id == FN_NAME || type == DOMNode::PROCESSING_INSTRUCTION_NODE) {
+            const XMLCh* name = node->getNodeName();
+            return name ? XString(name) : XString();
+        }
+        size_t length;
+        const XMLCh* local = local_name_ptr(node, &length);
+        return XString(local, length);
+    }
+
+    Value id(const Context& ctx) const {
+        Value arg = args_[0]->evaluate(ctx);
+        std::vector<XString> tokens;
+
+        std::vector<XString> sources;
+        if (arg.type == Value::NODESET) {
+            for (DOMNode* n : arg.nodes) sources.push_back(string_value(n));
+        } else {
+            sources.push_back(to_string(arg));
+        }
+        for (const XString& s : sources) {
+            size_t i = 0;
+            while (i < s.length()) {
+                while (i < s.length() && is_xml_space(s[i])) i++;
+                size_t start = i;
+                while (i < s.length() && !is_xml_space(s[i])) i++;
+                if (i > start) tokens.push_back(s.substr(start, i - start));
+            }
+        }
+
+        DOMDocument* doc = ctx.node->getNodeType() == DOMNode::DOCUMENT_NODE
+            ? static_cast<DOMDocument*>(ctx.node) : ctx.node->getOwnerDocument();
+        std::vector<DOMNode*> result;
+        if (doc) {
+            for (const XString& token : tokens) {
+                DOMElement* e = doc->getElementById(token.c_str());
+                if (e) result.push_back(e);
+            }
+        }
+        sort_document_order(result);
+        return make_nodeset(result);
+    }
+
+    XString substring(const Context& ctx) const {
+        std::vector<unsigned long> chars = to_code_points(string_arg(ctx, 0));
+        double start = xpath_round(to_number(args_[1]->evaluate(ctx)));
+        double end = std::numeric_limits<double>::infinity();
+        if (args_.size() > 2) {
+            end = start + xpath_round(to_number(args_[2]->evaluate(ctx)));
+        }
+
+        XString result;
+        for (size_t i = 0; i < chars.size(); i++) {
+            double position = (double)(i + 1);
+            if (position >= start && position < end) {
+                append_code_point(result, chars[i]);
+            }
+        }
+        return result;
+    }
+
+    static XString normalize_space(const XString& s) {
+        XString result;
+        bool pending_space = false;
+        for (XMLCh c : s) {
+            if (is_xml_space(c)) {
+                pending_space = !result.empty();
+            } else {
+                if (pending_space) result.push_back(' ');
+                pending_space = false;
+                result.push_back(c);
+            }
+        }
+        return result;
+    }
+
+    XString translate(const Context& ctx) const {
+        std::vector<unsigned long> chars = to_code_points(string_arg(ctx, 0));
+        std::vector<unsigned long> from = to_code_points(string_arg(ctx, 1));
+        std::vector<unsigned long> to = to_code_points(string_arg(ctx, 2));
+
+        XString result;
+        for (unsigned long c : chars) {
+            std::vector<unsigned long>::iterator it = std::find(from.begin(), from.end(), c);
+            if (it == from.end()) {
+                append_code_point(result, c);
+            } else {
+                size_t index = (size_t)(it - from.begin());
+                if (index < to.size()) append_code_point(result, to[index]);
+            }
+        }
+        return result;
+    }
+
+    bool lang(const Context& ctx) const {
+        XString wanted = to_string(args_[0]->evaluate(ctx));
+        static const XString lang_name = xstr("lang");
+        static const XString xml_lang = xstr("xml:lang");
+
+        for (DOMNode* n = ctx.node; n; n = xp_parent(n)) {
+            if (n->getNodeType() != DOMNode::ELEMENT_NODE) continue;
+            DOMElement* e = static_cast<DOMElement*>(n);
+            DOMAttr* attr = e->getAttributeNodeNS(XML_URI, lang_name.c_str());
+            if (!attr) attr = e->getAttributeNode(xml_lang.c_str());
+            if (!attr) continue;
+
+            XString value(attr->getValue());
+            if (value.length() < wanted.length()) return false;
+            for (size_t i = 0; i < wanted.length(); i++) {
+                XMLCh a = value[i], b = wanted[i];
+                if (a >= 'A' && a <= 'Z') a = a - 'A' + 'a';
+                if (b >= 'A' && b <= 'Z') b = b - 'A' + 'a';
+                if (a != b) return false;
+            }
+            return value.length() == wanted.length() || value[wanted.length()] == '-';
+        }
+        return false;
+    }
+
+    const FunctionInfo& info_;
+    std::vector<Expr*> args_;
+};
+
+// ---------------------------------------------------------------------------
+// Lexer
+// ---------------------------------------------------------------------------
+
+enum TokenType {
+    T_EOF, T_LPAREN, T_RPAREN, T_LBRACKET, T_RBRACKET, T_DOT, T_DOTDOT, T_AT, T_COMMA,
+    T_COLONCOLON, T_SLASH, T_DSLASH, T_PIPE, T_PLUS, T_MINUS, T_EQ, T_NE, T_LT, T_LE,
+    T_GT, T_GE, T_MUL, T_AND, T_OR, T_MOD, T_DIV, T_NAME, T_STAR, T_NSSTAR, T_LITERAL,
+    T_NUMBER, T_VARIABLE
+};
+
+struct Token {
+    TokenType type;
+    std::string text;   // names, literals and numbers (UTF-8)
+    size_t position;
+};
+
+static bool is_operator_token(TokenType t) {
+    switch (t) {
+        case T_AND: case T_OR: case T_MOD: case T_DIV: case T_MUL: case T_SLASH: case T_DSLASH:
+        case T_PIPE: case T_PLUS: case T_MINUS: case T_EQ: case T_NE: case T_LT: case T_LE:
+        case T_GT: case T_GE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool is_name_start(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static inline bool is_name_char(unsigned char c) {
+    return is_name_start(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static std::vector<Token> tokenize(const std::string& src) {
+    std::vector<Token> tokens;
+    size_t i = 0;
+    size_t n = src.length();
+
+    while (true) {
+        while (i < n && (src[i] == ' ' || src[i] == '\t' || src[i] == '\r' || src[i] == '\n')) i++;
+
+        Token tok;
+        tok.position = i;
+        if (i >= n) {
+            tok.type = T_EOF;
+            tokens.push_back(tok);
+            break;
+        }
+
+        // XPath 1.0 section 3.7: '*' and operator names are operators only
+        // when preceded by a token that is not an operator or (, [, @, ::, ,
+        bool operator_context = false;
+        if (!tokens.empty()) {
+            TokenType prev = tokens.back().type;
+            operator_context = !(prev == T_AT || prev == T_COLONCOLON || prev == T_LPAREN ||
+                                 prev == T_LBRACKET || prev == T_COMMA || is_operator_token(prev));
+        }
+
+        char c = src[i];
+        switch (c) {
+            case '(': tok.type = T_LPAREN; i++; break;
+            case ')': tok.type = T_RPAREN; i++; break;
+            case '[': tok.type = T_LBRACKET; i++; break;
+            case ']': tok.type = T_RBRACKET; i++; break;
+            case '@': tok.type = T_AT; i++; break;
+            case ',': tok.type = T_COMMA; i++; break;
+            case '|': tok.type = T_PIPE; i++; break;
+            case '+': tok.type = T_PLUS; i++; break;
+            case '-': tok.type = T_MINUS; i++; break;
+            case '=': tok.type = T_EQ; i++; break;
+            case '!':
+                if (i + 1 < n && src[i + 1] == '=') {
+                    tok.type = T_NE;
+                    i += 2;
+                    break;
+                }
+                throw Error("Unexpected character '!' at position " + std::to_string(i));
+            case '<':
+                if (i + 1 < n && src[i + 1] == '=') { tok.type = T_LE; i += 2; }
+                else { tok.type = T_LT; i++; }
+                break;
+            case '>':
+                if (i + 1 < n && src[i + 1] == '=') { tok.type = T_GE; i += 2; }
+                else { tok.type = T_GT; i++; }
+                break;
+            case '/':
+                if (i + 1 < n && src[i + 1] == '/') { tok.type = T_DSLASH; i += 2; }
+                else { tok.type = T_SLASH; i++; }
+                break;
+            case ':':
+                if (i + 1 < n && src[i + 1] == ':') {
+                    tok.type = T_COLONCOLON;
+                    i += 2;
+                    break;
+                }
+                throw Error("Unexpected character ':' at position " + std::to_string(i));
+            case '*':
+                tok.type = operator_context ? T_MUL : T_STAR;
+                i++;
+                break;
+            case '"':
+            case '\'': {
+                size_t close = src.find(c, i + 1);
+                if (close == std::string::npos) {
+                    throw Error("Unterminated string literal at position " + std::to_string(i));
+                }
+                tok.type = T_LITERAL;
+                tok.text = src.substr(i + 1, close - i - 1);
+                i = close + 1;
+                break;
+            }
+            case '$': {
+                size_t start = ++i;
+                if (i >= n || !is_name_start((unsigned char)src[i])) {
+                    throw Error("Invalid variable reference at position " + std::to_string(start - 1));
+                }
+                while (i < n && (is_name_char((unsigned char)src[i]) ||
+                                 (src[i] == ':' && i + 1 < n && is_name_start((unsigned char)src[i + 1])))) {
+                    i++;
+                }
+                tok.type = T_VARIABLE;
+                tok.text = src.substr(start, i - start);
+                break;
+            }
+            default: {
+                if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < n && src[i + 1] >= '0' && src[i + 1] <= '9')) {
+                    size_t start = i;
+                    while (i < n && src[i] >= '0' && src[i] <= '9') i++;
+                    if (i < n && src[i] == '.') {
+                        i++;
+                        while (i < n && src[i] >= '0' && src[i] <= '9') i++;
+                    }
+                    tok.type = T_NUMBER;
+                    tok.text = src.substr(start, i - start);
+                    break;
+                }
+                if (c == '.') {
+                    if (i + 1 < n && src[i + 1] == '.') { tok.type = T_DOTDOT; i += 2; }
+                    else { tok.type = T_DOT; i++; }
+                    break;
+                }
+                if (!is_name_start((unsigned char)c)) {
+                    throw Error(std::string("Unexpected character '") + c + "' at position " + std::to_string(i));
+                }
+
+                size_t start = i;
+                while (i < n && is_name_char((unsigned char)src[i])) i++;
+                std::string name = src.substr(start, i - start);
+
+                if (operator_context) {
+                    if (name == "and") tok.type = T_AND;
+                    else if (name == "or") tok.type = T_OR;
+                    else if (name == "mod") tok.type = T_MOD;
+                    else if (name == "div") tok.type = T_DIV;
+                    else throw Error("Expected an operator but found '" + name + "' at position " + std::to_string(start));
+                    break;
+                }
+
+                tok.type = T_NAME;
+                if (i + 1 < n && src[i] == ':' && src[i + 1] != ':') {
+                    if (src[i + 1] == '*') {
+                        tok.type = T_NSSTAR;
+                        i += 2;
+                    } else if (is_name_start((unsigned char)src[i + 1])) {
+                        i++;
+                        while (i < n && is_name_char((unsigned char)src[i])) i++;
+                        name = src.substr(start, i - start);
+                    }
+                }
+                tok.text = name;
+                break;
+            }
+        }
+
+        tokens.push_back(tok);
+    }
+
+    return tokens;
+}
+
+// ---------------------------------------------------------------------------
+// Optimizer
+// ---------------------------------------------------------------------------
+
+// descendant-or-self::node()/child::x[p] is equivalent to descendant::x[p]
+// when none of the predicates depend on position. This turns '//x' into a
+// single pass over the tree instead of one child scan per node.
+static void optimize_steps(std::vector<Step>& steps) {
+    for (size_t i = 0; i + 1 < steps.size(); i++) {
+        Step& current = steps[i];
+        Step& following = steps[i + 1];
+
+        if (current.axis != AXIS_DESCENDANT_OR_SELF || current.test.kind != NodeTest::ANY_NODE ||
+            !current.predicates.empty()) {
+            continue;
+        }
+        if (following.axis != AXIS_CHILD && following.axis != AXIS_DESCENDANT) {
+            continue;
+        }
+
+        bool positional = false;
+        for (const Expr* p : following.predicates) {
+            if (positional_predicate(p)) {
+                positional = true;
+                break;
+            }
+        }
+        if (positional) {
+            continue;
+        }
+
+        following.axis = AXIS_DESCENDANT;
+        steps.erase(steps.begin() + (long)i);
+        i--;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+// ---------------------------------------------------------------------------
+
+static const int MAX_PARSE_DEPTH = 512;
+
+static bool is_node_type_name(const std::string& name) {
+    return name == "node" || name == "text" || name == "comment" || name == "processing-instruction";
+}
+
+class Parser {
+public:
+    explicit Parser(const std::string& source) : tokens_(tokenize(source)), pos_(0), depth_(0) {}
+
+    Expr* parse() {
+        Expr* expr = parse_or();
+        if (peek().type != T_EOF) {
+            delete expr;
+            unexpected();
+        }
+        return expr;
+    }
+
+private:
+    // Owns a partially built expression while parsing can still throw
+    struct Holder {
+        Expr* expr;
+        explicit Holder(Expr* e) : expr(e) {}
+        ~Holder() { delete expr; }
+        Expr* release() { Expr* e = expr; expr = nullptr; return e; }
+    };
+
+    struct DepthGuard {
+        int& depth;
+        explicit DepthGuard(int& d) : depth(d) {
+            if (++depth > MAX_PARSE_DEPTH) {
+                throw Error("Expression is nested too deeply");
+            }
+        }
+        ~DepthGuard() { depth--; }
+    };
+
+    const Token& peek(size_t ahead = 0) const {
+        size_t index = pos_ + ahead;
+        return index < tokens_.size() ? tokens_[index] : tokens_.back();
+    }
+
+    const Token& next() {
+        const Token& t = tokens_[pos_];
+        if (pos_ + 1 < tokens_.size()) pos_++;
+        return t;
+    }
+
+    void expect(TokenType type, const char* what) {
+        if (peek().type != type) {
+            throw Error(std::string("Expected ") + what + " at position " + std::to_string(peek().position));
+        }
+        next();
+    }
+
+    void unexpected() {
+        const Token& t = peek();
+        if (t.type == T_EOF) {
+            throw Error("Unexpected end of expression");
+        }
+        throw Error("Unexpected token at position " + std::to_string(t.position));
+    }
+
+    Expr* parse_or() {
+        DepthGuard guard(depth_);
+        Holder left(parse_and());
+        while (peek().type == T_OR) {
+            next();
+            Expr* right = parse_and();
+            left.expr = new BinaryExpr(OP_OR, left.release(), right);
+        }
+        return left.release();
+    }
+
+    Expr* parse_and() {
+        Holder left(parse_equality());
+        while (peek().type == T_AND) {
+            next();
+            Expr* right = parse_equality();
+            left.expr = new BinaryExpr(OP_AND, left.release(), right);
+        }
+        return left.release();
+    }
+
+    Expr* parse_equality() {
+        Holder left(parse_relational());
+        while (peek().type == T_EQ || peek().type == T_NE) {
+            BinaryOp op = next().type == T_EQ ? OP_EQ : OP_NE;
+            Expr* right = parse_relational();
+            left.expr = new BinaryExpr(op, left.release(), right);
+        }
+        return left.release();
+    }
+
+    Expr* parse_relational() {
+        Holder left(parse_additive());
+        while (true) {
+            BinaryOp op;
+            switch (peek().type) {
+                case T_LT: op = OP_LT; break;
+                case T_LE: op = OP_LE; break;
+                case T_GT: op = OP_GT; break;
+                case T_GE: op = OP_GE; break;
+                default: return left.release();
+            }
+            next();
+            Expr* right = parse_additive();
+            left.expr = new BinaryExpr(op, left.release(), right);
+        }
+    }
+
+    Expr* parse_additive() {
+        Holder left(parse_multiplicative());
+        while (peek().type == T_PLUS || peek().type == T_MINUS) {
+            BinaryOp op = next().type == T_PLUS ? OP_ADD : OP_SUB;
+            Expr* right = parse_multiplicative();
+            left.expr = new BinaryExpr(op, left.release(), right);
+        }
+        return left.release();
+    }
+
+    Expr* parse_multiplicative() {
+        Holder left(parse_unary());
+        while (true) {
+            BinaryOp op;
+            switch (peek().type) {
+                case T_MUL: op = OP_MUL; break;
+                case T_DIV: op = OP_DIV; break;
+                case T_MOD: op = OP_MOD; break;
+                default: return left.release();
+            }
+            next();
+            Expr* right = parse_unary();
+            left.expr = new BinaryExpr(op, left.release(), right);
+        }
+    }
+
+    Expr* parse_unary() {
+        if (peek().type == T_MINUS) {
+            DepthGuard guard(depth_);
+            next();
+            return new NegateExpr(parse_unary());
+        }
+        return parse_union();
+    }
+
+    Expr* parse_union() {
+        Holder left(parse_path());
+        while (peek().type == T_PIPE) {
+            next();
+            Expr* right = parse_path();
+            left.expr = new UnionExpr(left.release(), right);
+        }
+        return left.release();
+    }
+
+    bool at_filter_start() const {
+        const Token& t = peek();
+        switch (t.type) {
+            case T_VARIABLE: case T_LPAREN: case T_LITERAL: case T_NUMBER:
+                return true;
+            case T_NAME:
+                return peek(1).type == T_LPAREN && !is_node_type_name(t.text);
+            default:
+                return false;
+        }
+    }
+
+    Expr* parse_path() {
+        if (at_filter_start()) {
+            Holder filter(parse_filter());
+            if (peek().type != T_SLASH && peek().type != T_DSLASH) {
+                return filter.release();
+            }
+            PathExpr* path = new PathExpr(filter.release(), false);
+            Holder holder(path);
+            parse_relative_path(path, true);
+            return holder.release();
+        }
+
+        if (peek().type == T_SLASH || peek().type == T_DSLASH) {
+            PathExpr* path = new PathExpr(nullptr, true);
+            Holder holder(path);
+            if (peek().type == T_SLASH) {
+                next();
+                // A lone '/' selects the root node
+                if (!at_step_start()) {
+                    return holder.release();
+                }
+                parse_relative_path(path, false);
+            } else {
+                parse_relative_path(path, true);
+            }
+            return holder.release();
+        }
+
+        if (!at_step_start()) {
+            unexpected();
+        }
+        PathExpr* path = new PathExpr(nullptr, false);
+        Holder holder(path);
+        parse_relative_path(path, false);
+        return holder.release();
+    }
+
+    bool at_step_start() const {
+        switch (peek().type) {
+            case T_DOT: case T_DOTDOT: case T_AT: case T_STAR: case T_NSSTAR: case T_NAME:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static Step descendant_or_self_step() {
+        Step step;
+        step.axis = AXIS_DESCENDANT_OR_SELF;
+        step.test.kind = NodeTest::ANY_NODE;
+        return step;
+    }
+
+    // Parses steps separated by '/' or '//'. If leading_separator is set the
+    // current token is the separator preceding the first step.
+    void parse_relative_path(PathExpr* path, bool leading_separator) {
+        if (leading_separator) {
+            if (next().type == T_DSLASH) {
+                path->steps().push_back(descendant_or_self_step());
+            }
+        }
+
+        while (true) {
+            path->steps().push_back(Step());
+            parse_step(path->steps().back());
+
+            if (peek().type == T_SLASH) {
+                next();
+            } else if (peek().type == T_DSLASH) {
+                next();
+                path->steps().push_back(descendant_or_self_step());
+            } else {
+                break;
+            }
+        }
+
+        optimize_steps(path->steps());
+    }
+
+    void parse_step(Step& step) {
+        const Token& t = peek();
+
+        if (t.type == T_DOT) {
+            next();
+            step.axis = AXIS_SELF;
+            step.test.kind = NodeTest::ANY_NODE;
+            return;
+        }
+        if (t.type == T_DOTDOT) {
+            next();
+            step.axis = AXIS_PARENT;
+            step.test.kind = NodeTest::ANY_NODE;
+            return;
+        }
+
+        step.axis = AXIS_CHILD;
+        if (t.type == T_AT) {
+            next();
+            step.axis = AXIS_ATTRIBUTE;
+        } else if (t.type == T_NAME && peek(1).type == T_COLONCOLON) {
+            std::string name = t.text;
+            bool found = false;
+            for (const AxisName& axis : AXES) {
+                if (name == axis.name) {
+                    step.axis = axis.axis;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                throw Error("Unknown axis: " + name);
+            }
+            next();
+            next();
+        }
+
+        parse_node_test(step.test);
+
+        while (peek().type == T_LBRACKET) {
+            step.predicates.push_back(parse_predicate());
+        }
+    }
+
+    void parse_node_test(NodeTest& test) {
+        const Token& t = peek();
+
+        if (t.type == T_STAR) {
+            next();
+            test.kind = NodeTest::ANY_NAME;
+            return;
+        }
+        if (t.type == T_NSSTAR) {
+            test.kind = NodeTest::NAMESPACE_ANY;
+            test.prefix = utf8_to_xstring(t.text.c_str(), t.text.length());
+            next();
+            return;
+        }
+        if (t.type != T_NAME) {
+            unexpected();
+        }
+
+        std::string name = t.text;
+        if (peek(1).type == T_LPAREN && is_node_type_name(name)) {
+            next();
+            next();
+            if (name == "node") test.kind = NodeTest::ANY_NODE;
+            else if (name == "text") test.kind = NodeTest::TEXT;
+            else if (name == "comment") test.kind = NodeTest::COMMENT;
+            else {
+                test.kind = NodeTest::PI;
+                if (peek().type == T_LITERAL) {
+                    test.has_target = true;
+                    test.local = utf8_to_xstring(peek().text.c_str(), peek().text.length());
+                    next();
+                }
+            }
+            expect(T_RPAREN, "')'");
+            return;
+        }
+
+        next();
+        test.kind = NodeTest::NAME;
+        size_t colon = name.find(':');
+        if (colon != std::string::npos) {
+            test.prefix = utf8_to_xstring(name.c_str(), colon);
+            test.local = utf8_to_xstring(name.c_str() + colon + 1, name.length() - colon - 1);
+        } else {
+            test.local = utf8_to_xstring(name.c_str(), name.length());
+        }
+    }
+
+    Expr* parse_predicate() {
+        DepthGuard guard(depth_);
+        expect(T_LBRACKET, "'['");
+        Holder expr(parse_or());
+        expect(T_RBRACKET, "']'");
+        return expr.release();
+    }
+
+    Expr* parse_filter() {
+        Holder primary(parse_primary());
+        if (peek().type != T_LBRACKET) {
+            return primary.release();
+        }
+
+        std::vector<Expr*> predicates;
+        try {
+            while (peek().type == T_LBRACKET) {
+                predicates.push_back(parse_predicate());
+            }
+        } catch (...) {
+            for (Expr* p : predicates) delete p;
+            throw;
+        }
+        return new FilterExpr(primary.release(), predicates);
+    }
+
+    Expr* parse_primary() {
+        const Token& t = peek();
+
+        switch (t.type) {
+            case T_VARIABLE: {
+                next();
+                return new VariableExpr(utf8_to_xstring(t.text.c_str(), t.text.length()));
+            }
+            case T_LITERAL: {
+                next();
+                return new LiteralExpr(utf8_to_xstring(t.text.c_str(), t.text.length()));
+            }
+            case T_NUMBER: {
+                next();
+                return new NumberExpr(strtod(t.text.c_str(), nullptr));
+            }
+            case T_LPAREN: {
+                DepthGuard guard(depth_);
+                next();
+                Holder expr(parse_or());
+                expect(T_RPAREN, "')'");
+                return expr.release();
+            }
+            case T_NAME:
+                return parse_function_call();
+            default:
+                unexpected();
+        }
+        return nullptr;
+    }
+
+    Expr* parse_function_call() {
+        DepthGuard guard(depth_);
+        std::string name = next().text;
+        const FunctionInfo* info = nullptr;
+        for (const FunctionInfo& f : FUNCTIONS) {
+            if (name == f.name) {
+                info = &f;
+                break;
+            }
+        }
+        if (!info) {
+            throw Error("Unknown function: " + name + "()");
+        }
+
+        expect(T_LPAREN, "'('");
+        std::vector<Expr*> args;
+        try {
+            if (peek().type != T_RPAREN) {
+                args.push_back(parse_or());
+                while (peek().type == T_COMMA) {
+                    next();
+                    args.push_back(parse_or());
+                }
+            }
+            expect(T_RPAREN, "')'");
+        } catch (...) {
+            for (Expr* a : args) delete a;
+            throw;
+        }
+
+        if (args.size() < info->min_args || args.size() > info->max_args) {
+            for (Expr* a : args) delete a;
+            throw Error("Wrong number of arguments to " + name + "()");
+        }
+        return new FunctionCall(*info, args);
+    }
+
+    std::vector<Token> tokens_;
+    size_t pos_;
+    int depth_;
+};
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+CompiledExpressionPtr compile(const std::string& expression) {
+    Parser parser(expression);
+    Expr* root = parser.parse();
+    return CompiledExpressionPtr(new CompiledExpression(root, expression));
+}
+
+Profile::Profile(const CompiledExpression& expression) {
+    expression.root()->explain(*this, 0);
+}
+
+void Profile::add_line(int depth, const std::string& text) {
+    if (!plan_.empty()) {
+        plan_ += '\n';
+    }
+    plan_.append((size_t)depth * 2, ' ');
+    plan_ += text;
+}
+
+void Profile::add_step(const void* step, int depth, const std::string& text) {
+    index_[step] = steps_.size();
+    StepProfile profile = { text, 0, 0, 0 };
+    steps_.push_back(profile);
+    add_line(depth, "step " + std::to_string(steps_.size()) + " " + text);
+}
+
+StepProfile* Profile::step(const void* step) {
+    std::map<const void*, size_t>::iterator it = index_.find(step);
+    return it == index_.end() ? nullptr : &steps_[it->second];
+}
+
+// The element whose in-scope namespaces bind the prefixes of an
+// expression evaluated at context: the context node itself, or the
+// nearest element above it. Documents use their document element.
+static DOMNode* namespace_context(DOMNode* context) {
+    if (context->getNodeType() == DOMNode::DOCUMENT_NODE) {
+        DOMElement* root = static_cast<DOMDocument*>(context)->getDocumentElement();
+        return root ? static_cast<DOMNode*>(root) : context;
+    }
+    DOMNode* node = context;
+    while (node && node->getNodeType() != DOMNode::ELEMENT_NODE) {
+        node = xp_parent(node);
+    }
+    return node ? node : context;
+}
+
+Value evaluate(const CompiledExpression& expression, DOMNode* context, const VariableMap* variables,
+               Profile* profile) {
+    Environment env = { variables, namespace_context(context), profile };
+    Context ctx = { context, 1, 1, &env };
+    return expression.root()->evaluate(ctx);
+}
+
+bool for_each_node(const CompiledExpression& expression, DOMNode* context, NodeVisitor& visitor,
+                   Profile* profile) {
+    Environment env = { nullptr, namespace_context(context), profile };
+    Context ctx = { context, 1, 1, &env };
+    return expression.root()->stream(ctx, visitor);
+}
+
+void select_nodes(const CompiledExpression& expression, DOMNode* context, std::vector<DOMNode*>& out,
+                  Profile* profile) {
+    Value result = evaluate(expression, context, nullptr, profile);
+    if (result.type != Value::NODESET) {
+        throw Error("Expression does not evaluate to a node-set");
+    }
+    out.insert(out.end(), result.nodes.begin(), result.nodes.end());
+}
+
+} // namespace native_xpath
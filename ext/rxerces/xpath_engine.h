@@ -0,0 +1,145 @@
+#ifndef RXERCES_XPATH_ENGINE_H
+#define RXERCES_XPATH_ENGINE_H
+
+#include <xercesc/util/XercesDefs.hpp>
+#include <xercesc/dom/DOM.hpp>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Native XPath 1.0 engine that evaluates expressions directly against the
+// Xerces DOM. Expressions are compiled once into an immutable AST that can
+// be shared between documents; evaluation needs neither Xalan nor a mirror
+// tree of the document.
+//
+// Adjacent DOM text and CDATA siblings are one text node, as in the XPath
+// data model, represented by the first of them. The namespace axis is made
+// of the in-scope xmlns attributes and leaves out the implicit xml
+// namespace node.
+//
+// This file does not depend on Ruby so it can be reused by the native
+// benchmark harness, and neither do the other native_* modules next to it.
+// Errors are reported by throwing native_xpath::Error.
+namespace native_xpath {
+
+typedef std::basic_string<XMLCh> XString;
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const std::string& message) : std::runtime_error(message) {}
+};
+
+class Expr;
+
+// Receives the nodes of a streamed node-set in document order
+class NodeVisitor {
+public:
+    virtual ~NodeVisitor() {}
+    // Return false to stop evaluation
+    virtual bool visit(xercesc::DOMNode* node) = 0;
+};
+
+// A parsed and optimized XPath expression. Instances are immutable once
+// compiled and may be evaluated concurrently.
+class CompiledExpression {
+public:
+    CompiledExpression(Expr* root, const std::string& source);
+    ~CompiledExpression();
+
+    const std::string& source() const { return source_; }
+    const Expr* root() const { return root_; }
+
+    // True if the expression can only ever produce a node-set
+    bool returns_nodeset() const;
+
+    // True if the node-set can be produced incrementally in document
+    // order, so evaluation can stop as soon as enough nodes are found
+    bool streamable() const;
+
+private:
+    CompiledExpression(const CompiledExpression&);
+    CompiledExpression& operator=(const CompiledExpression&);
+
+    Expr* root_;
+    std::string source_;
+};
+
+typedef std::shared_ptr<const CompiledExpression> CompiledExpressionPtr;
+
+// What one location step did in a profiled evaluation
+struct StepProfile {
+    std::string step;        // Axis and node test, such as "child::item"
+    unsigned long contexts;  // Nodes the step was applied to
+    unsigned long visited;   // Nodes on the axis from those
+    unsigned long selected;  // Nodes left after the node test and predicates
+};
+
+// The plan of a compiled expression, and the work each of its location
+// steps does in the evaluations it is passed to. Steps inside predicates
+// count every node the predicate is evaluated for. A Profile must not be
+// shared between concurrent evaluations.
+class Profile {
+public:
+    explicit Profile(const CompiledExpression& expression);
+
+    // The expression tree after optimization, one node per line. Steps
+    // are numbered in the order of steps(), from 1.
+    const std::string& plan() const { return plan_; }
+    const std::vector<StepProfile>& steps() const { return steps_; }
+
+    // Used by the expression tree to describe itself and record counts
+    void add_line(int depth, const std::string& text);
+    void add_step(const void* step, int depth, const std::string& text);
+    StepProfile* step(const void* step);
+
+private:
+    std::string plan_;
+    std::vector<StepProfile> steps_;
+    std::map<const void*, size_t> index_;
+};
+
+// Result of evaluating an expression. Node-sets are always kept in
+// document order without duplicates.
+struct Value {
+    enum Type { NODESET, BOOLEAN, NUMBER, STRING };
+
+    Type type;
+    std::vector<xercesc::DOMNode*> nodes;
+    bool boolean;
+    double number;
+    XString string;
+
+    Value() : type(NODESET), boolean(false), number(0.0) {}
+};
+
+typedef std::map<XString, Value> VariableMap;
+
+// Parse an XPath 1.0 expression. Throws Error on syntax errors.
+CompiledExpressionPtr compile(const std::string& expression);
+
+// Evaluate an expression with the given context node. Given a profile
+// made for the expression, the work of each step is added to it.
+Value evaluate(const CompiledExpression& expression, xercesc::DOMNode* context,
+               const VariableMap* variables = nullptr, Profile* profile = nullptr);
+
+// Evaluate an expression that must produce a node-set, appending the
+// resulting nodes to out in document order. Throws Error otherwise.
+void select_nodes(const CompiledExpression& expression, xercesc::DOMNode* context,
+                  std::vector<xercesc::DOMNode*>& out, Profile* profile = nullptr);
+
+// Evaluate an expression that must produce a node-set, passing each node
+// to visitor in document order. Streamable expressions are evaluated
+// lazily and stop as soon as the visitor returns false; anything else is
+// evaluated in full first. Returns false if the visitor stopped early.
+bool for_each_node(const CompiledExpression& expression, xercesc::DOMNode* context,
+                   NodeVisitor& visitor, Profile* profile = nullptr);
+
+// UTF-8 <-> UTF-16 helpers that do not depend on the process locale
+XString utf8_to_xstring(const char* str, size_t length);
+std::string xstring_to_utf8(const XMLCh* str, size_t length);
+
+} // namespace native_xpath
+
+#endif
@@ -0,0 +1,146 @@
+#include "xpath_guard.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <vector>
+
+namespace native_guard {
+
+bool check(const std::string& xpath, size_t max_length, char* error_message, size_t error_size) {
+    if (xpath.empty()) {
+        snprintf(error_message, error_size, "XPath expression cannot be empty");
+        return false;
+    }
+
+    size_t len = xpath.length();
+
+    // Check for excessively long XPath expressions (potential DoS)
+    if (max_length > 0 && len > max_length) {
+        snprintf(error_message, error_size, "XPath expression is too long (max %zu characters)", max_length);
+        return false;
+    }
+
+    // Check for dangerous patterns that could indicate XPath injection
+    // These patterns are commonly used in XPath injection attacks
+
+    // 1. Check for unbalanced quotes which could break out of string literals
+    int single_quotes = 0;
+    int double_quotes = 0;
+    bool in_single_quote = false;
+    bool in_double_quote = false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = xpath[i];
+
+        // Track quote state
+        if (c == '\'' && !in_double_quote) {
+            in_single_quote = !in_single_quote;
+            single_quotes++;
+        } else if (c == '"' && !in_single_quote) {
+            in_double_quote = !in_double_quote;
+            double_quotes++;
+        }
+    }
+
+    // Unbalanced quotes are suspicious
+    if (single_quotes % 2 != 0 || double_quotes % 2 != 0) {
+        snprintf(error_message, error_size, "XPath expression contains unbalanced quotes");
+        return false;
+    }
+
+    // 2. Check for suspicious comment patterns that could be used to bypass validation
+    if (xpath.find("(:") != std::string::npos || xpath.find(":)") != std::string::npos) {
+        snprintf(error_message, error_size, "XPath expression contains suspicious comment patterns");
+        return false;
+    }
+
+    // 3. Check for null bytes which could truncate validation
+    if (xpath.find('\0') != std::string::npos) {
+        snprintf(error_message, error_size, "XPath expression contains null bytes");
+        return false;
+    }
+
+    // 4. Check for excessive nesting which could cause stack overflow
+    int bracket_depth = 0;
+    int paren_depth = 0;
+    const int MAX_DEPTH = 100;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = xpath[i];
+
+        if (c == '[') bracket_depth++;
+        else if (c == ']') bracket_depth--;
+        else if (c == '(') paren_depth++;
+        else if (c == ')') paren_depth--;
+
+        if (bracket_depth > MAX_DEPTH || paren_depth > MAX_DEPTH) {
+            snprintf(error_message, error_size, "XPath expression has excessive nesting depth");
+            return false;
+        }
+
+        if (bracket_depth < 0 || paren_depth < 0) {
+            snprintf(error_message, error_size, "XPath expression has unbalanced brackets or parentheses");
+            return false;
+        }
+    }
+
+    if (bracket_depth != 0 || paren_depth != 0) {
+        snprintf(error_message, error_size, "XPath expression has unbalanced brackets or parentheses");
+        return false;
+    }
+
+    // 5. Check for suspicious function calls that could access system functions
+    // or perform dangerous operations
+    std::vector<std::string> dangerous_patterns = {
+        "document(",       // Can access external documents
+        "doc(",            // Can access external documents
+        "collection(",     // Can access external collections
+        "unparsed-text(", // Can read arbitrary files
+        "system-property(", // Can leak system information
+        "environment-variable(", // Can leak environment variables
+    };
+
+    for (const auto& pattern : dangerous_patterns) {
+        if (xpath.find(pattern) != std::string::npos) {
+            snprintf(error_message, error_size, "XPath expression contains potentially dangerous function: %s", pattern.c_str());
+            return false;
+        }
+    }
+
+    // 6. Check for encoded characters that could bypass validation
+    // Use specific patterns to avoid false positives (e.g., "Q&A" in text)
+    if (xpath.find("&#") != std::string::npos ||    // Numeric character reference (&#60;)
+        xpath.find("&#x") != std::string::npos ||   // Hex character reference (&#x3C;)
+        xpath.find("&amp;#") != std::string::npos) { // Encoded entity reference
+        snprintf(error_message, error_size, "XPath expression contains encoded characters");
+        return false;
+    }
+
+    // 7. Detect potential boolean-based blind XPath injection patterns
+    // These patterns use 'or' with always-true conditions
+    std::vector<std::string> injection_patterns = {
+        "or 1=1",
+        "or '1'='1'",
+        "or \"1\"=\"1\"",
+        "or true()",
+        "and 1=0",
+        "and false()",
+        "or 'a'='a'",
+        "or \"a\"=\"a\"",
+    };
+
+    // Convert to lowercase for case-insensitive comparison
+    std::string xpath_lower = xpath;
+    std::transform(xpath_lower.begin(), xpath_lower.end(), xpath_lower.begin(), ::tolower);
+
+    for (const auto& pattern : injection_patterns) {
+        if (xpath_lower.find(pattern) != std::string::npos) {
+            snprintf(error_message, error_size, "XPath expression contains suspicious injection pattern");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace native_guard
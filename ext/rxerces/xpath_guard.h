@@ -0,0 +1,22 @@
+#ifndef RXERCES_XPATH_GUARD_H
+#define RXERCES_XPATH_GUARD_H
+
+#include <cstddef>
+#include <string>
+
+// Checks XPath expressions for the patterns used in XPath injection and
+// denial of service attacks before any engine sees them: unbalanced
+// quotes and brackets, excessive nesting, functions that reach outside the
+// document, character references and always-true conditions.
+//
+// Kept out of rxerces.cpp so the native benchmark harness can time the
+// checks without the validation cache.
+namespace native_guard {
+
+// True if xpath may be evaluated. Otherwise the reason is copied into
+// error_message. A max_length of 0 allows expressions of any length.
+bool check(const std::string& xpath, size_t max_length, char* error_message, size_t error_size);
+
+} // namespace native_guard
+
+#endif
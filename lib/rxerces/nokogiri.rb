@@ -19,6 +19,7 @@ module Nokogiri
     Text = RXerces::XML::Text
     NodeSet = RXerces::XML::NodeSet
     Schema = RXerces::XML::Schema
+    SyntaxError = RXerces::XML::SyntaxError
   end
 
   # Nokogiri-compatible HTML module
@@ -0,0 +1,123 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+require 'stringio'
+require 'digest'
+
+RSpec.describe "Canonicalization" do
+  let(:xml) do
+    '<?xml version="1.0"?>' \
+    '<!-- header -->' \
+    '<root xmlns="urn:default" xmlns:a="urn:a" xmlns:unused="urn:unused" xml:lang="en">' \
+    '<item z="1" a:y="2" b="x &amp; &lt;&quot;"><a:child/></item>' \
+    '<text>1 &lt; 2 &gt; 0<![CDATA[ & more]]></text>' \
+    '</root>'
+  end
+
+  let(:doc) { RXerces::XML::Document.parse(xml) }
+  let(:item) { doc.xpath("//*[local-name()='item']").first }
+
+  describe "Document#canonicalize" do
+    it "writes exclusive canonical XML without comments by default" do
+      expect(doc.canonicalize).to eq(
+        '<root xmlns="urn:default" xml:lang="en">' \
+        '<item xmlns:a="urn:a" b="x &amp; &lt;&quot;" z="1" a:y="2"><a:child></a:child></item>' \
+        '<text>1 &lt; 2 &gt; 0 &amp; more</text>' \
+        '</root>'
+      )
+    end
+
+    it "keeps comments outside the root element on their own line" do
+      expect(doc.canonicalize(with_comments: true)).to start_with("<!-- header -->\n<root")
+    end
+
+    it "writes every declaration where it appears in inclusive mode" do
+      expect(doc.canonicalize(mode: :inclusive)).to start_with(
+        '<root xmlns="urn:default" xmlns:a="urn:a" xmlns:unused="urn:unused" xml:lang="en"><item b='
+      )
+    end
+
+    it "returns a UTF-8 string" do
+      expect(doc.canonicalize.encoding).to eq(Encoding::UTF_8)
+    end
+
+    it "rejects unknown modes and options" do
+      expect { doc.canonicalize(mode: :c14n11) }.to raise_error(ArgumentError, /mode/)
+      expect { doc.canonicalize(indent: true) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "Node#canonicalize" do
+    it "declares the namespaces an element uses in exclusive mode" do
+      expect(item.canonicalize).to eq(
+        '<item xmlns="urn:default" xmlns:a="urn:a" b="x &amp; &lt;&quot;" z="1" a:y="2"><a:child></a:child></item>'
+      )
+    end
+
+    it "keeps listed inclusive namespaces in exclusive mode" do
+      expect(item.canonicalize(inclusive_namespaces: ['unused'])).to start_with(
+        '<item xmlns="urn:default" xmlns:a="urn:a" xmlns:unused="urn:unused" b='
+      )
+    end
+
+    it "leaves the inclusive namespaces array as it was" do
+      prefixes = [:unused].freeze
+      expect(item.canonicalize(inclusive_namespaces: prefixes)).to include('xmlns:unused="urn:unused"')
+      expect(prefixes).to eq([:unused])
+    end
+
+    it "inherits namespaces and xml attributes from ancestors in inclusive mode" do
+      expect(item.canonicalize(mode: :inclusive)).to eq(
+        '<item xmlns="urn:default" xmlns:a="urn:a" xmlns:unused="urn:unused" ' \
+        'b="x &amp; &lt;&quot;" z="1" xml:lang="en" a:y="2"><a:child></a:child></item>'
+      )
+    end
+
+    it "undeclares a default namespace that an element drops" do
+      undeclared = RXerces::XML::Document.parse('<r xmlns="urn:x"><s xmlns=""><t/></s></r>')
+      expect(undeclared.canonicalize).to eq('<r xmlns="urn:x"><s xmlns=""><t></t></s></r>')
+    end
+
+    it "escapes whitespace characters in attribute values" do
+      tabbed = RXerces::XML::Document.parse(%(<r a="&#9;&#10;&#13;"/>))
+      expect(tabbed.canonicalize).to eq('<r a="&#x9;&#xA;&#xD;"></r>')
+    end
+
+    it "raises for attribute nodes" do
+      attribute = doc.xpath('//@z').first
+      expect { attribute.canonicalize }.to raise_error(RuntimeError, /attribute/)
+    end
+  end
+
+  describe "#write_canonical" do
+    it "streams into an IO and returns it" do
+      io = StringIO.new
+      expect(doc.write_canonical(io)).to equal(io)
+      expect(io.string).to eq(doc.canonicalize)
+    end
+
+    it "appends to a String" do
+      out = +'<!-- -->'
+      item.write_canonical(out)
+      expect(out).to eq('<!-- -->' + item.canonicalize)
+    end
+
+    it "feeds a digest without building the whole string" do
+      digest = Digest::SHA256.new
+      doc.write_canonical(digest)
+      expect(digest.hexdigest).to eq(Digest::SHA256.hexdigest(doc.canonicalize))
+    end
+
+    it "refuses to change the tree while it is being written" do
+      large = RXerces::XML::Document.parse("<root>#{'<item>value</item>' * 20_000}</root>")
+      sink = Object.new
+      sink.define_singleton_method(:write) { |_chunk| large.root['changed'] = 'yes' }
+      expect { large.write_canonical(sink) }.to raise_error(RuntimeError, /cannot be modified/)
+      expect(large.root['changed']).to be_nil
+    end
+
+    it "rejects destinations that cannot be written to" do
+      expect { doc.write_canonical(42) }.to raise_error(TypeError)
+    end
+  end
+end
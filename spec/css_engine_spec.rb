@@ -0,0 +1,324 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe "CSS engine" do
+  let(:xml) do
+    <<-XML
+      <page xmlns:x="urn:extra" id="page">
+        <ul id="menu" class="list main">
+          <li id="l1" class="item">One</li>
+          <li id="l2" class="item special">Two</li>
+          <li id="l3" class="item">Three</li>
+          <li id="l4" lang="en-US">Four</li>
+        </ul>
+        <div id="d1">
+          <h2 id="h">Title</h2>
+          <!-- note -->
+          <p id="p1">First</p>
+          <p id="p2" data-kind="foo-bar"/>
+          <span id="s1"><p id="p3"/></span>
+        </div>
+        <x:note id="n1"/>
+        <empty id="e1"><!-- nothing --></empty>
+      </page>
+    XML
+  end
+
+  let(:doc) { RXerces::XML::Document.parse(xml) }
+
+  def ids(nodes)
+    nodes.map { |node| node['id'] }
+  end
+
+  around do |example|
+    engine = RXerces.css_engine
+    example.run
+  ensure
+    RXerces.css_engine = engine
+  end
+
+  describe "selection" do
+    it "uses the native engine by default" do
+      expect(RXerces.css_engine).to eq(:native)
+    end
+
+    it "matches type, class and id selectors" do
+      expect(ids(doc.css('li'))).to eq(%w[l1 l2 l3 l4])
+      expect(ids(doc.css('.special'))).to eq(%w[l2])
+      expect(ids(doc.css('#l3'))).to eq(%w[l3])
+      expect(ids(doc.css('ul.list.main > li.item.special'))).to eq(%w[l2])
+      expect(ids(doc.css('li#l3.special'))).to be_empty
+    end
+
+    it "matches attribute selectors" do
+      expect(ids(doc.css('[lang]'))).to eq(%w[l4])
+      expect(ids(doc.css('[lang|=en]'))).to eq(%w[l4])
+      expect(ids(doc.css('[class~=special]'))).to eq(%w[l2])
+      expect(ids(doc.css('p[id^=p]'))).to eq(%w[p1 p2 p3])
+      expect(ids(doc.css("[data-kind$='bar']"))).to eq(%w[p2])
+      expect(ids(doc.css('[data-kind*="o-b"]'))).to eq(%w[p2])
+      expect(ids(doc.css('li[class!=item]'))).to eq(%w[l2 l4])
+    end
+
+    it "matches the universal selector and namespaced elements" do
+      expect(doc.css('*').length).to eq(14)
+      expect(ids(doc.css('note'))).to eq(%w[n1])
+      expect(ids(doc.css('x|note'))).to eq(%w[n1])
+    end
+
+    it "matches ns|tag by namespace URI rather than by prefix" do
+      nested = RXerces::XML::Document.parse(
+        '<r xmlns:a="urn:u"><b:item xmlns:b="urn:u" id="i1"/><a:item id="i2"/><c:item xmlns:c="urn:v" id="i3"/></r>'
+      )
+      expect(ids(nested.css('a|item'))).to eq(%w[i1 i2])
+      expect(ids(nested.css('c|item'))).to eq(%w[i3])
+      expect(nested.css('q|item')).to be_empty
+    end
+
+    it "returns matches in document order" do
+      expect(ids(doc.css('h2, li.special, p'))).to eq(%w[l2 h p1 p2 p3])
+    end
+  end
+
+  describe "combinators" do
+    it "supports descendant and child combinators" do
+      expect(ids(doc.css('div p'))).to eq(%w[p1 p2 p3])
+      expect(ids(doc.css('div > p'))).to eq(%w[p1 p2])
+    end
+
+    it "supports the adjacent sibling combinator" do
+      expect(ids(doc.css('h2 + p'))).to eq(%w[p1])
+      expect(ids(doc.css('li + li + li'))).to eq(%w[l3 l4])
+    end
+
+    it "supports the general sibling combinator" do
+      expect(ids(doc.css('h2 ~ p'))).to eq(%w[p1 p2])
+      expect(ids(doc.css('#l2 ~ li'))).to eq(%w[l3 l4])
+    end
+
+    it "supports selector lists" do
+      expect(ids(doc.css('#l1, #p1'))).to eq(%w[l1 p1])
+    end
+  end
+
+  describe "pseudo-classes" do
+    it "supports :first-child, :last-child and :only-child" do
+      expect(ids(doc.css('li:first-child'))).to eq(%w[l1])
+      expect(ids(doc.css('li:last-child'))).to eq(%w[l4])
+      expect(ids(doc.css('p:only-child'))).to eq(%w[p3])
+    end
+
+    it "supports :nth-child()" do
+      expect(ids(doc.css('li:nth-child(2)'))).to eq(%w[l2])
+      expect(ids(doc.css('li:nth-child(odd)'))).to eq(%w[l1 l3])
+      expect(ids(doc.css('li:nth-child(even)'))).to eq(%w[l2 l4])
+      expect(ids(doc.css('li:nth-child(-n+2)'))).to eq(%w[l1 l2])
+      expect(ids(doc.css('li:nth-last-child(1)'))).to eq(%w[l4])
+    end
+
+    it "counts positions among many siblings" do
+      wide = RXerces::XML::Document.parse("<r>#{(1..500).map { |i| %(<i n="#{i}"/><j/>) }.join}</r>")
+      expect(wide.css('i:nth-child(4n+1)').map { |node| node['n'] }).to eq((1..500).step(2).map(&:to_s))
+      expect(wide.css('i:nth-of-type(250)').map { |node| node['n'] }).to eq(['250'])
+      expect(wide.css('i:nth-last-of-type(1)').map { |node| node['n'] }).to eq(['500'])
+    end
+
+    it "supports the -of-type pseudo-classes" do
+      expect(ids(doc.css('p:first-of-type'))).to eq(%w[p1 p3])
+      expect(ids(doc.css('p:last-of-type'))).to eq(%w[p2 p3])
+      expect(ids(doc.css('p:nth-of-type(2)'))).to eq(%w[p2])
+    end
+
+    it "supports :root and :empty" do
+      expect(ids(doc.css(':root'))).to eq(%w[page])
+      expect(ids(doc.css('div :empty'))).to eq(%w[p2 p3])
+      expect(ids(doc.css('empty:empty'))).to eq(%w[e1])
+    end
+
+    it "supports :not()" do
+      expect(ids(doc.css('li:not(.special)'))).to eq(%w[l1 l3 l4])
+      expect(ids(doc.css('li:not(.special, [lang])'))).to eq(%w[l1 l3])
+      expect(ids(doc.css('li:not(:first-child):not(:last-child)'))).to eq(%w[l2 l3])
+    end
+  end
+
+  describe "scoping" do
+    let(:div) { doc.at_css('#d1') }
+
+    it "only returns descendants of the node" do
+      expect(ids(div.css('p'))).to eq(%w[p1 p2 p3])
+      expect(div.css('li')).to be_empty
+      expect(div.css('div')).to be_empty
+    end
+
+    it "lets combinators match ancestors outside the node" do
+      expect(ids(div.css('page p'))).to eq(%w[p1 p2 p3])
+      expect(ids(div.css('div > span > p'))).to eq(%w[p3])
+    end
+
+    it "returns the first match with at_css" do
+      expect(div.at_css('p')['id']).to eq('p1')
+      expect(div.at_css('li')).to be_nil
+      expect(doc.at_css('li:nth-child(3)')['id']).to eq('l3')
+    end
+  end
+
+  describe "compiled selectors" do
+    let(:selector) { RXerces::XML::Selector.compile('li.item:not(.special)') }
+
+    it "compiles a selector for reuse" do
+      expect(selector).to be_a(RXerces::XML::Selector)
+      expect(selector.source).to eq('li.item:not(.special)')
+      expect(selector.to_s).to eq('li.item:not(.special)')
+      expect(selector.inspect).to include('li.item:not(.special)')
+    end
+
+    it "can be passed to css and at_css" do
+      expect(ids(doc.css(selector))).to eq(%w[l1 l3])
+      expect(doc.at_css(selector)['id']).to eq('l1')
+      expect(ids(doc.at_css('#menu').css(selector))).to eq(%w[l1 l3])
+    end
+
+    it "can be used with the XPath translation" do
+      RXerces.css_engine = :xpath
+      expect(ids(doc.css(RXerces::XML::Selector.compile('li.item')))).to eq(%w[l1 l2 l3])
+    end
+
+    it "raises ArgumentError for invalid selectors" do
+      expect { RXerces::XML::Selector.compile('li:hover') }.to raise_error(ArgumentError, /Unsupported pseudo-class/)
+      expect { RXerces::XML::Selector.compile(42) }.to raise_error(TypeError)
+    end
+
+    it "cannot be instantiated directly" do
+      expect { RXerces::XML::Selector.new }.to raise_error(NoMethodError)
+    end
+
+    it "returns consistent results for repeated selectors" do
+      3.times { expect(ids(doc.css('li.item'))).to eq(%w[l1 l2 l3]) }
+    end
+  end
+
+  describe "#matches?" do
+    let(:l2) { doc.at_css('#l2') }
+
+    it "tests an element against a selector" do
+      expect(l2.matches?('li')).to be true
+      expect(l2.matches?('.special')).to be true
+      expect(l2.matches?('ul > li:nth-child(2)')).to be true
+      expect(l2.matches?('page li')).to be true
+      expect(l2.matches?('li:first-child')).to be false
+      expect(l2.matches?('div li')).to be false
+    end
+
+    it "accepts a compiled selector" do
+      selector = RXerces::XML::Selector.compile('li.special')
+      expect(l2.matches?(selector)).to be true
+      expect(selector.matches?(l2)).to be true
+      expect(selector.matches?(doc.at_css('#l1'))).to be false
+    end
+
+    it "returns false for non-element nodes" do
+      text = l2.children.first
+      expect(text.matches?('*')).to be false
+    end
+
+    it "raises ArgumentError for invalid selectors" do
+      expect { l2.matches?('li >') }.to raise_error(ArgumentError, /Invalid CSS selector/)
+    end
+  end
+
+  describe "ancestors with a selector" do
+    let(:p3) { doc.at_css('#p3') }
+
+    it "filters ancestors by testing each one against the selector" do
+      expect(ids(p3.ancestors('div'))).to eq(%w[d1])
+      expect(ids(p3.ancestors('*'))).to eq(%w[s1 d1 page])
+      expect(ids(p3.ancestors('#d1 > span, page'))).to eq(%w[s1 page])
+      expect(p3.ancestors('li')).to be_empty
+    end
+
+    it "accepts a compiled selector" do
+      expect(ids(p3.ancestors(RXerces::XML::Selector.compile('span')))).to eq(%w[s1])
+    end
+  end
+
+  describe "errors" do
+    it "raises ArgumentError for invalid selectors" do
+      expect { doc.css('li >') }.to raise_error(ArgumentError, /Invalid CSS selector/)
+      expect { doc.css('li[') }.to raise_error(ArgumentError, /Invalid CSS selector/)
+      expect { doc.at_css('li:nth-child(x)') }.to raise_error(ArgumentError, /Invalid CSS selector/)
+    end
+
+    it "raises ArgumentError for unsupported pseudo-classes" do
+      expect { doc.css('li:hover') }.to raise_error(ArgumentError, /Unsupported pseudo-class: :hover/)
+      expect { doc.css('p::before') }.to raise_error(ArgumentError, /Pseudo-elements are not supported/)
+    end
+  end
+
+  describe "engine selection" do
+    it "can be switched to the XPath translation" do
+      RXerces.css_engine = :xpath
+      expect(RXerces.css_engine).to eq(:xpath)
+    end
+
+    it "rejects unknown engines" do
+      expect { RXerces.css_engine = :bogus }.to raise_error(ArgumentError, /unknown CSS engine/)
+      expect { RXerces.css_engine = 'native' }.to raise_error(TypeError)
+    end
+
+    it "confines node-scoped selectors to the node" do
+      RXerces.css_engine = :xpath
+      div = doc.at_css('#d1')
+      expect(ids(div.css('p'))).to eq(%w[p1 p2 p3])
+      expect(div.css('li')).to be_empty
+      expect(div.at_css('li')).to be_nil
+      expect(div.at_css('span p')['id']).to eq('p3')
+      expect(ids(div.css('li, p'))).to eq(%w[p1 p2 p3])
+    end
+
+    it "never visits nodes outside the node's subtree" do
+      xpath = RXerces::XML::Selector.compile('page p').to_xpath
+      expect(xpath).to eq(".//*[local-name()='p' and ancestor::*[local-name()='page']]")
+
+      scan = ->(path) { doc.xpath_profile(path)[:steps].select { |step| step[:step] == 'descendant::*' }.last }
+      scoped = scan.call("//*[@id='d1']/#{xpath}")
+      expect(scoped[:visited]).to eq(scan.call("//*[@id='d1']/.//*")[:visited])
+      expect(scoped[:visited]).to be < scan.call(xpath)[:visited]
+
+      RXerces.css_engine = :xpath
+      expect(ids(doc.at_css('#d1').css('page p'))).to eq(%w[p1 p2 p3])
+    end
+
+    ['p', 'div', 'page p', 'div p', 'div > span > p', 'ul > li', 'li, p', 'h2, #p3'].each do |selector|
+      it "agrees with the XPath translation below a node for #{selector}" do
+        %w[#d1 #menu].each do |scope|
+          native = ids(doc.at_css(scope).css(selector))
+          native_first = doc.at_css(scope).at_css(selector)&.[]('id')
+          RXerces.css_engine = :xpath
+          expect(ids(doc.at_css(scope).css(selector))).to eq(native)
+          expect(doc.at_css(scope).at_css(selector)&.[]('id')).to eq(native_first)
+          RXerces.css_engine = :native
+        end
+      end
+    end
+
+    ['li', '.special', '#l3', 'li.item', 'li#l2', 'li[lang]', 'p[id=p2]', 'div p', 'ul > li', 'li, h2',
+     'h2 + p', 'h2 ~ p', 'li + li', 'h2 ~ *', '[lang|=en]', '[data-kind$=bar]', '[class~=special]',
+     'li:nth-child(2n+1)', 'li:nth-last-child(-n+2)', 'li:first-child', ':only-child', ':root', ':empty',
+     'li:not(.special, [lang])', 'x|note', '|li'].each do |selector|
+      it "agrees with the XPath translation for #{selector}" do
+        native = ids(doc.css(selector))
+        RXerces.css_engine = :xpath
+        expect(ids(doc.css(selector))).to eq(native)
+      end
+    end
+
+    it "raises ArgumentError for selectors with no XPath translation" do
+      RXerces.css_engine = :xpath
+      expect { doc.css('p:first-of-type') }.to raise_error(ArgumentError, /not supported by the :xpath CSS engine/)
+      expect { doc.at_css('#d1').at_css('p:nth-of-type(2)') }.to raise_error(ArgumentError, /Invalid CSS selector/)
+      expect { doc.css('li:hover') }.to raise_error(ArgumentError, /Unsupported pseudo-class/)
+    end
+  end
+end
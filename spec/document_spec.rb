@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'stringio'
 
 RSpec.describe RXerces::XML::Document do
   let(:simple_xml) { '<root><child>Hello</child></root>' }
@@ -119,6 +120,97 @@ RSpec.describe RXerces::XML::Document do
     end
   end
 
+  describe "#to_s encoding" do
+    it "returns UTF-8 with a matching XML declaration" do
+      doc = RXerces::XML::Document.parse('<root>café</root>')
+      xml_string = doc.to_s
+      expect(xml_string.encoding).to eq(Encoding::UTF_8)
+      expect(xml_string).to include('encoding="UTF-8"')
+      expect(xml_string).to include("café")
+    end
+  end
+
+  describe "#write_to" do
+    let(:doc) { RXerces::XML::Document.parse(simple_xml) }
+
+    it "writes the document to an IO" do
+      io = StringIO.new
+      expect(doc.write_to(io)).to equal(io)
+      expect(io.string).to include('<root><child>Hello</child></root>')
+    end
+
+    it "appends to a String" do
+      buffer = +"prefix:"
+      doc.write_to(buffer)
+      expect(buffer).to start_with('prefix:<?xml')
+      expect(buffer).to include('<child>Hello</child>')
+    end
+
+    it "writes in the requested encoding" do
+      latin = RXerces::XML::Document.parse("<root>café</root>")
+      io = StringIO.new
+      latin.write_to(io, encoding: 'ISO-8859-1')
+      bytes = io.string.b
+      expect(bytes).to include('encoding="ISO-8859-1"')
+      expect(bytes).to include("caf\xE9".b)
+    end
+
+    it "accepts an Encoding object" do
+      io = StringIO.new
+      doc.write_to(io, encoding: Encoding::UTF_8)
+      expect(io.string).to include('encoding="UTF-8"')
+    end
+
+    it "indents when asked to" do
+      io = StringIO.new
+      doc.write_to(io, indent: true)
+      expect(io.string).to match(/<root>\s*\n\s+<child>Hello<\/child>/)
+    end
+
+    it "writes large documents in several chunks" do
+      large = RXerces::XML::Document.parse("<root>#{'<item>value</item>' * 20_000}</root>")
+      writes = []
+      sink = Object.new
+      sink.define_singleton_method(:write) { |chunk| writes << chunk.bytesize }
+      large.write_to(sink)
+      expect(writes.length).to be > 1
+      expect(writes.sum).to eq(large.to_s.bytesize)
+    end
+
+    it "refuses to change the tree while it is being written" do
+      large = RXerces::XML::Document.parse("<root>#{'<item>value</item>' * 20_000}</root>")
+      sink = Object.new
+      sink.define_singleton_method(:write) { |_chunk| large.root.children.first.remove }
+      expect { large.write_to(sink) }.to raise_error(RuntimeError, /cannot be modified/)
+
+      large.root['changed'] = 'yes'
+      expect(large.root['changed']).to eq('yes')
+    end
+
+    it "can be interrupted by Thread#raise and leaves the document writable" do
+      large = RXerces::XML::Document.parse("<root>#{'<item>value</item>' * 20_000}</root>")
+      thread = Thread.new { loop { large.to_s } }
+      sleep 0.05
+      thread.raise(ArgumentError, 'stop')
+      expect { thread.join }.to raise_error(ArgumentError, 'stop')
+
+      large.root['changed'] = 'yes'
+      expect(large.root['changed']).to eq('yes')
+    end
+
+    it "propagates errors raised by the IO" do
+      sink = Object.new
+      sink.define_singleton_method(:write) { |_chunk| raise IOError, "closed stream" }
+      expect { doc.write_to(sink) }.to raise_error(IOError, "closed stream")
+    end
+
+    it "rejects destinations that cannot be written to" do
+      expect { doc.write_to(42) }.to raise_error(TypeError)
+      expect { doc.write_to(StringIO.new, encoding: 8) }.to raise_error(TypeError)
+      expect { doc.write_to(StringIO.new, format: true) }.to raise_error(ArgumentError)
+    end
+  end
+
   describe "#to_xml" do
     it "is an alias for to_s" do
       doc = RXerces::XML::Document.parse(simple_xml)
@@ -126,6 +218,54 @@ RSpec.describe RXerces::XML::Document do
     end
   end
 
+  describe "#to_s with preserve_source" do
+    let(:source) do
+      "<?xml version='1.0'?>\n<root  id='r'>\n  <a x='1'/>\n  <b  y = '2'>text</b>\n</root>\n"
+    end
+    let(:doc) { RXerces::XML::Document.parse(source, preserve_source: true) }
+
+    it "returns the source unchanged when nothing was modified" do
+      expect(doc.to_s).to eq(source)
+    end
+
+    it "rebuilds only the start tags whose attributes changed" do
+      doc.xpath('//a').first['x'] = '3'
+      expect(doc.to_s).to eq("<?xml version='1.0'?>\n<root  id='r'>\n  <a x=\"3\"/>\n  <b  y = '2'>text</b>\n</root>\n")
+    end
+
+    it "tracks changed text, added and removed children" do
+      b = doc.xpath('//b').first
+      b.text = 'new & improved'
+      doc.xpath('//a').first.remove
+      doc.root.add_child(doc.create_element('c'))
+      expect(doc.to_s).to eq("<?xml version='1.0'?>\n<root  id='r'>\n  \n  <b  y = '2'>new &amp; improved</b>\n<c/></root>\n")
+    end
+
+    it "writes moved elements through the serializer" do
+      doc.root.add_child(doc.xpath('//a').first)
+      expect(doc.to_s).to include("</b>\n<a x=\"1\"/></root>")
+    end
+
+    it "serializes normally when indenting or changing encoding" do
+      expect(doc.write_to(+'', indent: true)).to eq(RXerces::XML::Document.parse(source).write_to(+'', indent: true))
+    end
+
+    it "refuses to change spans while writing from them" do
+      large_source = "<root>#{'<item>value</item>' * 20_000}<last>end</last></root>"
+      large = RXerces::XML::Document.parse(large_source, preserve_source: true)
+      large.root['id'] = 'r'
+      last = large.xpath('//last').first
+      sink = Object.new
+      sink.define_singleton_method(:write) { |_chunk| last.text = 'changed' }
+      expect { large.write_to(sink) }.to raise_error(RuntimeError, /cannot be modified/)
+      expect(large.to_s).to end_with("<last>end</last></root>")
+    end
+
+    it "does not change serialization without the option" do
+      expect(RXerces::XML::Document.parse(source).to_s).not_to eq(source)
+    end
+  end
+
   describe "#xpath" do
     it "returns a NodeSet" do
       doc = RXerces::XML::Document.parse(simple_xml)
@@ -177,6 +317,32 @@ RSpec.describe RXerces::XML::Document do
     end
   end
 
+  describe "#traverse" do
+    it "yields every node in the document, children first" do
+      doc = RXerces::XML::Document.parse('<!--c--><root><child>Hello</child></root>')
+      expect(doc.traverse.map(&:name)).to eq(['#comment', '#text', 'child', 'root'])
+      expect(doc.traverse(order: :pre, type: :element).map(&:name)).to eq(['root', 'child'])
+    end
+  end
+
+  describe "#each_element" do
+    it "yields elements, optionally by name" do
+      doc = RXerces::XML::Document.parse(complex_xml)
+      expect(doc.each_element.first.name).to eq('root')
+      expect(doc.each_element('city').map(&:text)).to eq(['New York', 'London'])
+    end
+  end
+
+  describe "#each_with_path" do
+    it "yields every node with its path in document order" do
+      doc = RXerces::XML::Document.parse(complex_xml)
+      paths = doc.each_with_path(type: :element).map { |path, _node| path }
+      expect(paths.first).to eq('/root[1]')
+      expect(paths).to include('/root[1]/person[2]/city[1]')
+      doc.each_with_path { |path, node| expect(path).to eq(node.path) }
+    end
+  end
+
   describe "#encoding" do
     it "returns UTF-8 for documents without explicit encoding" do
       doc = RXerces::XML::Document.parse(simple_xml)
@@ -289,6 +455,61 @@ RSpec.describe RXerces::XML::Document do
     end
   end
 
+  describe "#parse_stats" do
+    let(:xml) { '<root id="1"><a x="1" y="2">one<![CDATA[two]]></a><b><c/></b>three</root>' }
+
+    it "counts what the parser built" do
+      stats = RXerces::XML::Document.parse(xml).parse_stats
+      expect(stats[:elements]).to eq(4)
+      expect(stats[:attributes]).to eq(3)
+      expect(stats[:text_nodes]).to eq(3)
+      expect(stats[:max_depth]).to eq(3)
+      expect(stats[:input_bytes]).to eq(xml.bytesize)
+    end
+
+    it "records the parse time" do
+      stats = RXerces::XML::Document.parse(xml).parse_stats
+      expect(stats[:parse_time]).to be_a(Float)
+      expect(stats[:parse_time]).to be >= 0
+    end
+
+    it "counts the same with preserve_source" do
+      expect(RXerces::XML::Document.parse(xml, preserve_source: true).parse_stats.reject { |k, _| k == :parse_time })
+        .to eq(RXerces::XML::Document.parse(xml).parse_stats.reject { |k, _| k == :parse_time })
+    end
+  end
+
+  describe "#memory_stats" do
+    it "reports the DOM heap" do
+      small = RXerces::XML::Document.parse(simple_xml).memory_stats
+      large = RXerces::XML::Document.parse("<root>#{'<item>text</item>' * 5000}</root>").memory_stats
+      expect(small[:dom_bytes]).to be > 0
+      expect(large[:dom_bytes]).to be > small[:dom_bytes]
+    end
+
+    it "reports the compiled XPath cache" do
+      doc = RXerces::XML::Document.parse(complex_xml)
+      expect(doc.memory_stats[:xpath_cache_entries]).to eq(0)
+      doc.xpath('//person')
+      doc.xpath('//age')
+      doc.xpath('//person')
+      stats = doc.memory_stats
+      expect(stats[:xpath_cache_entries]).to be <= 2
+      expect(stats[:xpath_cache_bytes]).to be >= 0
+    end
+
+    it "reports the Xalan bridge once XPath has used it", xalan: true do
+      doc = RXerces::XML::Document.parse(complex_xml)
+      expect(doc.memory_stats[:xalan_bytes]).to eq(0)
+      doc.xpath('//person[age > 20]')
+      expect(doc.memory_stats[:xalan_bytes]).to be > 0
+    end
+
+    it "reports parse error storage" do
+      expect(RXerces::XML::Document.parse(simple_xml).memory_stats[:error_bytes]).to eq(0)
+    end
+  end
+
   describe "parse options validation" do
     let(:simple_xml) { '<root><child>test</child></root>' }
 
@@ -325,6 +546,16 @@ RSpec.describe RXerces::XML::Document do
         }.not_to raise_error
       end
 
+      it "accepts preserve_source" do
+        doc = RXerces::XML::Document.parse(simple_xml, preserve_source: true)
+        expect(doc.to_s).to eq(simple_xml)
+      end
+
+      it "accepts max_errors and fatal_on_first" do
+        doc = RXerces::XML::Document.parse(simple_xml, max_errors: 10, fatal_on_first: true)
+        expect(doc.errors).to eq([])
+      end
+
       it "accepts allow_external_entities set to true" do
         expect {
           doc = RXerces::XML::Document.parse(simple_xml, allow_external_entities: true)
@@ -366,6 +597,12 @@ RSpec.describe RXerces::XML::Document do
         }.to raise_error(ArgumentError, /Option keys must be symbols or strings/)
       end
 
+      it "rejects a max_errors below 1" do
+        expect {
+          RXerces::XML::Document.parse(simple_xml, max_errors: 0)
+        }.to raise_error(ArgumentError, /max_errors/)
+      end
+
       it "rejects options that are not a hash" do
         expect {
           RXerces::XML::Document.parse(simple_xml, "not a hash")
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'stringio'
 
 RSpec.describe RXerces::XML::Node do
   let(:xml) do
@@ -233,6 +234,145 @@ RSpec.describe RXerces::XML::Node do
     end
   end
 
+  describe "#child_at" do
+    it "returns the child at the given index" do
+      expect(root.child_at(1).name).to eq('person')
+      expect(root.child_at(1)['name']).to eq('Alice')
+      expect(root.child_at(3)['name']).to eq('Bob')
+    end
+
+    it "counts negative indexes from the end" do
+      expect(root.child_at(-2)['name']).to eq('Bob')
+    end
+
+    it "returns nil for out of range indexes" do
+      expect(root.child_at(100)).to be_nil
+      expect(root.child_at(-100)).to be_nil
+    end
+
+    it "agrees with children for wide elements" do
+      wide = RXerces::XML::Document.parse("<root>#{(1..100).map { |i| "<row n='#{i}'/>" }.join}</root>").root
+      expect(wide.child_at(0)['n']).to eq('1')
+      expect(wide.child_at(57)['n']).to eq('58')
+      expect(wide.child_at(-1)['n']).to eq('100')
+      expect(wide.child_at(100)).to be_nil
+    end
+
+    it "reflects changes to the document" do
+      wide = RXerces::XML::Document.parse("<root>#{(1..100).map { |i| "<row n='#{i}'/>" }.join}</root>").root
+      expect(wide.child_at(-1)['n']).to eq('100')
+
+      wide.child_at(0).remove
+      expect(wide.child_at(0)['n']).to eq('2')
+
+      wide.add_child(wide.document.create_element('last'))
+      expect(wide.child_at(-1).name).to eq('last')
+      expect(wide.child_count).to eq(100)
+    end
+  end
+
+  describe "#child_count" do
+    it "returns the number of child nodes" do
+      expect(root.child_count).to eq(root.children.length)
+    end
+
+    it "returns 0 for nodes without children" do
+      text = root.children.first
+      expect(text.child_count).to eq(0)
+    end
+  end
+
+  describe "#traverse" do
+    let(:tree) { RXerces::XML::Document.parse('<a><b><c/>text</b><!--note--><d/></a>').root }
+
+    it "yields the node and its descendants, children first" do
+      names = []
+      tree.traverse { |node| names << node.name }
+      expect(names).to eq(['c', '#text', 'b', '#comment', 'd', 'a'])
+    end
+
+    it "yields parents first with order: :pre" do
+      expect(tree.traverse(order: :pre).map(&:name)).to eq(['a', 'b', 'c', '#text', '#comment', 'd'])
+    end
+
+    it "filters by node type and name" do
+      expect(tree.traverse(type: :element).map(&:name)).to eq(['c', 'b', 'd', 'a'])
+      expect(tree.traverse(type: :comment).map(&:text)).to eq(['note'])
+      expect(tree.traverse(name: 'd').map(&:name)).to eq(['d'])
+    end
+
+    it "returns an Enumerator without a block" do
+      expect(tree.traverse).to be_a(Enumerator)
+      expect(tree.traverse(order: :pre).first.name).to eq('a')
+    end
+
+    it "stops when the block breaks" do
+      visited = []
+      result = tree.traverse(order: :pre) do |node|
+        visited << node.name
+        break node if node.name == 'c'
+      end
+      expect(result.name).to eq('c')
+      expect(visited).to eq(['a', 'b', 'c'])
+    end
+
+    it "returns self" do
+      expect(tree.traverse { |_| }).to equal(tree)
+    end
+
+    it "raises if the document is modified during traversal" do
+      expect {
+        tree.traverse(order: :pre) { |node| node.remove if node.name == 'b' }
+      }.to raise_error(RuntimeError, /modified during traversal/)
+    end
+
+    it "rejects invalid options" do
+      expect { tree.traverse(order: :sideways) {} }.to raise_error(ArgumentError, /order must be/)
+      expect { tree.traverse(type: :bogus) {} }.to raise_error(ArgumentError, /unknown node type/)
+      expect { tree.traverse(depth: 1) {} }.to raise_error(ArgumentError, /Unknown option: depth/)
+    end
+  end
+
+  describe "#each_descendant" do
+    let(:tree) { RXerces::XML::Document.parse('<a><b><c/>text</b><d/></a>').root }
+
+    it "yields descendants in document order, excluding the node" do
+      expect(tree.each_descendant.map(&:name)).to eq(['b', 'c', '#text', 'd'])
+    end
+
+    it "supports post-order and filters" do
+      expect(tree.each_descendant(order: :post).map(&:name)).to eq(['c', '#text', 'b', 'd'])
+      expect(tree.each_descendant(type: :text).map(&:text)).to eq(['text'])
+    end
+
+    it "yields nothing for leaf nodes" do
+      expect(tree.at_xpath('.//d').each_descendant.to_a).to be_empty
+    end
+  end
+
+  describe "#each_element" do
+    let(:tree) { RXerces::XML::Document.parse('<a><row n="1"><row n="2"/></row>text<other/><row n="3"/></a>').root }
+
+    it "yields descendant elements" do
+      expect(tree.each_element.map(&:name)).to eq(['row', 'row', 'other', 'row'])
+    end
+
+    it "filters by name" do
+      expect(tree.each_element('row').map { |row| row['n'] }).to eq(['1', '2', '3'])
+      expect(tree.each_element('row', order: :post).map { |row| row['n'] }).to eq(['2', '1', '3'])
+    end
+
+    it "accepts options without a name" do
+      expect(tree.each_element(order: :post).map(&:name)).to eq(['row', 'row', 'other', 'row'])
+    end
+
+    it "returns an Enumerator without a block" do
+      enum = tree.each_element('row')
+      expect(enum).to be_a(Enumerator)
+      expect(enum.count).to eq(3)
+    end
+  end
+
   describe "#parent" do
     it "returns the parent node" do
       person = root.children.find { |n| n.is_a?(RXerces::XML::Element) }
@@ -335,6 +475,91 @@ RSpec.describe RXerces::XML::Node do
     end
   end
 
+  describe "document order" do
+    let(:tree) { RXerces::XML::Document.parse('<a id="x"><b><c/></b><d/></a>') }
+    let(:a) { tree.root }
+    let(:b) { tree.at_xpath('//b') }
+    let(:c) { tree.at_xpath('//c') }
+    let(:d) { tree.at_xpath('//d') }
+
+    describe "#ancestor_of?" do
+      it "is true for nodes anywhere below this one" do
+        expect(a.ancestor_of?(c)).to be true
+        expect(b.ancestor_of?(c)).to be true
+      end
+
+      it "is false for the node itself, siblings and ancestors" do
+        expect(b.ancestor_of?(b)).to be false
+        expect(b.ancestor_of?(d)).to be false
+        expect(c.ancestor_of?(a)).to be false
+      end
+
+      it "treats attributes as part of their element" do
+        expect(a.ancestor_of?(tree.at_xpath('//@id'))).to be true
+        expect(b.ancestor_of?(tree.at_xpath('//@id'))).to be false
+      end
+
+      it "is false for nodes of another document" do
+        other = RXerces::XML::Document.parse('<a id="x"><b><c/></b><d/></a>')
+        expect(a.ancestor_of?(other.at_xpath('//c'))).to be false
+      end
+
+      it "follows modifications to the document" do
+        expect(b.ancestor_of?(d)).to be false
+        b.add_child(d)
+        expect(b.ancestor_of?(d)).to be true
+        d.remove
+        expect(a.ancestor_of?(d)).to be false
+      end
+
+      it "works on nodes removed from the document" do
+        b.remove
+        expect(b.ancestor_of?(c)).to be true
+        expect(a.ancestor_of?(c)).to be false
+      end
+    end
+
+    describe "#descendant_of?" do
+      it "is the converse of ancestor_of?" do
+        expect(c.descendant_of?(a)).to be true
+        expect(c.descendant_of?(b)).to be true
+        expect(a.descendant_of?(c)).to be false
+        expect(d.descendant_of?(b)).to be false
+      end
+    end
+
+    describe "#<=>" do
+      it "compares nodes in document order" do
+        expect(a <=> c).to eq(-1)
+        expect(d <=> c).to eq(1)
+        expect(c <=> tree.at_xpath('//c')).to eq(0)
+      end
+
+      it "sorts nodes into document order" do
+        expect([d, c, a, b].sort.map(&:name)).to eq(['a', 'b', 'c', 'd'])
+      end
+
+      it "places attributes after their element and before its children" do
+        id = tree.at_xpath('//@id')
+        expect(a <=> id).to eq(-1)
+        expect(id <=> b).to eq(-1)
+      end
+
+      it "returns nil for nodes of another document and non-nodes" do
+        other = RXerces::XML::Document.parse('<a/>')
+        expect(a <=> other.root).to be_nil
+        expect(a <=> 'a').to be_nil
+      end
+
+      it "follows modifications to the document" do
+        expect(b <=> d).to eq(-1)
+        b.remove
+        a.add_child(b)
+        expect(b <=> d).to eq(1)
+      end
+    end
+  end
+
   describe "#attributes" do
     it "returns a hash of attributes" do
       person = root.children.find { |n| n.is_a?(RXerces::XML::Element) }
@@ -917,6 +1142,44 @@ RSpec.describe RXerces::XML::Node do
     end
   end
 
+  describe "#to_xml" do
+    it "returns the XML of the node including its own tags" do
+      person = root.xpath('//person').first
+      xml = person.to_xml
+      expect(xml).to start_with('<person')
+      expect(xml).to include('<age>30</age>')
+      expect(xml).to end_with('</person>')
+    end
+
+    it "does not include an XML declaration" do
+      expect(root.xpath('//age').first.to_xml).to eq('<age>30</age>')
+    end
+
+    it "escapes text nodes" do
+      text = RXerces::XML::Document.parse('<a>x &amp; y</a>').root.children.first
+      expect(text.to_xml).to eq('x &amp; y')
+    end
+
+    it "returns a UTF-8 string" do
+      node = RXerces::XML::Document.parse('<a>café</a>').root
+      expect(node.to_xml.encoding).to eq(Encoding::UTF_8)
+      expect(node.to_xml).to eq('<a>café</a>')
+    end
+
+    it "is aliased as to_s" do
+      age = root.xpath('//age').first
+      expect(age.to_s).to eq(age.to_xml)
+    end
+  end
+
+  describe "#write_to" do
+    it "streams the node into an IO" do
+      io = StringIO.new
+      root.xpath('//age').first.write_to(io)
+      expect(io.string).to eq('<age>30</age>')
+    end
+  end
+
   describe "#path" do
     it "returns the XPath to the root element" do
       expect(root.path).to eq('/root[1]')
@@ -939,6 +1202,53 @@ RSpec.describe RXerces::XML::Node do
     end
   end
 
+  describe "#each_with_path" do
+    let(:tree) { RXerces::XML::Document.parse('<a><b/>x<b><c/></b><!--n--><b/></a>').root }
+
+    it "yields each node with its path, starting with this node" do
+      pairs = []
+      tree.each_with_path { |path, node| pairs << [path, node.name] }
+      expect(pairs).to eq([
+        ['/a[1]', 'a'],
+        ['/a[1]/b[1]', 'b'],
+        ['/a[1]/text()[1]', '#text'],
+        ['/a[1]/b[2]', 'b'],
+        ['/a[1]/b[2]/c[1]', 'c'],
+        ['/a[1]', '#comment'],
+        ['/a[1]/b[3]', 'b']
+      ])
+    end
+
+    it "yields the same paths as #path" do
+      tree.each_with_path { |path, node| expect(path).to eq(node.path) }
+    end
+
+    it "starts from the path of a nested node" do
+      second = tree.at_xpath('b[2]')
+      expect(second.each_with_path.map { |path, _node| path }).to eq(['/a[1]/b[2]', '/a[1]/b[2]/c[1]'])
+    end
+
+    it "filters by type and name" do
+      expect(tree.each_with_path(name: 'b').map { |path, _node| path }).to eq(['/a[1]/b[1]', '/a[1]/b[2]', '/a[1]/b[3]'])
+      expect(tree.each_with_path(type: :text).map { |path, _node| path }).to eq(['/a[1]/text()[1]'])
+    end
+
+    it "stops when the block breaks" do
+      result = tree.each_with_path { |path, _node| break path if path.end_with?('c[1]') }
+      expect(result).to eq('/a[1]/b[2]/c[1]')
+    end
+
+    it "rejects the order: option" do
+      expect { tree.each_with_path(order: :post) {} }.to raise_error(ArgumentError, /Unknown option: order/)
+    end
+
+    it "raises if the document is modified during the walk" do
+      expect {
+        tree.each_with_path { |_path, node| node.remove if node.name == 'c' }
+      }.to raise_error(RuntimeError, /modified during traversal/)
+    end
+  end
+
   describe "#blank?" do
     let(:blank_xml) { '<root><empty></empty><whitespace>   </whitespace><content>Hello</content></root>' }
     let(:blank_doc) { RXerces::XML::Document.parse(blank_xml) }
@@ -996,6 +1306,53 @@ RSpec.describe RXerces::XML::Node do
     end
   end
 
+  describe "#search_subtree" do
+    let(:alice) { root.xpath('person')[0] }
+
+    it "returns a NodeSet" do
+      expect(alice.search_subtree('.//age')).to be_a(RXerces::XML::NodeSet)
+    end
+
+    it "evaluates a leading // relative to the node" do
+      result = alice.search_subtree('//age')
+      expect(result.length).to eq(1)
+      expect(result.first.text).to eq('30')
+      expect(alice.xpath('//age').length).to eq(2)
+    end
+
+    it "evaluates a leading / relative to the node" do
+      expect(alice.search_subtree('/city').map(&:text)).to eq(['New York'])
+      expect(alice.search_subtree('/').map(&:name)).to eq(['person'])
+    end
+
+    it "evaluates every absolute branch relative to the node" do
+      bob = root.xpath('person')[1]
+      expect(alice.search_subtree('//age | //city').map(&:text)).to eq(['30', 'New York'])
+      expect(bob.search_subtree('(//age)[1]').map(&:text)).to eq(['25'])
+      expect(bob.search_subtree("//age[//city] | (/)").map(&:name)).to eq(['person', 'age'])
+    end
+
+    it "drops matches outside the subtree" do
+      expect(alice.search_subtree('..')).to be_empty
+      expect(alice.search_subtree('following-sibling::person')).to be_empty
+      expect(alice.search_subtree('ancestor-or-self::*').map(&:name)).to eq(['person'])
+    end
+
+    it "includes the node itself and its attributes" do
+      expect(alice.search_subtree('self::person').length).to eq(1)
+      expect(alice.search_subtree('@name').map(&:text)).to eq(['Alice'])
+    end
+
+    it "supports limit: and offset:" do
+      expect(alice.search_subtree('ancestor-or-self::* | .//*', limit: 2).map(&:name)).to eq(['person', 'age'])
+      expect(alice.search_subtree('.//*', offset: 1).map(&:name)).to eq(['city'])
+    end
+
+    it "raises for invalid expressions" do
+      expect { alice.search_subtree('.//[invalid') }.to raise_error(ArgumentError)
+    end
+  end
+
   describe "#at_xpath" do
     it "returns the first matching node" do
       result = root.at_xpath('.//age')
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'stringio'
 
 RSpec.describe RXerces::XML::NodeSet do
   let(:xml) do
@@ -145,6 +146,124 @@ RSpec.describe RXerces::XML::NodeSet do
     end
   end
 
+  describe "#to_xml" do
+    it "returns the XML of every node in one string" do
+      expect(nodeset.to_xml).to eq('<item>First</item><item>Second</item><item>Third</item>')
+    end
+
+    it "returns empty string for empty nodeset" do
+      expect(empty_nodeset.to_xml).to eq('')
+    end
+  end
+
+  describe "#write_to" do
+    it "streams every node into an IO" do
+      io = StringIO.new
+      expect(nodeset.write_to(io)).to equal(io)
+      expect(io.string).to eq(nodeset.to_xml)
+    end
+
+    it "appends to a String" do
+      buffer = +"<list>"
+      nodeset.write_to(buffer)
+      expect(buffer).to eq('<list><item>First</item><item>Second</item><item>Third</item>')
+    end
+  end
+
+  describe "#paths" do
+    it "returns the path of every node" do
+      expect(nodeset.paths).to eq(['/root[1]/item[1]', '/root[1]/item[2]', '/root[1]/item[3]'])
+    end
+
+    it "matches Node#path for mixed node types" do
+      set = doc.xpath('//item/text() | //item | /root')
+      expect(set.paths).to eq(set.map(&:path))
+    end
+
+    it "returns an empty array for an empty set" do
+      expect(empty_nodeset.paths).to eq([])
+    end
+  end
+
+  describe "set operations" do
+    let(:xml) do
+      <<-XML
+        <root>
+          <item id="1"/><item id="2"/><item id="3"/><item id="4"/><item id="5"/>
+        </root>
+      XML
+    end
+
+    let(:odd) { doc.xpath('//item[@id mod 2 = 1]') }
+    let(:low) { doc.xpath('//item[@id < 4]') }
+
+    def ids(set)
+      set.map { |node| node['id'] }
+    end
+
+    it "returns the union in document order without duplicates" do
+      result = odd | low
+      expect(result).to be_a(RXerces::XML::NodeSet)
+      expect(ids(result)).to eq(['1', '2', '3', '5'])
+    end
+
+    it "returns the intersection in document order" do
+      expect(ids(odd & low)).to eq(['1', '3'])
+    end
+
+    it "returns the difference in document order" do
+      expect(ids(odd - low)).to eq(['5'])
+      expect(ids(low - odd)).to eq(['2'])
+    end
+
+    it "handles empty sets" do
+      expect(ids(odd | empty_nodeset)).to eq(['1', '3', '5'])
+      expect(ids(odd & empty_nodeset)).to be_empty
+      expect(ids(empty_nodeset - odd)).to be_empty
+    end
+
+    it "combines results from separate queries for the same nodes" do
+      expect((doc.xpath('//item') & doc.css('item')).length).to eq(5)
+    end
+
+    it "raises TypeError for operands that are not node sets" do
+      expect { odd | [] }.to raise_error(TypeError)
+      expect { odd & doc.root }.to raise_error(TypeError, /NodeSet/)
+      expect { odd - nil }.to raise_error(TypeError, /NodeSet/)
+    end
+
+    describe "#sort" do
+      it "returns the nodes in document order" do
+        reversed = doc.xpath('//item').sort { |x, y| y['id'] <=> x['id'] }
+        expect(ids(reversed)).to eq(['5', '4', '3', '2', '1'])
+        expect(ids(reversed.sort)).to eq(['1', '2', '3', '4', '5'])
+        expect(reversed.sort).to be_a(RXerces::XML::NodeSet)
+        expect(ids((odd - low).sort)).to eq(['5'])
+        expect(doc.xpath('//item[@id > 3]').to_a.reverse.sort.map { |node| node['id'] }).to eq(['4', '5'])
+      end
+
+      it "sorts with a block" do
+        result = odd.sort { |x, y| y['id'] <=> x['id'] }
+        expect(result).to be_a(RXerces::XML::NodeSet)
+        expect(ids(result)).to eq(['5', '3', '1'])
+      end
+    end
+
+    describe "#uniq" do
+      it "returns a NodeSet keeping the original order" do
+        result = doc.xpath('//item').uniq
+        expect(result).to be_a(RXerces::XML::NodeSet)
+        expect(ids(result)).to eq(['1', '2', '3', '4', '5'])
+        expect(ids(odd.sort { |x, y| y['id'] <=> x['id'] }.uniq)).to eq(['5', '3', '1'])
+        expect(empty_nodeset.uniq).to be_empty
+      end
+
+      it "uniquifies by the block's result" do
+        expect(ids(doc.xpath('//item').uniq { |node| node['id'].to_i % 2 })).to eq(['1', '2'])
+      end
+    end
+  end
+
   describe "#inspect" do
     it "returns a string representation" do
       result = nodeset.inspect
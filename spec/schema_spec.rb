@@ -1,4 +1,6 @@
 require 'spec_helper'
+require 'stringio'
+require 'tempfile'
 
 RSpec.describe RXerces::XML::Schema do
   let(:simple_xsd) do
@@ -73,6 +75,29 @@ RSpec.describe RXerces::XML::Schema do
       expect(errors.first).to include('not-a-number')
     end
 
+    it 'reuses one schema for many validations' do
+      valid = RXerces::XML::Document.parse(valid_xml)
+      invalid = RXerces::XML::Document.parse(invalid_xml)
+      3.times do
+        expect(valid.validate(schema)).to be_empty
+        expect(invalid.validate(schema)).not_to be_empty
+      end
+    end
+
+    it 'validates the current state of a modified document' do
+      doc = RXerces::XML::Document.parse(valid_xml)
+      doc.xpath('//age').first.text = 'forty'
+      expect(doc.validate(schema).join).to include('forty')
+    end
+
+    it 'validates documents parsed with preserve_source' do
+      doc = RXerces::XML::Document.parse(invalid_xml, preserve_source: true)
+      expect(doc.validate(schema).first).to include('not-a-number')
+
+      doc.xpath('//age').first.text = '31'
+      expect(doc.validate(schema)).to be_empty
+    end
+
     it 'handles schema grammar loading errors gracefully' do
       # Create a schema with an invalid type reference
       invalid_schema_xsd = <<~XSD
@@ -100,4 +125,300 @@ RSpec.describe RXerces::XML::Schema do
       expect(errors.join).to include('invalid-type')
     end
   end
+
+  describe 'validation while parsing' do
+    let(:schema) { described_class.from_string(simple_xsd) }
+
+    it 'parses a valid document without errors' do
+      doc = RXerces::XML::Document.parse(valid_xml, schema: schema)
+      expect(doc.root.name).to eq('root')
+      expect(doc.errors).to be_empty
+    end
+
+    it 'builds the document and reports validation errors through errors' do
+      doc = RXerces::XML::Document.parse(invalid_xml, schema: schema)
+      expect(doc.xpath('//age').first.text).to eq('not-a-number')
+      expect(doc.errors).not_to be_empty
+      expect(doc.errors.first.message).to include('not-a-number')
+    end
+
+    it 'reports line numbers from the parsed source' do
+      doc = RXerces::XML::Document.parse(invalid_xml, schema: schema)
+      expect(doc.errors.first.message).to match(/line 4\b/)
+    end
+
+    it 'returns structured errors' do
+      error = RXerces::XML::Document.parse(invalid_xml, schema: schema).errors.first
+      expect(error).to be_a(RXerces::XML::SyntaxError)
+      expect(error.line).to eq(4)
+      expect(error.column).to be_a(Integer)
+      expect(error.level).to eq(2)
+      expect(error).to be_error
+      expect(error).not_to be_fatal
+      expect(error).not_to be_warning
+      expect(error.to_s).to start_with('Error at line 4, column ')
+    end
+
+    context 'with error limits' do
+      let(:many_invalid_xml) do
+        "<root><name>John</name><age>x</age><extra/><extra/><extra/></root>"
+      end
+
+      it 'collects every error by default' do
+        doc = RXerces::XML::Document.parse(many_invalid_xml, schema: schema)
+        expect(doc.errors.length).to be > 1
+      end
+
+      it 'stops parsing once max_errors have been reported' do
+        expect {
+          RXerces::XML::Document.parse(many_invalid_xml, schema: schema, max_errors: 1)
+        }.to raise_error(RXerces::XML::SyntaxError) { |e| expect(e.message.lines.length).to eq(2) }
+      end
+
+      it 'does not count warnings towards max_errors' do
+        # The repeated attribute declaration is a warning, not an error
+        warned_xml = <<~XML
+          <?xml version="1.0"?>
+          <!DOCTYPE root [
+            <!ELEMENT root (name, age)>
+            <!ELEMENT name (#PCDATA)>
+            <!ELEMENT age (#PCDATA)>
+            <!ATTLIST root id CDATA #IMPLIED>
+            <!ATTLIST root id CDATA #IMPLIED>
+          ]>
+          <root><name>John</name><age>30</age></root>
+        XML
+        doc = RXerces::XML::Document.parse(warned_xml, schema: schema, max_errors: 1)
+        expect(doc.errors).not_to be_empty
+        expect(doc.errors).to all(be_warning)
+      end
+
+      it 'stops at the first error with fatal_on_first' do
+        expect {
+          RXerces::XML::Document.parse(invalid_xml, schema: schema, fatal_on_first: true)
+        }.to raise_error(RXerces::XML::SyntaxError, /XML parsing failed:\nError at line 4/)
+      end
+
+      it 'carries the errors found before stopping' do
+        expect {
+          RXerces::XML::Document.parse(many_invalid_xml, schema: schema, max_errors: 2)
+        }.to raise_error(RXerces::XML::SyntaxError) { |e|
+          expect(e.errors.length).to eq(2)
+          expect(e.errors).to all(be_a(RXerces::XML::SyntaxError))
+          expect(e.errors.first).to be_error
+          expect(e.line).to eq(e.errors.last.line)
+        }
+      end
+
+      it 'limits the messages returned by validate' do
+        doc = RXerces::XML::Document.parse(many_invalid_xml)
+        expect(doc.validate(schema).length).to be > 1
+        expect(doc.validate(schema, max_errors: 1).length).to eq(1)
+        expect(doc.validate(schema, fatal_on_first: true).length).to eq(1)
+      end
+    end
+
+    it 'combines with preserve_source' do
+      doc = RXerces::XML::Document.parse(valid_xml, schema: schema, preserve_source: true)
+      expect(doc.errors).to be_empty
+      expect(doc.to_s).to eq(valid_xml)
+    end
+
+    it 'rejects schemas of the wrong type' do
+      expect {
+        RXerces::XML::Document.parse(valid_xml, schema: simple_xsd)
+      }.to raise_error(TypeError, /Schema/)
+    end
+  end
+
+  describe '#validate_many' do
+    let(:schema) { described_class.from_string(simple_xsd) }
+
+    it 'is frozen once compiled' do
+      expect(schema).to be_frozen
+    end
+
+    it 'validates documents and strings, returning errors in input order' do
+      inputs = [valid_xml, RXerces::XML::Document.parse(invalid_xml), invalid_xml, RXerces::XML::Document.parse(valid_xml)]
+      results = schema.validate_many(inputs, threads: 3)
+
+      expect(results.length).to eq(4)
+      expect(results[0]).to be_empty
+      expect(results[1]).not_to be_empty
+      expect(results[2]).not_to be_empty
+      expect(results[3]).to be_empty
+    end
+
+    it 'reports the same errors as validating one at a time' do
+      docs = Array.new(20) { |i| RXerces::XML::Document.parse(i.even? ? valid_xml : invalid_xml) }
+      expect(schema.validate_many(docs, threads: 4)).to eq(docs.map { |doc| doc.validate(schema) })
+    end
+
+    it 'returns an empty array for no input' do
+      expect(schema.validate_many([])).to eq([])
+    end
+
+    it 'can be used from several Ruby threads at once' do
+      threads = Array.new(4) { Thread.new { schema.validate_many([valid_xml, invalid_xml] * 5, threads: 2) } }
+      threads.map(&:value).each do |results|
+        expect(results.values_at(0, 2, 4, 6, 8)).to all(be_empty)
+        expect(results.values_at(1, 3, 5, 7, 9)).to all(satisfy { |errors| !errors.empty? })
+      end
+    end
+
+    it 'can be interrupted by Thread#raise and leaves the documents writable' do
+      docs = Array.new(200) { RXerces::XML::Document.parse(invalid_xml) }
+      thread = Thread.new { loop { schema.validate_many(docs, threads: 2) } }
+      sleep 0.05
+      thread.raise(ArgumentError, 'stop')
+      expect { thread.join }.to raise_error(ArgumentError, 'stop')
+
+      docs.first.root['changed'] = 'yes'
+      expect(docs.first.root['changed']).to eq('yes')
+    end
+
+    it 'rejects other inputs and bad thread counts' do
+      expect { schema.validate_many([42]) }.to raise_error(TypeError)
+      expect { schema.validate_many([valid_xml], threads: 0) }.to raise_error(ArgumentError)
+      expect { schema.validate_many([valid_xml], workers: 2) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'streaming validation' do
+    let(:list_schema) do
+      described_class.from_string(<<~XSD)
+        <?xml version="1.0" encoding="UTF-8"?>
+        <xs:schema xmlns:xs="http://www.w3.org/2001/XMLSchema">
+          <xs:element name="list">
+            <xs:complexType>
+              <xs:sequence>
+                <xs:element name="n" type="xs:integer" maxOccurs="unbounded"/>
+              </xs:sequence>
+            </xs:complexType>
+          </xs:element>
+        </xs:schema>
+      XSD
+    end
+
+    # Large enough to be read in several chunks; every 1000th item is invalid
+    let(:big_xml) do
+      items = (1..20_000).map { |i| (i % 1000).zero? ? "<n>x#{i}</n>" : "<n>#{i}</n>" }
+      "<list>\n#{items.join("\n")}\n</list>\n"
+    end
+
+    let(:big_file) do
+      file = Tempfile.new(['big', '.xml'])
+      file.write(big_xml)
+      file.close
+      file
+    end
+
+    after { big_file.unlink }
+
+    it 'validates a file and returns its errors' do
+      errors = list_schema.validate_file(big_file.path)
+      expect(errors.length).to eq(20)
+      expect(errors.first).to match(/line 1001\b.*x1000/)
+    end
+
+    it 'reads an IO in chunks' do
+      expect(list_schema.validate_io(StringIO.new(big_xml))).to eq(list_schema.validate_file(big_file.path))
+    end
+
+    it 'returns no errors for a valid stream' do
+      expect(list_schema.validate_io(StringIO.new('<list><n>1</n></list>'))).to eq([])
+    end
+
+    it 'yields each error to a block and returns the count' do
+      messages = []
+      expect(list_schema.validate_io(StringIO.new(big_xml)) { |message| messages << message }).to eq(20)
+      expect(messages.length).to eq(20)
+    end
+
+    it 'stops after max_errors' do
+      expect(list_schema.validate_file(big_file.path, max_errors: 3).length).to eq(3)
+
+      messages = []
+      list_schema.validate_io(StringIO.new(big_xml), max_errors: 2) { |message| messages << message }
+      expect(messages.length).to eq(2)
+    end
+
+    it 'stops when the block breaks or raises' do
+      seen = 0
+      list_schema.validate_file(big_file.path) { seen += 1; break }
+      expect(seen).to eq(1)
+
+      expect {
+        list_schema.validate_file(big_file.path) { raise ArgumentError, 'stop' }
+      }.to raise_error(ArgumentError, 'stop')
+    end
+
+    it 'carries on when the thread is woken up' do
+      thread = Thread.new { list_schema.validate_file(big_file.path) }
+      while thread.alive?
+        begin
+          thread.wakeup
+        rescue ThreadError
+          break # Finished meanwhile
+        end
+        Thread.pass
+      end
+      expect(thread.value.length).to eq(20)
+    end
+
+    it 'raises an interrupt from Thread#raise' do
+      thread = Thread.new { loop { list_schema.validate_file(big_file.path) } }
+      sleep 0.05
+      thread.raise(ArgumentError, 'stop')
+      expect { thread.join }.to raise_error(ArgumentError, 'stop')
+    end
+
+    it 'reports malformed input as an error' do
+      errors = list_schema.validate_io(StringIO.new('<list><n>1</n>'))
+      expect(errors.last).to match(/Fatal error/)
+    end
+
+    it 'raises for missing files and unreadable IOs' do
+      expect { list_schema.validate_file('/nonexistent/big.xml') }.to raise_error(Errno::ENOENT)
+      expect { list_schema.validate_io(42) }.to raise_error(TypeError)
+      expect { list_schema.validate_io(StringIO.new('<list/>'), max_errors: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'external entities' do
+    let(:number_schema) do
+      described_class.from_string(<<~XSD)
+        <?xml version="1.0" encoding="UTF-8"?>
+        <xs:schema xmlns:xs="http://www.w3.org/2001/XMLSchema">
+          <xs:element name="n" type="xs:integer"/>
+        </xs:schema>
+      XSD
+    end
+
+    let(:secret_file) do
+      file = Tempfile.new(['secret', '.txt'])
+      file.write('secret-value-42')
+      file.close
+      file
+    end
+
+    # Were the entity resolved, the type error would quote the file
+    let(:xxe_xml) do
+      %(<?xml version="1.0"?>\n<!DOCTYPE n [ <!ENTITY xxe SYSTEM "file://#{secret_file.path}"> ]>\n<n>&xxe;</n>)
+    end
+
+    after { secret_file.unlink }
+
+    it 'does not resolve SYSTEM entities' do
+      messages = number_schema.validate_io(StringIO.new(xxe_xml)) +
+                 number_schema.validate_many([xxe_xml]).first
+      expect(messages).not_to be_empty
+      expect(messages.join("\n")).not_to include('secret-value-42')
+    end
+
+    it 'accepts allow_external_entities as an opt-in' do
+      expect { number_schema.validate_io(StringIO.new('<n>1</n>'), allow_external_entities: true) }.not_to raise_error
+      expect(number_schema.validate_many(['<n>1</n>'], allow_external_entities: false)).to eq([[]])
+    end
+  end
 end
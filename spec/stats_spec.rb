@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe "RXerces.stats" do
+  let(:xml) { '<root><item id="1">a</item><item id="2">b</item></root>' }
+
+  before { RXerces.reset_stats }
+
+  it "counts parses and input bytes" do
+    2.times { RXerces::XML::Document.parse(xml) }
+    stats = RXerces.stats
+    expect(stats[:parses]).to eq(2)
+    expect(stats[:parse_bytes]).to eq(2 * xml.bytesize)
+  end
+
+  it "records parse latency in a histogram" do
+    RXerces::XML::Document.parse(xml)
+    histogram = RXerces.stats[:parse_time]
+    expect(histogram[:count]).to eq(1)
+    expect(histogram[:total]).to be > 0
+    expect(histogram[:buckets].values.sum).to eq(1)
+    expect(histogram[:buckets].keys.last).to eq(Float::INFINITY)
+  end
+
+  it "counts XPath queries, compile cache hits and misses, and wrapped nodes" do
+    doc = RXerces::XML::Document.parse(xml)
+    expression = "//item[@id='#{rand(1_000_000)}'] | //item"
+    3.times { doc.xpath(expression) }
+    stats = RXerces.stats
+    expect(stats[:xpath_queries]).to eq(3)
+    expect(stats[:xpath_compile_misses]).to eq(1)
+    expect(stats[:xpath_compile_hits]).to eq(2)
+    expect(stats[:nodes_wrapped]).to be >= 6
+    expect(stats[:xpath_time][:count]).to eq(3)
+  end
+
+  it "counts one compile cache lookup per bounded Xalan query", xalan: true do
+    engine = RXerces.xpath_engine
+    RXerces.xpath_engine = :xalan
+    doc = RXerces::XML::Document.parse(xml)
+    expression = "(//item[@id='#{rand(1_000_000)}'] | //item)[last()]"
+    doc.xpath(expression, limit: 1)
+    doc.at_xpath(expression)
+    stats = RXerces.stats
+    expect(stats[:xpath_compile_misses]).to eq(1)
+    expect(stats[:xpath_compile_hits]).to eq(1)
+  ensure
+    RXerces.xpath_engine = engine
+  end
+
+  it "counts XPath validation cache hits and misses" do
+    doc = RXerces::XML::Document.parse(xml)
+    expression = "//item[@id='#{rand(1_000_000)}']"
+    2.times { doc.xpath(expression) }
+    stats = RXerces.stats
+    expect(stats[:xpath_validation_misses]).to be >= 1
+    expect(stats[:xpath_validation_hits]).to be >= 1
+  end
+
+  it "counts serializations and validations" do
+    doc = RXerces::XML::Document.parse(xml)
+    doc.to_s
+    doc.canonicalize
+    schema = RXerces::XML::Schema.from_string(<<~XSD)
+      <xs:schema xmlns:xs="http://www.w3.org/2001/XMLSchema">
+        <xs:element name="root"/>
+      </xs:schema>
+    XSD
+    doc.validate(schema)
+    schema.validate_many([xml, xml])
+
+    stats = RXerces.stats
+    expect(stats[:serializations]).to be >= 2
+    expect(stats[:validations]).to eq(3)
+    expect(stats[:validate_time][:count]).to eq(3)
+  end
+
+  it "is safe to update from several threads" do
+    threads = Array.new(4) { Thread.new { 25.times { RXerces::XML::Document.parse(xml) } } }
+    threads.each(&:join)
+    expect(RXerces.stats[:parses]).to eq(100)
+  end
+
+  it "resets every counter and histogram" do
+    RXerces::XML::Document.parse(xml).xpath('//item')
+    RXerces.reset_stats
+    stats = RXerces.stats
+    expect(stats[:parses]).to eq(0)
+    expect(stats[:nodes_wrapped]).to eq(0)
+    expect(stats[:parse_time][:count]).to eq(0)
+  end
+end
@@ -0,0 +1,417 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe "XPath engines" do
+  let(:xml) do
+    <<-XML
+      <library xmlns:x="urn:extra" id="lib">
+        <!-- catalogue -->
+        <book id="1" category="fiction" lang="en">
+          <title>1984</title>
+          <author>George Orwell</author>
+          <price>15.99</price>
+        </book>
+        <book id="2" category="fiction">
+          <title>Brave New World</title>
+          <author>Aldous Huxley</author>
+          <price>14.99</price>
+        </book>
+        <x:book id="3" category="non-fiction">
+          <title>Sapiens</title>
+          <author>Yuval Noah Harari</author>
+          <price>18.99</price>
+        </x:book>
+        <?index all?>
+        <shelf id="s1" xml:lang="en-GB">
+          <book id="4" category="reference">
+            <title>Dictionary</title>
+            <price>30</price>
+          </book>
+        </shelf>
+      </library>
+    XML
+  end
+
+  let(:doc) { RXerces::XML::Document.parse(xml) }
+
+  around do |example|
+    engine = RXerces.xpath_engine
+    example.run
+  ensure
+    RXerces.xpath_engine = engine
+  end
+
+  describe ".xpath_engine" do
+    it "defaults to xalan when available, native otherwise" do
+      expected = RXerces.xalan_enabled? ? :xalan : :native
+      expect(RXerces.xpath_engine).to eq(expected)
+    end
+
+    it "can be switched between engines" do
+      RXerces.xpath_engine = :xerces
+      expect(RXerces.xpath_engine).to eq(:xerces)
+      RXerces.xpath_engine = :native
+      expect(RXerces.xpath_engine).to eq(:native)
+    end
+
+    it "raises ArgumentError for an unknown engine" do
+      expect { RXerces.xpath_engine = :saxon }.to raise_error(ArgumentError, /unknown XPath engine/)
+    end
+
+    it "raises TypeError for a non-symbol" do
+      expect { RXerces.xpath_engine = "native" }.to raise_error(TypeError)
+    end
+
+    it "raises ArgumentError for xalan when it is not available" do
+      skip "Xalan available" if RXerces.xalan_enabled?
+      expect { RXerces.xpath_engine = :xalan }.to raise_error(ArgumentError, /Xalan/)
+    end
+  end
+
+  describe "native engine" do
+    before { RXerces.xpath_engine = :native }
+
+    def texts(nodes)
+      nodes.map { |n| n.text.strip }
+    end
+
+    context "location paths" do
+      it "selects descendants in document order" do
+        expect(texts(doc.xpath('//title'))).to eq(['1984', 'Brave New World', 'Sapiens', 'Dictionary'])
+      end
+
+      it "supports absolute and relative paths" do
+        expect(doc.xpath('/library/book').length).to eq(2)
+        expect(doc.xpath('book').length).to eq(2)
+        expect(doc.root.xpath('shelf/book/title').first.text).to eq('Dictionary')
+      end
+
+      it "supports positional predicates per step" do
+        expect(doc.xpath('//book[1]').map { |b| b['id'] }).to eq(['1', '4'])
+        expect(doc.xpath('(//book)[last()]').map { |b| b['id'] }).to eq(['4'])
+        expect(doc.xpath('//book[position() > 1]').map { |b| b['id'] }).to eq(['2'])
+      end
+
+      it "supports reverse axes with proximity positions" do
+        title = doc.at_xpath('//title[. = "Dictionary"]')
+        expect(title.xpath('ancestor::*[1]').first['id']).to eq('4')
+        expect(title.xpath('ancestor::*').map(&:name)).to eq(['library', 'shelf', 'book'])
+        expect(doc.xpath('//book[@id="2"]/preceding-sibling::*[1]').first['id']).to eq('1')
+      end
+
+      it "supports the following and preceding axes" do
+        expect(texts(doc.xpath('//book[@id="2"]/following::title'))).to eq(['Sapiens', 'Dictionary'])
+        expect(texts(doc.xpath('//book[@id="2"]/preceding::title'))).to eq(['1984'])
+      end
+
+      it "supports attribute selection" do
+        ids = doc.xpath('//book/@id')
+        expect(ids.map(&:text)).to eq(['1', '2', '4'])
+      end
+
+      it "supports node type tests" do
+        expect(doc.xpath('//comment()').first.text.strip).to eq('catalogue')
+        expect(doc.xpath('//processing-instruction("index")').length).to eq(1)
+        expect(doc.xpath('//book[1]/title/text()').map(&:text)).to eq(['1984', 'Dictionary'])
+      end
+
+      it "treats adjacent text and CDATA sections as one text node" do
+        mixed = RXerces::XML::Document.parse('<p>one<![CDATA[two]]>three<b/>four</p>')
+        expect(mixed.xpath('/p/text()').length).to eq(2)
+        expect(mixed.xpath('/p[text()[1] = "onetwothree"]').length).to eq(1)
+        expect(mixed.xpath('/p/text()[2]').map(&:text)).to eq(['four'])
+        expect(mixed.xpath('/p/b/preceding-sibling::node()').length).to eq(1)
+      end
+
+      it "resolves prefixes declared on the document element" do
+        expect(doc.xpath('//x:book').map { |b| b['id'] }).to eq(['3'])
+        expect(doc.xpath('//*[local-name() = "book"]').length).to eq(4)
+      end
+
+      it "merges unions in document order without duplicates" do
+        nodes = doc.xpath('//shelf | //book | //book[1]')
+        expect(nodes.map { |n| n['id'] }).to eq(['1', '2', 's1', '4'])
+      end
+    end
+
+    context "expressions and functions" do
+      it "compares node-sets with numbers and strings" do
+        expect(doc.xpath('//book[price > 15]').map { |b| b['id'] }).to eq(['1', '4'])
+        expect(doc.xpath('//book[author = "Aldous Huxley"]').length).to eq(1)
+        expect(doc.xpath('//book[@category != "fiction"]').map { |b| b['id'] }).to eq(['4'])
+      end
+
+      it "supports string functions" do
+        expect(doc.xpath('//book[starts-with(title, "Brave")]').length).to eq(1)
+        expect(doc.xpath('//book[contains(author, "Orwell")]').length).to eq(1)
+        expect(doc.xpath('//book[substring-before(@category, "c") = "fi"]').length).to eq(2)
+        expect(doc.xpath('//book[string-length(title) = 4]').length).to eq(1)
+        expect(doc.xpath('//book[translate(@category, "fiction", "FICTION") = "FICTION"]').length).to eq(2)
+        expect(doc.xpath('//title[normalize-space() = "Brave New World"]').length).to eq(1)
+      end
+
+      it "supports numeric functions" do
+        expect(doc.xpath('//book[floor(price) = 14]').length).to eq(1)
+        expect(doc.xpath('//book[round(price) = 16]').length).to eq(1)
+        expect(doc.xpath('/library[sum(book/price) > 30]').length).to eq(1)
+        expect(doc.xpath('/library[count(//book) = 3]').length).to eq(1)
+      end
+
+      it "supports boolean logic" do
+        expect(doc.xpath('//book[@category = "fiction" and price < 15]').length).to eq(1)
+        expect(doc.xpath('//book[@id = "1" or @id = "4"]').length).to eq(2)
+        expect(doc.xpath('//book[not(@lang)]').length).to eq(2)
+      end
+
+      it "supports lang() using inherited xml:lang" do
+        expect(doc.xpath('//book[lang("en")]').map { |b| b['id'] }).to eq(['4'])
+      end
+
+      it "supports id() for ID-typed attributes" do
+        result = doc.xpath('id("nothing")')
+        expect(result).to be_a(RXerces::XML::NodeSet)
+      end
+    end
+
+    context "at_xpath" do
+      it "returns the first node in document order" do
+        expect(doc.at_xpath('//book | //shelf')['id']).to eq('1')
+      end
+
+      it "returns nil when nothing matches" do
+        expect(doc.at_xpath('//magazine')).to be_nil
+        expect(doc.root.at_xpath('magazine')).to be_nil
+      end
+    end
+
+    context "errors" do
+      it "raises RuntimeError for syntax errors" do
+        expect { doc.xpath('//book[') }.to raise_error(ArgumentError)
+        expect { doc.xpath('//book[@id = ]') }.to raise_error(RuntimeError, /XPath error/)
+        expect { doc.xpath('//book/') }.to raise_error(RuntimeError, /XPath error/)
+      end
+
+      it "raises RuntimeError for unknown functions" do
+        expect { doc.xpath('//book[frobnicate()]') }.to raise_error(RuntimeError, /Unknown function/)
+      end
+
+      it "raises RuntimeError for undeclared prefixes" do
+        expect { doc.xpath('//y:book') }.to raise_error(RuntimeError, /Undeclared namespace prefix/)
+      end
+
+      it "raises RuntimeError for expressions that are not node-sets" do
+        expect { doc.xpath('count(//book)') }.to raise_error(RuntimeError, /node-set/)
+      end
+    end
+  end
+
+  describe "xerces engine" do
+    before { RXerces.xpath_engine = :xerces }
+
+    it "returns the same results for repeated queries" do
+      3.times do
+        expect(doc.xpath('//title').length).to eq(4)
+        expect(doc.xpath('/library/book/title').length).to eq(2)
+      end
+    end
+
+    it "keeps cached expressions independent of the context node" do
+      expect(doc.root.xpath('./book').length).to eq(2)
+      shelf = doc.root.xpath('./shelf').first
+      expect(shelf.xpath('./book').map { |b| b['id'] }).to eq(['4'])
+    end
+
+    it "returns the first match in document order from at_xpath" do
+      expect(doc.at_xpath('//title').text).to eq('1984')
+      expect(doc.at_xpath('//magazine')).to be_nil
+      expect(doc.xpath('//title').length).to eq(4)
+    end
+
+    it "resolves prefixes declared on the document element" do
+      expect(doc.xpath('//x:book').map { |b| b['id'] }).to eq(['3'])
+    end
+
+    it "resolves prefixes against the context node" do
+      nested = RXerces::XML::Document.parse(
+        '<root><a xmlns:p="urn:one"><p:item n="1"/></a><b xmlns:p="urn:two"><p:item n="2"/></b></root>'
+      )
+      a, b = nested.root.children
+      expect(a.xpath('.//p:item').map { |item| item['n'] }).to eq(['1'])
+      expect(b.xpath('.//p:item').map { |item| item['n'] }).to eq(['2'])
+      expect(a.xpath('.//p:item').map { |item| item['n'] }).to eq(['1'])
+    end
+
+    it "evicts old expressions without affecting results" do
+      150.times { |i| doc.xpath("//magazine#{i}") }
+      expect(doc.xpath('//title').length).to eq(4)
+      expect(doc.at_xpath('//price').text).to eq('15.99')
+    end
+
+    it "keeps caches separate per document" do
+      other = RXerces::XML::Document.parse('<library><title>Other</title></library>')
+      expect(doc.xpath('//title').length).to eq(4)
+      expect(other.xpath('//title').map(&:text)).to eq(['Other'])
+    end
+  end
+
+  describe "namespace prefixes" do
+    engines = [:native, :xerces]
+    engines << :xalan if RXerces.xalan_enabled?
+
+    let(:nested) do
+      RXerces::XML::Document.parse(
+        '<root xmlns:p="urn:one"><p:item n="1"/><inner xmlns:p="urn:two"><p:item n="2"/></inner></root>'
+      )
+    end
+
+    engines.each do |engine|
+      it "binds them at the context node with the #{engine} engine" do
+        RXerces.xpath_engine = engine
+        inner = nested.root.children.last
+        expect(nested.root.xpath('.//p:item').map { |item| item['n'] }).to eq(['1'])
+        expect(inner.xpath('.//p:item').map { |item| item['n'] }).to eq(['2'])
+        expect(inner.xpath('p:item').map { |item| item['n'] }).to eq(['2'])
+      end
+    end
+
+    (engines - [:native]).each do |engine|
+      it "compiles once for nodes with the same bindings with the #{engine} engine" do
+        RXerces.xpath_engine = engine
+        shared = RXerces::XML::Document.parse(
+          '<root xmlns:p="urn:one"><a><p:item/></a><a><p:item/></a><a xmlns:p="urn:two"><p:item/></a></root>'
+        )
+        RXerces.reset_stats
+        expect(shared.root.children.map { |a| a.xpath('p:item').length }).to eq([1, 1, 1])
+        expect(RXerces.stats[:xpath_compile_misses]).to eq(2)
+        expect(RXerces.stats[:xpath_compile_hits]).to eq(1)
+      end
+    end
+  end
+
+  describe "native engine compared with Xalan", xalan: true do
+    expressions = [
+      '//book',
+      '//title',
+      '//book[1]',
+      '(//book)[last()]',
+      '//book[@category="fiction"]/title',
+      '//book[price > 15]',
+      '//book/@id',
+      '//@*',
+      '//text()[normalize-space()]',
+      '//comment()',
+      '//processing-instruction()',
+      '//x:book/*',
+      '//*[local-name()="book"]',
+      '//book[2]/following::*',
+      '//book[2]/preceding::*',
+      '//title[.="Dictionary"]/ancestor::*',
+      '//title/following-sibling::*[1]',
+      '//price/preceding-sibling::node()',
+      '//shelf | //book[1] | //title',
+      '//book[contains(author, "o")][position() = last()]',
+      '//book[lang("en")]',
+      '//*[count(*) > 2]',
+      '/library/*[position() mod 2 = 0]',
+      '//book[not(@lang) and substring(@category, 1, 3) = "fic"]',
+    ]
+
+    def describe_nodes(nodes)
+      nodes.map { |n| [n.class, n.name, n.path, n.text] }
+    end
+
+    expressions.each do |expr|
+      it "returns the same nodes for #{expr}" do
+        RXerces.xpath_engine = :xalan
+        expected = describe_nodes(doc.xpath(expr))
+
+        RXerces.xpath_engine = :native
+        expect(describe_nodes(doc.xpath(expr))).to eq(expected)
+      end
+    end
+
+    it "returns the same nodes relative to a context node" do
+      shelf = doc.at_xpath('//shelf')
+
+      RXerces.xpath_engine = :xalan
+      expected = describe_nodes(shelf.xpath('.//title | ../book/@id | preceding-sibling::*[1]'))
+
+      RXerces.xpath_engine = :native
+      expect(describe_nodes(shelf.xpath('.//title | ../book/@id | preceding-sibling::*[1]'))).to eq(expected)
+    end
+  end
+
+  describe "#xpath_profile" do
+    it "reports where the time of a query went" do
+      RXerces.xpath_engine = :native
+      profile = doc.xpath_profile('//book[price > 15]/title')
+      expect(profile[:engine]).to eq(:native)
+      expect(profile[:result_count]).to eq(doc.xpath('//book[price > 15]/title').length)
+      %i[compile_time execution_time wrap_time].each do |key|
+        expect(profile[key]).to be_a(Float)
+        expect(profile[key]).to be >= 0
+      end
+    end
+
+    it "shows the compiled plan with numbered steps" do
+      plan = doc.xpath_profile('//book[@lang]/title')[:plan]
+      expect(plan).to start_with('path /')
+      expect(plan).to include('step 1 descendant::book')
+      expect(plan).to include('step 2 attribute::lang')
+      expect(plan).to include('step 3 child::title')
+    end
+
+    it "counts the nodes each step visits and selects" do
+      steps = doc.xpath_profile('/library/book')[:steps]
+      expect(steps.map { |s| s[:step] }).to eq(['child::library', 'child::book'])
+      expect(steps[1][:contexts]).to eq(1)
+      expect(steps[1][:selected]).to eq(2)
+      expect(steps[1][:visited]).to be > steps[1][:selected]
+    end
+
+    it "reports cache hits on a repeated query" do
+      RXerces.xpath_engine = :native
+      expr = "//title[. = 'profile #{rand}']"
+      first = doc.xpath_profile(expr)
+      second = doc.xpath_profile(expr)
+      expect(first[:compile_cache_hit]).to be false
+      expect(second[:compile_cache_hit]).to be true
+      expect(second[:validation_cache_hit]).to be true
+    end
+
+    it "profiles the Xerces engine" do
+      RXerces.xpath_engine = :xerces
+      profile = doc.xpath_profile('/library/book/title')
+      expect(profile[:engine]).to eq(:xerces)
+      expect(profile[:result_count]).to eq(2)
+    end
+
+    it "profiles the Xalan engine", xalan: true do
+      RXerces.xpath_engine = :xalan
+      profile = doc.xpath_profile('//book[position() = 2]')
+      expect(profile[:engine]).to eq(:xalan)
+      expect(profile[:result_count]).to eq(doc.xpath('//book[position() = 2]').length)
+      expect(profile[:steps]).not_to be_empty
+      expect(profile[:plan_engine]).to eq(:native)
+    end
+
+    it "leaves the plan pass out of the compile stats", xalan: true do
+      RXerces.xpath_engine = :xalan
+      expr = "//book[@lang = 'profile #{rand}']"
+      RXerces.reset_stats
+      doc.xpath_profile(expr)
+      stats = RXerces.stats
+      expect(stats[:xpath_compile_hits] + stats[:xpath_compile_misses]).to eq(1)
+    end
+
+    it "validates the expression" do
+      expect { doc.xpath_profile("//book[@id='1]") }.to raise_error(ArgumentError)
+    end
+
+    it "raises errors from the query itself" do
+      RXerces.xpath_engine = :native
+      expect { doc.xpath_profile('count(//book)') }.to raise_error(RuntimeError, /node-set/)
+    end
+  end
+end
@@ -105,6 +105,134 @@ RSpec.describe "XPath support" do
     end
   end
 
+  describe "Limits and offsets" do
+    engines = [:native, :xerces]
+    engines << :xalan if RXerces.xalan_enabled?
+
+    around do |example|
+      engine = RXerces.xpath_engine
+      example.run
+    ensure
+      RXerces.xpath_engine = engine
+    end
+
+    engines.each do |engine|
+      context "with the #{engine} engine" do
+        before { RXerces.xpath_engine = engine }
+
+        it "returns at most limit nodes" do
+          books = doc.xpath('//book', limit: 2)
+          expect(books).to be_a(RXerces::XML::NodeSet)
+          expect(books.map { |b| b['id'] }).to eq(['1', '2'])
+        end
+
+        it "skips offset nodes" do
+          expect(doc.xpath('//book', offset: 1).map { |b| b['id'] }).to eq(['2', '3'])
+          expect(doc.xpath('//book', offset: 1, limit: 1).map { |b| b['id'] }).to eq(['2'])
+        end
+
+        it "returns an empty nodeset past the end" do
+          expect(doc.xpath('//book', offset: 5).length).to eq(0)
+          expect(doc.xpath('//book', limit: 0).length).to eq(0)
+        end
+
+        it "supports limits on node queries" do
+          expect(doc.root.xpath('book/title', limit: 1).map { |t| t.text }).to eq(['1984'])
+        end
+
+        it "returns the first match from at_xpath" do
+          expect(doc.at_xpath('//book')['id']).to eq('1')
+        end
+
+        it "agrees with the unlimited query" do
+          ['//book', '//book/title', '/library/book/title'].each do |expr|
+            all = doc.xpath(expr).map(&:path)
+            expect(doc.xpath(expr, limit: 2).map(&:path)).to eq(all.first(2))
+            expect(doc.xpath(expr, offset: 1, limit: 1).map(&:path)).to eq(all[1, 1])
+            expect(doc.at_xpath(expr).path).to eq(all.first)
+            expect(doc.xpath_each(expr).map(&:path)).to eq(all)
+          end
+        end
+      end
+    end
+
+    it "rejects unknown options" do
+      expect { doc.xpath('//book', first: 1) }.to raise_error(ArgumentError, /Unknown option: first/)
+    end
+
+    it "rejects negative values" do
+      expect { doc.xpath('//book', limit: -1) }.to raise_error(ArgumentError, /limit/)
+      expect { doc.xpath('//book', offset: -1) }.to raise_error(ArgumentError, /offset/)
+    end
+
+    it "rejects non-integer values" do
+      expect { doc.xpath('//book', limit: '1') }.to raise_error(TypeError)
+    end
+  end
+
+  describe "Iterating matches" do
+    it "yields each match in document order" do
+      ids = []
+      doc.xpath_each('//book') { |book| ids << book['id'] }
+      expect(ids).to eq(['1', '2', '3'])
+    end
+
+    it "returns the receiver" do
+      expect(doc.xpath_each('//book') {}).to equal(doc)
+    end
+
+    it "stops when the block breaks" do
+      seen = 0
+      result = doc.xpath_each('//book[@category="fiction"]') do |book|
+        seen += 1
+        break book
+      end
+
+      expect(seen).to eq(1)
+      expect(result['id']).to eq('1')
+    end
+
+    it "propagates exceptions raised in the block" do
+      expect {
+        doc.xpath_each('//book') { raise IOError, "stop" }
+      }.to raise_error(IOError, "stop")
+
+      expect(doc.xpath('//book').length).to eq(3)
+    end
+
+    it "returns an enumerator without a block" do
+      enum = doc.xpath_each('//title')
+      expect(enum).to be_a(Enumerator)
+      expect(enum.first.text).to eq('1984')
+      expect(enum.map(&:text)).to eq(['1984', 'Brave New World', 'Sapiens'])
+    end
+
+    it "iterates relative to a node" do
+      book = doc.at_xpath('//book[@id="2"]')
+      names = book.xpath_each('*').map(&:name)
+      expect(names).to eq(['title', 'author', 'year', 'price'])
+    end
+
+    it "raises if the block modifies the document" do
+      seen = 0
+      expect {
+        doc.xpath_each('//book') { |book| seen += 1; book.remove }
+      }.to raise_error(RuntimeError, /document modified during iteration/)
+      expect(seen).to eq(1)
+      expect(doc.xpath('//book').length).to eq(2)
+    end
+
+    it "raises if the block changes an attribute" do
+      expect {
+        doc.xpath_each('//book') { |book| book['seen'] = 'yes' }
+      }.to raise_error(RuntimeError, /document modified during iteration/)
+    end
+
+    it "raises for invalid expressions" do
+      expect { doc.xpath_each('//book[') {} }.to raise_error(ArgumentError)
+    end
+  end
+
   describe "Error handling" do
     it "raises error for invalid XPath" do
       expect {
@@ -118,18 +246,28 @@ RSpec.describe "XPath support" do
       }.to raise_error(RuntimeError, /XPath error/)
     end
 
-    it "raises error for XPath with unsupported features" do
-      skip "Xalan installed, skipping" if xalan_installed
-      expect {
-        doc.xpath('//book[substring-before(@category, "c")]')
-      }.to raise_error(RuntimeError, /XPath error/)
-    end
+    context "with the Xerces engine" do
+      around do |example|
+        engine = RXerces.xpath_engine
+        RXerces.xpath_engine = :xerces
+        example.run
+      ensure
+        RXerces.xpath_engine = engine
+      end
 
-    it "handles very long XPath expressions" do
-      skip "Xalan installed, skipping" if xalan_installed
-      long_xpath = '/' + ('child::' * 100) + 'library'
-      result = doc.xpath(long_xpath)
-      expect(result).to be_a(RXerces::XML::NodeSet)
+      it "raises error for XPath with unsupported features" do
+        skip "Xalan installed, skipping" if xalan_installed
+        expect {
+          doc.xpath('//book[substring-before(@category, "c")]')
+        }.to raise_error(RuntimeError, /XPath error/)
+      end
+
+      it "handles very long XPath expressions" do
+        skip "Xalan installed, skipping" if xalan_installed
+        long_xpath = '/' + ('child::' * 100) + 'library'
+        result = doc.xpath(long_xpath)
+        expect(result).to be_a(RXerces::XML::NodeSet)
+      end
     end
   end
 